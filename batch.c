@@ -0,0 +1,336 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.c"
+
+#define IO_PUTCHAR 0xFF00
+#define IO_GETCHAR 0xFF01
+
+/*
+ * 6502-batch: run many independent programs on a work-stealing thread pool.
+ *
+ * Each manifest line describes one job:
+ *
+ *   <binary> <load address> <input file or -> <budget>
+ *
+ * The load address is hex ($8000, 0x8000 or 8000). The budget is the number
+ * of clock cycles the job may run, 0 for no limit. Blank lines and lines
+ * starting with # are ignored.
+ */
+
+enum job_status { JOB_PENDING, JOB_BRK, JOB_BUDGET, JOB_LOAD_ERROR };
+
+static const char *status_names[] = {"pending", "brk", "budget", "error"};
+
+struct job {
+  char *path;
+  uint16_t load_addr;
+  struct rom_image *image; // shared by the jobs running the same binary
+  char *input_path;
+  uint64_t budget;
+
+  uint8_t *input;
+  size_t input_len, input_pos;
+
+  char *out;
+  size_t out_len, out_cap;
+
+  int status;
+  cpu6502 regs;
+  uint64_t undocumented; // opcodes run as NOPs
+  uint16_t undocumented_pc;
+};
+
+static void job_putc(struct job *job, uint8_t c) {
+  if (job->out_len == job->out_cap) {
+    job->out_cap = job->out_cap ? job->out_cap * 2 : 256;
+    job->out = realloc(job->out, job->out_cap);
+  }
+  job->out[job->out_len++] = c;
+}
+
+static uint8_t job_getc(struct job *job) {
+  if (job->input_pos < job->input_len)
+    return job->input[job->input_pos++];
+  return 0;
+}
+
+// Same ports as program.c, but per job instead of stdio.
+static uint8_t job_io_read(bus_device *dev, machine6502 *m, uint16_t addr) {
+  if (addr == IO_GETCHAR)
+    return job_getc(m->user);
+  return m->memory[addr];
+}
+
+static void job_io_write(bus_device *dev, machine6502 *m, uint16_t addr,
+                         uint8_t value) {
+  if (addr == IO_PUTCHAR)
+    job_putc(m->user, value);
+  else
+    m->memory[addr] = value;
+}
+
+static bus_device job_io = {job_io_read, job_io_write};
+
+static int read_file(const char *path, uint8_t **data, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+
+  *data = malloc(size > 0 ? (size_t)size : 1);
+  *len = fread(*data, 1, size > 0 ? (size_t)size : 0, f);
+  fclose(f);
+  return 0;
+}
+
+static int parse_manifest(const char *path, struct job **jobs_out) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  struct job *jobs = NULL;
+  int njobs = 0, cap = 0, lineno = 0;
+  char line[4096];
+
+  while (fgets(line, sizeof(line), f)) {
+    char bin[1024], addr[32], input[1024];
+    unsigned long long budget;
+
+    lineno++;
+    char *s = line + strspn(line, " \t");
+    if (*s == '#' || *s == '\n' || *s == '\0')
+      continue;
+
+    if (sscanf(s, "%1023s %31s %1023s %llu", bin, addr, input, &budget) != 4) {
+      fprintf(stderr, "%s:%d: expected <binary> <addr> <input> <budget>\n",
+              path, lineno);
+      fclose(f);
+      free(jobs);
+      return -1;
+    }
+
+    if (njobs == cap) {
+      cap = cap ? cap * 2 : 64;
+      jobs = realloc(jobs, cap * sizeof(struct job));
+    }
+
+    struct job *job = &jobs[njobs++];
+    memset(job, 0, sizeof(*job));
+    job->path = strdup(bin);
+    job->input_path = strcmp(input, "-") ? strdup(input) : NULL;
+    job->budget = budget;
+
+    const char *a = addr;
+    if (*a == '$')
+      a++;
+    job->load_addr = (uint16_t)strtoul(a, NULL, 16);
+  }
+
+  fclose(f);
+  *jobs_out = jobs;
+  return njobs;
+}
+
+/* --------------------------------------------------------- */
+/* Work-stealing pool                                         */
+/* --------------------------------------------------------- */
+
+// The owner pops from the tail, thieves take from the head. Jobs never
+// spawn jobs, so a worker that finds every deque empty is done.
+struct deque {
+  pthread_mutex_t lock;
+  int *items;
+  int head, tail;
+};
+
+struct pool {
+  int nworkers;
+  struct deque *deques;
+  struct job *jobs;
+};
+
+struct worker {
+  struct pool *pool;
+  int id;
+};
+
+static int deque_pop(struct deque *d) {
+  int item = -1;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail)
+    item = d->items[--d->tail];
+  pthread_mutex_unlock(&d->lock);
+  return item;
+}
+
+static int deque_steal(struct deque *d) {
+  int item = -1;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail)
+    item = d->items[d->head++];
+  pthread_mutex_unlock(&d->lock);
+  return item;
+}
+
+static int next_job(struct pool *pool, int id) {
+  int item = deque_pop(&pool->deques[id]);
+  for (int i = 1; item < 0 && i < pool->nworkers; i++)
+    item = deque_steal(&pool->deques[(id + i) % pool->nworkers]);
+  return item;
+}
+
+// clean is the worker's machine right after reset; restoring it only
+// copies back the pages the previous job wrote.
+static void run_job(machine6502 *m, struct snapshot *clean, struct job *job) {
+  snapshot_restore(m, clean);
+  m->user = job;
+  m->undocumented = 0;
+
+  if (!job->image) {
+    job->status = JOB_LOAD_ERROR;
+    return;
+  }
+  if (job->input_path &&
+      read_file(job->input_path, &job->input, &job->input_len) != 0) {
+    job->status = JOB_LOAD_ERROR;
+    return;
+  }
+
+  bus_map_image(m, job->image);
+  m->cpu.PC =
+      (uint16_t)bus_read(m, 0xFFFC) | ((uint16_t)bus_read(m, 0xFFFD) << 8);
+
+  int status = run_cpu_until(m, job->budget ? job->budget : UINT64_MAX);
+
+  job->status = (status == RUN_BRK) ? JOB_BRK : JOB_BUDGET;
+  job->regs = m->cpu;
+  job->undocumented = m->undocumented;
+  job->undocumented_pc = m->undocumented_pc;
+
+  // Only the output is kept for the report.
+  free(job->input);
+  job->input = NULL;
+  job->input_len = 0;
+}
+
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+  machine6502 *m = machine_new();
+  int item;
+
+  bus_map_device(m, IO_PUTCHAR >> 8, 1, &job_io);
+  struct snapshot *clean = snapshot_take(m);
+
+  while ((item = next_job(w->pool, w->id)) >= 0)
+    run_job(m, clean, &w->pool->jobs[item]);
+
+  snapshot_free(clean);
+  machine_free(m);
+  return NULL;
+}
+
+static void print_result(int index, struct job *job) {
+  printf("%d %s %s cycles=%llu A=%02X X=%02X Y=%02X SP=%02X PC=%04X P=%02X "
+         "out=\"",
+         index, job->path, status_names[job->status],
+         (unsigned long long)job->regs.cycles, job->regs.A, job->regs.X,
+         job->regs.Y, job->regs.SP, job->regs.PC, pack_P(&job->regs));
+
+  for (size_t i = 0; i < job->out_len; i++) {
+    uint8_t c = job->out[i];
+    if (c == '\n')
+      fputs("\\n", stdout);
+    else if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c < 0x20 || c >= 0x7F)
+      printf("\\x%02X", c);
+    else
+      putchar(c);
+  }
+  printf("\"\n");
+}
+
+int main(int argc, char **argv) {
+  int nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    if (opt == 'j') {
+      nworkers = atoi(optarg);
+    } else {
+      fprintf(stderr, "usage: %s [-j threads] manifest\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-j threads] manifest\n", argv[0]);
+    return 1;
+  }
+  if (nworkers < 1)
+    nworkers = 1;
+
+  struct job *jobs;
+  int njobs = parse_manifest(argv[optind], &jobs);
+  if (njobs < 0)
+    return 1;
+
+  // Open each binary once; the jobs that run it map the same pages.
+  struct rom_image **images = calloc(njobs, sizeof(struct rom_image *));
+  int nimages = 0;
+  for (int i = 0; i < njobs; i++) {
+    for (int k = 0; k < i && !jobs[i].image; k++)
+      if (jobs[k].load_addr == jobs[i].load_addr &&
+          !strcmp(jobs[k].path, jobs[i].path))
+        jobs[i].image = jobs[k].image;
+    if (!jobs[i].image &&
+        (jobs[i].image = rom_open(jobs[i].path, jobs[i].load_addr)))
+      images[nimages++] = jobs[i].image;
+  }
+
+  // Deal the jobs out round-robin; stealing evens out the rest.
+  struct pool pool = {nworkers, calloc(nworkers, sizeof(struct deque)), jobs};
+  for (int i = 0; i < nworkers; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.deques[i].items = malloc((njobs / nworkers + 1) * sizeof(int));
+  }
+  for (int i = 0; i < njobs; i++) {
+    struct deque *d = &pool.deques[i % nworkers];
+    d->items[d->tail++] = i;
+  }
+
+  pthread_t *threads = malloc(nworkers * sizeof(pthread_t));
+  struct worker *workers = malloc(nworkers * sizeof(struct worker));
+  for (int i = 0; i < nworkers; i++) {
+    workers[i] = (struct worker){&pool, i};
+    pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+  }
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(threads[i], NULL);
+
+  int failed = 0;
+  for (int i = 0; i < njobs; i++) {
+    print_result(i, &jobs[i]);
+    if (jobs[i].undocumented)
+      fprintf(stderr, "%s: job %d ran %llu undocumented opcodes as NOPs, "
+              "the first at $%04X\n", jobs[i].path, i,
+              (unsigned long long)jobs[i].undocumented,
+              jobs[i].undocumented_pc);
+    failed |= (jobs[i].status == JOB_LOAD_ERROR);
+  }
+  for (int i = 0; i < nimages; i++)
+    rom_close(images[i]);
+
+  return failed ? 1 : 0;
+}
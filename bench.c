@@ -0,0 +1,364 @@
+#include "cpu.c"
+#include "workloads.c"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * bench: time a fixed set of workloads on every tier built in and report
+ * emulated MIPS, host nanoseconds per instruction and, on x86, host TSC
+ * cycles per emulated clock cycle. -j prints the results as JSON, for
+ * comparing runs across interpreter changes. Each figure is the best of
+ * BENCH_TRIES runs. The wide tier runs WIDE_LANES copies of the workload in
+ * lockstep, as one rep per lane, and counts the instructions of all of them.
+ * After timing a tier, one more run of it from a fresh load must end with
+ * the registers, cycle count and memory that table ends with; bench exits
+ * with 1 if any does not.
+ */
+#define BENCH_TRIES 3
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TSC 1
+#else
+#define BENCH_TSC 0
+#endif
+
+static machine6502 m;
+#define MACHINE (&m)
+
+#if CPU_WIDE
+static struct wide6502 *wide;
+#endif
+
+/* Copy of the original switch decoder, kept as the baseline to beat. It
+   fetches through the bus and counts cycles like cpu_step, so the two
+   differ only in how they decode. So far they come out even: on the loop
+   workload both take about 50 host instructions an instruction, the
+   switch's inlined cases costing what the table's indirect call does. */
+static uint8_t switch_step(machine6502 *m) {
+  cpu6502 *cpu = &m->cpu;
+  uint8_t opcode = fetch8(m);
+  cpu->cycles += op_cycles[opcode];
+
+  switch (opcode) {
+  case 0xA9: { // LDA immediate
+    uint8_t value = fetch8(m);
+    LDA_c(m, value);
+    break;
+  }
+  case 0x8D: { // STA absolute
+    uint16_t addr = fetch16(m);
+    STA_c(m, addr);
+    break;
+  }
+  case 0xA2: { // LDX immediate
+    uint8_t value = fetch8(m);
+    LDX_c(m, value);
+    break;
+  }
+  case 0xE8: // INX
+    INX_c(m);
+    break;
+  case 0xE0: { // CPX immediate
+    uint8_t value = fetch8(m);
+    CPX_c(m, value);
+    break;
+  }
+  case 0x90: { // BCC relative
+    int8_t offset = (int8_t)fetch8(m);
+    BCC_c(m, offset);
+    break;
+  }
+  case 0x4C: { // JMP absolute
+    uint16_t addr = fetch16(m);
+    JMP_c(m, addr);
+    break;
+  }
+  case 0x8A: // TXA
+    TXA_c(m);
+    break;
+  case 0x69: { // ADC immediate
+    uint8_t value = fetch8(m);
+    ADC_c(m, value);
+    break;
+  }
+  case 0xCA: // DEX
+    DEX_c(m);
+    break;
+  case 0xD0: { // BNE relative
+    int8_t offset = (int8_t)fetch8(m);
+    BNE_c(m, offset);
+    break;
+  }
+  case 0x20: { // JSR absolute
+    uint16_t addr = fetch16(m);
+    JSR_c(m, addr);
+    break;
+  }
+  case 0x60: // RTS
+    RTS_c(m);
+    break;
+  case 0x00: // BRK
+    BRK_c(m);
+    break;
+  default:
+    printf("Unknown opcode: %02X at %04X\n", opcode, cpu->PC - 1);
+    break;
+  }
+  return opcode;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t tsc(void) {
+#if BENCH_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void load(const struct workload *w) {
+  reset_cpu();
+  for (size_t i = 0; i < w->len; i++)
+    m.memory[0x8000 + i] = w->code[i];
+  mem_changed(&m, 0x80, 1);
+#if CPU_WIDE
+  wide_free(wide);
+  wide = wide_new(&m, WIDE_LANES);
+#endif
+}
+
+static void restart(void) {
+  m.cpu.PC = 0x8000;
+  m.cpu.SP = 0xFF;
+}
+
+static void run_switch(void) {
+  while (switch_step(&m) != 0x00)
+    ;
+}
+
+static void run_table(void) {
+  while (cpu_step(&m) != 0x00)
+    ;
+}
+
+#if CPU_THREADED
+static void run_threaded_tier(void) { run_threaded(&m, UINT64_MAX); }
+#endif
+
+static void run_default(void) { run_cpu(&m); }
+
+#if CPU_WIDE
+static void run_wide(void) {
+  for (unsigned i = 0; i < WIDE_LANES; i++) {
+    wide_set_pc(wide, i, 0x8000);
+    wide->SP[i] = 0xFF;
+  }
+  wide_run(wide, UINT64_MAX);
+}
+#endif
+
+struct tier {
+  const char *name;
+  void (*run)(void);
+  int lanes; // machines one call runs, 0 for one
+};
+
+// The switch decoder only knows the opcodes of the loop workload.
+static const struct tier switch_tier = {"switch", run_switch};
+
+static const struct tier tiers[] = {
+    {"table", run_table},
+#if CPU_THREADED
+    {"threaded", run_threaded_tier},
+#endif
+    {CPU_JIT_X86 ? "jit" : CPU_BLOCKS ? "blocks" : "run_cpu", run_default},
+#if CPU_WIDE
+    {"wide", run_wide, WIDE_LANES},
+#endif
+};
+
+// Where a run of a workload ends up.
+struct outcome {
+  uint8_t a, x, y, sp, p;
+  uint16_t pc;
+  uint64_t cycles;
+  uint8_t memory[0x10000];
+};
+
+static struct outcome expected, got;
+static int failed;
+
+static void outcome_of(machine6502 *mm, struct outcome *o) {
+  o->a = mm->cpu.A;
+  o->x = mm->cpu.X;
+  o->y = mm->cpu.Y;
+  o->sp = mm->cpu.SP;
+  o->p = pack_P(&mm->cpu);
+  o->pc = mm->cpu.PC;
+  o->cycles = mm->cpu.cycles;
+  memcpy(o->memory, mm->memory, sizeof(o->memory));
+}
+
+static int outcome_differs(const struct outcome *a, const struct outcome *b) {
+  return a->a != b->a || a->x != b->x || a->y != b->y || a->sp != b->sp ||
+         a->p != b->p || a->pc != b->pc || a->cycles != b->cycles ||
+         memcmp(a->memory, b->memory, sizeof(a->memory)) != 0;
+}
+
+// Run w once more on t from a fresh load and compare every machine it ran
+// with what table left.
+static void check(const struct workload *w, const struct tier *t) {
+  load(w);
+  restart();
+  t->run();
+  int lanes = t->lanes ? t->lanes : 1;
+  for (int i = 0; i < lanes; i++) {
+#if CPU_WIDE
+    if (t->lanes)
+      wide_get(wide, i, &m);
+#endif
+    outcome_of(&m, &got);
+    if (outcome_differs(&got, &expected)) {
+      fprintf(stderr,
+              "%s on %s: ends at PC=%04X A=%02X X=%02X Y=%02X P=%02X "
+              "SP=%02X after %llu cycles, not as table does\n",
+              w->name, t->name, got.pc, got.a, got.x, got.y, got.p, got.sp,
+              (unsigned long long)got.cycles);
+      failed = 1;
+      return;
+    }
+  }
+}
+
+struct result {
+  const char *workload, *tier;
+  uint64_t insns, cycles, host_cycles;
+  double seconds;
+};
+
+static int json;
+static int nresults;
+
+static void report(const struct result *r) {
+  double mips = r->insns / r->seconds / 1e6;
+  double ns = r->seconds * 1e9 / r->insns;
+  double per_cycle = (double)r->host_cycles / r->cycles;
+
+  if (json) {
+    printf("%s\n    {\"workload\": \"%s\", \"tier\": \"%s\", "
+           "\"instructions\": %llu, \"cycles\": %llu, \"seconds\": %.6f, "
+           "\"mips\": %.2f, \"ns_per_insn\": %.3f, ",
+           nresults ? "," : "", r->workload, r->tier,
+           (unsigned long long)r->insns, (unsigned long long)r->cycles,
+           r->seconds, mips, ns);
+    if (BENCH_TSC)
+      printf("\"host_cycles_per_cycle\": %.3f}", per_cycle);
+    else
+      printf("\"host_cycles_per_cycle\": null}");
+  } else {
+    printf("%-8s %-8s %10llu insns  %7.3f s  %8.2f MIPS  %6.2f ns/insn",
+           r->workload, r->tier, (unsigned long long)r->insns, r->seconds,
+           mips, ns);
+    if (BENCH_TSC)
+      printf("  %6.2f tsc/cycle", per_cycle);
+    printf("\n");
+  }
+  nresults++;
+}
+
+// Time reps runs of w on tier t, best of BENCH_TRIES. insns and cycles are
+// what one run takes, as counted by cpu_step.
+static void bench(const struct workload *w, const struct tier *t,
+                  uint64_t insns, uint64_t cycles) {
+  int lanes = t->lanes ? t->lanes : 1;
+  int calls = (w->reps + lanes - 1) / lanes;
+  uint64_t runs = (uint64_t)calls * lanes;
+  struct result best = {w->name, t->name, insns * runs, cycles * runs};
+
+  load(w);
+  for (int try = 0; try < BENCH_TRIES; try++) {
+    double t0 = now();
+    uint64_t c0 = tsc();
+    for (int r = 0; r < calls; r++) {
+      restart();
+      t->run();
+    }
+    uint64_t host_cycles = tsc() - c0;
+    double dt = now() - t0;
+    if (try == 0 || dt < best.seconds) {
+      best.seconds = dt;
+      best.host_cycles = host_cycles;
+    }
+  }
+  report(&best);
+  check(w, t);
+}
+
+// The flag-setting handlers back to back, without decode or dispatch, to
+// see what the status updates themselves cost. The barrier keeps the
+// compiler from sinking the stores to m.cpu out of the loop.
+static void run_handlers(long insns) {
+  reset_cpu();
+
+  double t0 = now();
+  for (long i = 0; i < insns / 8; i++) {
+    LDA((uint8_t)i);
+    ADC(0x11);
+    CMP(0x40);
+    INX();
+    AND(0x7F);
+    DEY();
+    TAX();
+    BNE(0);
+    __asm__ volatile("" ::: "memory");
+  }
+  double dt = now() - t0;
+  printf("%-8s %-8s %10ld insns  %7.3f s  %8.2f MIPS  %6.2f ns/insn\n", "",
+         "handlers", insns / 8 * 8, dt, insns / 8 * 8 / dt / 1e6,
+         dt * 1e9 / (insns / 8 * 8));
+}
+
+int main(int argc, char **argv) {
+  json = (argc > 1 && !strcmp(argv[1], "-j"));
+  if (argc > 1 && !json) {
+    fprintf(stderr, "usage: %s [-j]\n", argv[0]);
+    return 1;
+  }
+
+  if (json)
+    printf("{\n  \"tsc\": %s,\n  \"results\": [", BENCH_TSC ? "true" : "false");
+
+  int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+  int ntiers = sizeof(tiers) / sizeof(tiers[0]);
+  for (int i = 0; i < nworkloads; i++) {
+    const struct workload *w = &workloads[i];
+    uint64_t insns = 0;
+
+    load(w);
+    restart();
+    do {
+      insns++;
+    } while (cpu_step(&m) != 0x00);
+    uint64_t cycles = m.cpu.cycles;
+    outcome_of(&m, &expected);
+
+    if (w->code == loop_prog)
+      bench(w, &switch_tier, insns, cycles);
+    for (int k = 0; k < ntiers; k++)
+      bench(w, &tiers[k], insns, cycles);
+    if (w->code == loop_prog && !json)
+      run_handlers(insns * w->reps);
+  }
+
+  if (json)
+    printf("\n  ]\n}\n");
+  return failed;
+}
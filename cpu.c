@@ -1,6 +1,40 @@
-typedef unsigned char uint8_t;
-typedef signed char int8_t;
-typedef unsigned short uint16_t;
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CPU_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define CPU_MMAP 0
+#endif
+
+// Instruction tracing is compiled in only with -DCPU_TRACE; without it the
+// hooks in the run loops expand to nothing.
+#if defined(CPU_TRACE) && defined(__GNUC__)
+#define CPU_TRACING 1
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#else
+#define CPU_TRACING 0
+#endif
+
+// The scheduler runs machines on POSIX threads; build with -DCPU_NO_SCHED to
+// leave it out.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(CPU_NO_SCHED)
+#define CPU_SCHED 1
+#include <pthread.h>
+#else
+#define CPU_SCHED 0
+#endif
+
 
 typedef uint8_t reg8_t;
 typedef uint16_t reg16_t;
@@ -16,15 +50,18 @@ typedef reg8_t regP_t;
 
 struct Status {
   uint8_t C : 1;
-  uint8_t Z : 1;
+  uint8_t : 1; // Z, see zres
   uint8_t I : 1;
   uint8_t D : 1;
   uint8_t B : 1;
   uint8_t U : 1; // always 1?
   uint8_t V : 1;
-  uint8_t N : 1;
+  uint8_t : 1; // N, see nres
 };
 
+// Z and N are set by almost every instruction and read by few, so they are
+// kept lazily: zres and nres hold the last result that set them, and the
+// flags are only worked out when a branch, PHP, BRK or pack_P needs them.
 typedef struct {
   regA_t A;
   regX_t X;
@@ -32,358 +69,717 @@ typedef struct {
   regSP_t SP;
   regPC_t PC;
   struct Status P;
+  uint8_t zres;    // Z is set when this is 0
+  uint8_t nres;    // N is bit 7 of this
+  uint64_t cycles; // elapsed clock cycles
 } cpu6502;
 
-static uint8_t memory[0x10000];
-static cpu6502 default_cpu = {0};
+static inline int flag_Z(const cpu6502 *cpu) { return cpu->zres == 0; }
+static inline int flag_N(const cpu6502 *cpu) { return cpu->nres >> 7; }
+static inline void set_Z(cpu6502 *cpu, int z) { cpu->zres = !z; }
+static inline void set_N(cpu6502 *cpu, int n) { cpu->nres = n ? 0x80 : 0; }
 
-#define reset_cpu() reset_cpu_c(&default_cpu)
-void reset_cpu_c(cpu6502 *cpu) {
-  cpu->A = 0;
-  cpu->X = 0;
-  cpu->Y = 0;
-  cpu->SP = 0xFF;
-  cpu->PC = 0x0000;
+// Set Z and N from a result byte.
+static inline void set_NZ(cpu6502 *cpu, uint8_t v) {
+  cpu->zres = cpu->nres = v;
+}
 
-  cpu->P.C = 0;
-  cpu->P.Z = 0;
-  cpu->P.I = 0;
-  cpu->P.D = 0;
-  cpu->P.B = 0;
-  cpu->P.U = 1;
-  cpu->P.V = 0;
-  cpu->P.N = 0;
+typedef struct machine6502 machine6502;
+
+// A device owns one or more pages of the address space. Device structs
+// embed bus_device as their first member and cast back in the callbacks.
+typedef struct bus_device bus_device;
+struct bus_device {
+  uint8_t (*read)(bus_device *dev, machine6502 *m, uint16_t addr);
+  void (*write)(bus_device *dev, machine6502 *m, uint16_t addr, uint8_t value);
+};
+
+// One emulated machine: registers plus its own 64 KiB address space. The
+// shorthand macros below operate on MACHINE, which the including file
+// defines as a pointer to the machine it wants to drive.
+//
+// Every access goes through a 256-entry page table. A page with a rd/wr
+// pointer is plain memory; otherwise the access goes to the page's device.
+// ROM pages have a rd pointer and drop writes.
+//
+// The run loop caches decoded code in blocks and watches the RAM pages it
+// came from, so stores that reach code through the bus are seen. Snapshots
+// watch RAM pages the same way to learn which ones were written. Code that
+// writes memory[] directly after a run or snapshot must call mem_changed.
+// The cache, snapshot, trace and event pointers mean a machine must start
+// out zeroed (static storage or machine_new) before its first reset.
+//
+// Devices drive the IRQ and NMI lines and schedule events by cycle count,
+// see irq_raise and event_schedule. The run loops only look at either when
+// cpu.cycles reaches wake.
+typedef void (*event_fn)(machine6502 *m, void *ctx);
+
+struct event {
+  uint64_t at; // cpu.cycles at which fn runs
+  event_fn fn;
+  void *ctx;
+};
+
+struct block_cache;
+struct snapshot;
+struct trace;
+struct sched_task;
+struct machine6502 {
+  cpu6502 cpu;
+  void *user; // owned by the embedder, e.g. per-job I/O state
+  const uint8_t *rd[256];
+  uint8_t *wr[256];
+  bus_device *dev[256];
+  struct block_cache *blocks; // decoded code, allocated by the first run
+  struct snapshot *snap;      // last snapshot taken or restored, if any
+  uint64_t dirty[4];          // pages that may differ from snap
+  struct trace *trace;        // instruction trace, see trace_start
+  struct sched_task *task;    // scheduler entry, see sched_add
+  struct event *events;       // pending events, a min-heap on at
+  unsigned nevents, events_cap;
+  uint64_t wake;              // next event, or 0 when an interrupt is due
+  uint8_t irq;                // IRQ sources holding the line, one bit each
+  uint8_t nmi;                // an NMI edge not yet taken
+  uint8_t yield;              // cpu_yield was called
+  const uint8_t *fetch;       // rd page of the last instruction fetch
+  uint16_t fetch_tag;         // last address on that page, 0 for none
+  uint16_t undocumented_pc;   // where the first undocumented opcode ran
+  uint64_t undocumented;      // undocumented opcodes run, as NOPs
+  uint8_t memory[0x10000];    // backing store for RAM pages
+};
+
+static inline uint8_t bus_read(machine6502 *m, uint16_t addr) {
+  const uint8_t *page = m->rd[addr >> 8];
+  if (page)
+    return page[addr & 0xFF];
+  return m->dev[addr >> 8]->read(m->dev[addr >> 8], m, addr);
+}
+
+static inline void bus_write(machine6502 *m, uint16_t addr, uint8_t value) {
+  uint8_t *page = m->wr[addr >> 8];
+  if (page)
+    page[addr & 0xFF] = value;
+  else
+    m->dev[addr >> 8]->write(m->dev[addr >> 8], m, addr, value);
+}
+
+// Instruction stream reads for cpu_step. The page last fetched from is
+// cached, so the common case compares against fetch_tag instead of going
+// through the page table. No page ends at 0, so a zeroed machine starts
+// with nothing cached; mem_changed drops the cache whenever pages move.
+static inline uint8_t bus_fetch(machine6502 *m, uint16_t addr) {
+  if (__builtin_expect((addr | 0xFF) == m->fetch_tag, 1))
+    return m->fetch[addr & 0xFF];
+  const uint8_t *page = m->rd[addr >> 8];
+  if (!page)
+    return m->dev[addr >> 8]->read(m->dev[addr >> 8], m, addr);
+  m->fetch = page;
+  m->fetch_tag = addr | 0xFF;
+  return page[addr & 0xFF];
+}
+
+static uint8_t rom_read(bus_device *dev, machine6502 *m, uint16_t addr) {
+  return m->rd[addr >> 8][addr & 0xFF];
+}
+
+static void rom_write(bus_device *dev, machine6502 *m, uint16_t addr,
+                      uint8_t value) {}
+
+static bus_device rom_device = {rom_read, rom_write};
+
+void blocks_invalidate(machine6502 *m, unsigned page, unsigned npages);
+
+// Note that pages [page, page + npages) changed behind the bus: drop any
+// code cached from them and stop sharing them with the machine's snapshot.
+void mem_changed(machine6502 *m, unsigned page, unsigned npages) {
+  m->fetch_tag = 0;
+  for (unsigned p = page; p < page + npages && p < 256; p++)
+    m->dirty[p >> 6] |= 1ull << (p & 63);
+  blocks_invalidate(m, page, npages);
+}
+
+// Back pages [page, page + npages) with the machine's own memory.
+void bus_map_ram(machine6502 *m, unsigned page, unsigned npages) {
+  mem_changed(m, page, npages);
+  for (unsigned p = page; p < page + npages && p < 256; p++) {
+    m->rd[p] = &m->memory[p << 8];
+    m->wr[p] = &m->memory[p << 8];
+    m->dev[p] = NULL;
+  }
+}
 
-  for (int i = 0; i < 0x10000; i++)
-    memory[i] = 0;
+// Map read-only data over pages [page, page + npages). data is not copied.
+void bus_map_rom(machine6502 *m, unsigned page, unsigned npages,
+                 const uint8_t *data) {
+  mem_changed(m, page, npages);
+  for (unsigned p = page; p < page + npages && p < 256; p++) {
+    m->rd[p] = data + ((p - page) << 8);
+    m->wr[p] = NULL;
+    m->dev[p] = &rom_device;
+  }
+}
+
+// Route every access to pages [page, page + npages) to dev.
+void bus_map_device(machine6502 *m, unsigned page, unsigned npages,
+                    bus_device *dev) {
+  mem_changed(m, page, npages);
+  for (unsigned p = page; p < page + npages && p < 256; p++) {
+    m->rd[p] = NULL;
+    m->wr[p] = NULL;
+    m->dev[p] = dev;
+  }
+}
+
+#define reset_cpu() reset_cpu_c(MACHINE)
+void reset_cpu_c(machine6502 *m) {
+  m->cpu.A = 0;
+  m->cpu.X = 0;
+  m->cpu.Y = 0;
+  m->cpu.SP = 0xFF;
+  m->cpu.PC = 0x0000;
+  m->cpu.cycles = 0;
+
+  m->cpu.P.C = 0;
+  m->cpu.P.I = 0;
+  m->cpu.P.D = 0;
+  m->cpu.P.B = 0;
+  m->cpu.P.U = 1;
+  m->cpu.P.V = 0;
+  set_Z(&m->cpu, 0);
+  set_N(&m->cpu, 0);
+
+  m->nevents = 0;
+  m->wake = UINT64_MAX;
+  m->irq = 0;
+  m->nmi = 0;
+  m->yield = 0;
+  m->undocumented = 0;
+
+  memset(m->memory, 0, sizeof(m->memory));
+
+  bus_map_ram(m, 0x00, 256);
 }
 
 static uint8_t pack_P(cpu6502 *cpu) {
-  return (cpu->P.N << 7) | (cpu->P.V << 6) | (1 << 5) | (cpu->P.B << 4) |
-         (cpu->P.D << 3) | (cpu->P.I << 2) | (cpu->P.Z << 1) | (cpu->P.C);
+  return (flag_N(cpu) << 7) | (cpu->P.V << 6) | (1 << 5) | (cpu->P.B << 4) |
+         (cpu->P.D << 3) | (cpu->P.I << 2) | (flag_Z(cpu) << 1) | (cpu->P.C);
 }
 
 static void unpack_P(cpu6502 *cpu, uint8_t value) {
-  cpu->P.N = (value >> 7) & 1;
+  set_N(cpu, (value >> 7) & 1);
   cpu->P.V = (value >> 6) & 1;
   cpu->P.U = 1;
   cpu->P.B = 0;
   cpu->P.D = (value >> 3) & 1;
   cpu->P.I = (value >> 2) & 1;
-  cpu->P.Z = (value >> 1) & 1;
+  set_Z(cpu, (value >> 1) & 1);
   cpu->P.C = (value >> 0) & 1;
 }
 
-#define push(value) push_c(&default_cpu, value)
-void push_c(cpu6502 *cpu, uint8_t value) {
-  memory[0x0100 | cpu->SP] = value;
-  cpu->SP--;
+machine6502 *machine_new(void) {
+  machine6502 *m = malloc(sizeof(machine6502));
+  if (m) {
+    m->user = NULL;
+    m->blocks = NULL;
+    m->snap = NULL;
+    memset(m->dirty, 0, sizeof(m->dirty));
+    m->trace = NULL;
+    m->task = NULL;
+    m->events = NULL;
+    m->events_cap = 0;
+    reset_cpu_c(m);
+  }
+  return m;
+}
+
+void blocks_free(machine6502 *m);
+void snapshot_free(struct snapshot *s);
+#if CPU_TRACING
+int trace_stop(machine6502 *m);
+#endif
+
+void machine_free(machine6502 *m) {
+  if (m) {
+    blocks_free(m);
+    snapshot_free(m->snap);
+#if CPU_TRACING
+    trace_stop(m);
+#endif
+    free(m->events);
+  }
+  free(m);
+}
+
+#define push(value) push_c(MACHINE, value)
+void push_c(machine6502 *m, uint8_t value) {
+  bus_write(m, 0x0100 | m->cpu.SP, value);
+  m->cpu.SP--;
+}
+
+#define pull() pull_c(MACHINE)
+uint8_t pull_c(machine6502 *m) {
+  m->cpu.SP++;
+  return bus_read(m, 0x0100 | m->cpu.SP);
+}
+
+/* --------------------------------------------------------- */
+/* Interrupts and events                                      */
+/* --------------------------------------------------------- */
+
+// IRQ is level triggered: each source sets its own bit while it holds the
+// line and clears it once the handler has acknowledged the device. NMI is
+// edge triggered and taken once per nmi_raise, whatever I says.
+//
+// Interrupts and events are handled between instructions by events_run,
+// which the run loops call when cpu.cycles reaches wake. Anything that may
+// make an interrupt due sooner lowers wake to 0; the loops reread it after
+// every device access and after CLI, PLP and RTI, so a device can raise a
+// line from inside a read or write. Events and lines are not part of
+// snapshots, and reset drops them.
+
+// I may have just been cleared: come back for an IRQ that was held off.
+static inline void irq_recheck(machine6502 *m) {
+  if (m->irq && !m->cpu.P.I)
+    m->wake = 0;
+}
+
+void irq_raise(machine6502 *m, uint8_t source) {
+  m->irq |= source;
+  irq_recheck(m);
+}
+
+void irq_clear(machine6502 *m, uint8_t source) { m->irq &= ~source; }
+
+void nmi_raise(machine6502 *m) {
+  m->nmi = 1;
+  m->wake = 0;
+}
+
+static void event_swap(struct event *a, struct event *b) {
+  struct event t = *a;
+  *a = *b;
+  *b = t;
+}
+
+static void event_sift_down(machine6502 *m, unsigned i) {
+  struct event *h = m->events;
+  for (;;) {
+    unsigned min = i, l = 2 * i + 1, r = l + 1;
+    if (l < m->nevents && h[l].at < h[min].at)
+      min = l;
+    if (r < m->nevents && h[r].at < h[min].at)
+      min = r;
+    if (min == i)
+      return;
+    event_swap(&h[i], &h[min]);
+    i = min;
+  }
+}
+
+// Run fn(m, ctx) between instructions once cpu.cycles reaches at. An event
+// that is already due runs before the next instruction. Returns -1 when out
+// of memory.
+int event_schedule(machine6502 *m, uint64_t at, event_fn fn, void *ctx) {
+  if (m->nevents == m->events_cap) {
+    unsigned cap = m->events_cap ? m->events_cap * 2 : 16;
+    struct event *h = realloc(m->events, cap * sizeof(struct event));
+    if (!h)
+      return -1;
+    m->events = h;
+    m->events_cap = cap;
+  }
+
+  unsigned i = m->nevents++;
+  m->events[i] = (struct event){at, fn, ctx};
+  while (i > 0 && m->events[(i - 1) / 2].at > at) {
+    event_swap(&m->events[i], &m->events[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  if (at < m->wake)
+    m->wake = at;
+  return 0;
+}
+
+// Drop every pending event with this fn and ctx.
+void event_cancel(machine6502 *m, event_fn fn, void *ctx) {
+  for (unsigned i = 0; i < m->nevents;) {
+    if (m->events[i].fn == fn && m->events[i].ctx == ctx) {
+      m->events[i] = m->events[--m->nevents];
+      // The moved event may belong above i or below it.
+      while (i > 0 && m->events[(i - 1) / 2].at > m->events[i].at) {
+        event_swap(&m->events[i], &m->events[(i - 1) / 2]);
+        i = (i - 1) / 2;
+      }
+      event_sift_down(m, i);
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+// The interrupt sequence: like BRK, but PC is not advanced and the pushed
+// P has B clear.
+static void interrupt_c(machine6502 *m, uint16_t vector) {
+  push_c(m, (m->cpu.PC >> 8) & 0xFF);
+  push_c(m, m->cpu.PC & 0xFF);
+  push_c(m, pack_P(&m->cpu) & ~0x10);
+  m->cpu.P.I = 1;
+  m->cpu.PC = bus_read(m, vector) | ((uint16_t)bus_read(m, vector + 1) << 8);
+  m->cpu.cycles += 7;
+}
+
+// Run the events that are due, take a pending interrupt, and set wake for
+// the next visit. NMI goes before IRQ.
+void events_run(machine6502 *m) {
+  while (m->nevents && m->events[0].at <= m->cpu.cycles) {
+    struct event e = m->events[0];
+    m->events[0] = m->events[--m->nevents];
+    event_sift_down(m, 0);
+    e.fn(m, e.ctx);
+  }
+
+  if (m->nmi) {
+    m->nmi = 0;
+    interrupt_c(m, 0xFFFA);
+  } else if (m->irq && !m->cpu.P.I) {
+    interrupt_c(m, 0xFFFE);
+  }
+
+  m->wake = m->nevents ? m->events[0].at : UINT64_MAX;
+  if (m->nmi)
+    m->wake = 0;
+  irq_recheck(m);
+}
+
+// Decimal mode ADC and SBC, the way the NMOS 6502 does them: each nibble is
+// added in binary and corrected by 6 when it leaves 0-9. For ADC, Z comes
+// from the binary sum and N and V from the sum before the high nibble is
+// corrected. SBC sets every flag as in binary mode, so only its result is
+// computed here. The corrections are selects rather than branches, and
+// callers test P.D once to get here, so binary mode pays for one flag test.
+struct bcd_sum {
+  uint8_t a, c, v, zres, nres;
+};
+
+static inline struct bcd_sum adc_bcd(uint8_t a, uint8_t m, unsigned c) {
+  struct bcd_sum r;
+  unsigned lo = (a & 0x0F) + (m & 0x0F) + c;
+  lo = lo >= 0x0A ? ((lo + 0x06) & 0x0F) + 0x10 : lo;
+  unsigned sum = (a & 0xF0) + (m & 0xF0) + lo;
+  r.zres = (uint8_t)(a + m + c);
+  r.nres = (uint8_t)sum;
+  r.v = (~(a ^ m) & (a ^ sum) & 0x80) != 0;
+  sum = sum >= 0xA0 ? sum + 0x60 : sum;
+  r.a = (uint8_t)sum;
+  r.c = sum > U8_MAX;
+  return r;
 }
 
-#define pull() pull_c(&default_cpu)
-uint8_t pull_c(cpu6502 *cpu) {
-  cpu->SP++;
-  return memory[0x0100 | cpu->SP];
+static inline uint8_t sbc_bcd(uint8_t a, uint8_t m, unsigned c) {
+  int lo = (a & 0x0F) - (m & 0x0F) + (int)c - 1;
+  lo = lo < 0 ? ((lo - 0x06) & 0x0F) - 0x10 : lo;
+  int diff = (a & 0xF0) - (m & 0xF0) + lo;
+  diff = diff < 0 ? diff - 0x60 : diff;
+  return (uint8_t)diff;
 }
 
-#define ADC(M) ADC_c(&default_cpu, M)
-void ADC_c(cpu6502 *cpu, uint8_t M) {
+#define ADC(M) ADC_c(MACHINE, M)
+void ADC_c(machine6502 *m, uint8_t M) {
   // C Z V N affected
-  uint16_t sum = cpu->A + M + (cpu->P.C ? 1 : 0);
+  if (m->cpu.P.D) {
+    struct bcd_sum r = adc_bcd(m->cpu.A, M, m->cpu.P.C);
+    m->cpu.A = r.a;
+    m->cpu.P.C = r.c;
+    m->cpu.P.V = r.v;
+    m->cpu.zres = r.zres;
+    m->cpu.nres = r.nres;
+    return;
+  }
 
-  cpu->P.C = (sum > U8_MAX);
-  cpu->P.V = (~(cpu->A ^ M) & (cpu->A ^ sum) & 0x80) != 0;
+  uint16_t sum = m->cpu.A + M + (m->cpu.P.C ? 1 : 0);
 
-  cpu->A = sum;
+  m->cpu.P.C = (sum > U8_MAX);
+  m->cpu.P.V = (~(m->cpu.A ^ M) & (m->cpu.A ^ sum) & 0x80) != 0;
 
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = sum;
+
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
-#define AND(M) AND_c(&default_cpu, M)
-void AND_c(cpu6502 *cpu, uint8_t M) {
+#define AND(M) AND_c(MACHINE, M)
+void AND_c(machine6502 *m, uint8_t M) {
   // Z N affected
-  cpu->A = cpu->A & M;
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = m->cpu.A & M;
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
-#define BRK() BRK_c(&default_cpu)
-void BRK_c(cpu6502 *cpu) {
-  cpu->PC++;
+#define BRK() BRK_c(MACHINE)
+void BRK_c(machine6502 *m) {
+  m->cpu.PC++;
 
-  push_c(cpu, (cpu->PC >> 8) & 0xFF);
-  push_c(cpu, cpu->PC & 0xFF);
+  push_c(m, (m->cpu.PC >> 8) & 0xFF);
+  push_c(m, m->cpu.PC & 0xFF);
 
-  uint8_t p = pack_P(cpu);
+  uint8_t p = pack_P(&m->cpu);
   p |= 0x10;
-  push_c(cpu, p);
+  push_c(m, p);
 
-  cpu->P.I = 1;
+  m->cpu.P.I = 1;
 
-  uint8_t lo = memory[0xFFFE];
-  uint8_t hi = memory[0xFFFF];
-  cpu->PC = ((uint16_t)hi << 8) | lo;
+  uint8_t lo = bus_read(m, 0xFFFE);
+  uint8_t hi = bus_read(m, 0xFFFF);
+  m->cpu.PC = ((uint16_t)hi << 8) | lo;
 }
 
-#define BCC(offset) BCC_c(&default_cpu, offset)
-void BCC_c(cpu6502 *cpu, uint8_t offset) {
-  if (!cpu->P.C)
-    cpu->PC += (int8_t)offset;
+// Taken branches cost one extra cycle, two if the target is on another page.
+static inline void branch(machine6502 *m, uint8_t offset) {
+  uint16_t target = m->cpu.PC + (int8_t)offset;
+  m->cpu.cycles += 1 + ((target ^ m->cpu.PC) > 0xFF);
+  m->cpu.PC = target;
 }
 
-#define BCS(offset) BCS_c(&default_cpu, offset)
-void BCS_c(cpu6502 *cpu, uint8_t offset) {
-  if (cpu->P.C == 1)
-    cpu->PC += (int8_t)offset;
+#define BCC(offset) BCC_c(MACHINE, offset)
+void BCC_c(machine6502 *m, uint8_t offset) {
+  if (!m->cpu.P.C)
+    branch(m, offset);
 }
 
-#define BEQ(offset) BEQ_c(&default_cpu, offset)
-void BEQ_c(cpu6502 *cpu, uint8_t offset) {
-  if (cpu->P.Z == 1)
-    cpu->PC += (int8_t)offset;
+#define BCS(offset) BCS_c(MACHINE, offset)
+void BCS_c(machine6502 *m, uint8_t offset) {
+  if (m->cpu.P.C == 1)
+    branch(m, offset);
 }
 
-#define BIT(M) BIT_c(&default_cpu, M)
-void BIT_c(cpu6502 *cpu, uint8_t M) {
-  // N V affected
-  uint8_t result = cpu->A & M;
-  cpu->P.Z = (result == 0);
-  cpu->P.V = (M & 0x40) != 0;
-  cpu->P.N = (M & 0x80) != 0;
+#define BEQ(offset) BEQ_c(MACHINE, offset)
+void BEQ_c(machine6502 *m, uint8_t offset) {
+  if (flag_Z(&m->cpu))
+    branch(m, offset);
 }
 
-#define BMI(offset) BMI_c(&default_cpu, offset)
-void BMI_c(cpu6502 *cpu, uint8_t offset) {
-  if (cpu->P.N == 1)
-    cpu->PC += (int8_t)offset;
+#define BIT(M) BIT_c(MACHINE, M)
+void BIT_c(machine6502 *m, uint8_t M) {
+  // Z V N affected
+  m->cpu.zres = m->cpu.A & M;
+  m->cpu.P.V = (M & 0x40) != 0;
+  m->cpu.nres = M;
 }
 
-#define BNE(offset) BNE_c(&default_cpu, offset)
-void BNE_c(cpu6502 *cpu, uint8_t offset) {
-  if (!cpu->P.Z)
-    cpu->PC += (int8_t)offset;
+#define BMI(offset) BMI_c(MACHINE, offset)
+void BMI_c(machine6502 *m, uint8_t offset) {
+  if (flag_N(&m->cpu))
+    branch(m, offset);
 }
 
-#define BPL(offset) BPL_c(&default_cpu, offset)
-void BPL_c(cpu6502 *cpu, uint8_t offset) {
-  if (!cpu->P.N)
-    cpu->PC += (int8_t)offset;
+#define BNE(offset) BNE_c(MACHINE, offset)
+void BNE_c(machine6502 *m, uint8_t offset) {
+  if (!flag_Z(&m->cpu))
+    branch(m, offset);
 }
 
-#define CLC() CLC_c(&default_cpu)
-void CLC_c(cpu6502 *cpu) { cpu->P.C = 0; }
+#define BPL(offset) BPL_c(MACHINE, offset)
+void BPL_c(machine6502 *m, uint8_t offset) {
+  if (!flag_N(&m->cpu))
+    branch(m, offset);
+}
+
+#define CLC() CLC_c(MACHINE)
+void CLC_c(machine6502 *m) { m->cpu.P.C = 0; }
 
-#define CLD() CLD_c(&default_cpu)
-void CLD_c(cpu6502 *cpu) { cpu->P.D = 0; }
+#define CLD() CLD_c(MACHINE)
+void CLD_c(machine6502 *m) { m->cpu.P.D = 0; }
 
-#define CLI() CLI_c(&default_cpu)
-void CLI_c(cpu6502 *cpu) { cpu->P.I = 0; }
+#define CLI() CLI_c(MACHINE)
+void CLI_c(machine6502 *m) {
+  m->cpu.P.I = 0;
+  irq_recheck(m);
+}
 
-#define CLV() CLV_c(&default_cpu)
-void CLV_c(cpu6502 *cpu) { cpu->P.V = 0; }
+#define CLV() CLV_c(MACHINE)
+void CLV_c(machine6502 *m) { m->cpu.P.V = 0; }
 
-#define CMP(M) CMP_c(&default_cpu, M)
-void CMP_c(cpu6502 *cpu, uint8_t M) {
+#define CMP(M) CMP_c(MACHINE, M)
+void CMP_c(machine6502 *m, uint8_t M) {
   // C Z N affected
-  uint8_t result = cpu->A - M;
-  cpu->P.C = (cpu->A >= M);
-  cpu->P.Z = (cpu->A == M);
-  cpu->P.N = (result & 0x80) != 0;
+  uint8_t result = m->cpu.A - M;
+  m->cpu.P.C = (m->cpu.A >= M);
+  set_NZ(&m->cpu, result);
 }
 
-#define CPX(M) CPX_c(&default_cpu, M)
-void CPX_c(cpu6502 *cpu, uint8_t M) {
+#define CPX(M) CPX_c(MACHINE, M)
+void CPX_c(machine6502 *m, uint8_t M) {
   // C Z N affected
-  uint8_t result = cpu->X - M;
-  cpu->P.C = (cpu->X >= M);
-  cpu->P.Z = (cpu->X == M);
-  cpu->P.N = (result & 0x80) != 0;
+  uint8_t result = m->cpu.X - M;
+  m->cpu.P.C = (m->cpu.X >= M);
+  set_NZ(&m->cpu, result);
 }
 
-#define CPY(M) CPY_c(&default_cpu, M)
-void CPY_c(cpu6502 *cpu, uint8_t M) {
+#define CPY(M) CPY_c(MACHINE, M)
+void CPY_c(machine6502 *m, uint8_t M) {
   // C Z N affected
-  uint8_t result = cpu->Y - M;
-  cpu->P.C = (cpu->Y >= M);
-  cpu->P.Z = (cpu->Y == M);
-  cpu->P.N = (result & 0x80) != 0;
+  uint8_t result = m->cpu.Y - M;
+  m->cpu.P.C = (m->cpu.Y >= M);
+  set_NZ(&m->cpu, result);
 }
 
-#define DEC(addr) DEC_c(&default_cpu, addr)
-void DEC_c(cpu6502 *cpu, uint16_t addr) {
+#define DEC(addr) DEC_c(MACHINE, addr)
+void DEC_c(machine6502 *m, uint16_t addr) {
   // Z N affected
-  uint8_t value = memory[addr];
+  uint8_t value = bus_read(m, addr);
   value = (value - 1) & U8_MAX;
 
-  memory[addr] = value;
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  bus_write(m, addr, value);
+  set_NZ(&m->cpu, value);
 }
 
-#define DEX() DEX_c(&default_cpu)
-void DEX_c(cpu6502 *cpu) {
+#define DEX() DEX_c(MACHINE)
+void DEX_c(machine6502 *m) {
   // Z N affected
-  uint8_t value = cpu->X;
+  uint8_t value = m->cpu.X;
   value = (value - 1) & U8_MAX;
 
-  cpu->X = value;
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  m->cpu.X = value;
+  set_NZ(&m->cpu, value);
 }
 
-#define DEY() DEY_c(&default_cpu)
-void DEY_c(cpu6502 *cpu) {
+#define DEY() DEY_c(MACHINE)
+void DEY_c(machine6502 *m) {
   // Z N affected
-  uint8_t value = cpu->Y;
+  uint8_t value = m->cpu.Y;
   value = (value - 1) & U8_MAX;
 
-  cpu->Y = value;
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  m->cpu.Y = value;
+  set_NZ(&m->cpu, value);
 }
 
-#define EOR(M) EOR_c(&default_cpu, M)
-void EOR_c(cpu6502 *cpu, uint8_t M) {
+#define EOR(M) EOR_c(MACHINE, M)
+void EOR_c(machine6502 *m, uint8_t M) {
   // Z N affected
-  cpu->A = cpu->A ^ M;
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = m->cpu.A ^ M;
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
-#define INC(addr) INC_c(&default_cpu, addr)
-void INC_c(cpu6502 *cpu, uint16_t addr) {
+#define INC(addr) INC_c(MACHINE, addr)
+void INC_c(machine6502 *m, uint16_t addr) {
   // Z N affected
-  uint8_t value = memory[addr];
+  uint8_t value = bus_read(m, addr);
   value = (value + 1) & U8_MAX;
 
-  memory[addr] = value;
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  bus_write(m, addr, value);
+  set_NZ(&m->cpu, value);
 }
 
-#define INX() INX_c(&default_cpu)
-void INX_c(cpu6502 *cpu) {
+#define INX() INX_c(MACHINE)
+void INX_c(machine6502 *m) {
   // Z N affected
-  uint8_t value = cpu->X;
+  uint8_t value = m->cpu.X;
   value = (value + 1) & U8_MAX;
 
-  cpu->X = value;
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  m->cpu.X = value;
+  set_NZ(&m->cpu, value);
 }
 
-#define INY() INY_c(&default_cpu)
-void INY_c(cpu6502 *cpu) {
+#define INY() INY_c(MACHINE)
+void INY_c(machine6502 *m) {
   // Z N affected
-  uint8_t value = cpu->Y;
+  uint8_t value = m->cpu.Y;
   value = (value + 1) & U8_MAX;
 
-  cpu->Y = value;
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  m->cpu.Y = value;
+  set_NZ(&m->cpu, value);
 }
 
-#define JMP(addr) JMP_c(&default_cpu, addr)
-void JMP_c(cpu6502 *cpu, uint16_t addr) { cpu->PC = addr; }
+#define JMP(addr) JMP_c(MACHINE, addr)
+void JMP_c(machine6502 *m, uint16_t addr) { m->cpu.PC = addr; }
 
-#define LDA(M) LDA_c(&default_cpu, M)
-void LDA_c(cpu6502 *cpu, uint8_t M) {
+#define LDA(M) LDA_c(MACHINE, M)
+void LDA_c(machine6502 *m, uint8_t M) {
   // Z N affected
-  cpu->A = M;
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = M;
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
-#define LDX(M) LDX_c(&default_cpu, M)
-void LDX_c(cpu6502 *cpu, uint8_t M) {
+#define LDX(M) LDX_c(MACHINE, M)
+void LDX_c(machine6502 *m, uint8_t M) {
   // Z N affected
-  cpu->X = M;
-  cpu->P.Z = (cpu->X == 0);
-  cpu->P.N = (cpu->X & 0x80) != 0;
+  m->cpu.X = M;
+  set_NZ(&m->cpu, m->cpu.X);
 }
 
-#define LDY(M) LDY_c(&default_cpu, M)
-void LDY_c(cpu6502 *cpu, uint8_t M) {
+#define LDY(M) LDY_c(MACHINE, M)
+void LDY_c(machine6502 *m, uint8_t M) {
   // Z N affected
-  cpu->Y = M;
-  cpu->P.Z = (cpu->Y == 0);
-  cpu->P.N = (cpu->Y & 0x80) != 0;
+  m->cpu.Y = M;
+  set_NZ(&m->cpu, m->cpu.Y);
 }
 
-#define ORA(M) ORA_c(&default_cpu, M)
-void ORA_c(cpu6502 *cpu, uint8_t M) {
+#define ORA(M) ORA_c(MACHINE, M)
+void ORA_c(machine6502 *m, uint8_t M) {
   // Z N affected
-  cpu->A = cpu->A | M;
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = m->cpu.A | M;
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
-#define PHA() PHA_c(&default_cpu)
-void PHA_c(cpu6502 *cpu) { push_c(cpu, cpu->A); }
+#define PHA() PHA_c(MACHINE)
+void PHA_c(machine6502 *m) { push_c(m, m->cpu.A); }
 
-#define PLA() PLA_c(&default_cpu)
-uint8_t PLA_c(cpu6502 *cpu) { return pull_c(cpu); }
+#define PLA() PLA_c(MACHINE)
+uint8_t PLA_c(machine6502 *m) { return pull_c(m); }
 
-#define SEC() SEC_c(&default_cpu)
-void SEC_c(cpu6502 *cpu) { cpu->P.C = 1; }
+#define SEC() SEC_c(MACHINE)
+void SEC_c(machine6502 *m) { m->cpu.P.C = 1; }
 
-#define SED() SED_c(&default_cpu)
-void SED_c(cpu6502 *cpu) { cpu->P.D = 1; }
+#define SED() SED_c(MACHINE)
+void SED_c(machine6502 *m) { m->cpu.P.D = 1; }
 
-#define SEI() SEI_c(&default_cpu)
-void SEI_c(cpu6502 *cpu) { cpu->P.I = 1; }
+#define SEI() SEI_c(MACHINE)
+void SEI_c(machine6502 *m) { m->cpu.P.I = 1; }
 
-#define STA(addr) STA_c(&default_cpu, addr)
-void STA_c(cpu6502 *cpu, uint16_t addr) { memory[addr] = cpu->A; }
+#define STA(addr) STA_c(MACHINE, addr)
+void STA_c(machine6502 *m, uint16_t addr) { bus_write(m, addr, m->cpu.A); }
 
-#define STX(addr) STX_c(&default_cpu, addr)
-void STX_c(cpu6502 *cpu, uint16_t addr) { memory[addr] = cpu->X; }
+#define STX(addr) STX_c(MACHINE, addr)
+void STX_c(machine6502 *m, uint16_t addr) { bus_write(m, addr, m->cpu.X); }
 
-#define STY(addr) STY_c(&default_cpu, addr)
-void STY_c(cpu6502 *cpu, uint16_t addr) { memory[addr] = cpu->Y; }
+#define STY(addr) STY_c(MACHINE, addr)
+void STY_c(machine6502 *m, uint16_t addr) { bus_write(m, addr, m->cpu.Y); }
 
-#define TAX() TAX_c(&default_cpu)
-void TAX_c(cpu6502 *cpu) {
+#define TAX() TAX_c(MACHINE)
+void TAX_c(machine6502 *m) {
   // Z N affected
-  cpu->X = cpu->A;
-  cpu->P.Z = (cpu->X == 0);
-  cpu->P.N = (cpu->X & 0x80) != 0;
+  m->cpu.X = m->cpu.A;
+  set_NZ(&m->cpu, m->cpu.X);
 }
 
-#define TAY() TAY_c(&default_cpu)
-void TAY_c(cpu6502 *cpu) {
+#define TAY() TAY_c(MACHINE)
+void TAY_c(machine6502 *m) {
   // Z N affected
-  cpu->Y = cpu->A;
-  cpu->P.Z = (cpu->Y == 0);
-  cpu->P.N = (cpu->Y & 0x80) != 0;
+  m->cpu.Y = m->cpu.A;
+  set_NZ(&m->cpu, m->cpu.Y);
 }
 
-#define TSX() TSX_c(&default_cpu)
-void TSX_c(cpu6502 *cpu) {
+#define TSX() TSX_c(MACHINE)
+void TSX_c(machine6502 *m) {
   // Z N affected
-  cpu->X = cpu->SP;
-  cpu->P.Z = (cpu->X == 0);
-  cpu->P.N = (cpu->X & 0x80) != 0;
+  m->cpu.X = m->cpu.SP;
+  set_NZ(&m->cpu, m->cpu.X);
 }
 
-#define TXA() TXA_c(&default_cpu)
-void TXA_c(cpu6502 *cpu) {
+#define TXA() TXA_c(MACHINE)
+void TXA_c(machine6502 *m) {
   // Z N affected
-  cpu->A = cpu->X;
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = m->cpu.X;
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
-#define TXS() TXS_c(&default_cpu)
-void TXS_c(cpu6502 *cpu) { cpu->SP = cpu->X; }
+#define TXS() TXS_c(MACHINE)
+void TXS_c(machine6502 *m) { m->cpu.SP = m->cpu.X; }
 
-#define TYA() TYA_c(&default_cpu)
-void TYA_c(cpu6502 *cpu) {
+#define TYA() TYA_c(MACHINE)
+void TYA_c(machine6502 *m) {
   // Z N affected
-  cpu->A = cpu->Y;
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = m->cpu.Y;
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
 // SBC OK
@@ -400,176 +796,5785 @@ void TYA_c(cpu6502 *cpu) {
 // RTI OK
 // NOP OK
 
-#define SBC(M) SBC_c(&default_cpu, M)
-void SBC_c(cpu6502 *cpu, uint8_t M) {
+#define SBC(M) SBC_c(MACHINE, M)
+void SBC_c(machine6502 *m, uint8_t M) {
   // C Z V N affected
 
   uint16_t value = (uint16_t)M ^ 0x00FF;
-  uint16_t sum = cpu->A + value + (cpu->P.C ? 1 : 0);
-  
-  cpu->P.C = (sum & 0x100) != 0;
-  cpu->A = (uint8_t)sum;
-  
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.V = ((sum ^ cpu->A) & (sum ^ value) & 0x0080) != 0;
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  uint16_t sum = m->cpu.A + value + (m->cpu.P.C ? 1 : 0);
+  uint8_t result = (uint8_t)sum;
+  if (m->cpu.P.D)
+    result = sbc_bcd(m->cpu.A, M, m->cpu.P.C);
+
+  m->cpu.P.C = (sum & 0x100) != 0;
+  m->cpu.P.V = ((sum ^ m->cpu.A) & (sum ^ value) & 0x0080) != 0;
+  m->cpu.A = result;
+  set_NZ(&m->cpu, (uint8_t)sum);
 }
 
-#define ASL_A() ASL_A_c(&default_cpu)
-void ASL_A_c(cpu6502 *cpu) {
+#define ASL_A() ASL_A_c(MACHINE)
+void ASL_A_c(machine6502 *m) {
   // C Z N affected
-  uint8_t value = cpu->A;
-  cpu->P.C = (value & 0x80) != 0;
+  uint8_t value = m->cpu.A;
+  m->cpu.P.C = (value & 0x80) != 0;
 
   value = (value << 1) & U8_MAX;
-  cpu->A = value;
+  m->cpu.A = value;
 
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  set_NZ(&m->cpu, value);
 }
 
-#define ASL_M(M) ASL_A_c(&default_cpu, M)
-void ASL_M_c(cpu6502 *cpu, uint16_t addr) {
+#define ASL_M(M) ASL_M_c(MACHINE, M)
+void ASL_M_c(machine6502 *m, uint16_t addr) {
   // C Z N affected
-  uint8_t value = memory[addr];
-  cpu->P.C = (value & 0x80) != 0;
+  uint8_t value = bus_read(m, addr);
+  m->cpu.P.C = (value & 0x80) != 0;
 
   value = (value << 1) & U8_MAX;
-  memory[addr] = value;
+  bus_write(m, addr, value);
 
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  set_NZ(&m->cpu, value);
 }
 
-#define LSR_A() LSR_A_c(&default_cpu)
-void LSR_A_c(cpu6502 *cpu) {
+#define LSR_A() LSR_A_c(MACHINE)
+void LSR_A_c(machine6502 *m) {
   // C Z N affected
-  uint8_t value = cpu->A;
+  uint8_t value = m->cpu.A;
 
-  cpu->P.C = (value & 0x01) != 0;
+  m->cpu.P.C = (value & 0x01) != 0;
   value = (value >> 1) & U8_MAX;
-  cpu->A = value;
-  cpu->P.Z = (cpu->A == 0);
-  cpu->P.N = (cpu->A & 0x80) != 0;
+  m->cpu.A = value;
+  set_NZ(&m->cpu, m->cpu.A);
 }
 
-#define LSR_M(M) LSR_M_c(&default_cpu, M)
-void LSR_M_c(cpu6502 *cpu, uint16_t addr) {
+#define LSR_M(M) LSR_M_c(MACHINE, M)
+void LSR_M_c(machine6502 *m, uint16_t addr) {
   // C Z N affected
-  uint8_t value = memory[addr];
+  uint8_t value = bus_read(m, addr);
 
-  cpu->P.C = (value & 0x01) != 0;
+  m->cpu.P.C = (value & 0x01) != 0;
   value = (value >> 1) & U8_MAX;
-  memory[addr] = value;
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  bus_write(m, addr, value);
+  set_NZ(&m->cpu, value);
 }
 
-#define ROL_A() ROL_A_c(&default_cpu)
-void ROL_A_c(cpu6502 *cpu) {
+#define ROL_A() ROL_A_c(MACHINE)
+void ROL_A_c(machine6502 *m) {
   // C Z N affected
-  uint8_t value = cpu->A;
-  cpu->P.C = (value & 0x80) != 0;
+  uint8_t value = m->cpu.A;
+  uint8_t oldc = m->cpu.P.C;
+  m->cpu.P.C = (value & 0x80) != 0;
 
-  value = (value << 1) & U8_MAX;
-  cpu->A = value;
+  value = ((value << 1) | oldc) & U8_MAX;
+  m->cpu.A = value;
 
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  set_NZ(&m->cpu, value);
 }
 
-#define ROL_M(M) ROL_M_c(&default_cpu, M)
-void ROL_M_c(cpu6502 *cpu, uint16_t addr) {
+#define ROL_M(M) ROL_M_c(MACHINE, M)
+void ROL_M_c(machine6502 *m, uint16_t addr) {
   // C Z N affected
-  uint8_t value = memory[addr];
-  cpu->P.C = (value & 0x80) != 0;
+  uint8_t value = bus_read(m, addr);
+  uint8_t oldc = m->cpu.P.C;
+  m->cpu.P.C = (value & 0x80) != 0;
 
-  value = (value << 1) & U8_MAX;
-  memory[addr] = value;
+  value = ((value << 1) | oldc) & U8_MAX;
+  bus_write(m, addr, value);
 
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  set_NZ(&m->cpu, value);
 }
 
-#define ROR_A() ROR_A_c(&default_cpu)
-void ROR_A_c(cpu6502 *cpu) {
+#define ROR_A() ROR_A_c(MACHINE)
+void ROR_A_c(machine6502 *m) {
   // C Z N affected
 
-  uint8_t value = cpu->A;
-  uint8_t oldc = cpu->P.C;
+  uint8_t value = m->cpu.A;
+  uint8_t oldc = m->cpu.P.C;
   
-  cpu->P.C = (value & 0x01) != 0;
+  m->cpu.P.C = (value & 0x01) != 0;
 
-  value = (value >> 1) & U8_MAX;
-  cpu->A = value;
+  value = (value >> 1) | (oldc << 7);
+  m->cpu.A = value;
 
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  set_NZ(&m->cpu, value);
 }
 
-#define ROR_M(M) ROL_M_c(&default_cpu, M)
-void ROR_M_c(cpu6502 *cpu, uint16_t addr) {
+#define ROR_M(M) ROR_M_c(MACHINE, M)
+void ROR_M_c(machine6502 *m, uint16_t addr) {
   // C Z N affected
-  uint8_t value = memory[addr];
-  cpu->P.C = (value & 0x80) != 0;
+  uint8_t value = bus_read(m, addr);
+  uint8_t oldc = m->cpu.P.C;
+  m->cpu.P.C = (value & 0x01) != 0;
 
-  value = (value >> 1) & U8_MAX;
-  memory[addr] = value;
+  value = (value >> 1) | (oldc << 7);
+  bus_write(m, addr, value);
   
-  cpu->P.Z = (value == 0);
-  cpu->P.N = (value & 0x80) != 0;
+  set_NZ(&m->cpu, value);
+}
+
+#define BVC(offset) BVC_c(MACHINE, offset)
+void BVC_c(machine6502 *m, uint8_t offset) {
+  if (!m->cpu.P.V) {
+    branch(m, offset);
+  }
+}
+
+#define BVS(offset) BVS_c(MACHINE, offset)
+void BVS_c(machine6502 *m, int8_t offset) {
+  if (m->cpu.P.V) {
+    branch(m, offset);
+  }
+}
+
+#define PHP() PHP_c(MACHINE)
+void PHP_c(machine6502 *m) {
+  uint8_t p = pack_P(&m->cpu) | 0x10;
+  push_c(m, p);
+}
+
+#define PLP() PLP_c(MACHINE)
+void PLP_c(machine6502 *m) {
+  uint8_t p = pull_c(m);
+  unpack_P(&m->cpu, p);
+  irq_recheck(m);
+}
+
+#define JSR(addr) JSR_c(MACHINE, addr)
+void JSR_c(machine6502 *m, uint16_t addr){
+  uint16_t r_addr = m->cpu.PC -1;
+  push_c(m, (r_addr >> 8) & 0xFF);
+  push_c(m, r_addr & 0xFF);
+  m->cpu.PC = addr; 
+}
+
+#define RTS() RTS_c(MACHINE)
+void RTS_c(machine6502 *m){
+  uint8_t lo = pull_c(m);
+  uint8_t hi = pull_c(m);
+  m->cpu.PC = ((uint16_t)hi << 8| lo)+1;
+}
+
+#define RTI() RTI_c(MACHINE)
+void RTI_c(machine6502 *m){
+  uint8_t p = pull_c(m);
+  unpack_P(&m->cpu, p);
+
+  uint8_t lo = pull_c(m);
+  uint8_t hi = pull_c(m);
+  m->cpu.PC = ((uint16_t)hi << 8| lo);
+  irq_recheck(m);
+}
+
+#define NOP() NOP_c(MACHINE)
+void NOP_c(machine6502 *m){}
+
+int load_bin(machine6502 *m, const char *path, uint16_t load_addr) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror("fopen");
+    return -1;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+
+  if (size <= 0 || load_addr + size > 0x10000) {
+    fprintf(stderr, "invalid binary size\n");
+    fclose(f);
+    return -1;
+  }
+
+  fread(&m->memory[load_addr], 1, (size_t)size, f);
+  fclose(f);
+
+  m->memory[0xFFFC] = load_addr & 0xFF;
+  m->memory[0xFFFD] = (load_addr >> 8) & 0xFF;
+
+  unsigned first = load_addr >> 8, last = (load_addr + size - 1) >> 8;
+  mem_changed(m, first, last - first + 1);
+  mem_changed(m, 0xFF, 1);
+
+  return 0;
+}
+
+/* --------------------------------------------------------- */
+/* ROM images                                                 */
+/* --------------------------------------------------------- */
+
+// A program image opened read-only and mapped straight into machines'
+// page tables, so any number of machines can run it without a copy of
+// their own. Two layouts are understood:
+//
+//   segmented  $FF $FF, then segments of <first> <last> (little endian,
+//              inclusive) followed by last - first + 1 bytes of data, each
+//              optionally preceded by another $FF $FF. This is the Atari
+//              executable layout, which ld65 writes for format = atari.
+//   flat       anything else, placed at the load address.
+//
+// Pages the image covers whole point into the file mapping. The few it
+// covers in part are put together in a private copy, the rest of which
+// reads as 0. If the image does not set the reset vector itself, it is
+// pointed at the load address, or at the first segment.
+struct rom_image {
+  void *map;
+  size_t map_len;
+  const uint8_t *page[256]; // NULL for pages the image does not cover
+  uint8_t (*own)[256];      // the partly covered pages
+  uint16_t entry;
+  int has_vector;
+};
+
+struct rom_segment {
+  unsigned first, len;
+  size_t off; // in the file
+};
+
+static int rom_segments(const uint8_t *data, size_t size, uint16_t load_addr,
+                        struct rom_segment *seg, int max) {
+  if (size < 2 || data[0] != 0xFF || data[1] != 0xFF) {
+    if (load_addr + size > 0x10000)
+      return -1;
+    seg[0] = (struct rom_segment){load_addr, (unsigned)size, 0};
+    return 1;
+  }
+
+  int n = 0;
+  size_t off = 2;
+  while (off < size) {
+    if (size - off >= 2 && data[off] == 0xFF && data[off + 1] == 0xFF)
+      off += 2;
+    if (size - off < 4 || n == max)
+      return -1;
+    unsigned first = data[off] | data[off + 1] << 8;
+    unsigned last = data[off + 2] | data[off + 3] << 8;
+    off += 4;
+    if (last < first || size - off < last - first + 1)
+      return -1;
+    seg[n++] = (struct rom_segment){first, last - first + 1, off};
+    off += last - first + 1;
+  }
+  return n;
+}
+
+void rom_close(struct rom_image *img) {
+  if (!img)
+    return;
+#if CPU_MMAP
+  if (img->map)
+    munmap(img->map, img->map_len);
+#else
+  free(img->map);
+#endif
+  free(img->own);
+  free(img);
+}
+
+static void *rom_map_file(const char *path, size_t *size, size_t *map_len) {
+#if CPU_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+  struct stat st;
+  void *map = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    *size = *map_len = (size_t)st.st_size;
+    map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      perror(path);
+      map = NULL;
+    }
+  } else {
+    fprintf(stderr, "%s: empty or unreadable image\n", path);
+  }
+  close(fd);
+  return map;
+#else
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  rewind(f);
+  // Room for a full last page, zeroed, as a file mapping would give.
+  uint8_t *map = n > 0 ? calloc(1, (size_t)n + 256) : NULL;
+  if (map && fread(map, 1, (size_t)n, f) == (size_t)n) {
+    *size = (size_t)n;
+    *map_len = (size_t)n + 256;
+  } else {
+    fprintf(stderr, "%s: empty or unreadable image\n", path);
+    free(map);
+    map = NULL;
+  }
+  fclose(f);
+  return map;
+#endif
 }
 
-#define BVC(offset) BVC_c(&default_cpu, offset)
-void BVC_c(cpu6502 *cpu, uint8_t offset) {
-  if (!cpu->P.V) {
-    cpu->PC += (int8_t)offset;
+// Open the image at path; flat images go at load_addr. Returns NULL, having
+// said why on stderr, if it cannot be read or does not fit in 64 KiB.
+struct rom_image *rom_open(const char *path, uint16_t load_addr) {
+  struct rom_image *img = calloc(1, sizeof(struct rom_image));
+  if (!img)
+    return NULL;
+  size_t size;
+  img->map = rom_map_file(path, &size, &img->map_len);
+  if (!img->map) {
+    free(img);
+    return NULL;
+  }
+  const uint8_t *data = img->map;
+
+  struct rom_segment seg[256];
+  int nseg = rom_segments(data, size, load_addr, seg, 256);
+  if (nseg <= 0) {
+    fprintf(stderr, "%s: bad segment or image too large\n", path);
+    rom_close(img);
+    return NULL;
+  }
+
+  // A page is taken straight from the file if one segment covers it
+  // whole, or runs from its start to the end of the file: the mapping
+  // reads as 0 from there to the end of its last system page.
+#if CPU_MMAP
+  size_t sys_page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t mapped = (size_t)(size + sys_page - 1) / sys_page * sys_page;
+#else
+  size_t mapped = img->map_len;
+#endif
+  uint8_t count[256] = {0};
+  int direct[256];
+  for (int i = 0; i < nseg; i++) {
+    unsigned end = seg[i].first + seg[i].len;
+    for (unsigned p = seg[i].first >> 8; p <= (end - 1) >> 8; p++) {
+      size_t off = seg[i].off + (p << 8) - seg[i].first;
+      int whole = (p << 8) >= seg[i].first &&
+                  (end >= (p + 1) << 8 ||
+                   (seg[i].off + seg[i].len == size && off + 256 <= mapped));
+      if (count[p] < 255)
+        count[p]++;
+      direct[p] = whole ? i : -1;
+    }
+  }
+
+  unsigned vec = 0xFFFC;
+  for (int i = 0; i < nseg; i++)
+    if (seg[i].first <= vec && vec + 1 < seg[i].first + seg[i].len)
+      img->has_vector = 1;
+  img->entry = (uint16_t)seg[0].first;
+  int patch = !img->has_vector && count[0xFF];
+  if (patch)
+    direct[0xFF] = -1;
+
+  unsigned nown = 0;
+  for (unsigned p = 0; p < 256; p++)
+    if (count[p] && (count[p] > 1 || direct[p] < 0))
+      nown++;
+  if (nown && !(img->own = calloc(nown, 256))) {
+    rom_close(img);
+    return NULL;
+  }
+
+  nown = 0;
+  for (unsigned p = 0; p < 256; p++) {
+    if (!count[p])
+      continue;
+    if (count[p] == 1 && direct[p] >= 0) {
+      struct rom_segment *s = &seg[direct[p]];
+      img->page[p] = data + s->off + (p << 8) - s->first;
+      continue;
+    }
+    uint8_t *own = img->own[nown++];
+    for (int i = 0; i < nseg; i++) { // later segments win
+      unsigned lo = seg[i].first, hi = seg[i].first + seg[i].len;
+      if (lo < p << 8)
+        lo = p << 8;
+      if (hi > (p + 1) << 8)
+        hi = (p + 1) << 8;
+      if (lo < hi)
+        memcpy(&own[lo & 0xFF], data + seg[i].off + lo - seg[i].first,
+               hi - lo);
+    }
+    img->page[p] = own;
+  }
+
+  if (patch) {
+    uint8_t *own = (uint8_t *)img->page[0xFF];
+    own[0xFC] = img->entry & 0xFF;
+    own[0xFD] = img->entry >> 8;
+    img->has_vector = 1;
+  }
+  return img;
+}
+
+// Map the pages img covers into m as ROM. Pages that already belong to a
+// device keep it, and get a copy of the image in memory[] beneath. img
+// must stay open while m can still read from it.
+void bus_map_image(machine6502 *m, const struct rom_image *img) {
+  for (unsigned p = 0; p < 256; p++) {
+    if (!img->page[p])
+      continue;
+    if (!m->rd[p]) { // a device
+      memcpy(&m->memory[p << 8], img->page[p], 256);
+      mem_changed(m, p, 1);
+    } else {
+      bus_map_rom(m, p, 1, img->page[p]);
+    }
+  }
+
+  if (!img->has_vector) {
+    m->memory[0xFFFC] = img->entry & 0xFF;
+    m->memory[0xFFFD] = img->entry >> 8;
+    mem_changed(m, 0xFF, 1);
   }
 }
 
-#define BVS(offset) BVS_c(&default_cpu, offset)
-void BVS_c(cpu6502 *cpu, int8_t offset) {
-  if (cpu->P.V) {
-    cpu->PC += (int8_t)offset;
+/* --------------------------------------------------------- */
+/* Decoder: addressing-mode resolvers and the opcode table    */
+/* --------------------------------------------------------- */
+
+enum addr_mode {
+  IMP, // implied
+  ACC, // accumulator
+  IMM, // #$nn
+  ZP,  // $nn
+  ZPX, // $nn,X
+  ZPY, // $nn,Y
+  ABS, // $nnnn
+  ABX, // $nnnn,X
+  ABY, // $nnnn,Y
+  IND, // ($nnnn)
+  IZX, // ($nn,X)
+  IZY, // ($nn),Y
+  REL, // branch offset
+};
+
+// Instruction length in bytes, opcode included.
+static const uint8_t mode_len[] = {
+    [IMP] = 1, [ACC] = 1, [IMM] = 2, [ZP] = 2,  [ZPX] = 2, [ZPY] = 2, [ABS] = 3,
+    [ABX] = 3, [ABY] = 3, [IND] = 3, [IZX] = 2, [IZY] = 2, [REL] = 2,
+};
+
+static inline uint8_t fetch8(machine6502 *m) {
+  return bus_fetch(m, m->cpu.PC++);
+}
+
+static inline uint16_t fetch16(machine6502 *m) {
+  uint8_t lo = bus_fetch(m, m->cpu.PC++);
+  uint8_t hi = bus_fetch(m, m->cpu.PC++);
+  return ((uint16_t)hi << 8) | lo;
+}
+
+// Every resolver returns the effective address of the operand, so read
+// instructions can always be expressed as fn(m, bus_read(m, addr)).
+static inline uint16_t addr_imm(machine6502 *m) { return m->cpu.PC++; }
+
+static inline uint16_t addr_zp(machine6502 *m) { return fetch8(m); }
+
+static inline uint16_t addr_zpx(machine6502 *m) {
+  return (uint8_t)(fetch8(m) + m->cpu.X);
+}
+
+static inline uint16_t addr_zpy(machine6502 *m) {
+  return (uint8_t)(fetch8(m) + m->cpu.Y);
+}
+
+static inline uint16_t addr_abs(machine6502 *m) { return fetch16(m); }
+
+static inline uint16_t addr_abx(machine6502 *m) {
+  return (uint16_t)(fetch16(m) + m->cpu.X);
+}
+
+static inline uint16_t addr_aby(machine6502 *m) {
+  return (uint16_t)(fetch16(m) + m->cpu.Y);
+}
+
+static inline uint16_t addr_ind(machine6502 *m) {
+  // JMP ($xxFF) fetches the high byte from $xx00, as on the real chip
+  uint16_t ptr = fetch16(m);
+  uint8_t lo = bus_read(m, ptr);
+  uint8_t hi = bus_read(m, (ptr & 0xFF00) | ((ptr + 1) & 0x00FF));
+  return ((uint16_t)hi << 8) | lo;
+}
+
+static inline uint16_t addr_izx(machine6502 *m) {
+  uint8_t zp = fetch8(m) + m->cpu.X;
+  uint8_t lo = bus_read(m, zp);
+  uint8_t hi = bus_read(m, (uint8_t)(zp + 1));
+  return ((uint16_t)hi << 8) | lo;
+}
+
+static inline uint16_t addr_izy(machine6502 *m) {
+  uint8_t zp = fetch8(m);
+  uint8_t lo = bus_read(m, zp);
+  uint8_t hi = bus_read(m, (uint8_t)(zp + 1));
+  return (uint16_t)((((uint16_t)hi << 8) | lo) + m->cpu.Y);
+}
+
+// Indexed reads take an extra cycle when indexing carries into the high
+// byte. Stores and read-modify-write always pay it, so they use the plain
+// resolvers and have it in their base count.
+static inline uint16_t page_penalty(machine6502 *m, uint16_t base,
+                                    uint16_t addr) {
+  m->cpu.cycles += ((base ^ addr) >> 8) & 1;
+  return addr;
+}
+
+static inline uint16_t addr_abx_r(machine6502 *m) {
+  uint16_t base = fetch16(m);
+  return page_penalty(m, base, base + m->cpu.X);
+}
+
+static inline uint16_t addr_aby_r(machine6502 *m) {
+  uint16_t base = fetch16(m);
+  return page_penalty(m, base, base + m->cpu.Y);
+}
+
+static inline uint16_t addr_izy_r(machine6502 *m) {
+  uint8_t zp = fetch8(m);
+  uint16_t base =
+      bus_read(m, zp) | ((uint16_t)bus_read(m, (uint8_t)(zp + 1)) << 8);
+  return page_penalty(m, base, base + m->cpu.Y);
+}
+
+#define addr_imm_r addr_imm
+#define addr_zp_r addr_zp
+#define addr_zpx_r addr_zpx
+#define addr_zpy_r addr_zpy
+#define addr_abs_r addr_abs
+#define addr_izx_r addr_izx
+
+typedef void (*op_fn)(machine6502 *m);
+
+// Read:   fn(m, M)      ADC AND BIT CMP CPX CPY EOR LDA LDX LDY ORA SBC
+// Write:  fn(m, addr)   STA STX STY, memory read-modify-write, JMP, JSR
+// Branch: fn(m, off)    Bxx
+// Impl:   fn(m)         everything else
+#define OP_R(fn, mode)                                                         \
+  static void op_##fn##_##mode(machine6502 *m) {                               \
+    fn##_c(m, bus_read(m, addr_##mode##_r(m)));                                \
   }
+#define OP_W(fn, mode)                                                         \
+  static void op_##fn##_##mode(machine6502 *m) { fn##_c(m, addr_##mode(m)); }
+#define OP_B(fn)                                                               \
+  static void op_##fn(machine6502 *m) { fn##_c(m, fetch8(m)); }
+#define OP_I(fn)                                                               \
+  static void op_##fn(machine6502 *m) { fn##_c(m); }
+
+#define OP_R_ALL(fn)                                                           \
+  OP_R(fn, imm)                                                                \
+  OP_R(fn, zp) OP_R(fn, zpx) OP_R(fn, abs) OP_R(fn, abx) OP_R(fn, aby)         \
+      OP_R(fn, izx) OP_R(fn, izy)
+
+OP_R_ALL(ADC)
+OP_R_ALL(AND)
+OP_R_ALL(CMP)
+OP_R_ALL(EOR)
+OP_R_ALL(LDA)
+OP_R_ALL(ORA)
+OP_R_ALL(SBC)
+
+OP_R(BIT, zp) OP_R(BIT, abs)
+OP_R(CPX, imm) OP_R(CPX, zp) OP_R(CPX, abs)
+OP_R(CPY, imm) OP_R(CPY, zp) OP_R(CPY, abs)
+OP_R(LDX, imm) OP_R(LDX, zp) OP_R(LDX, zpy) OP_R(LDX, abs) OP_R(LDX, aby)
+OP_R(LDY, imm) OP_R(LDY, zp) OP_R(LDY, zpx) OP_R(LDY, abs) OP_R(LDY, abx)
+
+OP_W(STA, zp) OP_W(STA, zpx) OP_W(STA, abs) OP_W(STA, abx) OP_W(STA, aby)
+OP_W(STA, izx) OP_W(STA, izy)
+OP_W(STX, zp) OP_W(STX, zpy) OP_W(STX, abs)
+OP_W(STY, zp) OP_W(STY, zpx) OP_W(STY, abs)
+
+OP_W(ASL_M, zp) OP_W(ASL_M, zpx) OP_W(ASL_M, abs) OP_W(ASL_M, abx)
+OP_W(LSR_M, zp) OP_W(LSR_M, zpx) OP_W(LSR_M, abs) OP_W(LSR_M, abx)
+OP_W(ROL_M, zp) OP_W(ROL_M, zpx) OP_W(ROL_M, abs) OP_W(ROL_M, abx)
+OP_W(ROR_M, zp) OP_W(ROR_M, zpx) OP_W(ROR_M, abs) OP_W(ROR_M, abx)
+OP_W(INC, zp) OP_W(INC, zpx) OP_W(INC, abs) OP_W(INC, abx)
+OP_W(DEC, zp) OP_W(DEC, zpx) OP_W(DEC, abs) OP_W(DEC, abx)
+
+OP_W(JMP, abs) OP_W(JMP, ind) OP_W(JSR, abs)
+
+OP_B(BCC) OP_B(BCS) OP_B(BEQ) OP_B(BMI) OP_B(BNE) OP_B(BPL) OP_B(BVC)
+OP_B(BVS)
+
+OP_I(ASL_A) OP_I(LSR_A) OP_I(ROL_A) OP_I(ROR_A)
+OP_I(BRK) OP_I(RTI) OP_I(RTS) OP_I(NOP)
+OP_I(CLC) OP_I(CLD) OP_I(CLI) OP_I(CLV) OP_I(SEC) OP_I(SED) OP_I(SEI)
+OP_I(DEX) OP_I(DEY) OP_I(INX) OP_I(INY)
+OP_I(TAX) OP_I(TAY) OP_I(TSX) OP_I(TXA) OP_I(TXS) OP_I(TYA)
+OP_I(PHA) OP_I(PHP) OP_I(PLP)
+
+static void op_PLA(machine6502 *m) { LDA_c(m, PLA_c(m)); }
+
+struct opcode {
+  const char *name;
+  uint8_t mode;
+  op_fn exec;
+};
+
+// Undocumented opcodes are left zeroed and run as one-byte NOPs, see
+// op_exec.
+const struct opcode op_table[256] = {
+    [0x69] = {"ADC", IMM, op_ADC_imm}, [0x65] = {"ADC", ZP, op_ADC_zp},
+    [0x75] = {"ADC", ZPX, op_ADC_zpx}, [0x6D] = {"ADC", ABS, op_ADC_abs},
+    [0x7D] = {"ADC", ABX, op_ADC_abx}, [0x79] = {"ADC", ABY, op_ADC_aby},
+    [0x61] = {"ADC", IZX, op_ADC_izx}, [0x71] = {"ADC", IZY, op_ADC_izy},
+
+    [0x29] = {"AND", IMM, op_AND_imm}, [0x25] = {"AND", ZP, op_AND_zp},
+    [0x35] = {"AND", ZPX, op_AND_zpx}, [0x2D] = {"AND", ABS, op_AND_abs},
+    [0x3D] = {"AND", ABX, op_AND_abx}, [0x39] = {"AND", ABY, op_AND_aby},
+    [0x21] = {"AND", IZX, op_AND_izx}, [0x31] = {"AND", IZY, op_AND_izy},
+
+    [0x0A] = {"ASL", ACC, op_ASL_A},   [0x06] = {"ASL", ZP, op_ASL_M_zp},
+    [0x16] = {"ASL", ZPX, op_ASL_M_zpx}, [0x0E] = {"ASL", ABS, op_ASL_M_abs},
+    [0x1E] = {"ASL", ABX, op_ASL_M_abx},
+
+    [0x90] = {"BCC", REL, op_BCC},     [0xB0] = {"BCS", REL, op_BCS},
+    [0xF0] = {"BEQ", REL, op_BEQ},     [0x30] = {"BMI", REL, op_BMI},
+    [0xD0] = {"BNE", REL, op_BNE},     [0x10] = {"BPL", REL, op_BPL},
+    [0x50] = {"BVC", REL, op_BVC},     [0x70] = {"BVS", REL, op_BVS},
+
+    [0x24] = {"BIT", ZP, op_BIT_zp},   [0x2C] = {"BIT", ABS, op_BIT_abs},
+
+    [0x00] = {"BRK", IMP, op_BRK},
+
+    [0x18] = {"CLC", IMP, op_CLC},     [0xD8] = {"CLD", IMP, op_CLD},
+    [0x58] = {"CLI", IMP, op_CLI},     [0xB8] = {"CLV", IMP, op_CLV},
+
+    [0xC9] = {"CMP", IMM, op_CMP_imm}, [0xC5] = {"CMP", ZP, op_CMP_zp},
+    [0xD5] = {"CMP", ZPX, op_CMP_zpx}, [0xCD] = {"CMP", ABS, op_CMP_abs},
+    [0xDD] = {"CMP", ABX, op_CMP_abx}, [0xD9] = {"CMP", ABY, op_CMP_aby},
+    [0xC1] = {"CMP", IZX, op_CMP_izx}, [0xD1] = {"CMP", IZY, op_CMP_izy},
+
+    [0xE0] = {"CPX", IMM, op_CPX_imm}, [0xE4] = {"CPX", ZP, op_CPX_zp},
+    [0xEC] = {"CPX", ABS, op_CPX_abs},
+    [0xC0] = {"CPY", IMM, op_CPY_imm}, [0xC4] = {"CPY", ZP, op_CPY_zp},
+    [0xCC] = {"CPY", ABS, op_CPY_abs},
+
+    [0xC6] = {"DEC", ZP, op_DEC_zp},   [0xD6] = {"DEC", ZPX, op_DEC_zpx},
+    [0xCE] = {"DEC", ABS, op_DEC_abs}, [0xDE] = {"DEC", ABX, op_DEC_abx},
+    [0xCA] = {"DEX", IMP, op_DEX},     [0x88] = {"DEY", IMP, op_DEY},
+
+    [0x49] = {"EOR", IMM, op_EOR_imm}, [0x45] = {"EOR", ZP, op_EOR_zp},
+    [0x55] = {"EOR", ZPX, op_EOR_zpx}, [0x4D] = {"EOR", ABS, op_EOR_abs},
+    [0x5D] = {"EOR", ABX, op_EOR_abx}, [0x59] = {"EOR", ABY, op_EOR_aby},
+    [0x41] = {"EOR", IZX, op_EOR_izx}, [0x51] = {"EOR", IZY, op_EOR_izy},
+
+    [0xE6] = {"INC", ZP, op_INC_zp},   [0xF6] = {"INC", ZPX, op_INC_zpx},
+    [0xEE] = {"INC", ABS, op_INC_abs}, [0xFE] = {"INC", ABX, op_INC_abx},
+    [0xE8] = {"INX", IMP, op_INX},     [0xC8] = {"INY", IMP, op_INY},
+
+    [0x4C] = {"JMP", ABS, op_JMP_abs}, [0x6C] = {"JMP", IND, op_JMP_ind},
+    [0x20] = {"JSR", ABS, op_JSR_abs},
+
+    [0xA9] = {"LDA", IMM, op_LDA_imm}, [0xA5] = {"LDA", ZP, op_LDA_zp},
+    [0xB5] = {"LDA", ZPX, op_LDA_zpx}, [0xAD] = {"LDA", ABS, op_LDA_abs},
+    [0xBD] = {"LDA", ABX, op_LDA_abx}, [0xB9] = {"LDA", ABY, op_LDA_aby},
+    [0xA1] = {"LDA", IZX, op_LDA_izx}, [0xB1] = {"LDA", IZY, op_LDA_izy},
+
+    [0xA2] = {"LDX", IMM, op_LDX_imm}, [0xA6] = {"LDX", ZP, op_LDX_zp},
+    [0xB6] = {"LDX", ZPY, op_LDX_zpy}, [0xAE] = {"LDX", ABS, op_LDX_abs},
+    [0xBE] = {"LDX", ABY, op_LDX_aby},
+    [0xA0] = {"LDY", IMM, op_LDY_imm}, [0xA4] = {"LDY", ZP, op_LDY_zp},
+    [0xB4] = {"LDY", ZPX, op_LDY_zpx}, [0xAC] = {"LDY", ABS, op_LDY_abs},
+    [0xBC] = {"LDY", ABX, op_LDY_abx},
+
+    [0x4A] = {"LSR", ACC, op_LSR_A},   [0x46] = {"LSR", ZP, op_LSR_M_zp},
+    [0x56] = {"LSR", ZPX, op_LSR_M_zpx}, [0x4E] = {"LSR", ABS, op_LSR_M_abs},
+    [0x5E] = {"LSR", ABX, op_LSR_M_abx},
+
+    [0xEA] = {"NOP", IMP, op_NOP},
+
+    [0x09] = {"ORA", IMM, op_ORA_imm}, [0x05] = {"ORA", ZP, op_ORA_zp},
+    [0x15] = {"ORA", ZPX, op_ORA_zpx}, [0x0D] = {"ORA", ABS, op_ORA_abs},
+    [0x1D] = {"ORA", ABX, op_ORA_abx}, [0x19] = {"ORA", ABY, op_ORA_aby},
+    [0x01] = {"ORA", IZX, op_ORA_izx}, [0x11] = {"ORA", IZY, op_ORA_izy},
+
+    [0x48] = {"PHA", IMP, op_PHA},     [0x08] = {"PHP", IMP, op_PHP},
+    [0x68] = {"PLA", IMP, op_PLA},     [0x28] = {"PLP", IMP, op_PLP},
+
+    [0x2A] = {"ROL", ACC, op_ROL_A},   [0x26] = {"ROL", ZP, op_ROL_M_zp},
+    [0x36] = {"ROL", ZPX, op_ROL_M_zpx}, [0x2E] = {"ROL", ABS, op_ROL_M_abs},
+    [0x3E] = {"ROL", ABX, op_ROL_M_abx},
+    [0x6A] = {"ROR", ACC, op_ROR_A},   [0x66] = {"ROR", ZP, op_ROR_M_zp},
+    [0x76] = {"ROR", ZPX, op_ROR_M_zpx}, [0x6E] = {"ROR", ABS, op_ROR_M_abs},
+    [0x7E] = {"ROR", ABX, op_ROR_M_abx},
+
+    [0x40] = {"RTI", IMP, op_RTI},     [0x60] = {"RTS", IMP, op_RTS},
+
+    [0xE9] = {"SBC", IMM, op_SBC_imm}, [0xE5] = {"SBC", ZP, op_SBC_zp},
+    [0xF5] = {"SBC", ZPX, op_SBC_zpx}, [0xED] = {"SBC", ABS, op_SBC_abs},
+    [0xFD] = {"SBC", ABX, op_SBC_abx}, [0xF9] = {"SBC", ABY, op_SBC_aby},
+    [0xE1] = {"SBC", IZX, op_SBC_izx}, [0xF1] = {"SBC", IZY, op_SBC_izy},
+
+    [0x38] = {"SEC", IMP, op_SEC},     [0xF8] = {"SED", IMP, op_SED},
+    [0x78] = {"SEI", IMP, op_SEI},
+
+    [0x85] = {"STA", ZP, op_STA_zp},   [0x95] = {"STA", ZPX, op_STA_zpx},
+    [0x8D] = {"STA", ABS, op_STA_abs}, [0x9D] = {"STA", ABX, op_STA_abx},
+    [0x99] = {"STA", ABY, op_STA_aby}, [0x81] = {"STA", IZX, op_STA_izx},
+    [0x91] = {"STA", IZY, op_STA_izy},
+    [0x86] = {"STX", ZP, op_STX_zp},   [0x96] = {"STX", ZPY, op_STX_zpy},
+    [0x8E] = {"STX", ABS, op_STX_abs},
+    [0x84] = {"STY", ZP, op_STY_zp},   [0x94] = {"STY", ZPX, op_STY_zpx},
+    [0x8C] = {"STY", ABS, op_STY_abs},
+
+    [0xAA] = {"TAX", IMP, op_TAX},     [0xA8] = {"TAY", IMP, op_TAY},
+    [0xBA] = {"TSX", IMP, op_TSX},     [0x8A] = {"TXA", IMP, op_TXA},
+    [0x9A] = {"TXS", IMP, op_TXS},     [0x98] = {"TYA", IMP, op_TYA},
+};
+
+// Base cycles per opcode. Undocumented opcodes count as 2 so that a run
+// through garbage still makes progress against a cycle budget.
+const uint8_t op_cycles[256] = {
+    // 0 1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    7, 6, 2, 2, 2, 3, 5, 2, 3, 2, 2, 2, 2, 4, 6, 2, // 0
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2, // 1
+    6, 6, 2, 2, 3, 3, 5, 2, 4, 2, 2, 2, 4, 4, 6, 2, // 2
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2, // 3
+    6, 6, 2, 2, 2, 3, 5, 2, 3, 2, 2, 2, 3, 4, 6, 2, // 4
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2, // 5
+    6, 6, 2, 2, 2, 3, 5, 2, 4, 2, 2, 2, 5, 4, 6, 2, // 6
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2, // 7
+    2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2, // 8
+    2, 6, 2, 2, 4, 4, 4, 2, 2, 5, 2, 2, 2, 5, 2, 2, // 9
+    2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2, // A
+    2, 5, 2, 2, 4, 4, 4, 2, 2, 4, 2, 2, 4, 4, 4, 2, // B
+    2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2, // C
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2, // D
+    2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2, // E
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2, // F
+};
+
+/* --------------------------------------------------------- */
+/* Assembler                                                  */
+/* --------------------------------------------------------- */
+
+// An in-process assembler for the ca65 subset 6502.s is written in, so that
+// tests and tools can build programs from source text without running ca65
+// and ld65. A line is an optional label and then one of:
+//
+//   lda #expr       any documented mnemonic, in any case, in any of its
+//                   addressing modes: #imm, zp, zp,x, zp,y, abs, abs,x,
+//                   abs,y, (ind), (zp,x), (zp),y, a, or a branch target
+//   name = expr     a constant
+//   .segment "X"    switch to segment X. ZEROPAGE, CODE and VECTORS start
+//                   where custom.cfg puts them, other segments at their
+//                   first .org. Code before any .segment goes to CODE.
+//   .org expr       move the current segment to expr
+//   .byte, .word    data: expressions, and strings for .byte
+//
+// Labels end in ':'; those starting with '@' are local to the label before
+// them. ';' starts a comment. Expressions are numbers ($hex, %binary,
+// decimal, 'c'), symbols and * for the current address, with unary -, ~,
+// < (low byte) and > (high byte), the binary operators * / + - << >> & ^ |
+// at C's precedences, and parentheses. As in ca65, an operand that fits in
+// a byte takes the zero page form unless it refers to a symbol defined
+// further down, which is taken to be absolute.
+//
+// The first pass works out where the labels go and the second places the
+// bytes into a 64 KiB image, with a bit for each byte placed.
+#define ASM_LINE_MAX 256
+#define ASM_NAME_MAX 64
+#define ASM_SEGMENTS 16
+
+struct asm_symbol {
+  char name[ASM_NAME_MAX];
+  int32_t value;
+  int line;    // where it is defined
+  int forward; // its value refers to a symbol defined further down
+};
+
+struct asm_image {
+  uint8_t mem[0x10000];
+  uint8_t used[0x10000 / 8]; // a bit for each byte placed
+  uint16_t entry;            // the first address placed
+  int placed;
+  struct asm_symbol *syms;
+  unsigned nsyms, cap;
+};
+
+struct asm_segment {
+  char name[ASM_NAME_MAX];
+  unsigned pc;
+  int has_pc;
+};
+
+struct asm_state {
+  const char *name; // of the source, for messages
+  int pass, line;
+  struct asm_image *img;
+  struct asm_segment seg[ASM_SEGMENTS];
+  int nseg, cur;
+  char scope[ASM_NAME_MAX]; // the last label not starting with '@'
+  int forward;              // the last expression referred further down
+};
+
+// Where segments start until an .org moves them, as in custom.cfg.
+static const struct {
+  const char *name;
+  unsigned start;
+} asm_default_segments[] = {
+    {"ZEROPAGE", 0x0000},
+    {"CODE", 0x8000},
+    {"VECTORS", 0xFFFA},
+};
+
+static int asm_error(struct asm_state *st, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s:%d: ", st->name, st->line);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+  return -1;
 }
 
-#define PHP() PHP_c(&default_cpu)
-void PHP_c(cpu6502 *cpu) {
-  uint8_t p = pack_P(cpu) | 0x10;
-  push_c(cpu, p);
+static int asm_ident_start(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' ||
+         c == '@';
 }
 
-#define PLP() PLP_c(&default_cpu)
-void PLP_c(cpu6502 *cpu) {
-  uint8_t p = pull_c(cpu);
-  unpack_P(cpu, p);
+static int asm_ident_char(char c) {
+  return asm_ident_start(c) || (c >= '0' && c <= '9');
 }
 
-#define JSR(addr) JSR_c(&default_cpu, addr)
-void JSR_c(cpu6502 *cpu, uint16_t addr){
-  uint16_t r_addr = cpu->PC -1;
-  push_c(cpu, (r_addr >> 8) & 0xFF);
-  push_c(cpu, r_addr & 0xFF);
-  cpu->PC = addr; 
+static const char *asm_skip(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\r')
+    p++;
+  return p;
 }
 
-#define RTS() RTS_c(&default_cpu)
-void RTS_c(cpu6502 *cpu){
-  uint8_t lo = pull_c(cpu);
-  uint8_t hi = pull_c(cpu);
-  cpu->PC = ((uint16_t)hi << 8| lo)+1;
+// Read the identifier at *p into buf, with @locals put in the current
+// scope. Returns its length in the source, or 0 if there is none.
+static int asm_ident(struct asm_state *st, const char **p, char *buf) {
+  const char *s = *p;
+  if (!asm_ident_start(*s))
+    return 0;
+  while (asm_ident_char(*s))
+    s++;
+  int len = (int)(s - *p);
+  int pre = **p == '@' ? (int)strlen(st->scope) : 0;
+  if (pre + len >= ASM_NAME_MAX) {
+    asm_error(st, "name too long");
+    return -1;
+  }
+  memcpy(buf, st->scope, pre);
+  memcpy(buf + pre, *p, len);
+  buf[pre + len] = 0;
+  *p = s;
+  return len;
 }
 
-#define RTI() RTI_c(&default_cpu)
-void RTI_c(cpu6502 *cpu){
-  uint8_t p = pull_c(cpu);
-  unpack_P(cpu, p);
+static struct asm_symbol *asm_lookup(const struct asm_image *img,
+                                     const char *name) {
+  for (unsigned i = 0; i < img->nsyms; i++)
+    if (!strcmp(img->syms[i].name, name))
+      return &img->syms[i];
+  return NULL;
+}
 
-  uint8_t lo = pull_c(cpu);
-  uint8_t hi = pull_c(cpu);
-  cpu->PC = ((uint16_t)hi << 8| lo);
+static int asm_define(struct asm_state *st, const char *name, int32_t value,
+                      int forward) {
+  struct asm_image *img = st->img;
+  struct asm_symbol *sym = asm_lookup(img, name);
+  if (st->pass == 2) {
+    if (sym && sym->line == st->line && sym->value == value)
+      return 0;
+    return asm_error(st, "%s moved between passes", name);
+  }
+  if (sym)
+    return asm_error(st, "%s is already defined on line %d", name, sym->line);
+  if (img->nsyms == img->cap) {
+    unsigned cap = img->cap ? img->cap * 2 : 64;
+    struct asm_symbol *syms = realloc(img->syms, cap * sizeof(*syms));
+    if (!syms)
+      return asm_error(st, "out of memory");
+    img->syms = syms;
+    img->cap = cap;
+  }
+  sym = &img->syms[img->nsyms++];
+  snprintf(sym->name, sizeof(sym->name), "%s", name);
+  sym->value = value;
+  sym->line = st->line;
+  sym->forward = forward;
+  return 0;
 }
 
-#define NOP() NOP_c(&default_cpu)
-void NOP_c(cpu6502 *cpu){}
+static int asm_expr(struct asm_state *st, const char **p, int32_t *v);
+
+static int asm_primary(struct asm_state *st, const char **p, int32_t *v) {
+  const char *s = asm_skip(*p);
+  char name[ASM_NAME_MAX];
+  int base = 0;
+
+  *v = 0;
+  if (*s == '$') {
+    base = 16;
+    s++;
+  } else if (*s == '%') {
+    base = 2;
+    s++;
+  } else if (*s >= '0' && *s <= '9') {
+    base = 10;
+  }
+  if (base) {
+    const char *start = s;
+    for (;; s++) {
+      int d = *s >= '0' && *s <= '9'   ? *s - '0'
+              : *s >= 'a' && *s <= 'f' ? *s - 'a' + 10
+              : *s >= 'A' && *s <= 'F' ? *s - 'A' + 10
+                                       : 99;
+      if (d >= base)
+        break;
+      *v = *v * base + d;
+      if (*v > 0xFFFFFF)
+        return asm_error(st, "number too large");
+    }
+    if (s == start)
+      return asm_error(st, "expected a number");
+    *p = s;
+    return 0;
+  }
+  if (*s == '\'') {
+    if (!s[1] || s[2] != '\'')
+      return asm_error(st, "bad character constant");
+    *v = (uint8_t)s[1];
+    *p = s + 3;
+    return 0;
+  }
+  if (*s == '*') {
+    *v = (int32_t)st->seg[st->cur].pc;
+    *p = s + 1;
+    return 0;
+  }
+  if (*s == '(') {
+    *p = s + 1;
+    if (asm_expr(st, p, v))
+      return -1;
+    s = asm_skip(*p);
+    if (*s != ')')
+      return asm_error(st, "expected )");
+    *p = s + 1;
+    return 0;
+  }
+
+  int len = asm_ident(st, &s, name);
+  if (len < 0)
+    return -1;
+  if (!len)
+    return asm_error(st, "expected an expression");
+  const struct asm_symbol *sym = asm_lookup(st->img, name);
+  if (!sym) {
+    if (st->pass == 2)
+      return asm_error(st, "undefined symbol %s", name);
+    st->forward = 1;
+  } else {
+    *v = sym->value;
+    st->forward |= sym->line > st->line || sym->forward;
+  }
+  *p = s;
+  return 0;
+}
+
+static int asm_unary(struct asm_state *st, const char **p, int32_t *v) {
+  const char *s = asm_skip(*p);
+  char op = *s;
+  if (op != '-' && op != '~' && op != '<' && op != '>')
+    return asm_primary(st, p, v);
+  *p = s + 1;
+  if (asm_unary(st, p, v))
+    return -1;
+  *v = op == '-'   ? -*v
+       : op == '~' ? ~*v
+       : op == '<' ? *v & 0xFF
+                   : *v >> 8 & 0xFF;
+  return 0;
+}
+
+// Binary operators by precedence, loosest first.
+static const char *const asm_binops[][3] = {
+    {"|"}, {"^"}, {"&"}, {"<<", ">>"}, {"+", "-"}, {"*", "/"},
+};
+
+static int asm_binary(struct asm_state *st, const char **p, int32_t *v,
+                      int level) {
+  int nlevels = sizeof(asm_binops) / sizeof(asm_binops[0]);
+  if (level == nlevels)
+    return asm_unary(st, p, v);
+  if (asm_binary(st, p, v, level + 1))
+    return -1;
+  for (;;) {
+    const char *s = asm_skip(*p), *op = NULL;
+    for (int i = 0; i < 3 && asm_binops[level][i]; i++) {
+      size_t n = strlen(asm_binops[level][i]);
+      if (!strncmp(s, asm_binops[level][i], n))
+        op = asm_binops[level][i];
+    }
+    if (!op)
+      return 0;
+    *p = s + strlen(op);
+    int32_t r;
+    if (asm_binary(st, p, &r, level + 1))
+      return -1;
+    switch (op[0] == op[1] ? op[0] + 0x100 : op[0]) {
+    case '|': *v |= r; break;
+    case '^': *v ^= r; break;
+    case '&': *v &= r; break;
+    case '<' + 0x100: *v = (int32_t)((uint32_t)*v << (r & 31)); break;
+    case '>' + 0x100: *v >>= r & 31; break;
+    case '+': *v += r; break;
+    case '-': *v -= r; break;
+    case '*': *v *= r; break;
+    case '/':
+      if (!r) {
+        if (st->pass == 2)
+          return asm_error(st, "division by zero");
+        r = 1; // a forward symbol, still 0 in the first pass
+      }
+      *v /= r;
+      break;
+    }
+  }
+}
+
+static int asm_expr(struct asm_state *st, const char **p, int32_t *v) {
+  return asm_binary(st, p, v, 0);
+}
+
+static int asm_emit(struct asm_state *st, uint8_t byte) {
+  struct asm_segment *seg = &st->seg[st->cur];
+  if (!seg->has_pc)
+    return asm_error(st, "segment %s has no address; .org it first",
+                     seg->name);
+  if (seg->pc > 0xFFFF)
+    return asm_error(st, "past the end of memory");
+  if (st->pass == 2) {
+    struct asm_image *img = st->img;
+    img->mem[seg->pc] = byte;
+    img->used[seg->pc >> 3] |= 1 << (seg->pc & 7);
+    if (!img->placed) {
+      img->entry = (uint16_t)seg->pc;
+      img->placed = 1;
+    }
+  }
+  seg->pc++;
+  return 0;
+}
+
+static int asm_segment(struct asm_state *st, const char *name) {
+  for (int i = 0; i < st->nseg; i++)
+    if (!strcmp(st->seg[i].name, name)) {
+      st->cur = i;
+      return 0;
+    }
+  if (st->nseg == ASM_SEGMENTS)
+    return asm_error(st, "too many segments");
+  struct asm_segment *seg = &st->seg[st->nseg];
+  snprintf(seg->name, sizeof(seg->name), "%s", name);
+  seg->pc = 0;
+  seg->has_pc = 0;
+  for (size_t i = 0;
+       i < sizeof(asm_default_segments) / sizeof(asm_default_segments[0]); i++)
+    if (!strcmp(asm_default_segments[i].name, name)) {
+      seg->pc = asm_default_segments[i].start;
+      seg->has_pc = 1;
+    }
+  st->cur = st->nseg++;
+  return 0;
+}
+
+// mnemonic, upper case, and the operand text after it.
+static int asm_insn(struct asm_state *st, const char *mnemonic,
+                    const char *p) {
+  // The opcode for each addressing mode, or -1.
+  int ops[REL + 1], known = 0;
+  for (int mode = IMP; mode <= REL; mode++)
+    ops[mode] = -1;
+  for (int op = 0; op < 256; op++)
+    if (op_table[op].name && !memcmp(op_table[op].name, mnemonic, 4)) {
+      ops[op_table[op].mode] = op;
+      known = 1;
+    }
+  if (!known)
+    return asm_error(st, "unknown instruction %s", mnemonic);
+
+  int mode, index = 0; // 'X' or 'Y' after a comma
+  int32_t v = 0;
+  p = asm_skip(p);
+  st->forward = 0;
+  if (!*p) {
+    mode = ops[IMP] >= 0 ? IMP : ACC;
+  } else if ((*p == 'a' || *p == 'A') && !asm_ident_char(p[1]) &&
+             !*asm_skip(p + 1)) {
+    mode = ACC;
+    p = asm_skip(p + 1);
+  } else if (*p == '#') {
+    p++;
+    if (asm_expr(st, &p, &v))
+      return -1;
+    if (st->pass == 2 && (v < -128 || v > 0xFF))
+      return asm_error(st, "immediate value $%X out of range", v);
+    mode = IMM;
+  } else {
+    // (ind), (zp,x) and (zp),y, for mnemonics that have them; otherwise
+    // the parentheses are part of an expression.
+    const char *s = p;
+    int indirect =
+        *p == '(' && (ops[IND] >= 0 || ops[IZX] >= 0 || ops[IZY] >= 0);
+    if (indirect)
+      s++;
+    if (asm_expr(st, &s, &v))
+      return -1;
+    s = asm_skip(s);
+    if (*s == ',') {
+      s = asm_skip(s + 1);
+      index = *s == 'x' || *s == 'X' ? 'X' : *s == 'y' || *s == 'Y' ? 'Y' : 0;
+      if (!index || asm_ident_char(s[1]))
+        return asm_error(st, "expected x or y after the comma");
+      s = asm_skip(s + 1);
+    }
+    if (indirect) {
+      if (*s != ')')
+        return asm_error(st, "expected )");
+      s = asm_skip(s + 1);
+      if (index == 'X')
+        mode = IZX;
+      else if (index == 'Y')
+        return asm_error(st, "(zp,y) is not an addressing mode");
+      else if (*s == ',') {
+        s = asm_skip(s + 1);
+        if ((*s != 'y' && *s != 'Y') || asm_ident_char(s[1]))
+          return asm_error(st, "expected y after (zp),");
+        s = asm_skip(s + 1);
+        mode = IZY;
+      } else {
+        mode = IND;
+      }
+    } else if (ops[REL] >= 0) {
+      if (index)
+        return asm_error(st, "a branch target takes no index");
+      mode = REL;
+    } else {
+      // The zero page form if the value is known to fit, or if there is
+      // no absolute one.
+      static const int zp[] = {ZP, ZPX, ZPY}, abs[] = {ABS, ABX, ABY};
+      int i = index == 'X' ? 1 : index == 'Y' ? 2 : 0;
+      int small = !st->forward && v >= 0 && v <= 0xFF;
+      mode = ops[zp[i]] >= 0 && (small || ops[abs[i]] < 0) ? zp[i] : abs[i];
+    }
+    p = s;
+  }
+  if (*p)
+    return asm_error(st, "unexpected %s", p);
+
+  int op = ops[mode];
+  if (op < 0)
+    return asm_error(st, "%s has no such addressing mode", mnemonic);
+  if (mode == REL) {
+    int32_t off = v - (int32_t)(st->seg[st->cur].pc + 2);
+    if (st->pass == 2 && (off < -128 || off > 127))
+      return asm_error(st, "branch out of range (%d bytes)", off);
+    v = off;
+  } else if (st->pass == 2 && mode != IMM) {
+    int32_t max = mode_len[mode] == 2 ? 0xFF : 0xFFFF;
+    if (mode_len[mode] > 1 && (v < 0 || v > max))
+      return asm_error(st, "address $%X out of range", v);
+  }
+
+  if (asm_emit(st, (uint8_t)op))
+    return -1;
+  for (int i = 1; i < mode_len[mode]; i++)
+    if (asm_emit(st, (uint8_t)(v >> (8 * (i - 1)))))
+      return -1;
+  return 0;
+}
+
+// dir is lower case, without the '.'.
+static int asm_directive(struct asm_state *st, const char *dir,
+                         const char *p) {
+  p = asm_skip(p);
+  if (!strcmp(dir, "segment")) {
+    char name[ASM_NAME_MAX];
+    const char *end = *p == '"' ? strchr(p + 1, '"') : NULL;
+    if (!end || end == p + 1 || end - p > ASM_NAME_MAX || *asm_skip(end + 1))
+      return asm_error(st, ".segment takes a quoted name");
+    memcpy(name, p + 1, end - p - 1);
+    name[end - p - 1] = 0;
+    return asm_segment(st, name);
+  }
+  if (!strcmp(dir, "org")) {
+    int32_t v;
+    st->forward = 0;
+    if (asm_expr(st, &p, &v))
+      return -1;
+    if (*asm_skip(p))
+      return asm_error(st, "unexpected %s", asm_skip(p));
+    if (st->forward)
+      return asm_error(st, ".org must not refer further down");
+    if (v < 0 || v > 0xFFFF)
+      return asm_error(st, ".org $%X out of range", v);
+    st->seg[st->cur].pc = (unsigned)v;
+    st->seg[st->cur].has_pc = 1;
+    return 0;
+  }
+
+  int word = !strcmp(dir, "word");
+  if (!word && strcmp(dir, "byte"))
+    return asm_error(st, "unknown directive .%s", dir);
+  for (;;) {
+    p = asm_skip(p);
+    if (*p == '"' && !word) {
+      for (p++; *p && *p != '"'; p++)
+        if (asm_emit(st, (uint8_t)*p))
+          return -1;
+      if (*p++ != '"')
+        return asm_error(st, "unterminated string");
+    } else {
+      int32_t v;
+      if (asm_expr(st, &p, &v))
+        return -1;
+      if (st->pass == 2 && (v < (word ? -32768 : -128) ||
+                            v > (word ? 0xFFFF : 0xFF)))
+        return asm_error(st, "$%X does not fit in a %s", v, dir);
+      if (asm_emit(st, (uint8_t)v) || (word && asm_emit(st, (uint8_t)(v >> 8))))
+        return -1;
+    }
+    p = asm_skip(p);
+    if (!*p)
+      return 0;
+    if (*p++ != ',')
+      return asm_error(st, "expected a comma");
+  }
+}
+
+static int asm_line(struct asm_state *st, char *line) {
+  // Cut the comment, minding quotes.
+  char quote = 0;
+  for (char *c = line; *c; c++) {
+    if (quote && *c == quote)
+      quote = 0;
+    else if (!quote && (*c == '"' || *c == '\''))
+      quote = *c;
+    else if (!quote && *c == ';') {
+      *c = 0;
+      break;
+    }
+  }
+  size_t n = strlen(line);
+  while (n && asm_skip(&line[n - 1]) != &line[n - 1])
+    line[--n] = 0;
+
+  const char *p = asm_skip(line);
+  char name[ASM_NAME_MAX];
+  int local = *p == '@';
+  int len = asm_ident(st, &p, name);
+  if (len < 0)
+    return -1;
+  if (len && *p == ':') { // a label
+    if (!local)
+      snprintf(st->scope, sizeof(st->scope), "%s", name);
+    const struct asm_segment *seg = &st->seg[st->cur];
+    if (!seg->has_pc)
+      return asm_error(st, "segment %s has no address; .org it first",
+                       seg->name);
+    if (asm_define(st, name, (int32_t)seg->pc, 0))
+      return -1;
+    p = asm_skip(p + 1);
+    local = *p == '@';
+    len = asm_ident(st, &p, name);
+    if (len < 0)
+      return -1;
+  }
+
+  if (len && *asm_skip(p) == '=') {
+    int32_t v;
+    p = asm_skip(p) + 1;
+    st->forward = 0;
+    if (asm_expr(st, &p, &v))
+      return -1;
+    if (*asm_skip(p))
+      return asm_error(st, "unexpected %s", asm_skip(p));
+    // Keep the first pass's view of whether it refers further down: the
+    // second must size the instructions that use it the same way.
+    const struct asm_symbol *sym = asm_lookup(st->img, name);
+    return asm_define(st, name, v, st->pass == 2 && sym ? sym->forward
+                                                        : st->forward);
+  }
+  if (len) {
+    char mnemonic[4];
+    if (len != 3 || local)
+      return asm_error(st, "unknown instruction %s", name);
+    for (int i = 0; i < 3; i++)
+      mnemonic[i] = name[i] >= 'a' && name[i] <= 'z' ? name[i] - 32 : name[i];
+    mnemonic[3] = 0;
+    return asm_insn(st, mnemonic, p);
+  }
+  if (*p == '.') {
+    char dir[16];
+    int i = 0;
+    for (p++; asm_ident_char(*p) && i < 15; p++)
+      dir[i++] = *p >= 'A' && *p <= 'Z' ? *p + 32 : *p;
+    dir[i] = 0;
+    return asm_directive(st, dir, p);
+  }
+  if (*p)
+    return asm_error(st, "unexpected %s", p);
+  return 0;
+}
+
+static int asm_pass(struct asm_state *st, const char *src, size_t len) {
+  st->nseg = 0;
+  st->scope[0] = 0;
+  if (asm_segment(st, "CODE"))
+    return -1;
+  st->line = 0;
+  for (size_t off = 0; off < len;) {
+    const char *nl = memchr(src + off, '\n', len - off);
+    size_t n = nl ? (size_t)(nl - (src + off)) : len - off;
+    char line[ASM_LINE_MAX];
+    st->line++;
+    if (n >= sizeof(line))
+      return asm_error(st, "line too long");
+    memcpy(line, src + off, n);
+    line[n] = 0;
+    if (asm_line(st, line))
+      return -1;
+    off += n + 1;
+  }
+  return 0;
+}
+
+void asm_close(struct asm_image *img) {
+  if (img)
+    free(img->syms);
+  free(img);
+}
+
+// Assemble the len bytes of source at src; name is what messages call it.
+// Returns NULL, having said why on stderr, on the first error.
+struct asm_image *asm_assemble(const char *src, size_t len, const char *name) {
+  struct asm_state st = {.name = name ? name : "asm"};
+  st.img = calloc(1, sizeof(struct asm_image));
+  if (!st.img)
+    return NULL;
+  for (st.pass = 1; st.pass <= 2; st.pass++)
+    if (asm_pass(&st, src, len)) {
+      asm_close(st.img);
+      return NULL;
+    }
+  return st.img;
+}
+
+// Assemble the file at path, as asm_assemble.
+struct asm_image *asm_open(const char *path) {
+  size_t size, map_len;
+  void *map = rom_map_file(path, &size, &map_len);
+  if (!map)
+    return NULL;
+  struct asm_image *img = asm_assemble(map, size, path);
+#if CPU_MMAP
+  munmap(map, map_len);
+#else
+  free(map);
+#endif
+  return img;
+}
+
+// The value of symbol name in img, or -1 if it has none.
+int32_t asm_symbol(const struct asm_image *img, const char *name) {
+  const struct asm_symbol *sym = asm_lookup(img, name);
+  return sym ? sym->value : -1;
+}
+
+// Copy the bytes img placed into m's memory[]. If img does not set the
+// reset vector, it is pointed at the first address placed, as for ROM
+// images. Pages mapped to a ROM image go on reading the image.
+void asm_load(machine6502 *m, const struct asm_image *img) {
+  for (unsigned p = 0; p < 256; p++) {
+    int changed = 0;
+    for (unsigned a = p << 8; a < (p + 1) << 8; a += 8) {
+      uint8_t bits = img->used[a >> 3];
+      for (unsigned i = 0; bits; i++, bits >>= 1)
+        if (bits & 1)
+          m->memory[a + i] = img->mem[a + i];
+      changed |= img->used[a >> 3];
+    }
+    if (changed)
+      mem_changed(m, p, 1);
+  }
+
+  if ((img->used[0xFFFC >> 3] & 0x30) != 0x30 && img->placed) {
+    m->memory[0xFFFC] = img->entry & 0xFF;
+    m->memory[0xFFFD] = img->entry >> 8;
+    mem_changed(m, 0xFF, 1);
+  }
+}
+
+/* --------------------------------------------------------- */
+/* Disassembler                                               */
+/* --------------------------------------------------------- */
+
+// Text for the decoder's own tables: the mnemonic and mode come from
+// op_table and the length from mode_len, so the disassembler cannot
+// disagree with what cpu_step runs. Output is ca65 syntax, which
+// asm_assemble reads back; undocumented opcodes come out as .byte.
+//
+// Nothing here allocates or calls printf, so trace tools can afford a line
+// per instruction: text is built with fixed-size copies into buffers that
+// leave a few bytes of slack past the text, see DIS_TEXT_MAX.
+
+#define DIS_TEXT_MAX 16 // "LDA ($12),Y" and slack for the copies
+#define DIS_LINE_MAX 32 // "8000  B1 12     " text and a newline
+
+struct dis_mode {
+  char pre[4], post[4]; // operand text around the value
+  uint8_t npre, npost;
+  uint8_t digits; // width of the value in hex digits
+};
+
+#define DIS_MODE(pre, post, digits)                                            \
+  {pre, post, sizeof(pre) - 1, sizeof(post) - 1, digits}
+
+static const struct dis_mode dis_modes[] = {
+    [IMP] = DIS_MODE("", "", 0),     [ACC] = DIS_MODE("A", "", 0),
+    [IMM] = DIS_MODE("#$", "", 2),   [ZP] = DIS_MODE("$", "", 2),
+    [ZPX] = DIS_MODE("$", ",X", 2),  [ZPY] = DIS_MODE("$", ",Y", 2),
+    [ABS] = DIS_MODE("$", "", 4),    [ABX] = DIS_MODE("$", ",X", 4),
+    [ABY] = DIS_MODE("$", ",Y", 4),  [IND] = DIS_MODE("($", ")", 4),
+    [IZX] = DIS_MODE("($", ",X)", 2), [IZY] = DIS_MODE("($", "),Y", 2),
+    [REL] = DIS_MODE("$", "", 4),
+};
+
+static const char dis_hex[] = "0123456789ABCDEF";
+
+#define DIS_HEX2(p, v)                                                         \
+  ((p)[0] = dis_hex[(uint8_t)(v) >> 4], (p)[1] = dis_hex[(v) & 0xF])
+
+// Length in bytes of the instruction starting with op; 1 for undocumented
+// opcodes, which are shown as data.
+static inline unsigned dis_len(uint8_t op) {
+  return op_table[op].name ? mode_len[op_table[op].mode] : 1;
+}
+
+// Write the instruction at pc as text to out, which must have room for
+// DIS_TEXT_MAX bytes. b holds the instruction's bytes, dis_len(b[0]) of
+// them. Returns the length of the text, which is not NUL-terminated.
+static inline unsigned dis_text(char *out, uint16_t pc, const uint8_t *b) {
+  const struct opcode *o = &op_table[b[0]];
+  if (!o->name) {
+    memcpy(out, ".byte $", 8);
+    DIS_HEX2(out + 7, b[0]);
+    return 9;
+  }
+  memcpy(out, o->name, 4); // three letters and the NUL
+  if (o->mode == IMP)
+    return 3;
+
+  const struct dis_mode *d = &dis_modes[o->mode];
+  char *p = out + 4;
+  out[3] = ' ';
+  memcpy(p, d->pre, 4);
+  p += d->npre;
+  unsigned v = b[1];
+  if (o->mode == REL)
+    v = (uint16_t)(pc + 2 + (int8_t)b[1]);
+  else if (d->digits == 4)
+    v |= b[2] << 8;
+  if (d->digits == 4) {
+    DIS_HEX2(p, v >> 8);
+    p += 2;
+  }
+  if (d->digits) {
+    DIS_HEX2(p, v & 0xFF);
+    p += 2;
+  }
+  memcpy(p, d->post, 4);
+  return (unsigned)(p + d->npost - out);
+}
+
+// m's memory as the CPU would read it, except that device pages show
+// memory[] rather than being read through the device.
+static inline uint8_t dis_peek(const machine6502 *m, uint16_t addr) {
+  const uint8_t *page = m->rd[addr >> 8];
+  return page ? page[addr & 0xFF] : m->memory[addr];
+}
+
+// Disassemble m's memory from *addr up to end (exclusive, at most 0x10000)
+// into buf, one line per instruction:
+//
+//   8000  A9 05     LDA #$05
+//
+// Stops once another line might not fit in cap bytes. Returns the number of
+// bytes written and leaves *addr at the first instruction not written, so a
+// large range can be drained through a small buffer. A buffer smaller than
+// DIS_LINE_MAX gets nothing.
+size_t dis_range(const machine6502 *m, uint32_t *addr, uint32_t end,
+                 char *buf, size_t cap) {
+  if (cap < DIS_LINE_MAX)
+    return 0;
+  char *p = buf, *stop = buf + cap - DIS_LINE_MAX;
+  uint32_t a = *addr;
+  while (a < end && p <= stop) {
+    uint8_t b[3] = {dis_peek(m, (uint16_t)a), dis_peek(m, (uint16_t)(a + 1)),
+                    dis_peek(m, (uint16_t)(a + 2))};
+    unsigned len = dis_len(b[0]);
+    DIS_HEX2(p, a >> 8);
+    DIS_HEX2(p + 2, a & 0xFF);
+    memcpy(p + 4, "                ", 12);
+    for (unsigned i = 0; i < len; i++)
+      DIS_HEX2(p + 6 + 3 * i, b[i]);
+    p += 16;
+    p += dis_text(p, (uint16_t)a, b);
+    *p++ = '\n';
+    a += len;
+  }
+  *addr = a;
+  return (size_t)(p - buf);
+}
+
+/* --------------------------------------------------------- */
+/* Instruction trace                                          */
+/* --------------------------------------------------------- */
+
+// Built with -DCPU_TRACE, a machine with a trace attached logs every
+// instruction it starts, with the registers as they were before it ran.
+// The run loop only stores entries into a ring; a thread of the trace's
+// own encodes and compresses them into the output stream. When the ring
+// is full the machine waits for the thread, unless the trace was started
+// lossy: then it drops the entry, counts it and runs on, and the stream
+// has a gap there.
+//
+// The stream is "65IT" and a version byte, then blocks of
+//
+//   raw length, compressed length   32 bits each, little endian
+//   an LZ4 block                    that many bytes, decompressing to raw
+//
+// Each block decompresses to whole entries, each coded against the one
+// before it in the block (all fields 0 before the first). Taking pc (low
+// byte first), opcode, a, x, y, p and sp as bytes 0 to 7 of a word:
+//
+//   mask    bit i set for each byte i that follows, bit 2 aside
+//   bytes   those, in order, and always the opcode; the others are as
+//           before, but for pc, which is the previous pc plus its length
+//   cycles  if bit 2 is set, a LEB128 varint added to the previous count;
+//           otherwise the previous count plus its opcode's base cycles
+//
+// Straight-line code thus costs two or three bytes an instruction before
+// compression, and loops compress to next to nothing.
+struct trace_entry {
+  uint64_t cycles; // at the start of the instruction
+  uint16_t pc;
+  uint8_t op, a, x, y, p, sp;
+};
+
+#define TRACE_RING (1 << 14) // entries, a power of two; 256 KiB
+#define TRACE_BLOCK 0x10000  // bytes of encoded entries per block
+#define TRACE_ENTRY_MAX 19   // worst case: every byte and a 10-byte varint
+#define TRACE_MAGIC "65IT\x01"
+
+#if CPU_TRACING
+
+struct trace {
+  struct trace_entry ring[TRACE_RING];
+  _Alignas(64) uint64_t head; // next entry to store, written by the machine
+  uint64_t tail_seen;         // the machine's last look at tail
+  uint64_t dropped;           // entries a lossy trace had no room for
+  int lossy;
+  _Alignas(64) uint64_t tail; // next entry to drain, written by the thread
+  int stop;
+  int error; // the output could not be written
+  FILE *out;
+  pthread_t thread;
+};
+
+// Wait for the thread to free a slot. Returns 0 if the trace is lossy and
+// the entry was dropped instead.
+__attribute__((noinline, cold)) static int trace_wait(struct trace *t) {
+  while ((t->tail_seen = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE)) +
+             TRACE_RING == t->head) {
+    if (t->lossy) {
+      t->dropped++;
+      return 0;
+    }
+    sched_yield();
+  }
+  return 1;
+}
+
+static inline void trace_push(struct trace *t, uint16_t pc, uint8_t op,
+                              uint8_t a, uint8_t x, uint8_t y, uint8_t p,
+                              uint8_t sp, uint64_t cycles) {
+  uint64_t h = t->head;
+  if (__builtin_expect(h - t->tail_seen == TRACE_RING, 0) && !trace_wait(t))
+    return;
+  struct trace_entry *e = &t->ring[h & (TRACE_RING - 1)];
+  *e = (struct trace_entry){cycles, pc, op, a, x, y, p, sp};
+  __atomic_store_n(&t->head, h + 1, __ATOMIC_RELEASE);
+}
+
+// Log one instruction to t, if tracing is compiled in and t is not NULL.
+// The arguments are not evaluated otherwise.
+#define TRACE_ON(t) __builtin_expect((t) != NULL, 0)
+#define TRACE_INSN(t, pc, op, a, x, y, p, sp, cycles)                          \
+  do {                                                                         \
+    if (TRACE_ON(t))                                                           \
+      trace_push(t, pc, op, a, x, y, p, sp, cycles);                           \
+  } while (0)
+
+static uint8_t *lz4_length(uint8_t *o, size_t len) {
+  for (; len >= 255; len -= 255)
+    *o++ = 255;
+  *o++ = (uint8_t)len;
+  return o;
+}
+
+// Compress src[0, n) into dst, which has room for n + n / 255 + 16 bytes,
+// in the LZ4 block format. n is at most 64 KiB, so every offset fits.
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+  uint32_t table[1 << 12] = {0};
+  size_t anchor = 0, i = 0;
+  unsigned misses = 0;
+  uint8_t *o = dst;
+
+  // The format wants the last match to start 12 bytes before the end and
+  // the last 5 bytes to be literals.
+  while (n > 12 && i < n - 12) {
+    uint32_t seq;
+    memcpy(&seq, src + i, 4);
+    uint32_t h = (seq * 2654435761u) >> 20;
+    size_t cand = table[h];
+    table[h] = (uint32_t)i;
+    if (cand >= i || memcmp(src + cand, src + i, 4) != 0) {
+      // Step further the longer nothing matches, as LZ4 itself does;
+      // trace blocks are mostly long repeats or nothing much.
+      i += 1 + (misses++ >> 5);
+      continue;
+    }
+    misses = 0;
+
+    // Extend the match eight bytes at a time, then byte by byte.
+    size_t len = 4;
+    for (uint64_t a, b; i + len + 8 <= n - 5; len += 8) {
+      memcpy(&a, src + cand + len, 8);
+      memcpy(&b, src + i + len, 8);
+      if (a != b)
+        break;
+    }
+    while (i + len < n - 5 && src[cand + len] == src[i + len])
+      len++;
+    size_t lit = i - anchor, ml = len - 4, off = i - cand;
+    *o++ = (uint8_t)((lit < 15 ? lit : 15) << 4 | (ml < 15 ? ml : 15));
+    if (lit >= 15)
+      o = lz4_length(o, lit - 15);
+    memcpy(o, src + anchor, lit);
+    o += lit;
+    *o++ = off & 0xFF;
+    *o++ = off >> 8;
+    if (ml >= 15)
+      o = lz4_length(o, ml - 15);
+    i += len;
+    anchor = i;
+  }
+
+  size_t lit = n - anchor;
+  *o++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+  if (lit >= 15)
+    o = lz4_length(o, lit - 15);
+  memcpy(o, src + anchor, lit);
+  return (size_t)(o + lit - dst);
+}
+
+#else
+#define TRACE_ON(t) ((void)(t), 0)
+#define TRACE_INSN(t, ...) ((void)(t))
+#endif
+
+// Inflate an LZ4 block into dst. Returns the decompressed size, or -1 if
+// the block is corrupt or would not fit in cap bytes.
+static long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+                           size_t cap) {
+  const uint8_t *end = src + n;
+  size_t o = 0;
+  while (src < end) {
+    uint8_t token = *src++;
+    size_t lit = token >> 4, ml = token & 15;
+    if (lit == 15)
+      for (uint8_t b = 255; b == 255 && src < end; lit += b)
+        b = *src++;
+    if (lit > (size_t)(end - src) || lit > cap - o)
+      return -1;
+    memcpy(dst + o, src, lit);
+    src += lit;
+    o += lit;
+    if (src == end)
+      break;
+
+    if (end - src < 2)
+      return -1;
+    size_t off = src[0] | src[1] << 8;
+    src += 2;
+    if (ml == 15)
+      for (uint8_t b = 255; b == 255 && src < end; ml += b)
+        b = *src++;
+    ml += 4;
+    if (off == 0 || off > o || ml > cap - o)
+      return -1;
+    for (size_t k = 0; k < ml; k++, o++) // may overlap itself
+      dst[o] = dst[o - off];
+  }
+  return (long)o;
+}
+
+// The word to expect after prev: the same registers, the pc following.
+static uint64_t trace_guess(uint64_t prev) {
+  uint8_t op = (uint8_t)(prev >> 16);
+  return (prev & ~0xFFFFull) | (uint16_t)(prev + mode_len[op_table[op].mode]);
+}
+
+#if CPU_TRACING
+
+static uint64_t trace_word(const struct trace_entry *e) {
+  return e->pc | (uint64_t)e->op << 16 | (uint64_t)e->a << 24 |
+         (uint64_t)e->x << 32 | (uint64_t)e->y << 40 | (uint64_t)e->p << 48 |
+         (uint64_t)e->sp << 56;
+}
+
+struct trace_writer {
+  uint64_t word, cycles; // of the previous entry
+  size_t len;
+  uint8_t op_len[256]; // trace_guess's lookup, flattened
+  uint8_t raw[TRACE_BLOCK];
+  uint8_t packed[8 + TRACE_BLOCK + TRACE_BLOCK / 255 + 16];
+};
+
+static void trace_flush_block(struct trace *t, struct trace_writer *w) {
+  if (!w->len)
+    return;
+  size_t n = lz4_compress(w->raw, w->len, w->packed + 8);
+  for (int i = 0; i < 4; i++) {
+    w->packed[i] = (uint8_t)(w->len >> 8 * i);
+    w->packed[4 + i] = (uint8_t)(n >> 8 * i);
+  }
+  if (fwrite(w->packed, 1, 8 + n, t->out) != 8 + n)
+    t->error = 1;
+  w->len = 0;
+  w->word = w->cycles = 0;
+}
+
+// Encode ring entries [from, to). Every byte of an entry is stored and p
+// only moves past the ones that changed, since which registers change is
+// too hard to predict to branch on; the entry's length is worked out on
+// the side, so the next one need not wait for that.
+static void trace_encode(struct trace *t, struct trace_writer *w,
+                         uint64_t from, uint64_t to) {
+  const uint64_t lo7 = 0x7F7F7F7F7F7F7F7Full;
+  uint64_t prev = w->word, cycles = w->cycles;
+  uint8_t *o = w->raw + w->len;
+
+  for (uint64_t i = from; i != to; i++) {
+    if (o > w->raw + TRACE_BLOCK - TRACE_ENTRY_MAX) {
+      w->len = (size_t)(o - w->raw);
+      trace_flush_block(t, w);
+      prev = cycles = 0;
+      o = w->raw;
+    }
+    const struct trace_entry *e = &t->ring[i & (TRACE_RING - 1)];
+    uint8_t op = (uint8_t)(prev >> 16);
+    uint64_t guess = (prev & ~0xFFFFull) | (uint16_t)(prev + w->op_len[op]);
+    uint64_t word = trace_word(e), diff = word ^ guess;
+
+    // Bit 8i of changed is set if byte i of diff is not 0, and always for
+    // the opcode. The multiplies gather those bits into the mask and add
+    // them up.
+    uint64_t changed = (((diff & lo7) + lo7) | diff) & ~lo7;
+    changed = changed >> 7 | 1ull << 16;
+    unsigned mask = (unsigned)(changed * 0x0102040810204080ull >> 56);
+    uint8_t *start = o, *p = o + 1;
+#define TRACE_BYTE(k)                                                          \
+  *p = (uint8_t)(word >> 8 * k);                                               \
+  p += (changed >> 8 * k) & 1;
+    TRACE_BYTE(0) TRACE_BYTE(1) TRACE_BYTE(2) TRACE_BYTE(3)
+    TRACE_BYTE(4) TRACE_BYTE(5) TRACE_BYTE(6) TRACE_BYTE(7)
+#undef TRACE_BYTE
+    o += 1 + (changed * 0x0101010101010101ull >> 56);
+
+    mask &= ~0x04u;
+    if (e->cycles != cycles + op_cycles[op]) {
+      mask |= 0x04;
+      uint64_t v = e->cycles - cycles;
+      for (; v >= 0x80; v >>= 7)
+        *o++ = (uint8_t)v | 0x80;
+      *o++ = (uint8_t)v;
+    }
+    *start = (uint8_t)mask;
+    prev = word;
+    cycles = e->cycles;
+  }
+
+  w->len = (size_t)(o - w->raw);
+  w->word = prev;
+  w->cycles = cycles;
+}
+
+static void *trace_drain(void *arg) {
+  struct trace *t = arg;
+  struct trace_writer *w = calloc(1, sizeof(struct trace_writer));
+  if (!w)
+    t->error = 1;
+  for (int op = 0; w && op < 256; op++)
+    w->op_len[op] = mode_len[op_table[op].mode];
+
+  for (unsigned idle = 0;; idle++) {
+    uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    if (head == t->tail) {
+      // Nap rather than spin while the machine is not running. Once it
+      // starts again it may have to wait out one nap.
+      if (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        if (idle < 64)
+          sched_yield();
+        else
+          nanosleep(&(struct timespec){0, 50000}, NULL);
+        continue;
+      }
+      // The machine stored its last entry before setting stop.
+      if (__atomic_load_n(&t->head, __ATOMIC_ACQUIRE) == t->tail)
+        break;
+      continue;
+    }
+    // Hand space back every few thousand entries so the machine rarely
+    // catches up with us.
+    idle = 0;
+    if (head - t->tail > 4096)
+      head = t->tail + 4096;
+    if (w)
+      trace_encode(t, w, t->tail, head);
+    __atomic_store_n(&t->tail, head, __ATOMIC_RELEASE);
+  }
+
+  if (w)
+    trace_flush_block(t, w);
+  if (fflush(t->out) != 0)
+    t->error = 1;
+  free(w);
+  return NULL;
+}
+
+static int trace_attach(machine6502 *m, FILE *out, int lossy) {
+  if (m->trace)
+    return -1;
+  struct trace *t = aligned_alloc(64, sizeof(struct trace));
+  if (!t)
+    return -1;
+  t->head = t->tail = t->tail_seen = t->dropped = 0;
+  t->lossy = lossy;
+  t->stop = t->error = 0;
+  t->out = out;
+  if (fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, out) !=
+          sizeof(TRACE_MAGIC) - 1 ||
+      pthread_create(&t->thread, NULL, trace_drain, t) != 0) {
+    free(t);
+    return -1;
+  }
+  m->trace = t;
+  return 0;
+}
+
+// Start logging every instruction m runs to out, which the caller opened
+// for writing and closes after trace_stop. Returns 0, or -1 if the trace
+// could not be set up. A machine has at most one trace, and must not be
+// running when it is attached or removed.
+int trace_start(machine6502 *m, FILE *out) { return trace_attach(m, out, 0); }
+
+// Like trace_start, but the machine never waits on the trace: entries the
+// ring has no room for are dropped, and counted by trace_dropped.
+int trace_start_lossy(machine6502 *m, FILE *out) {
+  return trace_attach(m, out, 1);
+}
+
+// How many entries m's trace has dropped so far.
+uint64_t trace_dropped(const machine6502 *m) {
+  return m->trace ? m->trace->dropped : 0;
+}
+
+// Write out what is left of m's trace and detach it. Returns 0, or -1 if
+// any of the trace could not be written.
+int trace_stop(machine6502 *m) {
+  struct trace *t = m->trace;
+  if (!t)
+    return 0;
+  __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(t->thread, NULL);
+  int error = t->error;
+  free(t);
+  m->trace = NULL;
+  return error ? -1 : 0;
+}
+
+#endif
+
+// Read a stream written by trace_start, calling fn on every entry until it
+// returns nonzero. Returns 0 at the end of the stream or when fn stopped
+// it, -1 if the stream is damaged.
+int trace_read(FILE *in, int (*fn)(const struct trace_entry *e, void *ctx),
+               void *ctx) {
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+    return -1;
+
+  static const size_t max_packed = TRACE_BLOCK + TRACE_BLOCK / 255 + 16;
+  // raw has room for a damaged last entry to run past the end.
+  uint8_t *packed = malloc(max_packed);
+  uint8_t *raw = malloc(TRACE_BLOCK + TRACE_ENTRY_MAX);
+  int status = (packed && raw) ? 0 : -1;
+  uint8_t hdr[8];
+
+  while (status == 0 && fread(hdr, 1, 8, in) == 8) {
+    size_t rawlen = hdr[0] | hdr[1] << 8 | (size_t)hdr[2] << 16 |
+                    (size_t)hdr[3] << 24;
+    size_t n = hdr[4] | hdr[5] << 8 | (size_t)hdr[6] << 16 |
+               (size_t)hdr[7] << 24;
+    if (n > max_packed || fread(packed, 1, n, in) != n ||
+        lz4_decompress(packed, n, raw, TRACE_BLOCK) != (long)rawlen) {
+      status = -1;
+      break;
+    }
+    memset(raw + rawlen, 0, TRACE_ENTRY_MAX);
+
+    uint64_t word = 0, cycles = 0;
+    const uint8_t *s = raw, *end = raw + rawlen;
+    while (s < end) {
+      uint8_t mask = *s++;
+      uint64_t next = trace_guess(word);
+      for (int i = 0; i < 8; i++)
+        if ((mask >> i & 1) || i == 2)
+          next = (next & ~(0xFFull << 8 * i)) | (uint64_t)*s++ << 8 * i;
+      if (mask & 0x04) {
+        uint64_t d = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+          d |= (uint64_t)(*s & 0x7F) << shift;
+          if (!(*s++ & 0x80))
+            break;
+        }
+        cycles += d;
+      } else {
+        cycles += op_cycles[(uint8_t)(word >> 16)];
+      }
+      word = next;
+      if (s > end) {
+        status = -1;
+        break;
+      }
+
+      struct trace_entry e = {cycles,
+                              (uint16_t)word,
+                              (uint8_t)(word >> 16),
+                              (uint8_t)(word >> 24),
+                              (uint8_t)(word >> 32),
+                              (uint8_t)(word >> 40),
+                              (uint8_t)(word >> 48),
+                              (uint8_t)(word >> 56)};
+      if (fn(&e, ctx))
+        goto done;
+    }
+  }
+  if (status == 0 && ferror(in))
+    status = -1;
+
+done:
+  free(packed);
+  free(raw);
+  return status;
+}
+
+// An undocumented opcode does nothing but take its base cycles. The core
+// only counts them; front ends say so on stderr if they care.
+__attribute__((noinline, cold)) static void op_undocumented(machine6502 *m) {
+  if (!m->undocumented++)
+    m->undocumented_pc = m->cpu.PC - 1;
+}
+
+// The base cycles go on beside the handler lookup, inlined into cpu_step,
+// so counting them costs a table load and an add and no call of its own.
+static inline void op_exec(machine6502 *m, uint8_t opcode) {
+  op_fn exec = op_table[opcode].exec;
+
+  m->cpu.cycles += op_cycles[opcode];
+
+  if (__builtin_expect(exec != NULL, 1))
+    exec(m);
+  else
+    op_undocumented(m);
+}
+
+// Execute an opcode that has already been fetched; PC points past it.
+void cpu_exec(machine6502 *m, uint8_t opcode) { op_exec(m, opcode); }
+
+// Execute one instruction and return its opcode.
+uint8_t cpu_step(machine6502 *m) {
+  uint8_t opcode = bus_fetch(m, m->cpu.PC++);
+  TRACE_INSN(m->trace, m->cpu.PC - 1, opcode, m->cpu.A, m->cpu.X, m->cpu.Y,
+             pack_P(&m->cpu), m->cpu.SP, m->cpu.cycles);
+  op_exec(m, opcode);
+  return opcode;
+}
+
+/* --------------------------------------------------------- */
+/* Run loop                                                   */
+/* --------------------------------------------------------- */
+
+enum run_status {
+  RUN_BRK,    // executed a BRK
+  RUN_BUDGET, // reached the cycle deadline
+  RUN_YIELD,  // cpu_yield was called
+};
+
+// Build with -DCPU_NO_THREADED to get the portable cpu_step loop, or with
+// -DCPU_NO_BLOCKS to run the threaded loop without the block cache. On
+// x86-64 Linux, -DCPU_JIT also translates hot blocks to native code.
+#if defined(__GNUC__) && !defined(CPU_NO_THREADED)
+#define CPU_THREADED 1
+#else
+#define CPU_THREADED 0
+#endif
+
+#if CPU_THREADED && !defined(CPU_NO_BLOCKS)
+#define CPU_BLOCKS 1
+#else
+#define CPU_BLOCKS 0
+#endif
+
+#if CPU_BLOCKS && defined(CPU_JIT) && defined(__x86_64__) && defined(__linux__)
+#define CPU_JIT_X86 1
+#else
+#define CPU_JIT_X86 0
+#endif
+
+#if CPU_THREADED
+
+__attribute__((noinline, cold)) static uint8_t t_dev_read(machine6502 *m,
+                                                          uint16_t addr) {
+  return m->dev[addr >> 8]->read(m->dev[addr >> 8], m, addr);
+}
+
+__attribute__((noinline, cold)) static void
+t_dev_write(machine6502 *m, uint16_t addr, uint8_t value) {
+  m->dev[addr >> 8]->write(m->dev[addr >> 8], m, addr, value);
+}
+
+static inline uint16_t t_index(uint64_t *cyc, uint16_t base, uint8_t index) {
+  uint16_t addr = base + index;
+  *cyc += ((base ^ addr) >> 8) & 1;
+  return addr;
+}
+
+// Registers live in locals for the whole run, zres and nres included. I, D
+// and B are rarely touched and stay in cpu->P.
+#define T_SPILL()                                                              \
+  do {                                                                         \
+    cpu->A = A;                                                                \
+    cpu->X = X;                                                                \
+    cpu->Y = Y;                                                                \
+    cpu->SP = SP;                                                              \
+    cpu->PC = PC;                                                              \
+    cpu->P.C = C;                                                              \
+    cpu->zres = zres;                                                          \
+    cpu->P.V = V;                                                              \
+    cpu->nres = nres;                                                          \
+    cpu->cycles = cyc;                                                         \
+  } while (0)
+
+#define T_LOAD()                                                               \
+  do {                                                                         \
+    A = cpu->A;                                                                \
+    X = cpu->X;                                                                \
+    Y = cpu->Y;                                                                \
+    SP = cpu->SP;                                                              \
+    PC = cpu->PC;                                                              \
+    C = cpu->P.C;                                                              \
+    zres = cpu->zres;                                                          \
+    V = cpu->P.V;                                                              \
+    nres = cpu->nres;                                                          \
+    cyc = cpu->cycles;                                                         \
+  } while (0)
+
+// Memory goes through the page table. Device callbacks see cpu.cycles and
+// cpu.PC (which points into the operand) up to date; the other registers are
+// only written back on exit. A device may remap pages, so the cached code
+// page is dropped after every device access.
+#define T_DEV()                                                                \
+  do {                                                                         \
+    cpu->cycles = cyc;                                                         \
+    cpu->PC = PC;                                                              \
+    cpage = 1;                                                                 \
+  } while (0)
+// A device, CLI, PLP or RTI may have made an interrupt or event due sooner;
+// stop at m->wake so run_cpu_until can handle it.
+#define T_WAKE()                                                               \
+  do {                                                                         \
+    if (m->wake < deadline)                                                    \
+      deadline = m->wake;                                                      \
+  } while (0)
+#define T_RD(addr)                                                             \
+  ({                                                                           \
+    uint16_t a_ = (addr);                                                      \
+    const uint8_t *p_ = rd[a_ >> 8];                                           \
+    uint8_t v_;                                                                \
+    if (__builtin_expect(p_ != NULL, 1)) {                                     \
+      v_ = p_[a_ & 0xFF];                                                      \
+    } else {                                                                   \
+      T_DEV();                                                                 \
+      v_ = t_dev_read(m, a_);                                                  \
+      T_WAKE();                                                                \
+    }                                                                          \
+    v_;                                                                        \
+  })
+#define T_WR(addr, value)                                                      \
+  do {                                                                         \
+    uint16_t a_ = (addr);                                                      \
+    uint8_t *p_ = wr[a_ >> 8];                                                 \
+    if (__builtin_expect(p_ != NULL, 1)) {                                     \
+      p_[a_ & 0xFF] = (value);                                                 \
+    } else {                                                                   \
+      uint8_t v_ = (value);                                                    \
+      T_DEV();                                                                 \
+      t_dev_write(m, a_, v_);                                                  \
+      T_WAKE();                                                                \
+    }                                                                          \
+  } while (0)
+
+// Instruction stream reads come from the cached code page cp, which holds
+// page cpage (1 when nothing is cached: no page base has low bits set).
+#define T_FETCH()                                                              \
+  ({                                                                           \
+    uint8_t f_;                                                                \
+    if (__builtin_expect((PC & 0xFF00) == cpage, 1)) {                         \
+      f_ = cp[PC++ & 0xFF];                                                    \
+    } else if (rd[PC >> 8]) {                                                  \
+      cpage = PC & 0xFF00;                                                     \
+      cp = rd[PC >> 8];                                                        \
+      f_ = cp[PC++ & 0xFF];                                                    \
+    } else {                                                                   \
+      f_ = T_RD(PC++);                                                         \
+    }                                                                          \
+    f_;                                                                        \
+  })
+
+#define T_NEXT()                                                               \
+  do {                                                                         \
+    if (cyc >= deadline)                                                       \
+      goto out_of_budget;                                                      \
+    op = T_FETCH();                                                            \
+    TRACE_INSN(trace, PC - 1, op, A, X, Y, T_PACK_P(), SP, cyc);               \
+    cyc += op_cycles[op];                                                      \
+    goto *dispatch[op];                                                        \
+  } while (0)
+#define T_NZ(v) (zres = nres = (v))
+#define T_FETCH16()                                                            \
+  ({                                                                           \
+    uint8_t lo_ = T_FETCH();                                                   \
+    (uint16_t)(lo_ | (T_FETCH() << 8));                                        \
+  })
+#define T_PTR(zp)                                                              \
+  ({                                                                           \
+    uint8_t z_ = (zp);                                                         \
+    (uint16_t)(T_RD(z_) | (T_RD((uint8_t)(z_ + 1)) << 8));                     \
+  })
+#define T_PUSH(v) T_WR(0x0100 | SP--, (v))
+#define T_PULL() T_RD(0x0100 | ++SP)
+
+// Effective addresses, matching the addr_* resolvers.
+#define T_imm (PC++)
+#define T_zp (T_FETCH())
+#define T_zpx ((uint8_t)(T_FETCH() + X))
+#define T_zpy ((uint8_t)(T_FETCH() + Y))
+#define T_abs T_FETCH16()
+#define T_abx ((uint16_t)(T_FETCH16() + X))
+#define T_aby ((uint16_t)(T_FETCH16() + Y))
+#define T_izx T_PTR(T_FETCH() + X)
+#define T_izy ((uint16_t)(T_PTR(T_FETCH()) + Y))
+
+// Read variants, charging the page-crossing cycle like the addr_*_r ones.
+#define T_R_imm T_imm
+#define T_R_zp T_zp
+#define T_R_zpx T_zpx
+#define T_R_zpy T_zpy
+#define T_R_abs T_abs
+#define T_R_abx t_index(&cyc, T_FETCH16(), X)
+#define T_R_aby t_index(&cyc, T_FETCH16(), Y)
+#define T_R_izx T_izx
+#define T_R_izy t_index(&cyc, T_PTR(T_FETCH()), Y)
+
+// Instruction bodies mirror the _c handlers above.
+#define T_ADC(M)                                                               \
+  do {                                                                         \
+    if (__builtin_expect(cpu->P.D, 0)) {                                       \
+      struct bcd_sum r_ = adc_bcd(A, M, C);                                    \
+      A = r_.a;                                                                \
+      C = r_.c;                                                                \
+      V = r_.v;                                                                \
+      zres = r_.zres;                                                          \
+      nres = r_.nres;                                                          \
+      break;                                                                   \
+    }                                                                          \
+    uint16_t sum = A + M + C;                                                  \
+    C = (sum > U8_MAX);                                                        \
+    V = (~(A ^ M) & (A ^ sum) & 0x80) != 0;                                    \
+    A = sum;                                                                   \
+    T_NZ(A);                                                                   \
+  } while (0)
+#define T_SBC(M)                                                               \
+  do {                                                                         \
+    uint16_t value = (uint16_t)M ^ 0x00FF;                                     \
+    uint16_t sum = A + value + C;                                              \
+    uint8_t result = (uint8_t)sum;                                             \
+    if (__builtin_expect(cpu->P.D, 0))                                         \
+      result = sbc_bcd(A, M, C);                                               \
+    C = (sum & 0x100) != 0;                                                    \
+    V = ((sum ^ A) & (sum ^ value) & 0x0080) != 0;                             \
+    A = result;                                                                \
+    T_NZ((uint8_t)sum);                                                        \
+  } while (0)
+#define T_AND(M) T_NZ(A &= M)
+#define T_ORA(M) T_NZ(A |= M)
+#define T_EOR(M) T_NZ(A ^= M)
+#define T_LDA(M) T_NZ(A = M)
+#define T_LDX(M) T_NZ(X = M)
+#define T_LDY(M) T_NZ(Y = M)
+#define T_CMPR(R, M)                                                           \
+  do {                                                                         \
+    C = (R >= M);                                                              \
+    T_NZ((uint8_t)(R - M));                                                    \
+  } while (0)
+#define T_CMP(M) T_CMPR(A, M)
+#define T_CPX(M) T_CMPR(X, M)
+#define T_CPY(M) T_CMPR(Y, M)
+#define T_BIT(M)                                                               \
+  do {                                                                         \
+    zres = A & M;                                                              \
+    V = (M >> 6) & 1;                                                          \
+    nres = M;                                                                  \
+  } while (0)
+
+#define T_ASL(v) (C = (v) >> 7, (v) <<= 1)
+#define T_LSR(v) (C = (v) & 1, (v) >>= 1)
+#define T_ROL(v)                                                               \
+  ({                                                                           \
+    uint8_t in = C;                                                            \
+    C = (v) >> 7;                                                              \
+    (v) = (v) << 1 | in;                                                       \
+  })
+#define T_ROR(v)                                                               \
+  ({                                                                           \
+    uint8_t in = C;                                                            \
+    C = (v) & 1;                                                               \
+    (v) = (v) >> 1 | in << 7;                                                  \
+  })
+#define T_INC(v) ((v)++)
+#define T_DEC(v) ((v)--)
+
+#define T_READ(name, mode)                                                     \
+  L_##name##_##mode : {                                                        \
+    uint8_t M = T_RD(T_R_##mode);                                              \
+    T_##name(M);                                                               \
+    T_NEXT();                                                                  \
+  }
+#define T_READ_ALL(name)                                                       \
+  T_READ(name, imm)                                                            \
+  T_READ(name, zp)                                                             \
+  T_READ(name, zpx)                                                            \
+  T_READ(name, abs)                                                            \
+  T_READ(name, abx) T_READ(name, aby) T_READ(name, izx) T_READ(name, izy)
+#define T_STORE(name, reg, mode)                                               \
+  L_##name##_##mode : T_WR(T_##mode, reg);                                     \
+  T_NEXT();
+#define T_RMW(name, mode)                                                      \
+  L_##name##_##mode : {                                                        \
+    uint16_t ea = T_##mode;                                                    \
+    uint8_t v = T_RD(ea);                                                      \
+    T_##name(v);                                                               \
+    T_WR(ea, v);                                                               \
+    T_NZ(v);                                                                   \
+    T_NEXT();                                                                  \
+  }
+#define T_RMW_ALL(name)                                                        \
+  T_RMW(name, zp) T_RMW(name, zpx) T_RMW(name, abs) T_RMW(name, abx)
+#define T_BRANCH(name, cond)                                                   \
+  L_##name : {                                                                 \
+    int8_t off = (int8_t)T_FETCH();                                            \
+    if (cond) {                                                                \
+      uint16_t target = PC + off;                                              \
+      cyc += 1 + ((target ^ PC) > 0xFF);                                       \
+      PC = target;                                                             \
+    }                                                                          \
+    T_NEXT();                                                                  \
+  }
+#define T_TRANSFER(name, dst, src)                                             \
+  L_##name : T_NZ(dst = src);                                                  \
+  T_NEXT();
+
+#define T_PACK_P()                                                             \
+  ((nres & 0x80) | (V << 6) | 0x20 | (cpu->P.B << 4) | (cpu->P.D << 3) |       \
+   (cpu->P.I << 2) | ((zres == 0) << 1) | C)
+#define T_UNPACK_P(p)                                                          \
+  do {                                                                         \
+    uint8_t p_ = (p);                                                          \
+    unpack_P(cpu, p_);                                                         \
+    C = p_ & 1;                                                                \
+    zres = !(p_ & 0x02);                                                       \
+    V = (p_ >> 6) & 1;                                                         \
+    nres = p_ & 0x80;                                                          \
+  } while (0)
+
+#define T_R8(P, name, op)                                                      \
+  [op] = &&P##_##name##_imm, [op - 0x04] = &&P##_##name##_zp,                  \
+  [op + 0x0C] = &&P##_##name##_zpx, [op + 0x04] = &&P##_##name##_abs,          \
+  [op + 0x14] = &&P##_##name##_abx, [op + 0x10] = &&P##_##name##_aby,          \
+  [op - 0x08] = &&P##_##name##_izx, [op + 0x08] = &&P##_##name##_izy
+
+// Handler labels of the documented opcodes, named P_<name>. Column layout:
+// imm at op, zp at op-4, ...
+#define T_OPS(P)                                                               \
+  T_R8(P, ORA, 0x09), T_R8(P, AND, 0x29), T_R8(P, EOR, 0x49),                  \
+  T_R8(P, ADC, 0x69), T_R8(P, LDA, 0xA9), T_R8(P, CMP, 0xC9),                  \
+  T_R8(P, SBC, 0xE9),                                                          \
+                                                                               \
+  [0x24] = &&P##_BIT_zp, [0x2C] = &&P##_BIT_abs,                               \
+                                                                               \
+  [0xE0] = &&P##_CPX_imm, [0xE4] = &&P##_CPX_zp, [0xEC] = &&P##_CPX_abs,       \
+  [0xC0] = &&P##_CPY_imm, [0xC4] = &&P##_CPY_zp, [0xCC] = &&P##_CPY_abs,       \
+                                                                               \
+  [0xA2] = &&P##_LDX_imm, [0xA6] = &&P##_LDX_zp, [0xB6] = &&P##_LDX_zpy,       \
+  [0xAE] = &&P##_LDX_abs, [0xBE] = &&P##_LDX_aby,                              \
+  [0xA0] = &&P##_LDY_imm, [0xA4] = &&P##_LDY_zp, [0xB4] = &&P##_LDY_zpx,       \
+  [0xAC] = &&P##_LDY_abs, [0xBC] = &&P##_LDY_abx,                              \
+                                                                               \
+  [0x85] = &&P##_STA_zp, [0x95] = &&P##_STA_zpx, [0x8D] = &&P##_STA_abs,       \
+  [0x9D] = &&P##_STA_abx, [0x99] = &&P##_STA_aby, [0x81] = &&P##_STA_izx,      \
+  [0x91] = &&P##_STA_izy,                                                      \
+  [0x86] = &&P##_STX_zp, [0x96] = &&P##_STX_zpy, [0x8E] = &&P##_STX_abs,       \
+  [0x84] = &&P##_STY_zp, [0x94] = &&P##_STY_zpx, [0x8C] = &&P##_STY_abs,       \
+                                                                               \
+  [0x06] = &&P##_ASL_zp, [0x16] = &&P##_ASL_zpx, [0x0E] = &&P##_ASL_abs,       \
+  [0x1E] = &&P##_ASL_abx,                                                      \
+  [0x46] = &&P##_LSR_zp, [0x56] = &&P##_LSR_zpx, [0x4E] = &&P##_LSR_abs,       \
+  [0x5E] = &&P##_LSR_abx,                                                      \
+  [0x26] = &&P##_ROL_zp, [0x36] = &&P##_ROL_zpx, [0x2E] = &&P##_ROL_abs,       \
+  [0x3E] = &&P##_ROL_abx,                                                      \
+  [0x66] = &&P##_ROR_zp, [0x76] = &&P##_ROR_zpx, [0x6E] = &&P##_ROR_abs,       \
+  [0x7E] = &&P##_ROR_abx,                                                      \
+  [0xE6] = &&P##_INC_zp, [0xF6] = &&P##_INC_zpx, [0xEE] = &&P##_INC_abs,       \
+  [0xFE] = &&P##_INC_abx,                                                      \
+  [0xC6] = &&P##_DEC_zp, [0xD6] = &&P##_DEC_zpx, [0xCE] = &&P##_DEC_abs,       \
+  [0xDE] = &&P##_DEC_abx,                                                      \
+                                                                               \
+  [0x0A] = &&P##_ASL_A, [0x4A] = &&P##_LSR_A, [0x2A] = &&P##_ROL_A,            \
+  [0x6A] = &&P##_ROR_A,                                                        \
+                                                                               \
+  [0x90] = &&P##_BCC, [0xB0] = &&P##_BCS, [0xF0] = &&P##_BEQ,                  \
+  [0x30] = &&P##_BMI, [0xD0] = &&P##_BNE, [0x10] = &&P##_BPL,                  \
+  [0x50] = &&P##_BVC, [0x70] = &&P##_BVS,                                      \
+                                                                               \
+  [0x4C] = &&P##_JMP_abs, [0x6C] = &&P##_JMP_ind, [0x20] = &&P##_JSR,          \
+  [0x60] = &&P##_RTS, [0x40] = &&P##_RTI, [0x00] = &&P##_BRK,                  \
+  [0xEA] = &&P##_NOP,                                                          \
+                                                                               \
+  [0x18] = &&P##_CLC, [0x38] = &&P##_SEC, [0x58] = &&P##_CLI,                  \
+  [0x78] = &&P##_SEI, [0xB8] = &&P##_CLV, [0xD8] = &&P##_CLD,                  \
+  [0xF8] = &&P##_SED,                                                          \
+                                                                               \
+  [0xAA] = &&P##_TAX, [0xA8] = &&P##_TAY, [0xBA] = &&P##_TSX,                  \
+  [0x8A] = &&P##_TXA, [0x9A] = &&P##_TXS, [0x98] = &&P##_TYA,                  \
+  [0xE8] = &&P##_INX, [0xC8] = &&P##_INY, [0xCA] = &&P##_DEX,                  \
+  [0x88] = &&P##_DEY,                                                          \
+                                                                               \
+  [0x48] = &&P##_PHA, [0x68] = &&P##_PLA, [0x08] = &&P##_PHP,                  \
+  [0x28] = &&P##_PLP
+
+static int run_threaded(machine6502 *m, uint64_t deadline) {
+  static void *const native[256] = {T_OPS(L)};
+
+  // Hooked and undocumented opcodes take the slow path through cpu_exec.
+  void *dispatch[256];
+  for (int i = 0; i < 256; i++)
+    dispatch[i] = native[i] ? native[i] : &&slow;
+
+  cpu6502 *cpu = &m->cpu;
+  const uint8_t **rd = m->rd;
+  uint8_t **wr = m->wr;
+  const uint8_t *cp = NULL;
+  uint16_t cpage = 1;
+  struct trace *trace = m->trace;
+  uint8_t A, X, Y, SP, C, V, zres, nres, op;
+  uint16_t PC;
+  uint64_t cyc;
+  T_LOAD();
+  T_NEXT();
+
+  T_READ_ALL(ORA)
+  T_READ_ALL(AND)
+  T_READ_ALL(EOR)
+  T_READ_ALL(ADC)
+  T_READ_ALL(LDA)
+  T_READ_ALL(CMP)
+  T_READ_ALL(SBC)
+  T_READ(BIT, zp) T_READ(BIT, abs)
+  T_READ(CPX, imm) T_READ(CPX, zp) T_READ(CPX, abs)
+  T_READ(CPY, imm) T_READ(CPY, zp) T_READ(CPY, abs)
+  T_READ(LDX, imm) T_READ(LDX, zp) T_READ(LDX, zpy) T_READ(LDX, abs)
+  T_READ(LDX, aby)
+  T_READ(LDY, imm) T_READ(LDY, zp) T_READ(LDY, zpx) T_READ(LDY, abs)
+  T_READ(LDY, abx)
+
+  T_STORE(STA, A, zp) T_STORE(STA, A, zpx) T_STORE(STA, A, abs)
+  T_STORE(STA, A, abx) T_STORE(STA, A, aby) T_STORE(STA, A, izx)
+  T_STORE(STA, A, izy)
+  T_STORE(STX, X, zp) T_STORE(STX, X, zpy) T_STORE(STX, X, abs)
+  T_STORE(STY, Y, zp) T_STORE(STY, Y, zpx) T_STORE(STY, Y, abs)
+
+  T_RMW_ALL(ASL)
+  T_RMW_ALL(LSR)
+  T_RMW_ALL(ROL)
+  T_RMW_ALL(ROR)
+  T_RMW_ALL(INC)
+  T_RMW_ALL(DEC)
+
+L_ASL_A:
+  T_ASL(A);
+  T_NZ(A);
+  T_NEXT();
+L_LSR_A:
+  T_LSR(A);
+  T_NZ(A);
+  T_NEXT();
+L_ROL_A:
+  T_ROL(A);
+  T_NZ(A);
+  T_NEXT();
+L_ROR_A:
+  T_ROR(A);
+  T_NZ(A);
+  T_NEXT();
+
+  T_BRANCH(BCC, !C)
+  T_BRANCH(BCS, C)
+  T_BRANCH(BEQ, zres == 0)
+  T_BRANCH(BMI, nres & 0x80)
+  T_BRANCH(BNE, zres != 0)
+  T_BRANCH(BPL, !(nres & 0x80))
+  T_BRANCH(BVC, !V)
+  T_BRANCH(BVS, V)
+
+L_JMP_abs:
+  PC = T_FETCH16();
+  T_NEXT();
+L_JMP_ind: {
+  uint16_t ptr = T_FETCH16();
+  PC = T_RD(ptr) | (T_RD((ptr & 0xFF00) | ((ptr + 1) & 0x00FF)) << 8);
+  T_NEXT();
+}
+L_JSR: {
+  uint16_t addr = T_FETCH16();
+  uint16_t r_addr = PC - 1;
+  T_PUSH(r_addr >> 8);
+  T_PUSH(r_addr & 0xFF);
+  PC = addr;
+  T_NEXT();
+}
+L_RTS: {
+  uint8_t lo = T_PULL();
+  uint8_t hi = T_PULL();
+  PC = (((uint16_t)hi << 8) | lo) + 1;
+  T_NEXT();
+}
+L_RTI: {
+  T_UNPACK_P(T_PULL());
+  uint8_t lo = T_PULL();
+  uint8_t hi = T_PULL();
+  PC = ((uint16_t)hi << 8) | lo;
+  irq_recheck(m);
+  T_WAKE();
+  T_NEXT();
+}
+L_NOP:
+  T_NEXT();
+
+L_CLC:
+  C = 0;
+  T_NEXT();
+L_SEC:
+  C = 1;
+  T_NEXT();
+L_CLV:
+  V = 0;
+  T_NEXT();
+L_CLI:
+  cpu->P.I = 0;
+  irq_recheck(m);
+  T_WAKE();
+  T_NEXT();
+L_SEI:
+  cpu->P.I = 1;
+  T_NEXT();
+L_CLD:
+  cpu->P.D = 0;
+  T_NEXT();
+L_SED:
+  cpu->P.D = 1;
+  T_NEXT();
+
+  T_TRANSFER(TAX, X, A)
+  T_TRANSFER(TAY, Y, A)
+  T_TRANSFER(TSX, X, SP)
+  T_TRANSFER(TXA, A, X)
+  T_TRANSFER(TYA, A, Y)
+L_TXS:
+  SP = X;
+  T_NEXT();
+L_INX:
+  T_NZ(++X);
+  T_NEXT();
+L_INY:
+  T_NZ(++Y);
+  T_NEXT();
+L_DEX:
+  T_NZ(--X);
+  T_NEXT();
+L_DEY:
+  T_NZ(--Y);
+  T_NEXT();
+
+L_PHA:
+  T_PUSH(A);
+  T_NEXT();
+L_PLA:
+  T_NZ(A = T_PULL());
+  T_NEXT();
+L_PHP:
+  T_PUSH(T_PACK_P() | 0x10);
+  T_NEXT();
+L_PLP:
+  T_UNPACK_P(T_PULL());
+  irq_recheck(m);
+  T_WAKE();
+  T_NEXT();
+
+slow:
+  // Hand the instruction to cpu_exec with registers written back.
+  cyc -= op_cycles[op];
+  T_SPILL();
+  cpu_exec(m, op);
+  T_LOAD();
+  cpage = 1;
+  T_WAKE();
+  T_NEXT();
+
+L_BRK:
+  cyc -= op_cycles[op];
+  T_SPILL();
+  cpu_exec(m, op);
+  return RUN_BRK;
+
+out_of_budget:
+  T_SPILL();
+  return RUN_BUDGET;
+}
+
+#endif
+
+/* --------------------------------------------------------- */
+/* Block cache                                                */
+/* --------------------------------------------------------- */
+
+#define BLOCK_SLOTS 1024 // direct-mapped on the entry address
+#define BLOCK_INSNS 16   // decoded instructions per block, end marker included
+#define BLOCK_EMPTY 0x10000
+#define BLOCK_HASH(pc) (((pc) ^ ((pc) >> 10)) & (BLOCK_SLOTS - 1))
+
+// One pre-decoded instruction. h is its handler label in run_blocks, opnd
+// the immediate value, base address or branch target, and aux the extra
+// cycles a taken branch costs.
+struct block_insn {
+  void *h;
+  uint16_t pc;
+  uint16_t opnd;
+  uint8_t op;
+  uint8_t cyc;
+  uint8_t aux;
+};
+
+// A straight-line run of instructions entered at pc. The last one either
+// transfers control or is an end marker that continues at its own pc, so
+// ins[i + 1].pc is always the address after ins[i].
+struct block {
+  uint32_t pc;  // BLOCK_EMPTY when the slot is free
+  uint32_t end; // one past the last byte decoded
+#if CPU_JIT_X86
+  void *native;   // translated code, or NULL
+  uint32_t hits;  // entries through the interpreter since decoding
+  uint32_t bound; // cycles the block may need, less its last instruction
+#endif
+  struct block_insn ins[BLOCK_INSNS];
+};
+
+struct block_cache {
+  machine6502 *owner;  // a struct copy of the machine must not share it
+  struct jit *jit;     // native code for hot blocks, if built with CPU_JIT
+  uint64_t code[1024]; // one bit per address some block was decoded from
+  struct block slot[BLOCK_SLOTS];
+};
+
+static struct block_cache *blocks_of(machine6502 *m) {
+  return (m->blocks && m->blocks->owner == m) ? m->blocks : NULL;
+}
+
+static void blocks_drop(struct block_cache *bc, uint32_t lo, uint32_t hi) {
+  for (int i = 0; i < BLOCK_SLOTS; i++) {
+    struct block *b = &bc->slot[i];
+    if (b->pc != BLOCK_EMPTY && b->pc < hi && b->end > lo)
+      b->pc = BLOCK_EMPTY;
+  }
+}
+
+// Forget every block decoded from pages [page, page + npages). Pages no
+// block was decoded from since they were last invalidated are skipped
+// without scanning the slots.
+void blocks_invalidate(machine6502 *m, unsigned page, unsigned npages) {
+  struct block_cache *bc = blocks_of(m);
+  if (!bc)
+    return;
+
+  uint32_t lo = page << 8, hi = (page + npages) << 8;
+  uint64_t code = 0;
+  for (uint32_t a = lo; a < hi && a < 0x10000; a += 64) {
+    code |= bc->code[a >> 6];
+    bc->code[a >> 6] = 0;
+  }
+  if (code)
+    blocks_drop(bc, lo, hi);
+}
+
+#if CPU_JIT_X86
+static void jit_free(struct jit *j);
+#endif
+
+void blocks_free(machine6502 *m) {
+  struct block_cache *bc = blocks_of(m);
+#if CPU_JIT_X86
+  if (bc)
+    jit_free(bc->jit);
+#endif
+  free(bc);
+  m->blocks = NULL;
+}
+
+// RAM pages holding cached code, or not yet written since the last
+// snapshot, are mapped read-only with their writes routed here. Stores to
+// bytes no block was decoded from go straight through; the others also
+// drop the blocks covering that byte. Bits are only cleared per page, so a
+// stale bit just costs a scan. A page with no code left is writable again
+// after its first store.
+static void watch_write(bus_device *dev, machine6502 *m, uint16_t addr,
+                        uint8_t value) {
+  unsigned p = addr >> 8;
+  struct block_cache *bc = blocks_of(m);
+  if (bc && ((bc->code[addr >> 6] >> (addr & 63)) & 1))
+    blocks_drop(bc, addr, addr + 1);
+  ((uint8_t *)m->rd[p])[addr & 0xFF] = value;
+
+  m->dirty[p >> 6] |= 1ull << (p & 63);
+  if (!bc || !(bc->code[p * 4] | bc->code[p * 4 + 1] | bc->code[p * 4 + 2] |
+               bc->code[p * 4 + 3])) {
+    m->wr[p] = (uint8_t *)m->rd[p];
+    m->dev[p] = NULL;
+  }
+}
+
+static bus_device watch_device = {rom_read, watch_write};
+
+#if CPU_BLOCKS
+
+struct block_fuse {
+  uint8_t first, second;
+  void *h;
+};
+
+// Handler labels the decoder may use, supplied by run_blocks.
+struct block_labels {
+  void *const *op; // native handler per opcode, NULL for the slow path
+  void *slow, *end;
+  const struct block_fuse *fuse;
+  int nfuse;
+};
+
+#if CPU_JIT_X86
+
+/*
+ * x86-64 translation of hot blocks. Register assignment inside translated
+ * code, matching the locals of run_blocks:
+ *
+ *   ebx A   r12d X   r13d Y   r14d SP   ebp zres   r8d nres
+ *   r9d C   r10d V   r11 cycles   r15 machine
+ *
+ * eax, ecx, edx, esi and edi are scratch. All 6502 values are kept zero
+ * extended. An instruction that would reach a device or a watched page
+ * bails out before it has any effect, handing its block_insn back to the
+ * interpreter; translated code therefore never calls out and cannot see
+ * the block cache change under it.
+ */
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+enum { R14 = 14, R15 = 15 };
+
+#define J_A RBX
+#define J_X R12
+#define J_Y R13
+#define J_SP R14
+#define J_Z RBP
+#define J_N R8
+#define J_C R9
+#define J_V R10
+#define J_CYC R11
+#define J_M R15
+
+#define JIT_THRESHOLD 32        // block entries before translation
+#define JIT_ARENA (1 << 20)     // bytes of code per machine
+#define JIT_BAILS BLOCK_INSNS   // bail jumps per instruction, at most
+
+struct jit_regs {
+  uint64_t cyc, limit;
+  const struct block_insn *ip; // where translated code bailed out, or NULL
+  uint16_t PC;
+  uint8_t A, X, Y, SP, C, V, zres, nres;
+};
+
+typedef void (*jit_enter_fn)(struct jit_regs *r, machine6502 *m, void *code);
+
+struct jit {
+  uint8_t *base, *start, *p, *end; // code after start is per block
+  uint8_t *exit, *dispatch;
+  jit_enter_fn enter;
+  struct block *slot; // the cache's slots, for exits to a known pc
+  int full;
+};
+
+static void x8(struct jit *j, uint8_t v) {
+  if (j->p < j->end)
+    *j->p++ = v;
+  else
+    j->full = 1;
+}
+
+static void x32(struct jit *j, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    x8(j, v >> (8 * i));
+}
+
+static void x_rex(struct jit *j, int w, int reg, int index, int base,
+                  int force) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) |
+                (base >> 3);
+  if (rex != 0x40 || force)
+    x8(j, rex);
+}
+
+// op r/m, reg between registers
+static void x_rr(struct jit *j, int w, uint8_t op, int reg, int rm) {
+  x_rex(j, w, reg, 0, rm, 0);
+  x8(j, op);
+  x8(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// 81 /ext r/m, imm32
+static void x_ri(struct jit *j, int w, int ext, int rm, uint32_t imm) {
+  x_rex(j, w, 0, 0, rm, 0);
+  x8(j, 0x81);
+  x8(j, 0xC0 | (ext << 3) | (rm & 7));
+  x32(j, imm);
+}
+
+static void x_mov_ri(struct jit *j, int reg, uint32_t imm) {
+  x_rex(j, 0, 0, 0, reg, 0);
+  x8(j, 0xB8 + (reg & 7));
+  x32(j, imm);
+}
+
+static void x_mov_ri64(struct jit *j, int reg, uint64_t imm) {
+  x_rex(j, 1, 0, 0, reg, 0);
+  x8(j, 0xB8 + (reg & 7));
+  x32(j, (uint32_t)imm);
+  x32(j, (uint32_t)(imm >> 32));
+}
+
+// C1 /ext r/m, imm8: 4 is shl, 5 is shr
+static void x_shift(struct jit *j, int ext, int rm, uint8_t n) {
+  x_rex(j, 0, 0, 0, rm, 0);
+  x8(j, 0xC1);
+  x8(j, 0xC0 | (ext << 3) | (rm & 7));
+  x8(j, n);
+}
+
+// op with a [base + index * 2^scale + disp32] operand; index < 0 for none.
+// Opcodes above 0xFF are two bytes (0x0FB6 is movzx r32, r/m8).
+static void x_mem(struct jit *j, int w, int op, int reg, int base, int index,
+                  int scale, int32_t disp, int force_rex) {
+  x_rex(j, w, reg, index < 0 ? 0 : index, base, force_rex);
+  if (op > 0xFF)
+    x8(j, op >> 8);
+  x8(j, op & 0xFF);
+  if (index >= 0 || (base & 7) == RSP) {
+    x8(j, 0x80 | ((reg & 7) << 3) | 4);
+    x8(j, index >= 0 ? (scale << 6) | ((index & 7) << 3) | (base & 7) : 0x24);
+  } else {
+    x8(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+  }
+  x32(j, disp);
+}
+
+static uint8_t *x_jcc(struct jit *j, uint8_t cc) {
+  x8(j, 0x0F);
+  x8(j, 0x80 | cc);
+  x32(j, 0);
+  return j->p - 4;
+}
+
+static uint8_t *x_jmp(struct jit *j) {
+  x8(j, 0xE9);
+  x32(j, 0);
+  return j->p - 4;
+}
+
+static void x_patch(struct jit *j, uint8_t *at, uint8_t *target) {
+  if (j->full)
+    return;
+  int32_t rel = (int32_t)(target - (at + 4));
+  memcpy(at, &rel, 4);
+}
+
+#define X_JE 0x4
+#define X_JNE 0x5
+
+#define X_ADD 0x01
+#define X_OR 0x09
+#define X_AND 0x21
+#define X_SUB 0x29
+#define X_XOR 0x31
+#define X_MOV 0x89
+#define X_TEST 0x85
+
+#define JR(f) ((int32_t)offsetof(struct jit_regs, f))
+#define JM_RD ((int32_t)offsetof(machine6502, rd))
+#define JM_WR ((int32_t)offsetof(machine6502, wr))
+
+static void x_and_ff(struct jit *j, int reg) { x_ri(j, 0, 4, reg, 0xFF); }
+
+static void x_nz(struct jit *j, int reg) {
+  if (reg != J_Z)
+    x_rr(j, 0, X_MOV, reg, J_Z);
+  x_rr(j, 0, X_MOV, reg, J_N);
+}
+
+// The entry, exit and dispatch stubs shared by every block.
+static void jit_stubs(struct jit *j) {
+  static const uint8_t saved[] = {RBX, RBP, R12, R13, R14, R15};
+  static const struct {
+    uint8_t reg;
+    int32_t off;
+  } regs[] = {
+      {J_A, JR(A)}, {J_X, JR(X)},       {J_Y, JR(Y)},       {J_SP, JR(SP)},
+      {J_C, JR(C)}, {J_V, JR(V)},       {J_Z, JR(zres)},    {J_N, JR(nres)},
+  };
+
+  // enter(r, m, code)
+  j->enter = (jit_enter_fn)j->p;
+  for (int i = 0; i < 6; i++) {
+    x_rex(j, 0, 0, 0, saved[i], 0);
+    x8(j, 0x50 + (saved[i] & 7));
+  }
+  x8(j, 0x57); // push rdi
+  x_rr(j, 1, X_MOV, RSI, J_M);
+  for (int i = 0; i < 8; i++)
+    x_mem(j, 0, 0x0FB6, regs[i].reg, RDI, -1, 0, regs[i].off, 0);
+  x_mem(j, 1, 0x8B, J_CYC, RDI, -1, 0, JR(cyc), 0);
+  x8(j, 0xFF); // jmp rdx
+  x8(j, 0xE2);
+
+  // exit: rax = bail instruction or 0, edx = PC
+  j->exit = j->p;
+  x8(j, 0x5F); // pop rdi
+  x_mem(j, 1, 0x89, RAX, RDI, -1, 0, JR(ip), 0);
+  x8(j, 0x66);
+  x_mem(j, 0, 0x89, RDX, RDI, -1, 0, JR(PC), 0);
+  for (int i = 0; i < 8; i++)
+    x_mem(j, 0, 0x88, regs[i].reg, RDI, -1, 0, regs[i].off, 1);
+  x_mem(j, 1, 0x89, J_CYC, RDI, -1, 0, JR(cyc), 0);
+  for (int i = 5; i >= 0; i--) {
+    x_rex(j, 0, 0, 0, saved[i], 0);
+    x8(j, 0x58 + (saved[i] & 7));
+  }
+  x8(j, 0xC3);
+
+  // dispatch: edx = PC. Chain into the next block if it is translated
+  // and every instruction in it starts before the limit.
+  j->dispatch = j->p;
+  x_rr(j, 0, X_MOV, RDX, RCX);
+  x_shift(j, 5, RCX, 10);
+  x_rr(j, 0, X_XOR, RDX, RCX);
+  x_ri(j, 0, 4, RCX, BLOCK_SLOTS - 1);
+  x_rex(j, 1, RCX, 0, RCX, 0); // imul rcx, rcx, sizeof(struct block)
+  x8(j, 0x69);
+  x8(j, 0xC0 | (RCX << 3) | RCX);
+  x32(j, sizeof(struct block));
+  x_mem(j, 1, 0x8B, RAX, J_M, -1, 0, offsetof(machine6502, blocks), 0);
+  x_rr(j, 1, X_ADD, RCX, RAX);
+  x_mem(j, 0, 0x39, RDX, RAX, -1, 0,
+        offsetof(struct block_cache, slot) + offsetof(struct block, pc), 0);
+  uint8_t *miss1 = x_jcc(j, X_JNE);
+  x_mem(j, 1, 0x8B, RSI, RAX, -1, 0,
+        offsetof(struct block_cache, slot) + offsetof(struct block, native), 0);
+  x_rr(j, 1, X_TEST, RSI, RSI);
+  uint8_t *miss2 = x_jcc(j, X_JE);
+  x_mem(j, 0, 0x8B, RCX, RAX, -1, 0,
+        offsetof(struct block_cache, slot) + offsetof(struct block, bound), 0);
+  x_rr(j, 1, X_ADD, J_CYC, RCX);
+  x_mem(j, 1, 0x8B, RDI, RSP, -1, 0, 0, 0);
+  x_mem(j, 1, 0x3B, RCX, RDI, -1, 0, JR(limit), 0);
+  uint8_t *miss3 = x_jcc(j, 0x3); // jae
+  x8(j, 0xFF);                    // jmp rsi
+  x8(j, 0xE6);
+  uint8_t *miss = j->p;
+  x_rr(j, 0, X_XOR, RAX, RAX);
+  x_patch(j, x_jmp(j), j->exit);
+  x_patch(j, miss1, miss);
+  x_patch(j, miss2, miss);
+  x_patch(j, miss3, miss);
+
+  j->start = j->p;
+}
+
+// The arena is never writable and executable at once. Code is emitted
+// with the pages from `from` to the end read-write, then they go back to
+// read-execute before anything runs. Returns -1 if mprotect fails.
+static int jit_protect(struct jit *j, uint8_t *from, int prot) {
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uint8_t *at = (uint8_t *)((uintptr_t)from & ~(page - 1));
+  return mprotect(at, j->end - at, prot) == 0 ? 0 : -1;
+}
+
+static struct jit *jit_new(struct block *slot) {
+  void *mem = mmap(NULL, JIT_ARENA, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+
+  struct jit *j = calloc(1, sizeof(struct jit));
+  if (!j) {
+    munmap(mem, JIT_ARENA);
+    return NULL;
+  }
+  j->base = j->p = mem;
+  j->end = j->base + JIT_ARENA;
+  j->slot = slot;
+  jit_stubs(j);
+  if (jit_protect(j, j->base, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, JIT_ARENA);
+    free(j);
+    return NULL;
+  }
+  return j;
+}
+
+static void jit_free(struct jit *j) {
+  if (j) {
+    munmap(j->base, JIT_ARENA);
+    free(j);
+  }
+}
+
+// Drop all translations once the arena is full.
+static void jit_reset(struct jit *j, struct block_cache *bc) {
+  for (int i = 0; i < BLOCK_SLOTS; i++) {
+    bc->slot[i].native = NULL;
+    bc->slot[i].hits = 0;
+  }
+  j->p = j->start;
+  j->full = 0;
+}
+
+// Per-instruction state while translating: bail jumps to patch.
+struct jit_insn {
+  uint8_t *bail[JIT_BAILS];
+  int nbail;
+};
+
+static void x_bail_if(struct jit *j, struct jit_insn *ji, uint8_t cc) {
+  uint8_t *at = x_jcc(j, cc);
+  if (ji->nbail < JIT_BAILS)
+    ji->bail[ji->nbail++] = at;
+}
+
+// Load m->rd[page] or m->wr[page] into reg, bailing when it is NULL. The
+// page is the constant cpage, or ecx >> 8 when cpage < 0.
+static void x_page(struct jit *j, struct jit_insn *ji, int reg, int32_t table,
+                   int cpage) {
+  if (cpage >= 0) {
+    x_mem(j, 1, 0x8B, reg, J_M, -1, 0, table + cpage * 8, 0);
+  } else {
+    x_rr(j, 0, X_MOV, RCX, RDX);
+    x_shift(j, 5, RDX, 8);
+    x_mem(j, 1, 0x8B, reg, J_M, RDX, 3, table, 0);
+  }
+  x_rr(j, 1, X_TEST, reg, reg);
+  x_bail_if(j, ji, X_JE);
+}
+
+static void x_cycles(struct jit *j, int n) {
+  if (n)
+    x_ri(j, 1, 0, J_CYC, n);
+}
+
+struct jit_ea {
+  int cpage;     // page of the address if known, else -1
+  int in_ecx;    // address (or its page offset, after commit) is in ecx
+  int penalty;   // eax holds base ^ address for the page-crossing cycle
+  uint16_t addr; // constant address when !in_ecx
+};
+
+// Compute the effective address of a memory operand. Pointer reads from
+// zero page happen here, so they are checked (and may bail) here too.
+static struct jit_ea x_ea(struct jit *j, struct jit_insn *ji,
+                          const struct block_insn *in, int mode, int read) {
+  struct jit_ea ea = {-1, 1, 0, 0};
+  uint16_t opnd = in->opnd;
+
+  switch (mode) {
+  case ZP:
+  case ABS:
+    ea.cpage = opnd >> 8;
+    ea.in_ecx = 0;
+    ea.addr = opnd;
+    break;
+  case ZPX:
+  case ZPY:
+    x_mem(j, 0, 0x8D, RCX, mode == ZPX ? J_X : J_Y, -1, 0, opnd, 0);
+    x_and_ff(j, RCX);
+    ea.cpage = 0;
+    break;
+  case ABX:
+  case ABY:
+    x_mem(j, 0, 0x8D, RCX, mode == ABX ? J_X : J_Y, -1, 0, opnd, 0);
+    x_ri(j, 0, 4, RCX, 0xFFFF);
+    if (read) {
+      x_mov_ri(j, RAX, opnd);
+      x_rr(j, 0, X_XOR, RCX, RAX);
+      ea.penalty = 1;
+    }
+    break;
+  case IZX:
+  case IZY:
+    x_page(j, ji, RDI, JM_RD, 0);
+    if (mode == IZX) {
+      x_mem(j, 0, 0x8D, RCX, J_X, -1, 0, opnd, 0);
+      x_and_ff(j, RCX);
+      x_mem(j, 0, 0x0FB6, RAX, RDI, RCX, 0, 0, 0);
+      x_ri(j, 0, 0, RCX, 1);
+      x_and_ff(j, RCX);
+      x_mem(j, 0, 0x0FB6, RCX, RDI, RCX, 0, 0, 0);
+    } else {
+      x_mem(j, 0, 0x0FB6, RAX, RDI, -1, 0, opnd & 0xFF, 0);
+      x_mem(j, 0, 0x0FB6, RCX, RDI, -1, 0, (opnd + 1) & 0xFF, 0);
+    }
+    x_shift(j, 4, RCX, 8);
+    x_rr(j, 0, X_OR, RAX, RCX);
+    if (mode == IZY) {
+      x_rr(j, 0, X_MOV, RCX, RAX);
+      x_rr(j, 0, X_ADD, J_Y, RCX);
+      x_ri(j, 0, 4, RCX, 0xFFFF);
+      if (read) {
+        x_rr(j, 0, X_XOR, RCX, RAX);
+        ea.penalty = 1;
+      }
+    }
+    break;
+  }
+  return ea;
+}
+
+// After the page checks: charge the page-crossing cycle and reduce ecx to
+// the offset within the page.
+static void x_ea_commit(struct jit *j, struct jit_ea *ea) {
+  if (ea->penalty) {
+    x_shift(j, 5, RAX, 8);
+    x_ri(j, 0, 4, RAX, 1);
+    x_rr(j, 1, X_ADD, RAX, J_CYC);
+  }
+  if (ea->cpage < 0)
+    x_and_ff(j, RCX);
+}
+
+// movzx reg, [page + ea] (op 0x0FB6) or mov [page + ea], reg8 (op 0x88)
+static void x_ea_access(struct jit *j, struct jit_ea *ea, int op, int page,
+                        int reg) {
+  if (ea->in_ecx)
+    x_mem(j, 0, op, reg, page, RCX, 0, 0, op == 0x88);
+  else
+    x_mem(j, 0, op, reg, page, -1, 0, ea->addr & 0xFF, op == 0x88);
+}
+
+static void x_bail(struct jit *j, struct jit_insn *ji) {
+  uint8_t *at = x_jmp(j);
+  if (ji->nbail < JIT_BAILS)
+    ji->bail[ji->nbail++] = at;
+}
+
+static void x_dispatch(struct jit *j) { x_patch(j, x_jmp(j), j->dispatch); }
+
+// Continue at a constant pc: the dispatch checks with the slot address
+// folded in, and an indirect jump per exit rather than one shared by all.
+static void x_goto(struct jit *j, uint16_t pc) {
+  x_mov_ri(j, RDX, pc);
+  x_mov_ri64(j, RAX, (uintptr_t)&j->slot[BLOCK_HASH(pc)]);
+  x_mem(j, 0, 0x39, RDX, RAX, -1, 0, offsetof(struct block, pc), 0);
+  x_patch(j, x_jcc(j, X_JNE), j->dispatch);
+  x_mem(j, 1, 0x8B, RSI, RAX, -1, 0, offsetof(struct block, native), 0);
+  x_rr(j, 1, X_TEST, RSI, RSI);
+  x_patch(j, x_jcc(j, X_JE), j->dispatch);
+  x_mem(j, 0, 0x8B, RCX, RAX, -1, 0, offsetof(struct block, bound), 0);
+  x_rr(j, 1, X_ADD, J_CYC, RCX);
+  x_mem(j, 1, 0x8B, RDI, RSP, -1, 0, 0, 0);
+  x_mem(j, 1, 0x3B, RCX, RDI, -1, 0, JR(limit), 0);
+  x_patch(j, x_jcc(j, 0x3), j->dispatch);
+  x8(j, 0xFF); // jmp rsi
+  x8(j, 0xE6);
+}
+
+// Apply a read instruction to the operand in eax. Mirrors the T_* bodies.
+static void x_read_op(struct jit *j, const char *n) {
+  if (!strcmp(n, "LDA") || !strcmp(n, "LDX") || !strcmp(n, "LDY")) {
+    int reg = n[2] == 'A' ? J_A : n[2] == 'X' ? J_X : J_Y;
+    x_rr(j, 0, X_MOV, RAX, reg);
+    x_nz(j, reg);
+  } else if (!strcmp(n, "AND") || !strcmp(n, "ORA") || !strcmp(n, "EOR")) {
+    x_rr(j, 0, n[0] == 'A' ? X_AND : n[0] == 'O' ? X_OR : X_XOR, RAX, J_A);
+    x_nz(j, J_A);
+  } else if (!strcmp(n, "CMP") || !strcmp(n, "CPX") || !strcmp(n, "CPY")) {
+    x_rr(j, 0, X_MOV, n[2] == 'P' ? J_A : n[2] == 'X' ? J_X : J_Y, RCX);
+    x_rr(j, 0, X_SUB, RAX, RCX);
+    x_rr(j, 0, X_MOV, RCX, J_C);
+    x_shift(j, 5, J_C, 31);
+    x_ri(j, 0, 6, J_C, 1);
+    x_and_ff(j, RCX);
+    x_nz(j, RCX);
+  } else if (!strcmp(n, "BIT")) {
+    x_rr(j, 0, X_MOV, J_A, J_Z);
+    x_rr(j, 0, X_AND, RAX, J_Z);
+    x_rr(j, 0, X_MOV, RAX, J_V);
+    x_shift(j, 5, J_V, 6);
+    x_ri(j, 0, 4, J_V, 1);
+    x_rr(j, 0, X_MOV, RAX, J_N);
+  } else if (!strcmp(n, "ADC")) {
+    // sum = A + M + C; V = (~(A ^ M) & (A ^ sum) & 0x80) != 0
+    x_rr(j, 0, X_MOV, J_A, RCX);
+    x_rr(j, 0, X_ADD, RAX, RCX);
+    x_rr(j, 0, X_ADD, J_C, RCX);
+    x_rr(j, 0, X_MOV, J_A, RDX);
+    x_rr(j, 0, X_XOR, RAX, RDX);
+    x8(j, 0xF7); // not edx
+    x8(j, 0xD2);
+    x_rr(j, 0, X_MOV, J_A, RSI);
+    x_rr(j, 0, X_XOR, RCX, RSI);
+    x_rr(j, 0, X_AND, RSI, RDX);
+    x_shift(j, 5, RDX, 7);
+    x_ri(j, 0, 4, RDX, 1);
+    x_rr(j, 0, X_MOV, RDX, J_V);
+    x_rr(j, 0, X_MOV, RCX, J_C);
+    x_shift(j, 5, J_C, 8);
+    x_rr(j, 0, X_MOV, RCX, J_A);
+    x_and_ff(j, J_A);
+    x_nz(j, J_A);
+  } else if (!strcmp(n, "SBC")) {
+    // value = M ^ 0xFF; sum = A + value + C;
+    // V = ((sum ^ A) & (sum ^ value) & 0x80) != 0
+    x_rr(j, 0, X_MOV, RAX, RDX);
+    x_ri(j, 0, 6, RDX, 0xFF);
+    x_rr(j, 0, X_MOV, J_A, RCX);
+    x_rr(j, 0, X_ADD, RDX, RCX);
+    x_rr(j, 0, X_ADD, J_C, RCX);
+    x_rr(j, 0, X_MOV, RCX, RSI);
+    x_rr(j, 0, X_XOR, J_A, RSI);
+    x_rr(j, 0, X_XOR, RCX, RDX);
+    x_rr(j, 0, X_AND, RDX, RSI);
+    x_shift(j, 5, RSI, 7);
+    x_ri(j, 0, 4, RSI, 1);
+    x_rr(j, 0, X_MOV, RSI, J_V);
+    x_rr(j, 0, X_MOV, RCX, J_C);
+    x_shift(j, 5, J_C, 8);
+    x_ri(j, 0, 4, J_C, 1);
+    x_rr(j, 0, X_MOV, RCX, J_A);
+    x_and_ff(j, J_A);
+    x_nz(j, J_A);
+  }
+}
+
+// adc_bcd on eax. The corrections are short forward jumps.
+static void x_adc_bcd(struct jit *j) {
+  // lo = (A & 0x0F) + (M & 0x0F) + C in ecx
+  x_rr(j, 0, X_MOV, J_A, RCX);
+  x_ri(j, 0, 4, RCX, 0x0F);
+  x_rr(j, 0, X_MOV, RAX, RDX);
+  x_ri(j, 0, 4, RDX, 0x0F);
+  x_rr(j, 0, X_ADD, RDX, RCX);
+  x_rr(j, 0, X_ADD, J_C, RCX);
+  x_ri(j, 0, 7, RCX, 0x0A);
+  uint8_t *digit = x_jcc(j, 0x2); // jb
+  x_ri(j, 0, 0, RCX, 0x06);
+  x_ri(j, 0, 4, RCX, 0x0F);
+  x_ri(j, 0, 0, RCX, 0x10);
+  x_patch(j, digit, j->p);
+  // sum = (A & 0xF0) + (M & 0xF0) + lo in edx
+  x_rr(j, 0, X_MOV, J_A, RDX);
+  x_ri(j, 0, 4, RDX, 0xF0);
+  x_rr(j, 0, X_MOV, RAX, RSI);
+  x_ri(j, 0, 4, RSI, 0xF0);
+  x_rr(j, 0, X_ADD, RSI, RDX);
+  x_rr(j, 0, X_ADD, RCX, RDX);
+  // zres = A + M + C; nres = sum; V = (~(A ^ M) & (A ^ sum) & 0x80) != 0
+  x_rr(j, 0, X_MOV, J_A, J_Z);
+  x_rr(j, 0, X_ADD, RAX, J_Z);
+  x_rr(j, 0, X_ADD, J_C, J_Z);
+  x_and_ff(j, J_Z);
+  x_rr(j, 0, X_MOV, RDX, J_N);
+  x_and_ff(j, J_N);
+  x_rr(j, 0, X_MOV, J_A, RSI);
+  x_rr(j, 0, X_XOR, RAX, RSI);
+  x8(j, 0xF7); // not esi
+  x8(j, 0xD6);
+  x_rr(j, 0, X_MOV, J_A, RCX);
+  x_rr(j, 0, X_XOR, RDX, RCX);
+  x_rr(j, 0, X_AND, RCX, RSI);
+  x_shift(j, 5, RSI, 7);
+  x_ri(j, 0, 4, RSI, 1);
+  x_rr(j, 0, X_MOV, RSI, J_V);
+  x_ri(j, 0, 7, RDX, 0xA0);
+  digit = x_jcc(j, 0x2); // jb
+  x_ri(j, 0, 0, RDX, 0x60);
+  x_patch(j, digit, j->p);
+  // C = sum > 0xFF, and sum is at most 0x25F
+  x_rr(j, 0, X_MOV, RDX, J_C);
+  x_ri(j, 0, 0, J_C, 0x100);
+  x_shift(j, 5, J_C, 9);
+  x_rr(j, 0, X_MOV, RDX, J_A);
+  x_and_ff(j, J_A);
+}
+
+// sbc_bcd on eax, leaving the result in edi.
+static void x_sbc_bcd(struct jit *j) {
+  // lo = (A & 0x0F) - (M & 0x0F) + C - 1 in ecx
+  x_rr(j, 0, X_MOV, J_A, RCX);
+  x_ri(j, 0, 4, RCX, 0x0F);
+  x_rr(j, 0, X_MOV, RAX, RDX);
+  x_ri(j, 0, 4, RDX, 0x0F);
+  x_rr(j, 0, X_SUB, RDX, RCX);
+  x_rr(j, 0, X_ADD, J_C, RCX);
+  x_ri(j, 0, 5, RCX, 1);
+  uint8_t *digit = x_jcc(j, 0x9); // jns
+  x_ri(j, 0, 5, RCX, 0x06);
+  x_ri(j, 0, 4, RCX, 0x0F);
+  x_ri(j, 0, 5, RCX, 0x10);
+  x_patch(j, digit, j->p);
+  // diff = (A & 0xF0) - (M & 0xF0) + lo in edi
+  x_rr(j, 0, X_MOV, J_A, RDI);
+  x_ri(j, 0, 4, RDI, 0xF0);
+  x_rr(j, 0, X_MOV, RAX, RDX);
+  x_ri(j, 0, 4, RDX, 0xF0);
+  x_rr(j, 0, X_SUB, RDX, RDI);
+  x_rr(j, 0, X_ADD, RCX, RDI);
+  digit = x_jcc(j, 0x9); // jns
+  x_ri(j, 0, 5, RDI, 0x60);
+  x_patch(j, digit, j->p);
+  x_and_ff(j, RDI);
+}
+
+// ADC or SBC on eax. P.D is tested at run time, since a block translated
+// in one mode may run again after a SED or CLD.
+static void x_read_decimal(struct jit *j, const char *n) {
+  union {
+    struct Status s;
+    uint8_t bits;
+  } d = {0};
+  d.s.D = 1;
+  x_mem(j, 0, 0xF6, 0, J_M, -1, 0,
+        offsetof(machine6502, cpu) + offsetof(cpu6502, P), 0); // test [P], D
+  x8(j, d.bits);
+  uint8_t *decimal = x_jcc(j, X_JNE);
+  x_read_op(j, n);
+  uint8_t *done = x_jmp(j);
+  x_patch(j, decimal, j->p);
+  if (n[0] == 'A') {
+    x_adc_bcd(j);
+  } else {
+    // The flags are the binary ones, so only A differs.
+    x_sbc_bcd(j);
+    x_read_op(j, n);
+    x_rr(j, 0, X_MOV, RDI, J_A);
+  }
+  x_patch(j, done, j->p);
+}
+
+// Shift, rotate or step the value in eax. Mirrors T_ASL and friends; the
+// rotates take the old carry in through edx.
+static void x_modify(struct jit *j, const char *n) {
+  if (!strcmp(n, "INC") || !strcmp(n, "DEC")) {
+    x_ri(j, 0, n[0] == 'I' ? 0 : 5, RAX, 1);
+    x_and_ff(j, RAX);
+    return;
+  }
+  int left = !strcmp(n, "ASL") || !strcmp(n, "ROL");
+  int rotate = n[0] == 'R';
+  if (rotate)
+    x_rr(j, 0, X_MOV, J_C, RDX);
+  x_rr(j, 0, X_MOV, RAX, J_C);
+  if (left)
+    x_shift(j, 5, J_C, 7);
+  else
+    x_ri(j, 0, 4, J_C, 1);
+  x_shift(j, left ? 4 : 5, RAX, 1);
+  if (rotate) {
+    if (!left)
+      x_shift(j, 4, RDX, 7);
+    x_rr(j, 0, X_OR, RDX, RAX);
+  }
+  if (left)
+    x_and_ff(j, RAX);
+}
+
+static void x_push_imm(struct jit *j, uint8_t v) {
+  x_mem(j, 0, 0xC6, 0, RDI, J_SP, 0, 0, 0);
+  x8(j, v);
+  x_ri(j, 0, 5, J_SP, 1);
+  x_and_ff(j, J_SP);
+}
+
+static void x_pull(struct jit *j, int reg) {
+  x_ri(j, 0, 0, J_SP, 1);
+  x_and_ff(j, J_SP);
+  x_mem(j, 0, 0x0FB6, reg, RSI, J_SP, 0, 0, 0);
+}
+
+// Translate one instruction. Returns 0 for instructions that always go
+// back to the interpreter (BRK, RTI, the stack and mode flag operations
+// that touch cpu.P, and undocumented opcodes).
+static int x_insn(struct jit *j, struct jit_insn *ji,
+                  const struct block_insn *in, const struct block_labels *L) {
+  const struct opcode *o = &op_table[in->op];
+  const char *n = o->name;
+  int mode = o->mode;
+
+  if (in->h == L->slow || in->op == 0x00 || in->op == 0x40 ||
+      in->op == 0x08 || in->op == 0x28 || in->op == 0x58 || in->op == 0x78 ||
+      in->op == 0xD8 || in->op == 0xF8)
+    return 0;
+
+  static const char *const reads[] = {"ADC", "AND", "BIT", "CMP",
+                                      "CPX", "CPY", "EOR", "LDA",
+                                      "LDX", "LDY", "ORA", "SBC"};
+  for (unsigned i = 0; i < sizeof(reads) / sizeof(reads[0]); i++) {
+    if (strcmp(n, reads[i]))
+      continue;
+    if (mode == IMM) {
+      x_cycles(j, in->cyc);
+      x_mov_ri(j, RAX, in->opnd & 0xFF);
+    } else {
+      struct jit_ea ea = x_ea(j, ji, in, mode, 1);
+      x_page(j, ji, RSI, JM_RD, ea.cpage);
+      x_ea_commit(j, &ea);
+      x_cycles(j, in->cyc);
+      x_ea_access(j, &ea, 0x0FB6, RSI, RAX);
+    }
+    if (!strcmp(n, "ADC") || !strcmp(n, "SBC"))
+      x_read_decimal(j, n);
+    else
+      x_read_op(j, n);
+    return 1;
+  }
+
+  if (n[0] == 'S' && n[1] == 'T') {
+    struct jit_ea ea = x_ea(j, ji, in, mode, 0);
+    x_page(j, ji, RDI, JM_WR, ea.cpage);
+    x_ea_commit(j, &ea);
+    x_cycles(j, in->cyc);
+    x_rr(j, 0, X_MOV, n[2] == 'A' ? J_A : n[2] == 'X' ? J_X : J_Y, RAX);
+    x_ea_access(j, &ea, 0x88, RDI, RAX);
+    return 1;
+  }
+
+  if (!strcmp(n, "ASL") || !strcmp(n, "LSR") || !strcmp(n, "ROL") ||
+      !strcmp(n, "ROR") || !strcmp(n, "INC") || !strcmp(n, "DEC")) {
+    if (mode == ACC) {
+      x_cycles(j, in->cyc);
+      x_rr(j, 0, X_MOV, J_A, RAX);
+      x_modify(j, n);
+      x_rr(j, 0, X_MOV, RAX, J_A);
+    } else {
+      struct jit_ea ea = x_ea(j, ji, in, mode, 0);
+      x_page(j, ji, RSI, JM_RD, ea.cpage);
+      x_page(j, ji, RDI, JM_WR, ea.cpage);
+      x_ea_commit(j, &ea);
+      x_cycles(j, in->cyc);
+      x_ea_access(j, &ea, 0x0FB6, RSI, RAX);
+      x_modify(j, n);
+      x_ea_access(j, &ea, 0x88, RDI, RAX);
+    }
+    x_nz(j, RAX);
+    return 1;
+  }
+
+  if (mode == REL) {
+    // Taken when the tested register is zero (BCC BEQ BPL BVC) or not.
+    int reg, when_zero;
+    switch (in->op) {
+    case 0x90: reg = J_C; when_zero = 1; break;
+    case 0xB0: reg = J_C; when_zero = 0; break;
+    case 0xF0: reg = J_Z; when_zero = 1; break;
+    case 0xD0: reg = J_Z; when_zero = 0; break;
+    case 0x10: reg = J_N; when_zero = 1; break;
+    case 0x30: reg = J_N; when_zero = 0; break;
+    case 0x50: reg = J_V; when_zero = 1; break;
+    default:   reg = J_V; when_zero = 0; break;
+    }
+    x_cycles(j, in->cyc);
+    if (reg == J_N) {
+      x_rex(j, 0, 0, 0, J_N, 0); // test r8d, 0x80
+      x8(j, 0xF7);
+      x8(j, 0xC0 | (J_N & 7));
+      x32(j, 0x80);
+    } else {
+      x_rr(j, 0, X_TEST, reg, reg);
+    }
+    uint8_t *not_taken = x_jcc(j, when_zero ? X_JNE : X_JE);
+    x_cycles(j, in->aux);
+    x_goto(j, in->opnd);
+    x_patch(j, not_taken, j->p);
+    x_goto(j, in[1].pc);
+    return 1;
+  }
+
+  switch (in->op) {
+  case 0xAA: case 0xA8: case 0xBA: case 0x8A: case 0x98: {
+    int src = in->op == 0xBA ? J_SP : in->op == 0x8A ? J_X
+            : in->op == 0x98 ? J_Y : J_A;
+    int dst = in->op == 0xAA || in->op == 0xBA ? J_X : in->op == 0xA8 ? J_Y
+            : J_A;
+    x_cycles(j, in->cyc);
+    x_rr(j, 0, X_MOV, src, dst);
+    x_nz(j, dst);
+    return 1;
+  }
+  case 0x9A: // TXS
+    x_cycles(j, in->cyc);
+    x_rr(j, 0, X_MOV, J_X, J_SP);
+    return 1;
+  case 0xE8: case 0xC8: case 0xCA: case 0x88: {
+    int reg = (in->op == 0xE8 || in->op == 0xCA) ? J_X : J_Y;
+    x_cycles(j, in->cyc);
+    x_ri(j, 0, in->op == 0xE8 || in->op == 0xC8 ? 0 : 5, reg, 1);
+    x_and_ff(j, reg);
+    x_nz(j, reg);
+    return 1;
+  }
+  case 0x18: case 0x38: case 0xB8: // CLC SEC CLV
+    x_cycles(j, in->cyc);
+    x_mov_ri(j, in->op == 0xB8 ? J_V : J_C, in->op == 0x38);
+    return 1;
+  case 0xEA:
+    x_cycles(j, in->cyc);
+    return 1;
+  case 0x48: // PHA
+    x_page(j, ji, RDI, JM_WR, 0x01);
+    x_cycles(j, in->cyc);
+    x_mem(j, 0, 0x88, J_A, RDI, J_SP, 0, 0, 1);
+    x_ri(j, 0, 5, J_SP, 1);
+    x_and_ff(j, J_SP);
+    return 1;
+  case 0x68: // PLA
+    x_page(j, ji, RSI, JM_RD, 0x01);
+    x_cycles(j, in->cyc);
+    x_pull(j, J_A);
+    x_nz(j, J_A);
+    return 1;
+  case 0x20: { // JSR
+    uint16_t r_addr = in[1].pc - 1;
+    x_page(j, ji, RDI, JM_WR, 0x01);
+    x_cycles(j, in->cyc);
+    x_push_imm(j, r_addr >> 8);
+    x_push_imm(j, r_addr & 0xFF);
+    x_goto(j, in->opnd);
+    return 1;
+  }
+  case 0x60: // RTS
+    x_page(j, ji, RSI, JM_RD, 0x01);
+    x_cycles(j, in->cyc);
+    x_pull(j, RAX);
+    x_pull(j, RDX);
+    x_shift(j, 4, RDX, 8);
+    x_rr(j, 0, X_OR, RAX, RDX);
+    x_ri(j, 0, 0, RDX, 1);
+    x_ri(j, 0, 4, RDX, 0xFFFF);
+    x_dispatch(j);
+    return 1;
+  case 0x4C: // JMP abs
+    x_cycles(j, in->cyc);
+    x_goto(j, in->opnd);
+    return 1;
+  case 0x6C: { // JMP (ind), with the page wrap of the real chip
+    uint16_t ptr = in->opnd;
+    x_page(j, ji, RSI, JM_RD, ptr >> 8);
+    x_cycles(j, in->cyc);
+    x_mem(j, 0, 0x0FB6, RAX, RSI, -1, 0, ptr & 0xFF, 0);
+    x_mem(j, 0, 0x0FB6, RDX, RSI, -1, 0, (ptr + 1) & 0xFF, 0);
+    x_shift(j, 4, RDX, 8);
+    x_rr(j, 0, X_OR, RAX, RDX);
+    x_dispatch(j);
+    return 1;
+  }
+  }
+  return 0;
+}
+
+// Translate block b into the arena. Returns NULL if the arena filled up.
+static void *jit_translate(struct jit *j, struct block *b,
+                           const struct block_labels *L) {
+  struct jit_insn ji[BLOCK_INSNS];
+  uint8_t *code = j->p;
+  uint32_t bound = 0;
+  int n;
+
+  for (n = 0; b->ins[n].h != L->end; n++) {
+    ji[n].nbail = 0;
+    if (!x_insn(j, &ji[n], &b->ins[n], L)) {
+      if (n == 0) { // nothing to gain
+        j->p = code;
+        return NULL;
+      }
+      x_bail(j, &ji[n]);
+      n++;
+      break;
+    }
+  }
+  if (b->ins[n].h == L->end) {
+    x_goto(j, b->ins[n].pc);
+  }
+
+  // Out-of-line exits back to the interpreter at the bailing instruction.
+  for (int i = 0; i < n; i++) {
+    if (!ji[i].nbail)
+      continue;
+    uint8_t *stub = j->p;
+    uint64_t ip = (uint64_t)(uintptr_t)&b->ins[i];
+    x_mov_ri(j, RDX, b->ins[i].pc);
+    x_mov_ri64(j, RAX, ip);
+    x_patch(j, x_jmp(j), j->exit);
+    for (int k = 0; k < ji[i].nbail; k++)
+      x_patch(j, ji[i].bail[k], stub);
+  }
+
+  if (j->full)
+    return NULL;
+
+  // Every instruction of the block has to start before the deadline, so
+  // the worst case of all but the last one must fit.
+  for (int i = 0; i + 1 < n; i++)
+    bound += b->ins[i].cyc + 1;
+  b->bound = bound;
+  return code;
+}
+
+// Translate a block that just became hot, flushing a full arena once. The
+// block stays interpreted if the arena cannot be made writable.
+static void jit_compile(struct block_cache *bc, struct block *b,
+                        const struct block_labels *L) {
+  struct jit *j = bc->jit;
+  uint8_t *from = j->p;
+  if (jit_protect(j, from, PROT_READ | PROT_WRITE) != 0)
+    return;
+  b->native = jit_translate(j, b, L);
+  if (!b->native && j->full) {
+    jit_reset(j, bc);
+    from = j->start;
+    if (jit_protect(j, from, PROT_READ | PROT_WRITE) == 0)
+      b->native = jit_translate(j, b, L);
+  }
+  if (jit_protect(j, from, PROT_READ | PROT_EXEC) != 0) {
+    // Left writable, so nothing in it may run again.
+    jit_reset(j, bc);
+    b->native = NULL;
+  }
+}
+
+#endif
+
+static struct block_cache *blocks_new(machine6502 *m) {
+  struct block_cache *bc = calloc(1, sizeof(struct block_cache));
+  if (!bc)
+    return NULL;
+  bc->owner = m;
+  for (int i = 0; i < BLOCK_SLOTS; i++)
+    bc->slot[i].pc = BLOCK_EMPTY;
+#if CPU_JIT_X86
+  bc->jit = jit_new(bc->slot); // runs interpreted only if this fails
+#endif
+  m->blocks = bc;
+  return bc;
+}
+
+// Check that code on page p can be cached, and start watching it if it is
+// RAM. Device pages cannot be cached: their reads may have side effects.
+static int block_page(machine6502 *m, unsigned p) {
+  if (m->dev[p] == &watch_device || m->dev[p] == &rom_device)
+    return 1;
+  if (m->dev[p] || !m->rd[p] || m->rd[p] != m->wr[p])
+    return 0;
+  m->wr[p] = NULL;
+  m->dev[p] = &watch_device;
+  return 1;
+}
+
+// Decode the block entered at pc into b. Returns 0, leaving b empty, when
+// the first instruction cannot be cached.
+static int block_decode(machine6502 *m, struct block_cache *bc,
+                        struct block *b, uint16_t pc,
+                        const struct block_labels *L) {
+  uint32_t a = pc;
+  int n = 0;
+
+#if CPU_JIT_X86
+  b->native = NULL;
+  b->hits = 0;
+#endif
+  while (n < BLOCK_INSNS - 1 && a <= 0xFFFF && block_page(m, a >> 8)) {
+    uint8_t op = m->rd[a >> 8][a & 0xFF];
+    const struct opcode *o = &op_table[op];
+    void *h = L->op[op] ? L->op[op] : L->slow;
+    unsigned len = (h == L->slow) ? 1 : mode_len[o->mode];
+
+    if (a + len > 0x10000 || !block_page(m, (a + len - 1) >> 8))
+      break;
+
+    struct block_insn *in = &b->ins[n++];
+    uint16_t opnd = 0;
+    for (unsigned i = len - 1; i > 0; i--)
+      opnd = (opnd << 8) | m->rd[(a + i) >> 8][(a + i) & 0xFF];
+
+    in->h = h;
+    in->pc = a;
+    in->op = op;
+    in->cyc = op_cycles[op];
+    in->aux = 0;
+    in->opnd = opnd;
+
+    for (unsigned i = 0; i < len; i++)
+      bc->code[(a + i) >> 6] |= 1ull << ((a + i) & 63);
+    a += len;
+
+    if (h == L->slow)
+      break;
+    if (o->mode == REL) {
+      uint16_t next = a, target = next + (int8_t)opnd;
+      in->opnd = target;
+      in->aux = 1 + ((target ^ next) > 0xFF);
+
+      // A compare or counter step right before the branch jumps straight
+      // into it instead of going through dispatch.
+      struct block_insn *prev = &b->ins[n - 2];
+      for (int i = 0; n >= 2 && i < L->nfuse; i++)
+        if (L->fuse[i].first == prev->op && L->fuse[i].second == op &&
+            prev->h == L->op[prev->op])
+          prev->h = L->fuse[i].h;
+      break;
+    }
+    if (op == 0x00 || op == 0x20 || op == 0x40 || op == 0x4C || op == 0x60 ||
+        op == 0x6C)
+      break;
+  }
+
+  if (n == 0) {
+    b->pc = BLOCK_EMPTY;
+    return 0;
+  }
+
+  b->ins[n] = (struct block_insn){.h = L->end, .pc = (uint16_t)a};
+  b->pc = pc;
+  b->end = a;
+  return 1;
+}
+
+// Operands come pre-decoded from ip. PC is only kept up to date at block
+// exits; devices see the address after the current instruction, as they
+// do under cpu_step. Any device access ends the block after the current
+// instruction by zeroing limit, since the device may have remapped pages
+// or stored into cached code.
+#undef T_DEV
+#define T_DEV()                                                                \
+  do {                                                                         \
+    cpu->cycles = cyc;                                                         \
+    cpu->PC = ip[1].pc;                                                        \
+    limit = 0;                                                                 \
+  } while (0)
+// resync rereads m->wake.
+#undef T_WAKE
+#define T_WAKE()                                                               \
+  do {                                                                         \
+    if (m->wake < limit)                                                       \
+      limit = 0;                                                               \
+  } while (0)
+
+// End markers are not instructions and have no cycles.
+#define B_TRACE()                                                              \
+  do {                                                                         \
+    if (ip->cyc)                                                               \
+      TRACE_INSN(trace, ip->pc, ip->op, A, X, Y, T_PACK_P(), SP, cyc);         \
+  } while (0)
+
+#define B_NEXT()                                                               \
+  do {                                                                         \
+    ip++;                                                                      \
+    if (__builtin_expect(cyc >= limit, 0)) {                                   \
+      PC = ip->pc;                                                             \
+      goto resync;                                                             \
+    }                                                                          \
+    B_TRACE();                                                                 \
+    cyc += ip->cyc;                                                            \
+    goto *ip->h;                                                               \
+  } while (0)
+
+#define B_zp (ip->opnd)
+#define B_zpx ((uint8_t)(ip->opnd + X))
+#define B_zpy ((uint8_t)(ip->opnd + Y))
+#define B_abs (ip->opnd)
+#define B_abx ((uint16_t)(ip->opnd + X))
+#define B_aby ((uint16_t)(ip->opnd + Y))
+#define B_izx T_PTR(ip->opnd + X)
+#define B_izy ((uint16_t)(T_PTR(ip->opnd) + Y))
+
+// Read operands, charging the page-crossing cycle like T_R_*.
+#define B_M_imm ((uint8_t)ip->opnd)
+#define B_M_zp T_RD(B_zp)
+#define B_M_zpx T_RD(B_zpx)
+#define B_M_zpy T_RD(B_zpy)
+#define B_M_abs T_RD(B_abs)
+#define B_M_abx T_RD(t_index(&cyc, ip->opnd, X))
+#define B_M_aby T_RD(t_index(&cyc, ip->opnd, Y))
+#define B_M_izx T_RD(B_izx)
+#define B_M_izy T_RD(t_index(&cyc, T_PTR(ip->opnd), Y))
+
+#define B_READ(name, mode)                                                     \
+  B_##name##_##mode : {                                                        \
+    uint8_t M = B_M_##mode;                                                    \
+    T_##name(M);                                                               \
+    B_NEXT();                                                                  \
+  }
+#define B_READ_ALL(name)                                                       \
+  B_READ(name, imm)                                                            \
+  B_READ(name, zp)                                                             \
+  B_READ(name, zpx)                                                            \
+  B_READ(name, abs)                                                            \
+  B_READ(name, abx) B_READ(name, aby) B_READ(name, izx) B_READ(name, izy)
+#define B_STORE(name, reg, mode)                                               \
+  B_##name##_##mode : T_WR(B_##mode, reg);                                     \
+  B_NEXT();
+#define B_RMW(name, mode)                                                      \
+  B_##name##_##mode : {                                                        \
+    uint16_t ea = B_##mode;                                                    \
+    uint8_t v = T_RD(ea);                                                      \
+    T_##name(v);                                                               \
+    T_WR(ea, v);                                                               \
+    T_NZ(v);                                                                   \
+    B_NEXT();                                                                  \
+  }
+#define B_RMW_ALL(name)                                                        \
+  B_RMW(name, zp) B_RMW(name, zpx) B_RMW(name, abs) B_RMW(name, abx)
+#define B_BRANCH(name, cond)                                                   \
+  B_##name : {                                                                 \
+    PC = ip[1].pc;                                                             \
+    if (cond) {                                                                \
+      cyc += ip->aux;                                                          \
+      PC = ip->opnd;                                                           \
+    }                                                                          \
+    goto lookup;                                                               \
+  }
+#define B_TRANSFER(name, dst, src)                                             \
+  B_##name : T_NZ(dst = src);                                                  \
+  B_NEXT();
+
+// A fused pair runs the first instruction, then enters the branch that
+// follows it directly. The deadline is still checked in between.
+#define B_FUSE(name, first, branch)                                            \
+  F_##name##_##branch : first;                                                 \
+  ip++;                                                                        \
+  if (__builtin_expect(cyc >= limit, 0)) {                                     \
+    PC = ip->pc;                                                               \
+    goto resync;                                                               \
+  }                                                                            \
+  B_TRACE();                                                                   \
+  cyc += ip->cyc;                                                              \
+  goto B_##branch;
+#define B_FUSE_CMP(name, reg)                                                  \
+  B_FUSE(name, T_CMPR(reg, (uint8_t)ip->opnd), BNE)                            \
+  B_FUSE(name, T_CMPR(reg, (uint8_t)ip->opnd), BEQ)                            \
+  B_FUSE(name, T_CMPR(reg, (uint8_t)ip->opnd), BCC)                            \
+  B_FUSE(name, T_CMPR(reg, (uint8_t)ip->opnd), BCS)
+#define B_FUSE_CMP_OPS(name, op)                                               \
+  {op, 0xD0, &&F_##name##_BNE}, {op, 0xF0, &&F_##name##_BEQ},                  \
+      {op, 0x90, &&F_##name##_BCC}, {op, 0xB0, &&F_##name##_BCS}
+
+static int run_blocks(machine6502 *m, uint64_t deadline) {
+  static void *const native[256] = {T_OPS(B)};
+  static const struct block_fuse fuse[] = {
+      {0xCA, 0xD0, &&F_DEX_BNE},  {0x88, 0xD0, &&F_DEY_BNE},
+      {0xE8, 0xD0, &&F_INX_BNE},  {0xC8, 0xD0, &&F_INY_BNE},
+      B_FUSE_CMP_OPS(CMP, 0xC9),  B_FUSE_CMP_OPS(CPX, 0xE0),
+      B_FUSE_CMP_OPS(CPY, 0xC0),
+  };
+  const struct block_labels labels = {native, &&slow, &&end, fuse,
+                                      sizeof(fuse) / sizeof(fuse[0])};
+
+  struct block_cache *bc = blocks_of(m);
+  if (!bc && !(bc = blocks_new(m)))
+    return run_threaded(m, deadline);
+
+  cpu6502 *cpu = &m->cpu;
+  struct trace *trace = m->trace;
+  const uint8_t **rd = m->rd;
+  uint8_t **wr = m->wr;
+  const struct block_insn *ip = NULL;
+  struct block *b;
+  uint8_t A, X, Y, SP, C, V, zres, nres;
+  uint16_t PC;
+  uint64_t cyc, limit = deadline;
+  T_LOAD();
+
+lookup:
+  if (__builtin_expect(cyc >= limit, 0))
+    goto resync;
+  b = &bc->slot[BLOCK_HASH(PC)];
+  if (__builtin_expect(b->pc != PC, 0) &&
+      !block_decode(m, bc, b, PC, &labels))
+    goto step;
+#if CPU_JIT_X86
+  // Translated code has no trace hooks.
+  if (b->native && !TRACE_ON(trace) && cyc + b->bound < limit)
+    goto native;
+  if (++b->hits == JIT_THRESHOLD && bc->jit)
+    jit_compile(bc, b, &labels);
+#endif
+  ip = b->ins;
+  B_TRACE();
+  cyc += ip->cyc;
+  goto *ip->h;
+
+  B_READ_ALL(ORA)
+  B_READ_ALL(AND)
+  B_READ_ALL(EOR)
+  B_READ_ALL(ADC)
+  B_READ_ALL(LDA)
+  B_READ_ALL(CMP)
+  B_READ_ALL(SBC)
+  B_READ(BIT, zp) B_READ(BIT, abs)
+  B_READ(CPX, imm) B_READ(CPX, zp) B_READ(CPX, abs)
+  B_READ(CPY, imm) B_READ(CPY, zp) B_READ(CPY, abs)
+  B_READ(LDX, imm) B_READ(LDX, zp) B_READ(LDX, zpy) B_READ(LDX, abs)
+  B_READ(LDX, aby)
+  B_READ(LDY, imm) B_READ(LDY, zp) B_READ(LDY, zpx) B_READ(LDY, abs)
+  B_READ(LDY, abx)
+
+  B_STORE(STA, A, zp) B_STORE(STA, A, zpx) B_STORE(STA, A, abs)
+  B_STORE(STA, A, abx) B_STORE(STA, A, aby) B_STORE(STA, A, izx)
+  B_STORE(STA, A, izy)
+  B_STORE(STX, X, zp) B_STORE(STX, X, zpy) B_STORE(STX, X, abs)
+  B_STORE(STY, Y, zp) B_STORE(STY, Y, zpx) B_STORE(STY, Y, abs)
+
+  B_RMW_ALL(ASL)
+  B_RMW_ALL(LSR)
+  B_RMW_ALL(ROL)
+  B_RMW_ALL(ROR)
+  B_RMW_ALL(INC)
+  B_RMW_ALL(DEC)
+
+B_ASL_A:
+  T_ASL(A);
+  T_NZ(A);
+  B_NEXT();
+B_LSR_A:
+  T_LSR(A);
+  T_NZ(A);
+  B_NEXT();
+B_ROL_A:
+  T_ROL(A);
+  T_NZ(A);
+  B_NEXT();
+B_ROR_A:
+  T_ROR(A);
+  T_NZ(A);
+  B_NEXT();
+
+  B_BRANCH(BCC, !C)
+  B_BRANCH(BCS, C)
+  B_BRANCH(BEQ, zres == 0)
+  B_BRANCH(BMI, nres & 0x80)
+  B_BRANCH(BNE, zres != 0)
+  B_BRANCH(BPL, !(nres & 0x80))
+  B_BRANCH(BVC, !V)
+  B_BRANCH(BVS, V)
+
+  B_FUSE(DEX, T_NZ(--X), BNE)
+  B_FUSE(DEY, T_NZ(--Y), BNE)
+  B_FUSE(INX, T_NZ(++X), BNE)
+  B_FUSE(INY, T_NZ(++Y), BNE)
+  B_FUSE_CMP(CMP, A)
+  B_FUSE_CMP(CPX, X)
+  B_FUSE_CMP(CPY, Y)
+
+B_JMP_abs:
+  PC = ip->opnd;
+  goto lookup;
+B_JMP_ind: {
+  uint16_t ptr = ip->opnd;
+  PC = T_RD(ptr) | (T_RD((ptr & 0xFF00) | ((ptr + 1) & 0x00FF)) << 8);
+  goto lookup;
+}
+B_JSR: {
+  uint16_t r_addr = ip[1].pc - 1;
+  T_PUSH(r_addr >> 8);
+  T_PUSH(r_addr & 0xFF);
+  PC = ip->opnd;
+  goto lookup;
+}
+B_RTS: {
+  uint8_t lo = T_PULL();
+  uint8_t hi = T_PULL();
+  PC = (((uint16_t)hi << 8) | lo) + 1;
+  goto lookup;
+}
+B_RTI: {
+  T_UNPACK_P(T_PULL());
+  uint8_t lo = T_PULL();
+  uint8_t hi = T_PULL();
+  PC = ((uint16_t)hi << 8) | lo;
+  irq_recheck(m);
+  T_WAKE();
+  goto lookup;
+}
+B_NOP:
+  B_NEXT();
+
+B_CLC:
+  C = 0;
+  B_NEXT();
+B_SEC:
+  C = 1;
+  B_NEXT();
+B_CLV:
+  V = 0;
+  B_NEXT();
+B_CLI:
+  cpu->P.I = 0;
+  irq_recheck(m);
+  T_WAKE();
+  B_NEXT();
+B_SEI:
+  cpu->P.I = 1;
+  B_NEXT();
+B_CLD:
+  cpu->P.D = 0;
+  B_NEXT();
+B_SED:
+  cpu->P.D = 1;
+  B_NEXT();
+
+  B_TRANSFER(TAX, X, A)
+  B_TRANSFER(TAY, Y, A)
+  B_TRANSFER(TSX, X, SP)
+  B_TRANSFER(TXA, A, X)
+  B_TRANSFER(TYA, A, Y)
+B_TXS:
+  SP = X;
+  B_NEXT();
+B_INX:
+  T_NZ(++X);
+  B_NEXT();
+B_INY:
+  T_NZ(++Y);
+  B_NEXT();
+B_DEX:
+  T_NZ(--X);
+  B_NEXT();
+B_DEY:
+  T_NZ(--Y);
+  B_NEXT();
+
+B_PHA:
+  T_PUSH(A);
+  B_NEXT();
+B_PLA:
+  T_NZ(A = T_PULL());
+  B_NEXT();
+B_PHP:
+  T_PUSH(T_PACK_P() | 0x10);
+  B_NEXT();
+B_PLP:
+  T_UNPACK_P(T_PULL());
+  irq_recheck(m);
+  T_WAKE();
+  B_NEXT();
+
+end:
+  PC = ip->pc;
+  goto lookup;
+
+slow:
+  // Hooked and undocumented opcodes end their block and run via cpu_exec.
+  PC = ip->pc + 1;
+  cyc -= ip->cyc;
+  T_SPILL();
+  cpu_exec(m, ip->op);
+  T_LOAD();
+  T_WAKE();
+  goto lookup;
+
+#if CPU_JIT_X86
+native: {
+  // Translated code chains from block to block while each one fits before
+  // the limit, and comes back with the instruction it could not run, if any.
+  struct jit_regs r = {cyc, limit, NULL, PC, A, X, Y, SP, C, V, zres, nres};
+  bc->jit->enter(&r, m, b->native);
+  cyc = r.cyc;
+  PC = r.PC;
+  A = r.A;
+  X = r.X;
+  Y = r.Y;
+  SP = r.SP;
+  C = r.C;
+  V = r.V;
+  zres = r.zres;
+  nres = r.nres;
+  if (!r.ip)
+    goto lookup;
+  ip = r.ip;
+  cyc += ip->cyc;
+  goto *ip->h;
+}
+#endif
+
+step:
+  // Code on device pages is fetched live, one instruction at a time.
+  T_SPILL();
+  if (cpu_step(m) == 0x00)
+    return RUN_BRK;
+  T_LOAD();
+  T_WAKE();
+  goto lookup;
+
+B_BRK:
+  PC = ip->pc + 1;
+  cyc -= ip->cyc;
+  T_SPILL();
+  cpu_exec(m, 0x00);
+  return RUN_BRK;
+
+resync:
+  if (m->wake < deadline)
+    deadline = m->wake;
+  if (cyc >= deadline)
+    goto out_of_budget;
+  limit = deadline;
+  goto lookup;
+
+out_of_budget:
+  T_SPILL();
+  return RUN_BUDGET;
+}
+
+#endif
+
+// Run until BRK, until cpu.cycles reaches deadline or until cpu_yield. An
+// instruction that starts before the deadline always completes, so a run
+// may overshoot it by a few cycles. The loops below run up to the next
+// wake and come back here for events_run.
+int run_cpu_until(machine6502 *m, uint64_t deadline) {
+  for (;;) {
+    if (m->cpu.cycles >= m->wake)
+      events_run(m);
+    if (m->yield) {
+      m->yield = 0;
+      return RUN_YIELD;
+    }
+    if (m->cpu.cycles >= deadline)
+      return RUN_BUDGET;
+    uint64_t stop = m->wake < deadline ? m->wake : deadline;
+#if CPU_BLOCKS
+    if (run_blocks(m, stop) == RUN_BRK)
+      return RUN_BRK;
+#elif CPU_THREADED
+    if (run_threaded(m, stop) == RUN_BRK)
+      return RUN_BRK;
+#else
+    while (m->cpu.cycles < stop && m->cpu.cycles < m->wake) {
+      if (cpu_step(m) == 0x00) { /* BRK */
+        return RUN_BRK;
+      }
+    }
+#endif
+  }
+}
+
+// Run until BRK or for about `cycles` clock cycles.
+int run_cpu_for(machine6502 *m, uint64_t cycles) {
+  uint64_t deadline = m->cpu.cycles + cycles;
+  if (deadline < cycles)
+    deadline = UINT64_MAX;
+  return run_cpu_until(m, deadline);
+}
+
+// Run until BRK.
+void run_cpu(machine6502 *m) {
+  while (run_cpu_until(m, UINT64_MAX) == RUN_YIELD)
+    ;
+}
+
+// Make run_cpu_until return RUN_YIELD once the instruction in progress
+// completes. Devices and events may call it; like an interrupt, it is
+// seen between instructions.
+void cpu_yield(machine6502 *m) {
+  m->yield = 1;
+  m->wake = 0;
+}
+
+/* --------------------------------------------------------- */
+/* Scheduler                                                  */
+/* --------------------------------------------------------- */
+
+// A scheduler time-slices many machines over a few threads. Each turn runs
+// one machine with run_cpu_until for a quantum of cycles and puts it back,
+// so a program that never reaches BRK holds a thread one quantum at a time
+// instead of for good.
+//
+// Turns go by stride scheduling. A machine's pass grows by the cycles it
+// ran divided by its priority, and the ready machine with the lowest pass
+// runs next, so ready machines get cycles in proportion to their
+// priorities. A machine that becomes ready starts no lower than the pass
+// of the last turn taken: it runs within a turn or so per thread, but
+// banks no credit while parked.
+//
+// A device with nothing for the program to read answers as an empty port
+// would and calls sched_park. The machine leaves its thread after that
+// instruction and does not run again until sched_wake, so a program
+// polling the port costs nothing while it waits.
+#if CPU_SCHED
+
+#define SCHED_QUANTUM 100000 // default cycles per turn
+#define SCHED_STRIDE 256     // pass per cycle run at priority 1
+
+enum sched_status {
+  SCHED_READY,   // waiting for a thread
+  SCHED_RUNNING, // on a thread
+  SCHED_PARKED,  // waiting for sched_wake
+  SCHED_BRK,     // executed a BRK, and left the scheduler
+  SCHED_LIMIT,   // ran its cycle limit, and left the scheduler
+};
+
+// Called on a scheduler thread when m leaves the scheduler, with status
+// SCHED_BRK or SCHED_LIMIT. m is the caller's again from then on.
+typedef void (*sched_done_fn)(machine6502 *m, int status, void *ctx);
+
+struct sched;
+
+struct sched_task {
+  machine6502 *m;
+  struct sched_task *prev, *next; // every task of the scheduler
+  uint64_t pass;
+  uint64_t limit; // cpu.cycles at which m stops for good
+  unsigned priority;
+  int status;
+  uint8_t park;  // sched_park was called during this turn
+  uint8_t woken; // sched_wake was called during this turn
+};
+
+struct sched {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // a task became ready, or stop was set
+  pthread_cond_t idle; // no task is ready or running
+  struct sched_task **ready; // a min-heap on pass
+  unsigned nready, ready_cap;
+  unsigned running, parked;
+  struct sched_task *tasks;
+  uint64_t vtime; // pass of the last turn taken
+  uint64_t quantum;
+  sched_done_fn done;
+  void *ctx;
+  int stop;
+  unsigned nthreads;
+  pthread_t *threads;
+};
+
+// Put t on the ready heap. s->ready has room: sched_add grows it.
+static void sched_push(struct sched *s, struct sched_task *t) {
+  unsigned i = s->nready++;
+  if (t->pass < s->vtime)
+    t->pass = s->vtime;
+  t->status = SCHED_READY;
+  while (i > 0 && s->ready[(i - 1) / 2]->pass > t->pass) {
+    s->ready[i] = s->ready[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  s->ready[i] = t;
+  pthread_cond_signal(&s->work);
+}
+
+static struct sched_task *sched_pop(struct sched *s) {
+  struct sched_task *top = s->ready[0], *last = s->ready[--s->nready];
+  unsigned i = 0;
+  for (;;) {
+    unsigned min = 2 * i + 1;
+    if (min >= s->nready)
+      break;
+    if (min + 1 < s->nready && s->ready[min + 1]->pass < s->ready[min]->pass)
+      min++;
+    if (s->ready[min]->pass >= last->pass)
+      break;
+    s->ready[i] = s->ready[min];
+    i = min;
+  }
+  if (s->nready)
+    s->ready[i] = last;
+  return top;
+}
+
+// Unlink t, which has left the scheduler. Called with the lock held.
+static void sched_unlink(struct sched *s, struct sched_task *t) {
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    s->tasks = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  t->m->task = NULL;
+  free(t);
+}
+
+static void *sched_thread(void *arg) {
+  struct sched *s = arg;
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (!s->nready && !s->stop)
+      pthread_cond_wait(&s->work, &s->lock);
+    if (s->stop)
+      break;
+    struct sched_task *t = sched_pop(s);
+    s->vtime = t->pass;
+    t->status = SCHED_RUNNING;
+    s->running++;
+    pthread_mutex_unlock(&s->lock);
+
+    machine6502 *m = t->m;
+    uint64_t start = m->cpu.cycles, end = start + s->quantum;
+    if (end < start || end > t->limit)
+      end = t->limit;
+    int run = run_cpu_until(m, end);
+
+    pthread_mutex_lock(&s->lock);
+    t->pass += (m->cpu.cycles - start) * SCHED_STRIDE / t->priority;
+    int status = SCHED_READY;
+    if (run == RUN_BRK)
+      status = SCHED_BRK;
+    else if (m->cpu.cycles >= t->limit)
+      status = SCHED_LIMIT;
+    else if (t->park && !t->woken)
+      status = SCHED_PARKED;
+    t->park = t->woken = 0;
+    if (status == SCHED_READY) {
+      sched_push(s, t);
+    } else if (status == SCHED_PARKED) {
+      t->status = status;
+      s->parked++;
+    } else {
+      sched_unlink(s, t);
+      if (s->done) {
+        pthread_mutex_unlock(&s->lock);
+        s->done(m, status, s->ctx);
+        pthread_mutex_lock(&s->lock);
+      }
+    }
+    s->running--;
+    if (!s->nready && !s->running)
+      pthread_cond_broadcast(&s->idle);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// A scheduler giving machines quantum cycles a turn (0 for SCHED_QUANTUM).
+// done, if not NULL, is called with ctx as each machine leaves. Nothing
+// runs until sched_start. Returns NULL if out of memory.
+struct sched *sched_new(uint64_t quantum, sched_done_fn done, void *ctx) {
+  struct sched *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->idle, NULL);
+  s->quantum = quantum ? quantum : SCHED_QUANTUM;
+  s->done = done;
+  s->ctx = ctx;
+  return s;
+}
+
+// Start running machines on nthreads threads, once; machines may be added
+// before and after. Returns 0, or -1 if called twice or no thread started.
+int sched_start(struct sched *s, unsigned nthreads) {
+  if (s->threads || !nthreads)
+    return -1;
+  s->threads = malloc(nthreads * sizeof(pthread_t));
+  if (!s->threads)
+    return -1;
+  for (; s->nthreads < nthreads; s->nthreads++)
+    if (pthread_create(&s->threads[s->nthreads], NULL, sched_thread, s))
+      break;
+  return s->nthreads ? 0 : -1;
+}
+
+// Stop the threads, once each has finished its turn, and detach every
+// machine still scheduled; they keep their state, ready to run again.
+void sched_free(struct sched *s) {
+  if (!s)
+    return;
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+  for (unsigned i = 0; i < s->nthreads; i++)
+    pthread_join(s->threads[i], NULL);
+  while (s->tasks)
+    sched_unlink(s, s->tasks);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->work);
+  pthread_cond_destroy(&s->idle);
+  free(s->threads);
+  free(s->ready);
+  free(s);
+}
+
+// Schedule m, which must not be running or scheduled elsewhere, at
+// priority 1 or more. It leaves the scheduler at BRK or once it has run
+// limit more cycles (0 for no limit). Returns 0, or -1 if m is already
+// scheduled, priority is 0 or memory ran out.
+int sched_add(struct sched *s, machine6502 *m, unsigned priority,
+              uint64_t limit) {
+  if (m->task || !priority)
+    return -1;
+  struct sched_task *t = calloc(1, sizeof(*t));
+  if (!t)
+    return -1;
+  t->m = m;
+  t->priority = priority;
+  t->limit = m->cpu.cycles + limit;
+  if (!limit || t->limit < limit)
+    t->limit = UINT64_MAX;
+
+  pthread_mutex_lock(&s->lock);
+  unsigned ntasks = s->nready + s->running + s->parked + 1;
+  if (ntasks > s->ready_cap) {
+    unsigned cap = s->ready_cap ? s->ready_cap * 2 : 64;
+    struct sched_task **ready = realloc(s->ready, cap * sizeof(*ready));
+    if (!ready) {
+      pthread_mutex_unlock(&s->lock);
+      free(t);
+      return -1;
+    }
+    s->ready = ready;
+    s->ready_cap = cap;
+  }
+  t->next = s->tasks;
+  if (s->tasks)
+    s->tasks->prev = t;
+  s->tasks = t;
+  m->task = t;
+  sched_push(s, t);
+  pthread_mutex_unlock(&s->lock);
+  return 0;
+}
+
+// Park the machine running this instruction: for devices, on a scheduler
+// thread. Does nothing for a machine that is not scheduled.
+void sched_park(machine6502 *m) {
+  if (m->task) {
+    m->task->park = 1;
+    cpu_yield(m);
+  }
+}
+
+// Make m ready if it is parked, or keep it from parking at the end of the
+// turn it is in. Any thread may call it, e.g. once input has arrived.
+void sched_wake(struct sched *s, machine6502 *m) {
+  pthread_mutex_lock(&s->lock);
+  struct sched_task *t = m->task;
+  if (t && t->status == SCHED_PARKED) {
+    s->parked--;
+    sched_push(s, t);
+  } else if (t && t->status == SCHED_RUNNING) {
+    t->woken = 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Wait until no machine is ready or running: every machine has left or is
+// parked. Returns the number parked; without sched_start, it would wait
+// forever on any machine added.
+unsigned sched_wait(struct sched *s) {
+  pthread_mutex_lock(&s->lock);
+  while (s->nready || s->running)
+    pthread_cond_wait(&s->idle, &s->lock);
+  unsigned parked = s->parked;
+  pthread_mutex_unlock(&s->lock);
+  return parked;
+}
+
+#endif
+
+/* --------------------------------------------------------- */
+/* Lockstep lanes                                             */
+/* --------------------------------------------------------- */
+
+// A wide group runs up to WIDE_LANES copies of one program side by side,
+// for fuzzing and Monte Carlo jobs that differ only in their inputs. Each
+// register is one vector with a lane per machine, and memory is
+// interleaved: the lanes' bytes at one address sit next to each other, so
+// an access that every lane makes to the same address is one row load or
+// store. Each step runs one instruction in all the lanes whose PC is at the
+// group's PC, with the ALU done as GCC vector arithmetic over every lane and
+// the results kept only in those lanes.
+//
+// Lanes that branch apart are masked off. When the running lanes are not
+// all at one PC, the step goes to the lowest PC any of them is at, so the
+// lanes behind catch up with the ones ahead and the group closes up again
+// where their paths meet. Lanes whose code bytes differ at the PC, e.g.
+// after self-modifying code, wait and run as a group of their own.
+//
+// Pages 0 and 1 must be RAM. ROM pages are shared by all lanes. BRK, RTI,
+// PHP, PLP, JMP (ind), decimal ADC and SBC, undocumented opcodes, and
+// every access to a device page run a lane at a time through cpu_step on
+// a scratch machine, whose RAM pages are a device onto the lane's memory
+// and whose user pointer is the lane's. Devices must not remap pages.
+// Lanes have no events or interrupt lines.
+//
+// Build with -DCPU_NO_WIDE to leave the group out. On x86-64 Linux the run
+// loop is built both for AVX2 and for the baseline SSE2 and the loader
+// picks one.
+#if defined(__GNUC__) && !defined(CPU_NO_WIDE)
+#define CPU_WIDE 1
+#else
+#define CPU_WIDE 0
+#endif
+
+#if CPU_WIDE
+
+#ifndef WIDE_LANES
+#define WIDE_LANES 32 // bytes in an AVX2 register
+#endif
+#if WIDE_LANES < 8 || WIDE_LANES > 64 || (WIDE_LANES & (WIDE_LANES - 1))
+#error "WIDE_LANES must be a power of two from 8 to 64"
+#endif
+
+#if defined(__x86_64__) && defined(__linux__)
+#define WIDE_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define WIDE_CLONES
+#endif
+
+// Every vector has a byte per lane, PC included, so that masks from the
+// compares apply to any register as they are: converting between lane
+// widths costs a shuffle per lane without AVX-512. Masks are the result type
+// of vector compares, -1 in a lane that is set. GCC aligns vectors by what
+// the target can load, so the alignment is spelled out for the baseline and
+// AVX2 builds of wide_run to agree on it.
+#define WIDE_VEC __attribute__((vector_size(WIDE_LANES), aligned(WIDE_LANES)))
+typedef uint8_t wide_u8 WIDE_VEC;
+typedef int8_t wide_m8 WIDE_VEC;
+
+enum { WIDE_RAM, WIDE_ROM, WIDE_DEV };
+
+struct wide6502;
+
+// The scratch machine's view of one lane's memory.
+struct wide_lane_dev {
+  bus_device dev;
+  struct wide6502 *w;
+  unsigned lane;
+};
+
+struct wide6502 {
+  wide_u8 A, X, Y, SP, C, V, I, D, zres, nres;
+  wide_u8 PCL, PCH; // the PC's low and high bytes
+  uint64_t cycles[WIDE_LANES];
+  unsigned lanes;
+  int status[WIDE_LANES]; // how each lane's last wide_run ended
+  void *user[WIDE_LANES];
+  uint8_t kind[256]; // WIDE_RAM, WIDE_ROM or WIDE_DEV
+  const uint8_t *rom[256];
+  uint64_t devpages[4];
+  machine6502 *scratch;
+  struct wide_lane_dev lane_dev;
+  wide_u8 *mem; // mem[addr][lane]
+};
+
+// Lane i's byte at addr, e.g. to poke its inputs before a run.
+static inline uint8_t *wide_mem(struct wide6502 *w, unsigned i,
+                                uint16_t addr) {
+  return (uint8_t *)&w->mem[addr] + i;
+}
+
+static inline uint16_t wide_pc(const struct wide6502 *w, unsigned i) {
+  return w->PCL[i] | w->PCH[i] << 8;
+}
+
+static inline void wide_set_pc(struct wide6502 *w, unsigned i, uint16_t pc) {
+  w->PCL[i] = pc & 0xFF;
+  w->PCH[i] = pc >> 8;
+}
+
+static uint8_t wide_lane_read(bus_device *dev, machine6502 *m, uint16_t addr) {
+  struct wide_lane_dev *ld = (struct wide_lane_dev *)dev;
+  return *wide_mem(ld->w, ld->lane, addr);
+}
+
+static void wide_lane_write(bus_device *dev, machine6502 *m, uint16_t addr,
+                            uint8_t value) {
+  struct wide_lane_dev *ld = (struct wide_lane_dev *)dev;
+  *wide_mem(ld->w, ld->lane, addr) = value;
+}
+
+// Load lane i with m's registers, memory and user pointer. m must have the
+// page mapping the group was made with.
+void wide_put(struct wide6502 *w, unsigned i, const machine6502 *m) {
+  w->A[i] = m->cpu.A;
+  w->X[i] = m->cpu.X;
+  w->Y[i] = m->cpu.Y;
+  w->SP[i] = m->cpu.SP;
+  wide_set_pc(w, i, m->cpu.PC);
+  w->C[i] = m->cpu.P.C;
+  w->V[i] = m->cpu.P.V;
+  w->I[i] = m->cpu.P.I;
+  w->D[i] = m->cpu.P.D;
+  w->zres[i] = m->cpu.zres;
+  w->nres[i] = m->cpu.nres;
+  w->cycles[i] = m->cpu.cycles;
+  w->user[i] = m->user;
+  for (unsigned a = 0; a < 0x10000; a++)
+    *wide_mem(w, i, a) = m->memory[a];
+}
+
+// Copy lane i's registers and memory out to m, which must have the page
+// mapping the group was made with.
+void wide_get(struct wide6502 *w, unsigned i, machine6502 *m) {
+  m->cpu.A = w->A[i];
+  m->cpu.X = w->X[i];
+  m->cpu.Y = w->Y[i];
+  m->cpu.SP = w->SP[i];
+  m->cpu.PC = wide_pc(w, i);
+  m->cpu.P.C = w->C[i];
+  m->cpu.P.V = w->V[i];
+  m->cpu.P.I = w->I[i];
+  m->cpu.P.D = w->D[i];
+  m->cpu.P.B = 0;
+  m->cpu.P.U = 1;
+  m->cpu.zres = w->zres[i];
+  m->cpu.nres = w->nres[i];
+  m->cpu.cycles = w->cycles[i];
+  for (unsigned a = 0; a < 0x10000; a++)
+    m->memory[a] = *wide_mem(w, i, a);
+  mem_changed(m, 0x00, 256);
+}
+
+void wide_free(struct wide6502 *w) {
+  if (w) {
+    machine_free(w->scratch);
+    free(w->mem);
+  }
+  free(w);
+}
+
+// A group of `lanes` copies of proto, which must have RAM at pages 0 and 1.
+// Returns NULL if it does not, or if out of memory.
+struct wide6502 *wide_new(const machine6502 *proto, unsigned lanes) {
+  if (lanes < 1 || lanes > WIDE_LANES)
+    return NULL;
+  for (unsigned p = 0; p < 2; p++)
+    if (proto->rd[p] != &proto->memory[p << 8])
+      return NULL;
+
+  struct wide6502 *w =
+      aligned_alloc(_Alignof(struct wide6502), sizeof(struct wide6502));
+  if (!w)
+    return NULL;
+  memset(w, 0, sizeof(*w));
+  w->lanes = lanes;
+  w->mem = aligned_alloc(64, 0x10000 * sizeof(wide_u8));
+  w->scratch = machine_new();
+  if (!w->mem || !w->scratch) {
+    wide_free(w);
+    return NULL;
+  }
+  memset(w->mem, 0, 0x10000 * sizeof(wide_u8));
+
+  w->lane_dev = (struct wide_lane_dev){{wide_lane_read, wide_lane_write}, w};
+  for (unsigned p = 0; p < 256; p++) {
+    if (proto->rd[p] == &proto->memory[p << 8]) {
+      w->kind[p] = WIDE_RAM;
+      bus_map_device(w->scratch, p, 1, &w->lane_dev.dev);
+    } else if (proto->dev[p] == &rom_device) {
+      w->kind[p] = WIDE_ROM;
+      w->rom[p] = proto->rd[p];
+      bus_map_rom(w->scratch, p, 1, proto->rd[p]);
+    } else {
+      w->kind[p] = WIDE_DEV;
+      w->devpages[p >> 6] |= 1ull << (p & 63);
+      bus_map_device(w->scratch, p, 1, proto->dev[p]);
+    }
+  }
+  for (unsigned i = 0; i < lanes; i++)
+    wide_put(w, i, proto);
+  return w;
+}
+
+// Move lane i's bytes under device pages into the scratch machine's
+// memory[], where device callbacks look for them, or back.
+static void wide_swap_dev(struct wide6502 *w, unsigned i, int in) {
+  uint8_t *memory = w->scratch->memory;
+  for (int k = 0; k < 4; k++)
+    for (uint64_t bits = w->devpages[k]; bits; bits &= bits - 1) {
+      unsigned base = (k * 64 + __builtin_ctzll(bits)) << 8;
+      for (unsigned a = base; a < base + 256; a++) {
+        if (in)
+          memory[a] = *wide_mem(w, i, a);
+        else
+          *wide_mem(w, i, a) = memory[a];
+      }
+    }
+}
+
+// Run lane i's next instruction with cpu_step on the scratch machine.
+static uint8_t wide_step_lane(struct wide6502 *w, unsigned i) {
+  machine6502 *s = w->scratch;
+  s->cpu.A = w->A[i];
+  s->cpu.X = w->X[i];
+  s->cpu.Y = w->Y[i];
+  s->cpu.SP = w->SP[i];
+  s->cpu.PC = wide_pc(w, i);
+  s->cpu.P.C = w->C[i];
+  s->cpu.P.V = w->V[i];
+  s->cpu.P.I = w->I[i];
+  s->cpu.P.D = w->D[i];
+  s->cpu.zres = w->zres[i];
+  s->cpu.nres = w->nres[i];
+  s->cpu.cycles = w->cycles[i];
+  s->user = w->user[i];
+  w->lane_dev.lane = i;
+
+  wide_swap_dev(w, i, 1);
+  uint8_t op = cpu_step(s);
+  wide_swap_dev(w, i, 0);
+
+  w->A[i] = s->cpu.A;
+  w->X[i] = s->cpu.X;
+  w->Y[i] = s->cpu.Y;
+  w->SP[i] = s->cpu.SP;
+  wide_set_pc(w, i, s->cpu.PC);
+  w->C[i] = s->cpu.P.C;
+  w->V[i] = s->cpu.P.V;
+  w->I[i] = s->cpu.P.I;
+  w->D[i] = s->cpu.P.D;
+  w->zres[i] = s->cpu.zres;
+  w->nres[i] = s->cpu.nres;
+  w->cycles[i] = s->cpu.cycles;
+  return op;
+}
+
+// The byte at a in lane i, which must not be on a device page.
+static inline uint8_t wide_code(struct wide6502 *w, unsigned i, uint16_t a) {
+  if (w->kind[a >> 8] == WIDE_ROM)
+    return w->rom[a >> 8][a & 0xFF];
+  return *wide_mem(w, i, a);
+}
+
+// wide_run counts cycles in a byte per lane and adds them to cycles[] every
+// WIDE_FLUSH steps at most; no step takes more than WIDE_STEP_MAX cycles.
+#define WIDE_STEP_MAX 9
+#define WIDE_FLUSH (255 / WIDE_STEP_MAX)
+
+// Helpers for wide_run, as macros so that no vector is passed by value: the
+// baseline ABI has no registers for them. They work on the group w, the
+// lanes k running the instruction and the lanes ks left for cpu_step. An
+// effective address is two vectors, its low and high bytes. Single lanes
+// are only read or written through a copy in an array: indexing a vector
+// variable keeps it in memory for the whole of wide_run.
+#define W_SEL(k, a, b)                                                         \
+  ({                                                                           \
+    wide_u8 sel_ = (wide_u8)(k);                                               \
+    ((a) & sel_) | ((b) & ~sel_);                                              \
+  })
+#define W_ARRAY(name, v)                                                       \
+  uint8_t name[WIDE_LANES];                                                    \
+  do {                                                                         \
+    wide_u8 t_ = (wide_u8)(v);                                                 \
+    memcpy(name, &t_, sizeof(t_));                                             \
+  } while (0)
+#if defined(__SSE2__) && WIDE_LANES >= 16
+typedef char wide_c16 __attribute__((vector_size(16)));
+// Lane i of mask k as bit i, with a pmovmskb per 16 lanes.
+#define W_BITS(k)                                                              \
+  ({                                                                           \
+    wide_m8 b_ = (k);                                                          \
+    uint64_t bits_ = 0;                                                        \
+    for (int j_ = 0; j_ < WIDE_LANES / 16; j_++) {                             \
+      wide_c16 h_;                                                             \
+      memcpy(&h_, (char *)&b_ + 16 * j_, 16);                                  \
+      bits_ |= (uint64_t)(uint16_t)__builtin_ia32_pmovmskb128(h_) << 16 * j_;  \
+    }                                                                          \
+    bits_;                                                                     \
+  })
+#else
+// Lane i of mask k as bit i: each 64-bit word of k has eight 0x00 or 0xFF
+// bytes, and the multiply gathers their top bits into its top byte.
+#define W_BITS(k)                                                              \
+  ({                                                                           \
+    wide_m8 b_ = (k);                                                          \
+    uint64_t q_[WIDE_LANES / 8], bits_ = 0;                                    \
+    memcpy(q_, &b_, sizeof(b_));                                               \
+    for (int j_ = 0; j_ < WIDE_LANES / 8; j_++)                                \
+      bits_ |= ((q_[j_] & 0x8080808080808080ull) * 0x0002040810204081ull) >>  \
+               56 << (8 * j_);                                                 \
+    bits_;                                                                     \
+  })
+#endif
+// The mask with lane i set for each bit i of bits.
+#define W_MASK(bits)                                                           \
+  ({                                                                           \
+    uint64_t mb_ = (bits);                                                     \
+    int8_t m_[WIDE_LANES];                                                     \
+    wide_m8 r_;                                                                \
+    for (unsigned i_ = 0; i_ < WIDE_LANES; i_++)                               \
+      m_[i_] = -(int8_t)(mb_ >> i_ & 1);                                       \
+    memcpy(&r_, m_, sizeof(r_));                                               \
+    r_;                                                                        \
+  })
+#define W_ANY(k) (W_BITS(k) != 0)
+// The lowest lane set in bits, or the last lane if there is none.
+#define W_LOWEST(bits)                                                         \
+  ((unsigned)__builtin_ctzll((bits) | 1ull << (WIDE_LANES - 1)))
+
+// Zero page and stack accesses: both pages are RAM in every lane.
+#define W_RD_RAM(page, lo)                                                     \
+  ({                                                                           \
+    W_ARRAY(l_, lo);                                                           \
+    uint8_t a0_ = l_[W_LOWEST(W_BITS(k))];                                     \
+    wide_u8 v_;                                                                \
+    if (!W_ANY(k & ((lo) != a0_))) {                                           \
+      v_ = w->mem[(page) << 8 | a0_];                                          \
+    } else {                                                                   \
+      uint8_t val_[WIDE_LANES];                                                \
+      for (unsigned i_ = 0; i_ < WIDE_LANES; i_++)                             \
+        val_[i_] = *wide_mem(w, i_, (page) << 8 | l_[i_]);                     \
+      memcpy(&v_, val_, sizeof(v_));                                           \
+    }                                                                          \
+    v_;                                                                        \
+  })
+#define W_WR_RAM(page, lo, v)                                                  \
+  do {                                                                         \
+    W_ARRAY(l_, lo);                                                           \
+    uint64_t bits_ = W_BITS(k);                                                \
+    uint8_t a0_ = l_[W_LOWEST(bits_)];                                         \
+    wide_u8 v_ = (v);                                                          \
+    if (!W_ANY(k & ((lo) != a0_))) {                                           \
+      w->mem[(page) << 8 | a0_] = W_SEL(k, v_, w->mem[(page) << 8 | a0_]);     \
+    } else {                                                                   \
+      W_ARRAY(val_, v_);                                                       \
+      for (; bits_; bits_ &= bits_ - 1) {                                      \
+        unsigned i_ = __builtin_ctzll(bits_);                                  \
+        *wide_mem(w, i_, (page) << 8 | l_[i_]) = val_[i_];                     \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+// Read lo/hi in the lanes of k. Lanes whose address is on a device page
+// move from k to ks, to run the instruction through wide_step_lane.
+#define W_RD(lo, hi)                                                           \
+  ({                                                                           \
+    W_ARRAY(lo_, lo);                                                          \
+    W_ARRAY(hi_, hi);                                                          \
+    uint64_t bits_ = W_BITS(k);                                                \
+    unsigned f_ = W_LOWEST(bits_);                                             \
+    uint16_t a0_ = lo_[f_] | hi_[f_] << 8;                                     \
+    wide_u8 v_ = {};                                                           \
+    if (!W_ANY(k & ~(((lo) == lo_[f_]) & ((hi) == hi_[f_])))) {                \
+      if (w->kind[a0_ >> 8] == WIDE_RAM) {                                     \
+        v_ = w->mem[a0_];                                                      \
+      } else if (w->kind[a0_ >> 8] == WIDE_ROM) {                              \
+        v_ += w->rom[a0_ >> 8][a0_ & 0xFF];                                    \
+      } else {                                                                 \
+        ks |= k;                                                               \
+        k = (wide_m8){};                                                       \
+      }                                                                        \
+    } else {                                                                   \
+      uint8_t val_[WIDE_LANES] = {0};                                          \
+      uint64_t dev_ = 0;                                                       \
+      for (; bits_; bits_ &= bits_ - 1) {                                      \
+        unsigned i_ = __builtin_ctzll(bits_);                                  \
+        uint16_t a_ = lo_[i_] | hi_[i_] << 8;                                  \
+        if (w->kind[a_ >> 8] == WIDE_RAM)                                      \
+          val_[i_] = *wide_mem(w, i_, a_);                                     \
+        else if (w->kind[a_ >> 8] == WIDE_ROM)                                 \
+          val_[i_] = w->rom[a_ >> 8][a_ & 0xFF];                               \
+        else                                                                   \
+          dev_ |= 1ull << i_;                                                  \
+      }                                                                        \
+      memcpy(&v_, val_, sizeof(v_));                                           \
+      if (dev_) {                                                              \
+        wide_m8 d_ = W_MASK(dev_);                                             \
+        ks |= d_;                                                              \
+        k &= ~d_;                                                              \
+      }                                                                        \
+    }                                                                          \
+    v_;                                                                        \
+  })
+// Write v to lo/hi in the lanes of k. ROM drops the write, and lanes whose
+// address is on a device page move from k to ks.
+#define W_WR(lo, hi, v)                                                        \
+  do {                                                                         \
+    W_ARRAY(lo_, lo);                                                          \
+    W_ARRAY(hi_, hi);                                                          \
+    uint64_t bits_ = W_BITS(k);                                                \
+    unsigned f_ = W_LOWEST(bits_);                                             \
+    uint16_t a0_ = lo_[f_] | hi_[f_] << 8;                                     \
+    wide_u8 v_ = (v);                                                          \
+    if (!W_ANY(k & ~(((lo) == lo_[f_]) & ((hi) == hi_[f_])))) {                \
+      if (w->kind[a0_ >> 8] == WIDE_RAM) {                                     \
+        w->mem[a0_] = W_SEL(k, v_, w->mem[a0_]);                               \
+      } else if (w->kind[a0_ >> 8] == WIDE_DEV) {                              \
+        ks |= k;                                                               \
+        k = (wide_m8){};                                                       \
+      }                                                                        \
+    } else {                                                                   \
+      W_ARRAY(val_, v_);                                                       \
+      uint64_t dev_ = 0;                                                       \
+      for (; bits_; bits_ &= bits_ - 1) {                                      \
+        unsigned i_ = __builtin_ctzll(bits_);                                  \
+        uint16_t a_ = lo_[i_] | hi_[i_] << 8;                                  \
+        if (w->kind[a_ >> 8] == WIDE_RAM)                                      \
+          *wide_mem(w, i_, a_) = val_[i_];                                     \
+        else if (w->kind[a_ >> 8] == WIDE_DEV)                                 \
+          dev_ |= 1ull << i_;                                                  \
+      }                                                                        \
+      if (dev_) {                                                              \
+        wide_m8 d_ = W_MASK(dev_);                                             \
+        ks |= d_;                                                              \
+        k &= ~d_;                                                              \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+#define W_FLUSH()                                                              \
+  do {                                                                         \
+    W_ARRAY(s_, spent);                                                        \
+    for (unsigned i_ = 0; i_ < WIDE_LANES; i_++)                               \
+      w->cycles[i_] += s_[i_];                                                 \
+    spent = (wide_u8){};                                                       \
+  } while (0)
+
+// Column layouts as in T_R8: the eight read modes of ORA, AND, EOR, ADC,
+// LDA, CMP and SBC by their imm opcode, and the four read-modify-write
+// modes by the zp one.
+#define W_R8(op)                                                               \
+  case op:                                                                     \
+  case op - 0x04:                                                              \
+  case op + 0x0C:                                                              \
+  case op + 0x04:                                                              \
+  case op + 0x14:                                                              \
+  case op + 0x10:                                                              \
+  case op - 0x08:                                                              \
+  case op + 0x08
+#define W_RMW4(op)                                                             \
+  case op:                                                                     \
+  case op + 0x10:                                                              \
+  case op + 0x08:                                                              \
+  case op + 0x18
+
+// Operand of a read instruction; indexed reads that cross a page pay a
+// cycle.
+#define W_M()                                                                  \
+  ({                                                                           \
+    add += pen;                                                                \
+    o->mode == IMM ? (wide_u8){} + b1 : W_RD(eal, eah);                        \
+  })
+#define W_NZ(v)                                                                \
+  do {                                                                         \
+    w->zres = W_SEL(k, (v), w->zres);                                          \
+    w->nres = W_SEL(k, (v), w->nres);                                          \
+  } while (0)
+#define W_SET(reg, v) (w->reg = W_SEL(k, (v), w->reg))
+#define W_LOAD(reg)                                                            \
+  do {                                                                         \
+    wide_u8 M = W_M();                                                         \
+    W_SET(reg, M);                                                             \
+    W_NZ(M);                                                                   \
+  } while (0)
+#define W_LOGIC(op)                                                            \
+  do {                                                                         \
+    wide_u8 r = w->A op W_M();                                                 \
+    W_SET(A, r);                                                               \
+    W_NZ(r);                                                                   \
+  } while (0)
+#define W_CMP(reg)                                                             \
+  do {                                                                         \
+    wide_u8 M = W_M();                                                         \
+    W_SET(C, (wide_u8)(w->reg >= M) & 1);                                      \
+    W_NZ((wide_u8)(w->reg - M));                                               \
+  } while (0)
+// Binary ADC; SBC is ADC of the operand's complement.
+#define W_ADD(M)                                                               \
+  do {                                                                         \
+    wide_u8 m_ = (M), a_ = w->A, s_ = a_ + m_ + w->C;                          \
+    W_SET(C, ((a_ & m_) | ((a_ | m_) & ~s_)) >> 7);                            \
+    W_SET(V, (~(a_ ^ m_) & (a_ ^ s_)) >> 7);                                   \
+    W_SET(A, s_);                                                              \
+    W_NZ(s_);                                                                  \
+  } while (0)
+#define W_RMW(body)                                                            \
+  do {                                                                         \
+    wide_u8 v = W_RD(eal, eah);                                                \
+    body;                                                                      \
+    W_WR(eal, eah, v);                                                         \
+    W_NZ(v);                                                                   \
+  } while (0)
+#define W_ASL(v) (W_SET(C, (v) >> 7), (v) <<= 1)
+#define W_LSR(v) (W_SET(C, (v) & 1), (v) >>= 1)
+#define W_ROL(v)                                                               \
+  ({                                                                           \
+    wide_u8 in_ = w->C;                                                        \
+    W_SET(C, (v) >> 7);                                                        \
+    (v) = (v) << 1 | in_;                                                      \
+  })
+#define W_ROR(v)                                                               \
+  ({                                                                           \
+    wide_u8 in_ = w->C;                                                        \
+    W_SET(C, (v) & 1);                                                         \
+    (v) = (v) >> 1 | in_ << 7;                                                 \
+  })
+#define W_ACC(shift)                                                           \
+  do {                                                                         \
+    wide_u8 v = w->A;                                                          \
+    shift(v);                                                                  \
+    W_SET(A, v);                                                               \
+    W_NZ(v);                                                                   \
+  } while (0)
+// Every lane in k goes on to target, and so does the lead lane: next.
+#define W_JUMP(target)                                                         \
+  do {                                                                         \
+    next = (target);                                                           \
+    npcl = (wide_u8){} + (uint8_t)next;                                        \
+    npch = (wide_u8){} + (uint8_t)(next >> 8);                                 \
+  } while (0)
+#define W_BRANCH(cond)                                                         \
+  do {                                                                         \
+    uint16_t target = pc + 2 + (int8_t)b1;                                     \
+    wide_u8 taken = (wide_u8)(k & (cond));                                     \
+    npcl = W_SEL(taken, (wide_u8){} + (uint8_t)target, npcl);                  \
+    npch = W_SEL(taken, (wide_u8){} + (uint8_t)(target >> 8), npch);           \
+    add += taken & (uint8_t)(1 + (((target ^ (pc + 2)) & 0xFF00) != 0));       \
+    if (W_BITS((wide_m8)taken) >> lead & 1)                                    \
+      next = target;                                                           \
+  } while (0)
+#define W_PUSH(v)                                                              \
+  do {                                                                         \
+    W_WR_RAM(1, w->SP, (v));                                                   \
+    W_SET(SP, w->SP - 1);                                                      \
+  } while (0)
+#define W_PULL()                                                               \
+  ({                                                                           \
+    W_SET(SP, w->SP + 1);                                                      \
+    W_RD_RAM(1, w->SP);                                                        \
+  })
+#define W_TRANSFER(dst, src)                                                   \
+  do {                                                                         \
+    wide_u8 v = w->src;                                                        \
+    W_SET(dst, v);                                                             \
+    W_NZ(v);                                                                   \
+  } while (0)
+
+// Run every lane until it executes a BRK or its cycle count reaches
+// deadline, and set its status to RUN_BRK or RUN_BUDGET. As in
+// run_cpu_until, a lane may overshoot the deadline by a few cycles.
+WIDE_CLONES void wide_run(struct wide6502 *w, uint64_t deadline) {
+  wide_m8 live = W_MASK(~0ull >> (64 - w->lanes));
+  wide_u8 spent = {};
+  unsigned steps = 0;
+  for (unsigned i = 0; i < w->lanes; i++)
+    w->status[i] = RUN_BUDGET;
+  uint16_t pc = wide_pc(w, 0);
+
+  for (;;) {
+    // Bring cycles[] up to date, drop the lanes at the deadline and work
+    // out how many steps the rest can surely take before one reaches it.
+    if (steps == 0) {
+      W_FLUSH();
+      uint64_t room = UINT64_MAX, done = 0;
+      for (uint64_t bits = W_BITS(live); bits; bits &= bits - 1) {
+        unsigned i = __builtin_ctzll(bits);
+        if (w->cycles[i] >= deadline)
+          done |= 1ull << i;
+        else if (deadline - w->cycles[i] < room)
+          room = deadline - w->cycles[i];
+      }
+      live &= ~W_MASK(done);
+      steps = room / WIDE_STEP_MAX;
+      steps = steps < 1 ? 1 : steps > WIDE_FLUSH ? WIDE_FLUSH : steps;
+    }
+    steps--;
+
+    // Stay with the lanes at the PC the last group went to if that is all
+    // of them; otherwise regroup at the lowest PC.
+    wide_m8 k = live & (w->PCL == (uint8_t)pc) & (w->PCH == (uint8_t)(pc >> 8));
+    if (W_ANY(live & ~k)) {
+      pc = 0xFFFF;
+      for (uint64_t bits = W_BITS(live); bits; bits &= bits - 1) {
+        uint16_t p = wide_pc(w, __builtin_ctzll(bits));
+        pc = p < pc ? p : pc;
+      }
+      k = live & (w->PCL == (uint8_t)pc) & (w->PCH == (uint8_t)(pc >> 8));
+    }
+    if (!W_ANY(k)) {
+      W_FLUSH();
+      return;
+    }
+
+    // ks gathers the lanes that run this instruction through cpu_step.
+    wide_m8 ks = {};
+    unsigned lead = W_LOWEST(W_BITS(k));
+    uint8_t op = 0, b1 = 0, b2 = 0;
+    const struct opcode *o = NULL;
+    unsigned len = 1;
+    if (w->kind[pc >> 8] == WIDE_DEV)
+      goto scalar;
+    op = wide_code(w, lead, pc);
+    o = &op_table[op];
+    if (!o->exec)
+      goto scalar;
+    len = mode_len[o->mode];
+    for (unsigned j = 0; j < len; j++) {
+      uint16_t a = pc + j;
+      if (w->kind[a >> 8] == WIDE_DEV)
+        goto scalar;
+      if (w->kind[a >> 8] == WIDE_RAM)
+        k &= (w->mem[a] == *wide_mem(w, lead, a));
+    }
+    if (len > 1)
+      b1 = wide_code(w, lead, pc + 1);
+    if (len > 2)
+      b2 = wide_code(w, lead, pc + 2);
+
+    uint16_t opnd = b1 | b2 << 8;
+    wide_u8 eal = {}, eah = {}, pen = {};
+    switch (o->mode) {
+    case ZP:
+      eal += b1;
+      break;
+    case ZPX:
+      eal = w->X + b1;
+      break;
+    case ZPY:
+      eal = w->Y + b1;
+      break;
+    case ABS:
+      eal += b1;
+      eah += b2;
+      break;
+    case ABX:
+    case ABY: {
+      wide_u8 r = o->mode == ABX ? w->X : w->Y;
+      eal = r + b1;
+      pen = (wide_u8)(eal < r) & 1;
+      eah = b2 + pen;
+      break;
+    }
+    case IZX: {
+      wide_u8 p = w->X + b1;
+      eal = W_RD_RAM(0, p);
+      eah = W_RD_RAM(0, p + 1);
+      break;
+    }
+    case IZY:
+      eal = w->mem[b1] + w->Y;
+      pen = (wide_u8)(eal < w->Y) & 1;
+      eah = w->mem[(uint8_t)(b1 + 1)] + pen;
+      break;
+    }
+
+    wide_u8 npcl, npch;
+    uint16_t next;
+    W_JUMP((uint16_t)(pc + len));
+    wide_u8 add = (wide_u8){} + op_cycles[op];
+    switch (op) {
+    W_R8(0x09):
+      W_LOGIC(|);
+      break;
+    W_R8(0x29):
+      W_LOGIC(&);
+      break;
+    W_R8(0x49):
+      W_LOGIC(^);
+      break;
+    W_R8(0x69):
+      if (W_ANY(k & (w->D != 0)))
+        goto scalar;
+      W_ADD(W_M());
+      break;
+    W_R8(0xE9):
+      if (W_ANY(k & (w->D != 0)))
+        goto scalar;
+      W_ADD(~W_M());
+      break;
+    W_R8(0xA9):
+      W_LOAD(A);
+      break;
+    W_R8(0xC9):
+      W_CMP(A);
+      break;
+    case 0xE0: case 0xE4: case 0xEC:
+      W_CMP(X);
+      break;
+    case 0xC0: case 0xC4: case 0xCC:
+      W_CMP(Y);
+      break;
+    case 0xA2: case 0xA6: case 0xB6: case 0xAE: case 0xBE:
+      W_LOAD(X);
+      break;
+    case 0xA0: case 0xA4: case 0xB4: case 0xAC: case 0xBC:
+      W_LOAD(Y);
+      break;
+    case 0x24: case 0x2C: {
+      wide_u8 M = W_M();
+      w->zres = W_SEL(k, w->A & M, w->zres);
+      W_SET(V, (M >> 6) & 1);
+      W_SET(nres, M);
+      break;
+    }
+
+    case 0x85: case 0x95: case 0x8D: case 0x9D: case 0x99: case 0x81:
+    case 0x91:
+      W_WR(eal, eah, w->A);
+      break;
+    case 0x86: case 0x96: case 0x8E:
+      W_WR(eal, eah, w->X);
+      break;
+    case 0x84: case 0x94: case 0x8C:
+      W_WR(eal, eah, w->Y);
+      break;
+
+    W_RMW4(0x06):
+      W_RMW(W_ASL(v));
+      break;
+    W_RMW4(0x46):
+      W_RMW(W_LSR(v));
+      break;
+    W_RMW4(0x26):
+      W_RMW(W_ROL(v));
+      break;
+    W_RMW4(0x66):
+      W_RMW(W_ROR(v));
+      break;
+    W_RMW4(0xE6):
+      W_RMW(v += 1);
+      break;
+    W_RMW4(0xC6):
+      W_RMW(v -= 1);
+      break;
+    case 0x0A:
+      W_ACC(W_ASL);
+      break;
+    case 0x4A:
+      W_ACC(W_LSR);
+      break;
+    case 0x2A:
+      W_ACC(W_ROL);
+      break;
+    case 0x6A:
+      W_ACC(W_ROR);
+      break;
+
+    case 0x10:
+      W_BRANCH(~(wide_m8)w->nres < 0);
+      break;
+    case 0x30:
+      W_BRANCH((wide_m8)w->nres < 0);
+      break;
+    case 0x50:
+      W_BRANCH(w->V == 0);
+      break;
+    case 0x70:
+      W_BRANCH(w->V != 0);
+      break;
+    case 0x90:
+      W_BRANCH(w->C == 0);
+      break;
+    case 0xB0:
+      W_BRANCH(w->C != 0);
+      break;
+    case 0xD0:
+      W_BRANCH(w->zres != 0);
+      break;
+    case 0xF0:
+      W_BRANCH(w->zres == 0);
+      break;
+
+    case 0x4C:
+      W_JUMP(opnd);
+      break;
+    case 0x20: {
+      uint16_t ret = pc + 2;
+      W_PUSH((wide_u8){} + (uint8_t)(ret >> 8));
+      W_PUSH((wide_u8){} + (uint8_t)ret);
+      W_JUMP(opnd);
+      break;
+    }
+    case 0x60: {
+      wide_u8 lo = W_PULL();
+      wide_u8 hi = W_PULL();
+      npcl = lo + 1;
+      npch = hi - (wide_u8)(npcl == 0);
+      W_ARRAY(nl_, npcl);
+      W_ARRAY(nh_, npch);
+      next = nl_[lead] | nh_[lead] << 8;
+      break;
+    }
+    case 0x48:
+      W_PUSH(w->A);
+      break;
+    case 0x68: {
+      wide_u8 v = W_PULL();
+      W_SET(A, v);
+      W_NZ(v);
+      break;
+    }
+
+    case 0x18:
+      W_SET(C, (wide_u8){});
+      break;
+    case 0x38:
+      W_SET(C, (wide_u8){} + 1);
+      break;
+    case 0x58:
+      W_SET(I, (wide_u8){});
+      break;
+    case 0x78:
+      W_SET(I, (wide_u8){} + 1);
+      break;
+    case 0xB8:
+      W_SET(V, (wide_u8){});
+      break;
+    case 0xD8:
+      W_SET(D, (wide_u8){});
+      break;
+    case 0xF8:
+      W_SET(D, (wide_u8){} + 1);
+      break;
+
+    case 0xAA:
+      W_TRANSFER(X, A);
+      break;
+    case 0xA8:
+      W_TRANSFER(Y, A);
+      break;
+    case 0xBA:
+      W_TRANSFER(X, SP);
+      break;
+    case 0x8A:
+      W_TRANSFER(A, X);
+      break;
+    case 0x98:
+      W_TRANSFER(A, Y);
+      break;
+    case 0x9A:
+      W_SET(SP, w->X);
+      break;
+    case 0xE8:
+      W_TRANSFER(X, X + 1);
+      break;
+    case 0xC8:
+      W_TRANSFER(Y, Y + 1);
+      break;
+    case 0xCA:
+      W_TRANSFER(X, X - 1);
+      break;
+    case 0x88:
+      W_TRANSFER(Y, Y - 1);
+      break;
+    case 0xEA:
+      break;
+
+    default:
+      goto scalar;
+    }
+
+    w->PCL = W_SEL(k, npcl, w->PCL);
+    w->PCH = W_SEL(k, npch, w->PCH);
+    spent += add & (wide_u8)k;
+    if (0) {
+    scalar:
+      ks |= k;
+      k = (wide_m8){};
+    }
+
+    // The next step starts at the lead lane's new PC, as a scalar unless
+    // the lane went through cpu_step: reading it back from PCL and PCH
+    // would wait on the vector store.
+    uint64_t brk = 0, sbits = W_BITS(ks);
+    for (uint64_t bits = sbits; bits; bits &= bits - 1) {
+      unsigned i = __builtin_ctzll(bits);
+      if (wide_step_lane(w, i) == 0x00) {
+        w->status[i] = RUN_BRK;
+        brk |= 1ull << i;
+      }
+    }
+    if (brk)
+      live &= ~W_MASK(brk);
+    pc = sbits ? wide_pc(w, lead) : next;
+  }
+}
+
+#undef W_SEL
+#undef W_ARRAY
+#undef W_BITS
+#undef W_MASK
+#undef W_ANY
+#undef W_LOWEST
+#undef W_RD_RAM
+#undef W_WR_RAM
+#undef W_RD
+#undef W_WR
+#undef W_R8
+#undef W_RMW4
+#undef W_M
+#undef W_NZ
+#undef W_SET
+#undef W_LOAD
+#undef W_LOGIC
+#undef W_CMP
+#undef W_ADD
+#undef W_RMW
+#undef W_ASL
+#undef W_LSR
+#undef W_ROL
+#undef W_ROR
+#undef W_ACC
+#undef W_JUMP
+#undef W_BRANCH
+#undef W_PUSH
+#undef W_PULL
+#undef W_TRANSFER
+#undef W_FLUSH
+
+#endif
+
+/* --------------------------------------------------------- */
+/* Profiler                                                   */
+/* --------------------------------------------------------- */
+
+// profile_run runs a machine one cpu_step at a time and counts what every
+// instruction costs, by PC and by opcode, in flat 64K arrays. Cycles are
+// measured around the step, so page crossings and taken branches are
+// charged where they happen.
+//
+// Time is also charged to call frames. A JSR opens a frame for its target
+// under the current one, and the frame closes once the stack unwinds past
+// the return address JSR_c pushed: normally at the matching RTS, but also
+// when code drops the address with PLA or resets SP. Frames form a call
+// tree whose root is the PC the first run started at; each node keeps the
+// cycles spent in it outside its callees.
+struct profile_node {
+  uint16_t entry;               // JSR target, or the root's start PC
+  uint32_t parent, child, next; // child and next are 0 for none
+  uint64_t calls, cycles;
+};
+
+struct profile_frame {
+  uint32_t node;
+  unsigned sp; // SP before the JSR; the frame is gone once SP is back here
+};
+
+struct profile {
+  uint64_t pc_insns[0x10000];
+  uint64_t pc_cycles[0x10000];
+  uint8_t pc_op[0x10000]; // last opcode run at each PC
+  uint64_t op_insns[256];
+  uint64_t op_spent[256];
+
+  struct profile_node *nodes;
+  uint32_t nnodes, cap;
+  int depth;
+  struct profile_frame frames[256];
+};
+
+struct profile *profile_new(void) { return calloc(1, sizeof(struct profile)); }
+
+void profile_free(struct profile *p) {
+  if (p)
+    free(p->nodes);
+  free(p);
+}
+
+static uint32_t profile_node_new(struct profile *p, uint32_t parent,
+                                 uint16_t entry) {
+  if (p->nnodes == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 256;
+    p->nodes = realloc(p->nodes, p->cap * sizeof(struct profile_node));
+  }
+  uint32_t n = p->nnodes++;
+  p->nodes[n] = (struct profile_node){entry, parent, 0, 0, 0, 0};
+  if (n) {
+    p->nodes[n].next = p->nodes[parent].child;
+    p->nodes[parent].child = n;
+  }
+  return n;
+}
+
+// Close the frames the stack has unwound past.
+static void profile_unwind(struct profile *p, unsigned sp) {
+  while (p->depth > 1 && p->frames[p->depth - 1].sp <= sp)
+    p->depth--;
+}
+
+static void profile_call(struct profile *p, unsigned sp, uint16_t entry) {
+  profile_unwind(p, sp);
+  if (p->depth == 256)
+    return; // keep charging the caller
+  uint32_t parent = p->frames[p->depth - 1].node, n;
+  for (n = p->nodes[parent].child; n; n = p->nodes[n].next)
+    if (p->nodes[n].entry == entry)
+      break;
+  if (!n)
+    n = profile_node_new(p, parent, entry);
+  p->nodes[n].calls++;
+  p->frames[p->depth++] = (struct profile_frame){n, sp};
+}
+
+// Like run_cpu_until, but counting every instruction into p. A profile may
+// gather several runs, of one machine or of several.
+int profile_run(machine6502 *m, struct profile *p, uint64_t deadline) {
+  if (!p->nnodes) {
+    profile_node_new(p, 0, m->cpu.PC);
+    p->nodes[0].calls = 1;
+    p->frames[0] = (struct profile_frame){0, 0x100};
+    p->depth = 1;
+  }
+
+  while (m->cpu.cycles < deadline) {
+    if (m->cpu.cycles >= m->wake) {
+      events_run(m);
+      continue;
+    }
+    uint16_t pc = m->cpu.PC;
+    uint8_t sp = m->cpu.SP;
+    uint64_t start = m->cpu.cycles;
+    uint8_t op = cpu_step(m);
+    uint64_t spent = m->cpu.cycles - start;
+
+    p->pc_insns[pc]++;
+    p->pc_cycles[pc] += spent;
+    p->pc_op[pc] = op;
+    p->op_insns[op]++;
+    p->op_spent[op] += spent;
+    // JSR is the caller's and RTS the callee's.
+    p->nodes[p->frames[p->depth - 1].node].cycles += spent;
+
+    if (op == 0x20)
+      profile_call(p, sp, m->cpu.PC);
+    else if (op == 0x60)
+      profile_unwind(p, m->cpu.SP);
+    else if (op == 0x00)
+      return RUN_BRK;
+  }
+  return RUN_BUDGET;
+}
+
+struct profile_row {
+  uint64_t cycles, insns, calls, total;
+  unsigned key;
+};
+
+static int profile_row_cmp(const void *a, const void *b) {
+  const struct profile_row *x = a, *y = b;
+  if (x->cycles != y->cycles)
+    return x->cycles < y->cycles ? 1 : -1;
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static double profile_pct(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+// Write the hot spots of p to out, most cycles first: the top PCs, every
+// opcode run, and the top call frames by their own cycles, with the cycles
+// spent under them. top limits the PCs and frames listed, 0 for all.
+void profile_report(const struct profile *p, FILE *out, int top) {
+  uint64_t cycles = 0, insns = 0;
+  for (int op = 0; op < 256; op++) {
+    cycles += p->op_spent[op];
+    insns += p->op_insns[op];
+  }
+  fprintf(out, "%llu instructions, %llu cycles\n",
+          (unsigned long long)insns, (unsigned long long)cycles);
+
+  struct profile_row *rows = malloc(0x10000 * sizeof(struct profile_row));
+  int n = 0;
+  for (unsigned pc = 0; pc < 0x10000; pc++)
+    if (p->pc_insns[pc])
+      rows[n++] = (struct profile_row){p->pc_cycles[pc], p->pc_insns[pc], 0,
+                                       0, pc};
+  qsort(rows, n, sizeof(*rows), profile_row_cmp);
+  fprintf(out, "\n%-6s %-4s %14s %7s %14s\n", "pc", "op", "cycles", "%",
+          "insns");
+  for (int i = 0; i < n && (!top || i < top); i++) {
+    const char *name = op_table[p->pc_op[rows[i].key]].name;
+    fprintf(out, "$%04X  %-4s %14llu %6.2f%% %14llu\n", rows[i].key,
+            name ? name : "???", (unsigned long long)rows[i].cycles,
+            profile_pct(rows[i].cycles, cycles),
+            (unsigned long long)rows[i].insns);
+  }
+
+  n = 0;
+  for (unsigned op = 0; op < 256; op++)
+    if (p->op_insns[op])
+      rows[n++] = (struct profile_row){p->op_spent[op], p->op_insns[op], 0, 0,
+                                       op};
+  qsort(rows, n, sizeof(*rows), profile_row_cmp);
+  fprintf(out, "\n%-6s %-4s %14s %7s %14s\n", "opcode", "", "cycles", "%",
+          "insns");
+  for (int i = 0; i < n; i++) {
+    const char *name = op_table[rows[i].key].name;
+    fprintf(out, "$%02X    %-4s %14llu %6.2f%% %14llu\n", rows[i].key,
+            name ? name : "???", (unsigned long long)rows[i].cycles,
+            profile_pct(rows[i].cycles, cycles),
+            (unsigned long long)rows[i].insns);
+  }
+
+  // A routine's total is what its outermost frames spent, callees and all,
+  // so that recursion is not counted twice. Children come after their
+  // parents, so walking backwards sums every subtree before its root.
+  uint64_t *under = malloc((p->nnodes + 1) * sizeof(uint64_t));
+  struct profile_row *fn = calloc(0x10000, sizeof(struct profile_row));
+  for (uint32_t i = 0; i < p->nnodes; i++)
+    under[i] = p->nodes[i].cycles;
+  for (uint32_t i = p->nnodes; i-- > 1;)
+    under[p->nodes[i].parent] += under[i];
+  for (uint32_t i = 0; i < p->nnodes; i++) {
+    const struct profile_node *node = &p->nodes[i];
+    struct profile_row *r = &fn[node->entry];
+    uint32_t a = i;
+    while (a && p->nodes[p->nodes[a].parent].entry != node->entry)
+      a = p->nodes[a].parent;
+    r->cycles += node->cycles;
+    r->calls += node->calls;
+    if (!a)
+      r->total += under[i];
+  }
+  n = 0;
+  for (unsigned pc = 0; pc < 0x10000; pc++)
+    if (fn[pc].calls) {
+      rows[n] = fn[pc];
+      rows[n++].key = pc;
+    }
+  qsort(rows, n, sizeof(*rows), profile_row_cmp);
+  fprintf(out, "\n%-6s %14s %7s %14s %7s %10s\n", "frame", "self", "%",
+          "total", "%", "calls");
+  for (int i = 0; i < n && (!top || i < top); i++)
+    fprintf(out, "$%04X  %14llu %6.2f%% %14llu %6.2f%% %10llu\n", rows[i].key,
+            (unsigned long long)rows[i].cycles,
+            profile_pct(rows[i].cycles, cycles),
+            (unsigned long long)rows[i].total,
+            profile_pct(rows[i].total, cycles),
+            (unsigned long long)rows[i].calls);
+
+  free(fn);
+  free(under);
+  free(rows);
+}
+
+// Write the call tree of p to out in the collapsed stack format that
+// flamegraph.pl and speedscope read: one line per call path with cycles of
+// its own, the frames from the root down separated by ';', then the count.
+void profile_collapsed(const struct profile *p, FILE *out) {
+  uint32_t path[257];
+  for (uint32_t i = 0; i < p->nnodes; i++) {
+    if (!p->nodes[i].cycles)
+      continue;
+    int len = 0;
+    for (uint32_t a = i; len < 257; a = p->nodes[a].parent) {
+      path[len++] = a;
+      if (!a)
+        break;
+    }
+    while (len--)
+      fprintf(out, "$%04X%c", p->nodes[path[len]].entry, len ? ';' : ' ');
+    fprintf(out, "%llu\n", (unsigned long long)p->nodes[i].cycles);
+  }
+}
+
+/* --------------------------------------------------------- */
+/* Snapshots                                                  */
+/* --------------------------------------------------------- */
+
+// Memory is kept in refcounted pages, so a snapshot taken from a machine
+// that was restored from (or saved to) another one shares every page that
+// has not been written since. Restoring into the machine a snapshot came
+// from copies back only the pages written since; restoring anywhere else
+// copies all 64 KiB. Device pages are always copied back, since devices
+// may change memory[] without going through the bus.
+struct snap_page {
+  unsigned refs;
+  uint8_t data[256];
+};
+
+struct snapshot {
+  unsigned refs;
+  cpu6502 cpu;
+  const uint8_t *rom[256];     // data of ROM pages
+  bus_device *dev[256];        // NULL for RAM pages
+  struct snap_page *page[256]; // memory[] under every page
+};
+
+static int mem_dirty(machine6502 *m, unsigned p) {
+  return (m->dirty[p >> 6] >> (p & 63)) & 1;
+}
+
+// Start tracking writes against s. Of the given pages, RAM ones are watched
+// until their next store, ROM ones are clean and device ones stay marked as
+// written; all other pages must already be clean and watched.
+static void snapshot_attach(machine6502 *m, struct snapshot *s,
+                            const uint64_t pages[4]) {
+  __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED); // before s may be m->snap
+  snapshot_free(m->snap);
+  m->snap = s;
+
+  for (int w = 0; w < 4; w++) {
+    for (uint64_t bits = pages[w]; bits; bits &= bits - 1) {
+      unsigned p = w * 64 + __builtin_ctzll(bits);
+      if (s->dev[p] && !s->rom[p])
+        continue;
+      m->dirty[w] &= ~(1ull << (p & 63));
+      if (m->wr[p]) {
+        m->wr[p] = NULL;
+        m->dev[p] = &watch_device;
+      }
+    }
+  }
+}
+
+void snapshot_free(struct snapshot *s) {
+  if (!s || __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  for (int p = 0; p < 256; p++)
+    if (__atomic_sub_fetch(&s->page[p]->refs, 1, __ATOMIC_ACQ_REL) == 0)
+      free(s->page[p]);
+  free(s);
+}
+
+// Capture registers, memory and the page mapping. Returns NULL if out of
+// memory.
+struct snapshot *snapshot_take(machine6502 *m) {
+  struct snapshot *s = malloc(sizeof(struct snapshot));
+  if (!s)
+    return NULL;
+  s->refs = 0;
+  s->cpu = m->cpu;
+  if (!m->snap)
+    memset(m->dirty, 0xFF, sizeof(m->dirty));
+
+  for (unsigned p = 0; p < 256; p++) {
+    int ram = (m->rd[p] == &m->memory[p << 8]);
+    s->dev[p] = ram ? NULL : m->dev[p];
+    s->rom[p] = (m->dev[p] == &rom_device) ? m->rd[p] : NULL;
+
+    if (!mem_dirty(m, p)) {
+      s->page[p] = m->snap->page[p];
+      __atomic_add_fetch(&s->page[p]->refs, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    s->page[p] = malloc(sizeof(struct snap_page));
+    if (!s->page[p]) {
+      while (p-- > 0) // unwind the pages taken so far
+        if (__atomic_sub_fetch(&s->page[p]->refs, 1, __ATOMIC_ACQ_REL) == 0)
+          free(s->page[p]);
+      free(s);
+      return NULL;
+    }
+    s->page[p]->refs = 1;
+    memcpy(s->page[p]->data, &m->memory[p << 8], 256);
+  }
+
+  uint64_t pages[4];
+  memcpy(pages, m->dirty, sizeof(pages));
+  snapshot_attach(m, s, pages);
+  __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+  return s;
+}
+
+// Put m back into the state s was taken in. The embedder's user pointer is
+// left alone.
+void snapshot_restore(machine6502 *m, struct snapshot *s) {
+  if (m->snap != s)
+    memset(m->dirty, 0xFF, sizeof(m->dirty));
+
+  uint64_t pages[4];
+  memcpy(pages, m->dirty, sizeof(pages));
+  m->fetch_tag = 0;
+  for (int w = 0; w < 4; w++) {
+    for (uint64_t bits = pages[w]; bits; bits &= bits - 1) {
+      unsigned p = w * 64 + __builtin_ctzll(bits);
+      blocks_invalidate(m, p, 1);
+      memcpy(&m->memory[p << 8], s->page[p]->data, 256);
+      if (!s->dev[p]) {
+        m->rd[p] = &m->memory[p << 8];
+        m->wr[p] = &m->memory[p << 8];
+        m->dev[p] = NULL;
+      } else {
+        m->rd[p] = s->rom[p];
+        m->wr[p] = NULL;
+        m->dev[p] = s->dev[p];
+      }
+    }
+  }
+
+  m->cpu = s->cpu;
+  snapshot_attach(m, s, pages);
+}
+
+// A new machine in the state s was taken in, sharing nothing with the
+// machine it came from. Returns NULL if out of memory.
+machine6502 *machine_fork(struct snapshot *s) {
+  machine6502 *m = malloc(sizeof(machine6502));
+  if (m) {
+    m->user = NULL;
+    m->blocks = NULL;
+    m->snap = NULL;
+    m->trace = NULL;
+    m->task = NULL;
+    m->events = NULL;
+    m->nevents = m->events_cap = 0;
+    m->wake = UINT64_MAX;
+    m->irq = m->nmi = m->yield = 0;
+    snapshot_restore(m, s);
+  }
+  return m;
+}
@@ -0,0 +1,118 @@
+#ifndef CPU6502_H
+#define CPU6502_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * lib6502: the emulator core as a library, for programs that link against
+ * one optimised build (make lib) rather than including cpu.c. A machine is
+ * an opaque handle; registers go in and out through cpu6502_regs, and
+ * devices are a pair of callbacks on a range of pages. Nothing here
+ * exposes the layout of a machine, so the core can change underneath
+ * without breaking callers. New calls raise CPU6502_ABI_VERSION; existing
+ * ones keep their meaning.
+ *
+ * A machine is used by one thread at a time. Calls that can fail return 0
+ * or a pointer on success and -1 or NULL on failure, having said why on
+ * stderr where there is more to say than "out of memory".
+ */
+
+#if defined(__GNUC__)
+#define CPU6502_API __attribute__((visibility("default")))
+#else
+#define CPU6502_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CPU6502_ABI_VERSION 1
+
+typedef struct machine6502 cpu6502_machine;
+
+// Why cpu6502_run returned.
+enum cpu6502_status {
+  CPU6502_BRK,    // executed a BRK
+  CPU6502_BUDGET, // ran the cycles it was given
+  CPU6502_YIELD,  // a device called cpu6502_yield
+};
+
+struct cpu6502_regs {
+  uint64_t cycles; // clock cycles run since the machine was created
+  uint16_t pc;
+  uint8_t a, x, y, sp;
+  uint8_t p; // NV-BDIZC, as PHP pushes it
+};
+
+// A device: read and write run for every access to its pages, with the
+// ctx it was mapped with. They may call cpu6502_irq, cpu6502_nmi and
+// cpu6502_yield on m, which take effect after the instruction.
+typedef uint8_t (*cpu6502_read_fn)(void *ctx, cpu6502_machine *m,
+                                   uint16_t addr);
+typedef void (*cpu6502_write_fn)(void *ctx, cpu6502_machine *m, uint16_t addr,
+                                 uint8_t value);
+
+// CPU6502_ABI_VERSION of the library, which may be newer than the header.
+CPU6502_API unsigned cpu6502_abi_version(void);
+
+// A machine with 64 KiB of zeroed RAM and its registers as at power on.
+CPU6502_API cpu6502_machine *cpu6502_new(void);
+CPU6502_API void cpu6502_free(cpu6502_machine *m);
+
+// Put the registers back as at power on and load PC from $FFFC. Memory,
+// devices and the cycle count are left alone.
+CPU6502_API void cpu6502_reset(cpu6502_machine *m);
+
+// Copy len bytes of data to addr. Returns -1 if they run past $FFFF.
+CPU6502_API int cpu6502_load(cpu6502_machine *m, uint16_t addr,
+                             const void *data, size_t len);
+
+// Load a program file: ca65 source (.s) is assembled, anything else is an
+// image as ld65 writes it, a flat one going at addr. The reset vector is
+// pointed at the program if it does not set it.
+CPU6502_API int cpu6502_load_file(cpu6502_machine *m, const char *path,
+                                  uint16_t addr);
+
+// Memory as the CPU sees it, but without running devices: their pages
+// read and write the RAM beneath them.
+CPU6502_API uint8_t cpu6502_peek(const cpu6502_machine *m, uint16_t addr);
+CPU6502_API void cpu6502_poke(cpu6502_machine *m, uint16_t addr,
+                              uint8_t value);
+
+CPU6502_API void cpu6502_get_regs(const cpu6502_machine *m,
+                                  struct cpu6502_regs *regs);
+CPU6502_API void cpu6502_set_regs(cpu6502_machine *m,
+                                  const struct cpu6502_regs *regs);
+
+// Run one instruction, taking any interrupt that is due first. Returns
+// the opcode run.
+CPU6502_API int cpu6502_step(cpu6502_machine *m);
+
+// Run until BRK, cpu6502_yield or about cycles clock cycles; returns an
+// enum cpu6502_status. An instruction is never cut short, so the run may
+// go a few cycles over.
+CPU6502_API int cpu6502_run(cpu6502_machine *m, uint64_t cycles);
+
+// Stop cpu6502_run after the current instruction.
+CPU6502_API void cpu6502_yield(cpu6502_machine *m);
+
+// Hand npages pages from page on to a device, or give them back to RAM.
+// Returns -1 if out of memory.
+CPU6502_API int cpu6502_map_io(cpu6502_machine *m, unsigned page,
+                               unsigned npages, cpu6502_read_fn read,
+                               cpu6502_write_fn write, void *ctx);
+CPU6502_API void cpu6502_map_ram(cpu6502_machine *m, unsigned page,
+                                 unsigned npages);
+
+// IRQ is level triggered: source is one of 8 bits, each held by one
+// device until it is serviced. NMI is taken once per call.
+CPU6502_API void cpu6502_irq(cpu6502_machine *m, uint8_t source, int level);
+CPU6502_API void cpu6502_nmi(cpu6502_machine *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
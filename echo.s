@@ -0,0 +1,11 @@
+; Copies stdin to stdout a byte at a time, stopping at the 0 that $FF01
+; reads at the end of input. check-replay records and replays it.
+
+.org $8000
+start:
+    lda $FF01
+    beq done
+    sta $FF00
+    jmp start
+done:
+    brk
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.c"
+
+/*
+ * functest: run Klaus Dormann's 6502_functional_test.bin to completion and
+ * time it.
+ *
+ * The test is a 64K image loaded at $0000 and entered at $0400. It ends in a
+ * trap, an instruction that jumps or branches to itself: the one at the
+ * success address (-s, $3469 in the published binary) means every test
+ * passed, any other marks the test that failed. Exit status is 0 on success,
+ * 1 on a failed test or a run that never traps, and 2 when it passed but
+ * ran slower than -m emulated MHz.
+ *
+ * By default the run goes one cpu_step at a time, which makes it a full-ISA
+ * throughput benchmark for the stepping core. -r runs it through
+ * run_cpu_for instead, so the threaded or block-cache loop this was built
+ * with does the work and the trap is checked between slices.
+ *
+ * An image ending in .s is assembled in-process instead and placed where
+ * its .orgs put it; -o does not apply. functest.s is a small one that
+ * passes or fails depending on where it is entered, and isa.s a full-ISA
+ * workload for the -m gate; make test runs both.
+ */
+
+#define FUNCTEST_SLICE 100000
+#define FUNCTEST_LIMIT 1000000000ull // cycles; the test itself needs ~96M
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Step until an instruction leaves PC where it was. BRK is part of the test,
+// so it runs like any other instruction.
+static int run_stepped(machine6502 *m, uint64_t *insns) {
+  uint64_t n = 0;
+  while (m->cpu.cycles < FUNCTEST_LIMIT) {
+    uint16_t pc = m->cpu.PC;
+    cpu_step(m);
+    n++;
+    if (m->cpu.PC == pc) {
+      *insns = n;
+      return 0;
+    }
+  }
+  *insns = n;
+  return -1;
+}
+
+// Run a slice at a time and look for the trap in between: step one
+// instruction by hand and see whether it stays put.
+static int run_sliced(machine6502 *m) {
+  while (m->cpu.cycles < FUNCTEST_LIMIT) {
+    run_cpu_for(m, FUNCTEST_SLICE);
+    uint16_t pc = m->cpu.PC;
+    cpu_step(m);
+    if (m->cpu.PC == pc)
+      return 0;
+  }
+  return -1;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-r] [-o origin] [-e entry] [-s success] [-m mhz] "
+          "image.bin\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  uint16_t origin = 0x0000, entry = 0x0400, success = 0x3469;
+  double min_mhz = 0;
+  int sliced = 0, opt;
+
+  while ((opt = getopt(argc, argv, "ro:e:s:m:")) != -1) {
+    switch (opt) {
+    case 'r':
+      sliced = 1;
+      break;
+    case 'o':
+      origin = (uint16_t)strtoul(optarg, NULL, 16);
+      break;
+    case 'e':
+      entry = (uint16_t)strtoul(optarg, NULL, 16);
+      break;
+    case 's':
+      success = (uint16_t)strtoul(optarg, NULL, 16);
+      break;
+    case 'm':
+      min_mhz = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  machine6502 *m = machine_new();
+  const char *path = argv[optind];
+  size_t len = strlen(path);
+  if (len > 2 && !strcmp(path + len - 2, ".s")) {
+    struct asm_image *code = asm_open(path);
+    if (!code) {
+      machine_free(m);
+      return 1;
+    }
+    asm_load(m, code);
+    asm_close(code);
+  } else if (load_bin(m, path, origin) != 0) {
+    machine_free(m);
+    return 1;
+  }
+  m->cpu.PC = entry;
+
+  uint64_t insns = 0;
+  double start = now();
+  int trapped = sliced ? run_sliced(m) : run_stepped(m, &insns);
+  double elapsed = now() - start;
+
+  double mhz = m->cpu.cycles / elapsed / 1e6;
+  printf("%s: %llu cycles in %.3f s, %.1f MHz", sliced ? "run_cpu" : "cpu_step",
+         (unsigned long long)m->cpu.cycles, elapsed, mhz);
+  if (!sliced)
+    printf(", %.1f MIPS", insns / elapsed / 1e6);
+  printf("\n");
+
+  int status = 0;
+  if (trapped != 0) {
+    printf("FAIL: no trap after %llu cycles, PC=%04X\n",
+           (unsigned long long)m->cpu.cycles, m->cpu.PC);
+    status = 1;
+  } else if (m->cpu.PC != success) {
+    printf("FAIL: trapped at %04X A=%02X X=%02X Y=%02X P=%02X SP=%02X "
+           "test=%02X\n",
+           m->cpu.PC, m->cpu.A, m->cpu.X, m->cpu.Y, pack_P(&m->cpu), m->cpu.SP,
+           m->memory[0x0200]);
+    status = 1;
+  } else if (mhz < min_mhz) {
+    printf("FAIL: %.1f MHz is below the %.1f MHz gate\n", mhz, min_mhz);
+    status = 2;
+  } else {
+    printf("PASS: trapped at %04X\n", m->cpu.PC);
+  }
+
+  machine_free(m);
+  return status;
+}
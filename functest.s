@@ -0,0 +1,44 @@
+; A stand-in for 6502_functional_test.bin, so check-functest can try
+; functest's trap detection without the real image. Entered at $0400 it
+; loops, calls, takes a BRK and ends in a JMP to itself at $0480: a pass
+; with -s 0480. Entered at $0500 it stores test number $42 and ends in a
+; branch to itself at $0505: a fail.
+
+.org $0400
+start:
+    ldx #0
+@fill:
+    txa
+    jsr double
+    sta $0300,x
+    inx
+    bne @fill
+    brk
+    .byte 0             ; BRK skips this
+    lda $03FF
+    cmp #$FE
+    bne @bad
+    jmp success
+@bad:
+    jmp fail
+
+double:
+    asl a
+    rts
+
+.org $0480
+success:
+    jmp success
+
+.org $0500
+fail:
+    lda #$42
+    sta $0200
+@trap:
+    bne @trap
+
+irq:
+    rti
+
+.org $FFFE
+    .word irq
@@ -0,0 +1,902 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.c"
+
+/*
+ * fuzz: differential conformance check of every execution tier against a
+ * reference model.
+ *
+ * Each case is a random machine state (registers and all 64 KiB) with one
+ * documented instruction at PC and a BRK wherever that instruction goes
+ * next. The reference model below, written from the data sheet and sharing
+ * no tables or handlers with cpu.c, works out what the instruction and the
+ * BRK must leave behind; every tier built in then runs the same state and
+ * has its registers, cycle count and memory compared. The block tier runs a
+ * case until the block has been translated, if the JIT is built in, and the
+ * runs after that are checked as the jit tier. The wide tier runs the case
+ * in two lanes of a lockstep group and checks both.
+ *
+ * Cases come from the seed and their number alone, so a failure reproduces
+ * with any number of threads. The first failing case for each tier and
+ * opcode is shrunk, by zeroing everything the failure does not depend on,
+ * before it is printed.
+ *
+ *   fuzz [-j threads] [-n cases] [-s seed]
+ */
+
+#define FUZZ_BUDGET 100 // cycles; enough for one instruction and the BRK
+
+/* --------------------------------------------------------- */
+/* Reference model                                            */
+/* --------------------------------------------------------- */
+
+enum ref_insn {
+  I_NONE, I_ADC, I_AND, I_ASL, I_BCC, I_BCS, I_BEQ, I_BIT, I_BMI, I_BNE,
+  I_BPL, I_BRK, I_BVC, I_BVS, I_CLC, I_CLD, I_CLI, I_CLV, I_CMP, I_CPX,
+  I_CPY, I_DEC, I_DEX, I_DEY, I_EOR, I_INC, I_INX, I_INY, I_JMP, I_JSR,
+  I_LDA, I_LDX, I_LDY, I_LSR, I_NOP, I_ORA, I_PHA, I_PHP, I_PLA, I_PLP,
+  I_ROL, I_ROR, I_RTI, I_RTS, I_SBC, I_SEC, I_SED, I_SEI, I_STA, I_STX,
+  I_STY, I_TAX, I_TAY, I_TSX, I_TXA, I_TXS, I_TYA,
+};
+
+static const char *const ref_names[] = {
+    "???", "ADC", "AND", "ASL", "BCC", "BCS", "BEQ", "BIT", "BMI", "BNE",
+    "BPL", "BRK", "BVC", "BVS", "CLC", "CLD", "CLI", "CLV", "CMP", "CPX",
+    "CPY", "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY", "JMP", "JSR",
+    "LDA", "LDX", "LDY", "LSR", "NOP", "ORA", "PHA", "PHP", "PLA", "PLP",
+    "ROL", "ROR", "RTI", "RTS", "SBC", "SEC", "SED", "SEI", "STA", "STX",
+    "STY", "TAX", "TAY", "TSX", "TXA", "TXS", "TYA",
+};
+
+enum ref_mode {
+  M_IMP, M_ACC, M_IMM, M_ZP, M_ZPX, M_ZPY, M_ABS, M_ABX, M_ABY, M_IND,
+  M_IZX, M_IZY, M_REL,
+};
+
+static const uint8_t ref_len[] = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 2, 2, 2};
+
+struct ref_op {
+  uint8_t insn, mode, cycles;
+};
+
+// The eight addressing modes of ORA AND EOR ADC STA LDA CMP SBC, at
+// opcode base | 0x01 .. 0x1D. STA has no immediate form and fixed costs.
+#define REF_ALU(insn, base)                                                    \
+  [base | 0x09] = {insn, M_IMM, 2}, [base | 0x05] = {insn, M_ZP, 3},           \
+  [base | 0x15] = {insn, M_ZPX, 4}, [base | 0x0D] = {insn, M_ABS, 4},          \
+  [base | 0x1D] = {insn, M_ABX, 4}, [base | 0x19] = {insn, M_ABY, 4},          \
+  [base | 0x01] = {insn, M_IZX, 6}, [base | 0x11] = {insn, M_IZY, 5}
+// ASL ROL LSR ROR, and INC DEC without the accumulator form.
+#define REF_SHIFT(insn, base)                                                  \
+  [base | 0x06] = {insn, M_ZP, 5}, [base | 0x16] = {insn, M_ZPX, 6},           \
+  [base | 0x0E] = {insn, M_ABS, 6}, [base | 0x1E] = {insn, M_ABX, 7}
+
+static const struct ref_op ref_ops[256] = {
+    REF_ALU(I_ORA, 0x00), REF_ALU(I_AND, 0x20), REF_ALU(I_EOR, 0x40),
+    REF_ALU(I_ADC, 0x60), REF_ALU(I_LDA, 0xA0), REF_ALU(I_CMP, 0xC0),
+    REF_ALU(I_SBC, 0xE0),
+
+    [0x85] = {I_STA, M_ZP, 3}, [0x95] = {I_STA, M_ZPX, 4},
+    [0x8D] = {I_STA, M_ABS, 4}, [0x9D] = {I_STA, M_ABX, 5},
+    [0x99] = {I_STA, M_ABY, 5}, [0x81] = {I_STA, M_IZX, 6},
+    [0x91] = {I_STA, M_IZY, 6},
+
+    REF_SHIFT(I_ASL, 0x00), REF_SHIFT(I_ROL, 0x20), REF_SHIFT(I_LSR, 0x40),
+    REF_SHIFT(I_ROR, 0x60), REF_SHIFT(I_DEC, 0xC0), REF_SHIFT(I_INC, 0xE0),
+    [0x0A] = {I_ASL, M_ACC, 2}, [0x2A] = {I_ROL, M_ACC, 2},
+    [0x4A] = {I_LSR, M_ACC, 2}, [0x6A] = {I_ROR, M_ACC, 2},
+
+    [0xA2] = {I_LDX, M_IMM, 2}, [0xA6] = {I_LDX, M_ZP, 3},
+    [0xB6] = {I_LDX, M_ZPY, 4}, [0xAE] = {I_LDX, M_ABS, 4},
+    [0xBE] = {I_LDX, M_ABY, 4},
+    [0xA0] = {I_LDY, M_IMM, 2}, [0xA4] = {I_LDY, M_ZP, 3},
+    [0xB4] = {I_LDY, M_ZPX, 4}, [0xAC] = {I_LDY, M_ABS, 4},
+    [0xBC] = {I_LDY, M_ABX, 4},
+    [0x86] = {I_STX, M_ZP, 3}, [0x96] = {I_STX, M_ZPY, 4},
+    [0x8E] = {I_STX, M_ABS, 4},
+    [0x84] = {I_STY, M_ZP, 3}, [0x94] = {I_STY, M_ZPX, 4},
+    [0x8C] = {I_STY, M_ABS, 4},
+    [0xE0] = {I_CPX, M_IMM, 2}, [0xE4] = {I_CPX, M_ZP, 3},
+    [0xEC] = {I_CPX, M_ABS, 4},
+    [0xC0] = {I_CPY, M_IMM, 2}, [0xC4] = {I_CPY, M_ZP, 3},
+    [0xCC] = {I_CPY, M_ABS, 4},
+    [0x24] = {I_BIT, M_ZP, 3}, [0x2C] = {I_BIT, M_ABS, 4},
+
+    [0x10] = {I_BPL, M_REL, 2}, [0x30] = {I_BMI, M_REL, 2},
+    [0x50] = {I_BVC, M_REL, 2}, [0x70] = {I_BVS, M_REL, 2},
+    [0x90] = {I_BCC, M_REL, 2}, [0xB0] = {I_BCS, M_REL, 2},
+    [0xD0] = {I_BNE, M_REL, 2}, [0xF0] = {I_BEQ, M_REL, 2},
+
+    [0x4C] = {I_JMP, M_ABS, 3}, [0x6C] = {I_JMP, M_IND, 5},
+    [0x20] = {I_JSR, M_ABS, 6}, [0x60] = {I_RTS, M_IMP, 6},
+    [0x00] = {I_BRK, M_IMP, 7}, [0x40] = {I_RTI, M_IMP, 6},
+
+    [0x48] = {I_PHA, M_IMP, 3}, [0x08] = {I_PHP, M_IMP, 3},
+    [0x68] = {I_PLA, M_IMP, 4}, [0x28] = {I_PLP, M_IMP, 4},
+
+    [0x18] = {I_CLC, M_IMP, 2}, [0x38] = {I_SEC, M_IMP, 2},
+    [0x58] = {I_CLI, M_IMP, 2}, [0x78] = {I_SEI, M_IMP, 2},
+    [0xB8] = {I_CLV, M_IMP, 2}, [0xD8] = {I_CLD, M_IMP, 2},
+    [0xF8] = {I_SED, M_IMP, 2},
+
+    [0xAA] = {I_TAX, M_IMP, 2}, [0xA8] = {I_TAY, M_IMP, 2},
+    [0xBA] = {I_TSX, M_IMP, 2}, [0x8A] = {I_TXA, M_IMP, 2},
+    [0x9A] = {I_TXS, M_IMP, 2}, [0x98] = {I_TYA, M_IMP, 2},
+    [0xE8] = {I_INX, M_IMP, 2}, [0xC8] = {I_INY, M_IMP, 2},
+    [0xCA] = {I_DEX, M_IMP, 2}, [0x88] = {I_DEY, M_IMP, 2},
+    [0xEA] = {I_NOP, M_IMP, 2},
+};
+
+enum { F_C = 0x01, F_Z = 0x02, F_I = 0x04, F_D = 0x08, F_V = 0x40, F_N = 0x80 };
+
+// B and bit 5 only exist on the stack, so they are not compared.
+#define REF_P_MASK 0xCF
+
+struct ref {
+  uint8_t a, x, y, sp, p;
+  uint16_t pc;
+  uint64_t cycles;
+  int ntouched;
+  uint16_t touched[32]; // every address read or written
+  uint8_t mem[0x10000];
+};
+
+static uint8_t ref_rd(struct ref *r, uint16_t addr) {
+  if (r->ntouched < 32)
+    r->touched[r->ntouched++] = addr;
+  return r->mem[addr];
+}
+
+static void ref_wr(struct ref *r, uint16_t addr, uint8_t v) {
+  if (r->ntouched < 32)
+    r->touched[r->ntouched++] = addr;
+  r->mem[addr] = v;
+}
+
+static void ref_push(struct ref *r, uint8_t v) { ref_wr(r, 0x100 | r->sp--, v); }
+
+static uint8_t ref_pull(struct ref *r) { return ref_rd(r, 0x100 | ++r->sp); }
+
+static void ref_flag(struct ref *r, uint8_t f, int on) {
+  r->p = on ? (r->p | f) : (r->p & ~f);
+}
+
+static uint8_t ref_nz(struct ref *r, uint8_t v) {
+  ref_flag(r, F_Z, v == 0);
+  ref_flag(r, F_N, v & 0x80);
+  return v;
+}
+
+static void ref_compare(struct ref *r, uint8_t reg, uint8_t v) {
+  ref_flag(r, F_C, reg >= v);
+  ref_nz(r, reg - v);
+}
+
+static void ref_add(struct ref *r, uint8_t v) {
+  unsigned sum = r->a + v + (r->p & F_C);
+  ref_flag(r, F_V, (r->a ^ sum) & (v ^ sum) & 0x80);
+  ref_flag(r, F_C, sum > 0xFF);
+  r->a = ref_nz(r, sum);
+}
+
+// Decimal mode as the NMOS part does it, invalid digits included. ADC takes
+// Z from the binary sum and N and V from the sum before the high digit is
+// adjusted; SBC sets every flag as in binary mode.
+static void ref_add_bcd(struct ref *r, uint8_t v) {
+  uint8_t binary = r->a + v + (r->p & F_C);
+  int lo = (r->a & 0x0F) + (v & 0x0F) + (r->p & F_C);
+  int hi = (r->a >> 4) + (v >> 4);
+  if (lo > 9) {
+    lo = (lo + 6) & 0x0F;
+    hi++;
+  }
+  uint8_t mid = (hi << 4) | lo;
+  ref_flag(r, F_Z, binary == 0);
+  ref_flag(r, F_N, mid & 0x80);
+  ref_flag(r, F_V, (r->a ^ mid) & (v ^ mid) & 0x80);
+  if (hi > 9)
+    hi += 6;
+  ref_flag(r, F_C, hi > 15);
+  r->a = (hi << 4) | lo;
+}
+
+static void ref_sub_bcd(struct ref *r, uint8_t v) {
+  int lo = (r->a & 0x0F) - (v & 0x0F) - !(r->p & F_C);
+  int hi = (r->a >> 4) - (v >> 4);
+  if (lo < 0) {
+    lo = (lo - 6) & 0x0F;
+    hi--;
+  }
+  if (hi < 0)
+    hi -= 6;
+  uint8_t a = (hi << 4) | lo;
+  ref_add(r, ~v);
+  r->a = a;
+}
+
+// Run the instruction at r->pc.
+static void ref_step(struct ref *r) {
+  uint8_t op = ref_rd(r, r->pc);
+  const struct ref_op *o = &ref_ops[op];
+  uint16_t next = r->pc + ref_len[o->mode];
+  uint16_t opnd = 0, ea = 0, base;
+  int crossed = 0;
+
+  if (ref_len[o->mode] > 1)
+    opnd = ref_rd(r, r->pc + 1);
+  if (ref_len[o->mode] > 2)
+    opnd |= ref_rd(r, r->pc + 2) << 8;
+
+  switch (o->mode) {
+  case M_IMM:
+    ea = r->pc + 1;
+    break;
+  case M_ZP:
+  case M_ABS:
+    ea = opnd;
+    break;
+  case M_ZPX:
+    ea = (uint8_t)(opnd + r->x);
+    break;
+  case M_ZPY:
+    ea = (uint8_t)(opnd + r->y);
+    break;
+  case M_ABX:
+  case M_ABY:
+    ea = opnd + (o->mode == M_ABX ? r->x : r->y);
+    crossed = (ea >> 8) != (opnd >> 8);
+    break;
+  case M_IND: // the pointer's high byte does not carry into the next page
+    ea = ref_rd(r, opnd) |
+         ref_rd(r, (opnd & 0xFF00) | (uint8_t)(opnd + 1)) << 8;
+    break;
+  case M_IZX:
+    ea = ref_rd(r, (uint8_t)(opnd + r->x)) |
+         ref_rd(r, (uint8_t)(opnd + r->x + 1)) << 8;
+    break;
+  case M_IZY:
+    base = ref_rd(r, opnd) | ref_rd(r, (uint8_t)(opnd + 1)) << 8;
+    ea = base + r->y;
+    crossed = (ea >> 8) != (base >> 8);
+    break;
+  case M_REL:
+    ea = next + (int8_t)opnd;
+    break;
+  }
+
+  r->cycles += o->cycles;
+  r->pc = next;
+
+  // Reads that index across a page pay a cycle; stores and
+  // read-modify-write always take the long way.
+  switch (o->insn) {
+  case I_ADC: case I_AND: case I_CMP: case I_EOR: case I_LDA: case I_LDX:
+  case I_LDY: case I_ORA: case I_SBC:
+    r->cycles += crossed;
+    break;
+  }
+
+  int taken = -1;
+  uint8_t v;
+  switch (o->insn) {
+  case I_ADC:
+    v = ref_rd(r, ea);
+    if (r->p & F_D)
+      ref_add_bcd(r, v);
+    else
+      ref_add(r, v);
+    break;
+  case I_SBC:
+    v = ref_rd(r, ea);
+    if (r->p & F_D)
+      ref_sub_bcd(r, v);
+    else
+      ref_add(r, ~v);
+    break;
+  case I_AND: r->a = ref_nz(r, r->a & ref_rd(r, ea)); break;
+  case I_ORA: r->a = ref_nz(r, r->a | ref_rd(r, ea)); break;
+  case I_EOR: r->a = ref_nz(r, r->a ^ ref_rd(r, ea)); break;
+  case I_LDA: r->a = ref_nz(r, ref_rd(r, ea)); break;
+  case I_LDX: r->x = ref_nz(r, ref_rd(r, ea)); break;
+  case I_LDY: r->y = ref_nz(r, ref_rd(r, ea)); break;
+  case I_CMP: ref_compare(r, r->a, ref_rd(r, ea)); break;
+  case I_CPX: ref_compare(r, r->x, ref_rd(r, ea)); break;
+  case I_CPY: ref_compare(r, r->y, ref_rd(r, ea)); break;
+  case I_BIT:
+    v = ref_rd(r, ea);
+    ref_flag(r, F_Z, (r->a & v) == 0);
+    r->p = (r->p & 0x3F) | (v & 0xC0);
+    break;
+  case I_STA: ref_wr(r, ea, r->a); break;
+  case I_STX: ref_wr(r, ea, r->x); break;
+  case I_STY: ref_wr(r, ea, r->y); break;
+
+  case I_ASL: case I_LSR: case I_ROL: case I_ROR: case I_INC: case I_DEC: {
+    unsigned in = o->mode == M_ACC ? r->a : ref_rd(r, ea), out;
+    unsigned c = r->p & F_C;
+    switch (o->insn) {
+    case I_ASL: out = in << 1; c = in >> 7; break;
+    case I_ROL: out = in << 1 | c; c = in >> 7; break;
+    case I_LSR: out = in >> 1; c = in & 1; break;
+    case I_ROR: out = in >> 1 | c << 7; c = in & 1; break;
+    case I_INC: out = in + 1; break;
+    default: out = in - 1; break;
+    }
+    ref_flag(r, F_C, c);
+    ref_nz(r, out);
+    if (o->mode == M_ACC)
+      r->a = out;
+    else
+      ref_wr(r, ea, out);
+    break;
+  }
+
+  case I_BPL: taken = !(r->p & F_N); break;
+  case I_BMI: taken = (r->p & F_N) != 0; break;
+  case I_BVC: taken = !(r->p & F_V); break;
+  case I_BVS: taken = (r->p & F_V) != 0; break;
+  case I_BCC: taken = !(r->p & F_C); break;
+  case I_BCS: taken = (r->p & F_C) != 0; break;
+  case I_BNE: taken = !(r->p & F_Z); break;
+  case I_BEQ: taken = (r->p & F_Z) != 0; break;
+
+  case I_JMP: r->pc = ea; break;
+  case I_JSR:
+    ref_push(r, (next - 1) >> 8);
+    ref_push(r, next - 1);
+    r->pc = ea;
+    break;
+  case I_RTS:
+    r->pc = ref_pull(r);
+    r->pc |= ref_pull(r) << 8;
+    r->pc++;
+    break;
+  case I_BRK:
+    next++; // the byte after BRK is skipped
+    ref_push(r, next >> 8);
+    ref_push(r, next);
+    ref_push(r, r->p | 0x30);
+    r->p |= F_I;
+    r->pc = ref_rd(r, 0xFFFE) | ref_rd(r, 0xFFFF) << 8;
+    break;
+  case I_RTI:
+    r->p = ref_pull(r);
+    r->pc = ref_pull(r);
+    r->pc |= ref_pull(r) << 8;
+    break;
+
+  case I_PHA: ref_push(r, r->a); break;
+  case I_PHP: ref_push(r, r->p | 0x30); break;
+  case I_PLA: r->a = ref_nz(r, ref_pull(r)); break;
+  case I_PLP: r->p = ref_pull(r); break;
+
+  case I_CLC: ref_flag(r, F_C, 0); break;
+  case I_SEC: ref_flag(r, F_C, 1); break;
+  case I_CLI: ref_flag(r, F_I, 0); break;
+  case I_SEI: ref_flag(r, F_I, 1); break;
+  case I_CLV: ref_flag(r, F_V, 0); break;
+  case I_CLD: ref_flag(r, F_D, 0); break;
+  case I_SED: ref_flag(r, F_D, 1); break;
+
+  case I_TAX: r->x = ref_nz(r, r->a); break;
+  case I_TAY: r->y = ref_nz(r, r->a); break;
+  case I_TSX: r->x = ref_nz(r, r->sp); break;
+  case I_TXA: r->a = ref_nz(r, r->x); break;
+  case I_TXS: r->sp = r->x; break;
+  case I_TYA: r->a = ref_nz(r, r->y); break;
+  case I_INX: r->x = ref_nz(r, r->x + 1); break;
+  case I_INY: r->y = ref_nz(r, r->y + 1); break;
+  case I_DEX: r->x = ref_nz(r, r->x - 1); break;
+  case I_DEY: r->y = ref_nz(r, r->y - 1); break;
+  case I_NOP: break;
+  }
+
+  // A taken branch costs a cycle, two if it lands on another page.
+  if (taken == 1) {
+    r->cycles += 1 + ((ea >> 8) != (next >> 8));
+    r->pc = ea;
+  }
+}
+
+/* --------------------------------------------------------- */
+/* Cases                                                      */
+/* --------------------------------------------------------- */
+
+struct fuzz_case {
+  uint64_t index;
+  uint8_t a, x, y, sp, p;
+  uint16_t pc;
+  uint8_t mem[0x10000];
+};
+
+static uint64_t splitmix(uint64_t *s) {
+  uint64_t z = (*s += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// A random byte, one time in four an edge value instead.
+static uint8_t fuzz_byte(uint64_t *s) {
+  static const uint8_t edges[] = {0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF};
+  uint64_t r = splitmix(s);
+  if ((r & 3) == 0)
+    return edges[(r >> 8) % sizeof(edges)];
+  return (uint8_t)(r >> 16);
+}
+
+static void fuzz_generate(struct fuzz_case *c, uint64_t seed, uint64_t index) {
+  uint64_t s = seed ^ (index * 0xD6E8FEB86659FD93ull);
+  for (int i = 0; i < 0x10000; i += 8) {
+    uint64_t r = splitmix(&s);
+    memcpy(&c->mem[i], &r, 8);
+  }
+
+  uint8_t op;
+  do
+    op = (uint8_t)splitmix(&s);
+  while (!ref_ops[op].insn);
+
+  c->index = index;
+  c->a = fuzz_byte(&s);
+  c->x = fuzz_byte(&s);
+  c->y = fuzz_byte(&s);
+  c->sp = fuzz_byte(&s);
+  c->p = fuzz_byte(&s) | 0x20;
+  // Clear of the zero page, the stack and the vectors.
+  c->pc = 0x0200 + splitmix(&s) % 0xFDE0;
+  c->mem[c->pc] = op;
+  c->mem[c->pc + 1] = fuzz_byte(&s);
+  c->mem[c->pc + 2] = fuzz_byte(&s);
+}
+
+static void ref_load(struct ref *r, const struct fuzz_case *c) {
+  r->a = c->a;
+  r->x = c->x;
+  r->y = c->y;
+  r->sp = c->sp;
+  r->p = c->p;
+  r->pc = c->pc;
+  r->cycles = 0;
+  r->ntouched = 0;
+  memcpy(r->mem, c->mem, sizeof(r->mem));
+}
+
+// Put a BRK where the instruction in c continues, and work out in want
+// what the instruction and that BRK leave behind. Returns -1 if the case
+// cannot be made to stop, e.g. a branch into its own operand or a store
+// over the BRK.
+static int fuzz_expect(struct fuzz_case *c, struct ref *want) {
+  uint8_t op = c->mem[c->pc];
+  unsigned len = ref_len[ref_ops[op].mode];
+
+  c->mem[(uint16_t)(c->pc + len)] = 0x00;
+  ref_load(want, c);
+  ref_step(want);
+  if (op == 0x00)
+    return 0;
+
+  uint16_t next = want->pc;
+  if ((uint16_t)(next - c->pc) < len)
+    return -1;
+  c->mem[next] = 0x00;
+  ref_load(want, c);
+  ref_step(want);
+  if (want->pc != next || want->mem[next] != 0x00)
+    return -1;
+  ref_step(want);
+  return 0;
+}
+
+/* --------------------------------------------------------- */
+/* Tiers                                                      */
+/* --------------------------------------------------------- */
+
+enum { TIER_TABLE, TIER_THREADED, TIER_BLOCKS, TIER_JIT, TIER_WIDE, NTIERS };
+
+static const char *const tier_names[] = {"table", "threaded", "blocks", "jit",
+                                         "wide"};
+
+#define FUZZ_LANES 2
+
+// How often the block tier runs each case: enough for the JIT to translate
+// it and run the translation twice.
+#if CPU_JIT_X86
+#define FUZZ_BLOCK_RUNS (JIT_THRESHOLD + 2)
+#else
+#define FUZZ_BLOCK_RUNS 2
+#endif
+
+struct worker {
+  int id, nworkers;
+  uint64_t seed, ncases;
+  machine6502 *m;
+  struct snapshot *snap; // the loaded case
+#if CPU_WIDE
+  struct wide6502 *wide; // FUZZ_LANES copies of it
+#endif
+  uint16_t pc;           // where its instruction is
+  struct fuzz_case *c, *trial;
+  struct ref *want;
+  uint64_t skipped, runs[NTIERS], failures[NTIERS];
+};
+
+static void fuzz_load(struct worker *w, const struct fuzz_case *c) {
+  machine6502 *m = w->m;
+  memcpy(m->memory, c->mem, sizeof(m->memory));
+  mem_changed(m, 0, 256);
+  m->cpu.A = c->a;
+  m->cpu.X = c->x;
+  m->cpu.Y = c->y;
+  m->cpu.SP = c->sp;
+  m->cpu.PC = c->pc;
+  m->cpu.cycles = 0;
+  unpack_P(&m->cpu, c->p);
+  snapshot_free(w->snap);
+  w->snap = snapshot_take(m);
+  w->pc = c->pc;
+}
+
+// Compare w's machine with want. Only pages either side wrote can differ.
+static int fuzz_matches(struct worker *w, const struct ref *want) {
+  machine6502 *m = w->m;
+  cpu6502 *cpu = &m->cpu;
+  if (cpu->A != want->a || cpu->X != want->x || cpu->Y != want->y ||
+      cpu->SP != want->sp || cpu->PC != want->pc ||
+      cpu->cycles != want->cycles ||
+      ((pack_P(cpu) ^ want->p) & REF_P_MASK))
+    return 0;
+
+  uint64_t pages[4];
+  memcpy(pages, m->dirty, sizeof(pages));
+  for (int i = 0; i < want->ntouched; i++)
+    pages[want->touched[i] >> 14] |= 1ull << ((want->touched[i] >> 8) & 63);
+  for (int k = 0; k < 4; k++)
+    for (uint64_t bits = pages[k]; bits; bits &= bits - 1) {
+      unsigned p = k * 64 + __builtin_ctzll(bits);
+      if (memcmp(&m->memory[p << 8], &want->mem[p << 8], 256))
+        return 0;
+    }
+  return 1;
+}
+
+// Run the loaded case once on tier t from its snapshot.
+static int fuzz_run(struct worker *w, int t) {
+  machine6502 *m = w->m;
+  snapshot_restore(m, w->snap);
+  switch (t) {
+#if CPU_THREADED
+  case TIER_THREADED:
+    return run_threaded(m, FUZZ_BUDGET);
+#endif
+#if CPU_BLOCKS
+  case TIER_BLOCKS:
+  case TIER_JIT:
+    return run_blocks(m, FUZZ_BUDGET);
+#endif
+  default:
+    while (m->cpu.cycles < FUZZ_BUDGET)
+      if (cpu_step(m) == 0x00)
+        return RUN_BRK;
+    return RUN_BUDGET;
+  }
+}
+
+#if CPU_WIDE
+// Run the loaded case in every lane of the wide group. Returns the lane
+// that got it wrong, or -1; the machine is left as that lane, or as the
+// last one.
+static int fuzz_run_wide(struct worker *w, const struct ref *want) {
+  machine6502 *m = w->m;
+  snapshot_restore(m, w->snap);
+  if (!w->wide)
+    w->wide = wide_new(m, FUZZ_LANES);
+  for (unsigned i = 0; i < FUZZ_LANES; i++)
+    wide_put(w->wide, i, m);
+  wide_run(w->wide, FUZZ_BUDGET);
+  for (unsigned i = 0; i < FUZZ_LANES; i++) {
+    wide_get(w->wide, i, m);
+    if (w->wide->status[i] != RUN_BRK || !fuzz_matches(w, want))
+      return i;
+  }
+  return -1;
+}
+#endif
+
+// Whether the block tier will run the loaded case as native code.
+static int fuzz_native(struct worker *w) {
+#if CPU_JIT_X86
+  struct block_cache *bc = blocks_of(w->m);
+  uint16_t pc = w->pc;
+  if (bc && bc->slot[BLOCK_HASH(pc)].pc == pc)
+    return bc->slot[BLOCK_HASH(pc)].native != NULL;
+#endif
+  return 0;
+}
+
+// Run the loaded case on every tier; sets bit t of the result for each
+// tier t that got it wrong. Only tiers in mask are run.
+static unsigned fuzz_check(struct worker *w, const struct ref *want,
+                           unsigned mask, int count) {
+  unsigned failed = 0;
+  for (int t = TIER_TABLE; t <= TIER_THREADED; t++) {
+    if (!(mask & 1u << t) || (t == TIER_THREADED && !CPU_THREADED))
+      continue;
+    if (fuzz_run(w, t) != RUN_BRK || !fuzz_matches(w, want))
+      failed |= 1u << t;
+    w->runs[t] += count;
+  }
+  if (CPU_BLOCKS && (mask & (1u << TIER_BLOCKS | 1u << TIER_JIT))) {
+    for (int i = 0; i < FUZZ_BLOCK_RUNS; i++) {
+      int t = fuzz_native(w) ? TIER_JIT : TIER_BLOCKS;
+      if (fuzz_run(w, t) != RUN_BRK || !fuzz_matches(w, want))
+        failed |= 1u << t;
+      w->runs[t] += count;
+    }
+  }
+#if CPU_WIDE
+  if (mask & 1u << TIER_WIDE) {
+    if (fuzz_run_wide(w, want) >= 0)
+      failed |= 1u << TIER_WIDE;
+    w->runs[TIER_WIDE] += count;
+  }
+#endif
+  return failed & mask;
+}
+
+/* --------------------------------------------------------- */
+/* Shrinking and reporting                                    */
+/* --------------------------------------------------------- */
+
+struct failure {
+  int found;
+  struct fuzz_case c;
+};
+
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct failure *failures[NTIERS][256];
+
+// Whether trial still trips tier t. Leaves the case loaded and w->want set.
+static int fuzz_still_fails(struct worker *w, struct fuzz_case *trial, int t) {
+  if (fuzz_expect(trial, w->want) != 0)
+    return 0;
+  fuzz_load(w, trial);
+  return (fuzz_check(w, w->want, 1u << t, 0) >> t) & 1;
+}
+
+// Shrink w->c, which fails on tier t: zero every byte of memory the
+// instruction does not touch, then each register and touched byte, then
+// single bits, for as long as the failure stays.
+static void fuzz_shrink(struct worker *w, int t) {
+  struct fuzz_case *best = w->c, *trial = w->trial;
+
+  *trial = *best;
+  memset(trial->mem, 0, sizeof(trial->mem));
+  fuzz_expect(best, w->want);
+  for (int i = 0; i < w->want->ntouched; i++)
+    trial->mem[w->want->touched[i]] = best->mem[w->want->touched[i]];
+  if (fuzz_still_fails(w, trial, t))
+    *best = *trial;
+
+  for (int changed = 1; changed;) {
+    changed = 0;
+    fuzz_expect(best, w->want);
+    int n = w->want->ntouched;
+    uint16_t touched[32];
+    memcpy(touched, w->want->touched, sizeof(touched));
+
+    // Registers, then the bytes the instruction touched, operand included
+    // but not the opcode.
+    for (int f = 0; f < 5 + n; f++) {
+      for (int bit = -1; bit < 8; bit++) {
+        *trial = *best;
+        uint8_t *v = f == 0   ? &trial->a
+                     : f == 1 ? &trial->x
+                     : f == 2 ? &trial->y
+                     : f == 3 ? &trial->sp
+                     : f == 4 ? &trial->p
+                              : &trial->mem[touched[f - 5]];
+        if (f >= 5 && touched[f - 5] == best->pc)
+          break;
+        uint8_t keep = f == 4 ? 0x20 : 0;
+        uint8_t next = bit < 0 ? keep : (*v & ~(1u << bit)) | keep;
+        if (next == *v)
+          continue;
+        *v = next;
+        if (fuzz_still_fails(w, trial, t)) {
+          *best = *trial;
+          changed = 1;
+        }
+      }
+    }
+  }
+}
+
+static void fuzz_record(struct worker *w, int t) {
+  uint8_t op = w->c->mem[w->c->pc];
+
+  pthread_mutex_lock(&failures_lock);
+  int first = !failures[t][op] || failures[t][op]->c.index > w->c->index;
+  pthread_mutex_unlock(&failures_lock);
+  if (!first)
+    return;
+
+  struct failure *f = malloc(sizeof(struct failure));
+  f->c = *w->c;
+  struct fuzz_case *saved = w->c;
+  w->c = &f->c;
+  fuzz_shrink(w, t);
+  w->c = saved;
+
+  pthread_mutex_lock(&failures_lock);
+  if (!failures[t][op] || failures[t][op]->c.index > f->c.index) {
+    free(failures[t][op]);
+    failures[t][op] = f;
+    f = NULL;
+  }
+  pthread_mutex_unlock(&failures_lock);
+  free(f);
+}
+
+static void fuzz_disasm(const uint8_t *code, char *out, size_t size) {
+  const struct ref_op *o = &ref_ops[code[0]];
+  const char *n = ref_names[o->insn];
+  unsigned b = code[1], w = code[1] | code[2] << 8;
+  switch (o->mode) {
+  case M_IMP: snprintf(out, size, "%s", n); break;
+  case M_ACC: snprintf(out, size, "%s A", n); break;
+  case M_IMM: snprintf(out, size, "%s #$%02X", n, b); break;
+  case M_ZP: snprintf(out, size, "%s $%02X", n, b); break;
+  case M_ZPX: snprintf(out, size, "%s $%02X,X", n, b); break;
+  case M_ZPY: snprintf(out, size, "%s $%02X,Y", n, b); break;
+  case M_ABS: snprintf(out, size, "%s $%04X", n, w); break;
+  case M_ABX: snprintf(out, size, "%s $%04X,X", n, w); break;
+  case M_ABY: snprintf(out, size, "%s $%04X,Y", n, w); break;
+  case M_IND: snprintf(out, size, "%s ($%04X)", n, w); break;
+  case M_IZX: snprintf(out, size, "%s ($%02X,X)", n, b); break;
+  case M_IZY: snprintf(out, size, "%s ($%02X),Y", n, b); break;
+  case M_REL: snprintf(out, size, "%s %+d", n, (int8_t)b); break;
+  }
+}
+
+static void print_regs(const char *label, unsigned a, unsigned x, unsigned y,
+                       unsigned sp, unsigned p, unsigned pc,
+                       unsigned long long cycles) {
+  printf("  %-6s A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X cycles=%llu\n",
+         label, a, x, y, sp, p, pc, cycles);
+}
+
+// Print a shrunk failure: the state going in, then what the reference and
+// the tier made of it.
+static void fuzz_report(struct worker *w, int t, struct fuzz_case *c) {
+  char text[32];
+  uint8_t code[3] = {c->mem[c->pc], c->mem[(uint16_t)(c->pc + 1)],
+                     c->mem[(uint16_t)(c->pc + 2)]};
+  fuzz_disasm(code, text, sizeof(text));
+  printf("%s: $%02X %s (case %llu)\n", tier_names[t], code[0], text,
+         (unsigned long long)c->index);
+
+  fuzz_still_fails(w, c, t); // leaves w->m where the failing run stopped
+
+  printf("  in     A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X     ", c->a,
+         c->x, c->y, c->sp, c->p, c->pc);
+  for (int i = 0; i < 0x10000; i++)
+    if (c->mem[i])
+      printf(" $%04X=%02X", i, c->mem[i]);
+  printf("\n");
+
+  const struct ref *want = w->want;
+  cpu6502 *got = &w->m->cpu;
+  print_regs("want", want->a, want->x, want->y, want->sp, want->p | 0x30,
+             want->pc, want->cycles);
+  print_regs("got", got->A, got->X, got->Y, got->SP, pack_P(got) | 0x30,
+             got->PC, got->cycles);
+  for (int i = 0; i < 0x10000; i++)
+    if (w->m->memory[i] != want->mem[i])
+      printf("  $%04X  want %02X got %02X\n", i, want->mem[i],
+             w->m->memory[i]);
+}
+
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+
+  for (uint64_t i = w->id; i < w->ncases; i += w->nworkers) {
+    fuzz_generate(w->c, w->seed, i);
+    if (fuzz_expect(w->c, w->want) != 0) {
+      w->skipped++;
+      continue;
+    }
+    fuzz_load(w, w->c);
+    unsigned failed = fuzz_check(w, w->want, ~0u, 1);
+    for (int t = 0; t < NTIERS; t++)
+      if (failed & 1u << t) {
+        w->failures[t]++;
+        fuzz_record(w, t);
+      }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t ncases = 100000, seed = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:n:s:")) != -1) {
+    if (opt == 'j') {
+      nworkers = atoi(optarg);
+    } else if (opt == 'n') {
+      ncases = strtoull(optarg, NULL, 0);
+    } else if (opt == 's') {
+      seed = strtoull(optarg, NULL, 0);
+    } else {
+      fprintf(stderr, "usage: %s [-j threads] [-n cases] [-s seed]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (nworkers < 1)
+    nworkers = 1;
+
+  pthread_t *threads = malloc(nworkers * sizeof(pthread_t));
+  struct worker *workers = calloc(nworkers, sizeof(struct worker));
+  for (int i = 0; i < nworkers; i++) {
+    struct worker *w = &workers[i];
+    w->id = i;
+    w->nworkers = nworkers;
+    w->seed = seed;
+    w->ncases = ncases;
+    w->m = machine_new();
+    w->c = malloc(sizeof(struct fuzz_case));
+    w->trial = malloc(sizeof(struct fuzz_case));
+    w->want = malloc(sizeof(struct ref));
+    pthread_create(&threads[i], NULL, worker_main, w);
+  }
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(threads[i], NULL);
+
+  uint64_t skipped = 0, runs[NTIERS] = {0}, failed[NTIERS] = {0}, total = 0;
+  for (int i = 0; i < nworkers; i++) {
+    skipped += workers[i].skipped;
+    for (int t = 0; t < NTIERS; t++) {
+      runs[t] += workers[i].runs[t];
+      failed[t] += workers[i].failures[t];
+    }
+  }
+
+  for (int t = 0; t < NTIERS; t++)
+    for (int op = 0; op < 256; op++)
+      if (failures[t][op]) {
+        fuzz_report(&workers[0], t, &failures[t][op]->c);
+        free(failures[t][op]);
+      }
+
+  printf("%llu cases, %llu skipped, seed %llu\n", (unsigned long long)ncases,
+         (unsigned long long)skipped, (unsigned long long)seed);
+  for (int t = 0; t < NTIERS; t++) {
+    if (!runs[t])
+      continue;
+    printf("  %-8s %10llu runs %8llu failed\n", tier_names[t],
+           (unsigned long long)runs[t], (unsigned long long)failed[t]);
+    total += failed[t];
+  }
+
+  for (int i = 0; i < nworkers; i++) {
+    snapshot_free(workers[i].snap);
+#if CPU_WIDE
+    wide_free(workers[i].wide);
+#endif
+    machine_free(workers[i].m);
+    free(workers[i].c);
+    free(workers[i].trial);
+    free(workers[i].want);
+  }
+  free(workers);
+  free(threads);
+  return total ? 1 : 0;
+}
@@ -0,0 +1,224 @@
+; A full-ISA workload for check-functest's throughput gate, which runs it
+; whether or not the external functional test is there. Each of 65536
+; rounds goes through every documented instruction group, in most of its
+; addressing modes, and folds what it computed into a 16-bit checksum.
+; Entered at $0400 it traps at $0700 when the sum comes out as recorded
+; below, and at $0710 when it does not, with the sum in $10-$11.
+
+sum = $10               ; checksum, low byte first
+ptr = $12               ; pointer for the indirect modes
+count = $14             ; rounds left, low byte first
+tmp = $16               ; scratch, four bytes
+brks = $1A              ; BRKs taken
+
+EXPECTED = $F622
+
+.org $0400
+start:
+    cld
+    ldx #$FF
+    txs
+    lda #0
+    sta sum
+    sta sum+1
+    sta count
+    sta count+1
+    sta brks
+    lda #<$0300
+    sta ptr
+    lda #>$0300
+    sta ptr+1
+
+round:
+    ; Loads and stores.
+    lda count
+    ldx count+1
+    ldy #3
+    sta $0300,y
+    sta $0300,x
+    stx tmp
+    sty tmp+1
+    lda (ptr),y
+    ldx #0
+    eor (ptr,x)
+    sta (ptr),y
+    sta (ptr,x)
+    ldx #1
+    ldy tmp,x
+    sty $0301
+    ldx tmp+1,y
+    stx tmp+2
+    lda $0300
+    ldy $0303
+    ldx $0301,y
+    lda $0302,x
+    ldx #2              ; keep tmp,x inside tmp from here on
+    sta tmp,x
+    sta $0300,x
+
+    ; Arithmetic, binary and decimal.
+    clc
+    adc count
+    adc #$35
+    adc tmp+2
+    adc $0300
+    adc $0300,x
+    adc (ptr),y
+    sec
+    sbc #$11
+    sbc count+1
+    sbc tmp,x
+    sbc $0301,y
+    sbc (ptr,x)
+    sed
+    adc #$19
+    sbc #$07
+    cld
+    bvc @novf
+    inc tmp+3
+@novf:
+
+    ; Logic and BIT.
+    and #$7E
+    ora count
+    eor #$A5
+    and tmp+2
+    ora $0300,x
+    eor (ptr),y
+    bit tmp
+    bit $0300
+    bmi @neg
+    nop
+@neg:
+    bvs @ovf
+    nop
+@ovf:
+
+    ; Shifts and rotates, accumulator and memory.
+    asl a
+    rol a
+    lsr a
+    ror a
+    asl tmp
+    rol tmp+1
+    lsr tmp,x
+    ror tmp+2
+    asl $0300
+    rol $0300,x
+    lsr $0301
+    ror $0302,x
+
+    ; Increments, decrements and transfers.
+    inc tmp
+    dec tmp+1
+    inc tmp,x
+    dec $0300
+    inc $0300,x
+    dec $0301,x
+    tax
+    inx
+    dex
+    dex
+    tay
+    iny
+    dey
+    txa
+    tya
+    tsx
+    txs
+
+    ; Compares and every branch.
+    cmp #$80
+    bcc @lo
+    cmp tmp
+@lo:
+    cpx #$40
+    bcs @hi
+    cpx tmp+1
+@hi:
+    cpy $0300
+    beq @eq
+    cpy tmp
+@eq:
+    cmp $0300,x
+    bne @ne
+    cmp (ptr),y
+@ne:
+    cmp tmp,x
+    bpl @pos
+    cpx $0301
+@pos:
+    cmp $0301,y
+    cmp (ptr,x)
+    cpy #$10
+
+    ; The stack, flags, subroutines, jumps and BRK.
+    php
+    pha
+    sec
+    sei
+    clv
+    pla
+    plp
+    cli
+    jsr fold
+    jmp (vec)
+back:
+    brk
+    .byte 0             ; BRK skips this
+
+    ; Next round.
+    lda count
+    bne @dec_lo
+    dec count+1
+@dec_lo:
+    dec count
+    lda count
+    ora count+1
+    beq done
+    jmp round
+done:
+    lda brks
+    cmp #0              ; 65536 BRKs wrap it back to 0
+    bne @bad
+    lda sum
+    cmp #<EXPECTED
+    bne @bad
+    lda sum+1
+    cmp #>EXPECTED
+    bne @bad
+    jmp success
+@bad:
+    jmp fail
+
+; Add A and the carry into sum, then mix sum's high byte into its low one.
+fold:
+    adc sum
+    sta sum
+    lda sum+1
+    adc #0
+    sta sum+1
+    asl sum
+    rol sum+1
+    lda sum
+    adc #0
+    sta sum
+    rts
+
+irq:
+    inc brks
+    rti
+
+vec:
+    .word back
+
+.org $0700
+success:
+    jmp success
+
+.org $0710
+fail:
+    jmp fail
+
+.org $FFFE
+    .word irq
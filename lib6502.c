@@ -0,0 +1,178 @@
+#include "cpu.c"
+#include "cpu6502.h"
+
+/*
+ * lib6502: cpu6502.h over cpu.c. Built with -fvisibility=hidden (make lib),
+ * so the calls below are all the library exports; the rest of cpu.c stays
+ * internal and free to change.
+ */
+
+_Static_assert((int)CPU6502_BRK == RUN_BRK &&
+                   (int)CPU6502_BUDGET == RUN_BUDGET &&
+                   (int)CPU6502_YIELD == RUN_YIELD,
+               "cpu6502_status must match run_status");
+
+// A device mapped through cpu6502_map_io, shared by the pages it covers
+// and freed with the last of them.
+struct lib_io {
+  bus_device dev;
+  cpu6502_read_fn read;
+  cpu6502_write_fn write;
+  void *ctx;
+  unsigned pages;
+};
+
+static uint8_t lib_io_read(bus_device *dev, machine6502 *m, uint16_t addr) {
+  struct lib_io *io = (struct lib_io *)dev;
+  return io->read(io->ctx, m, addr);
+}
+
+static void lib_io_write(bus_device *dev, machine6502 *m, uint16_t addr,
+                         uint8_t value) {
+  struct lib_io *io = (struct lib_io *)dev;
+  io->write(io->ctx, m, addr, value);
+}
+
+// Drop the pages' hold on the devices mapped there with cpu6502_map_io,
+// before the pages are mapped again.
+static void lib_io_release(machine6502 *m, unsigned page, unsigned npages) {
+  for (unsigned p = page; p < page + npages && p < 256; p++) {
+    if (m->rd[p] || m->dev[p]->read != lib_io_read)
+      continue;
+    struct lib_io *io = (struct lib_io *)m->dev[p];
+    if (--io->pages == 0)
+      free(io);
+  }
+}
+
+CPU6502_API unsigned cpu6502_abi_version(void) { return CPU6502_ABI_VERSION; }
+
+CPU6502_API cpu6502_machine *cpu6502_new(void) { return machine_new(); }
+
+CPU6502_API void cpu6502_free(cpu6502_machine *m) {
+  if (m)
+    lib_io_release(m, 0, 256);
+  machine_free(m);
+}
+
+CPU6502_API void cpu6502_reset(cpu6502_machine *m) {
+  uint64_t cycles = m->cpu.cycles;
+  m->cpu = (cpu6502){.SP = 0xFF, .cycles = cycles};
+  unpack_P(&m->cpu, 0);
+  m->cpu.PC = (uint16_t)(bus_read(m, 0xFFFC) | bus_read(m, 0xFFFD) << 8);
+}
+
+CPU6502_API int cpu6502_load(cpu6502_machine *m, uint16_t addr,
+                             const void *data, size_t len) {
+  if (len > 0x10000u - addr)
+    return -1;
+  if (!len)
+    return 0;
+  memcpy(&m->memory[addr], data, len);
+  mem_changed(m, addr >> 8, ((addr + len - 1) >> 8) - (addr >> 8) + 1);
+  return 0;
+}
+
+CPU6502_API int cpu6502_load_file(cpu6502_machine *m, const char *path,
+                                  uint16_t addr) {
+  size_t len = strlen(path);
+  if (len > 2 && !strcmp(path + len - 2, ".s")) {
+    struct asm_image *code = asm_open(path);
+    if (!code)
+      return -1;
+    asm_load(m, code);
+    asm_close(code);
+    return 0;
+  }
+
+  // Copied into RAM rather than mapped, so the file can be closed.
+  struct rom_image *img = rom_open(path, addr);
+  if (!img)
+    return -1;
+  for (unsigned p = 0; p < 256; p++)
+    if (img->page[p])
+      memcpy(&m->memory[p << 8], img->page[p], 256);
+  if (!img->has_vector) {
+    m->memory[0xFFFC] = img->entry & 0xFF;
+    m->memory[0xFFFD] = img->entry >> 8;
+  }
+  mem_changed(m, 0, 256);
+  rom_close(img);
+  return 0;
+}
+
+CPU6502_API uint8_t cpu6502_peek(const cpu6502_machine *m, uint16_t addr) {
+  return dis_peek(m, addr);
+}
+
+CPU6502_API void cpu6502_poke(cpu6502_machine *m, uint16_t addr,
+                              uint8_t value) {
+  if (m->wr[addr >> 8])
+    m->wr[addr >> 8][addr & 0xFF] = value;
+  else
+    m->memory[addr] = value;
+  mem_changed(m, addr >> 8, 1);
+}
+
+CPU6502_API void cpu6502_get_regs(const cpu6502_machine *m,
+                                  struct cpu6502_regs *regs) {
+  cpu6502 cpu = m->cpu;
+  *regs = (struct cpu6502_regs){cpu.cycles, cpu.PC, cpu.A,
+                                cpu.X,      cpu.Y,  cpu.SP, pack_P(&cpu)};
+}
+
+CPU6502_API void cpu6502_set_regs(cpu6502_machine *m,
+                                  const struct cpu6502_regs *regs) {
+  m->cpu.cycles = regs->cycles;
+  m->cpu.PC = regs->pc;
+  m->cpu.A = regs->a;
+  m->cpu.X = regs->x;
+  m->cpu.Y = regs->y;
+  m->cpu.SP = regs->sp;
+  unpack_P(&m->cpu, regs->p);
+  // Events may now be due, and I may have been cleared.
+  m->wake = 0;
+}
+
+CPU6502_API int cpu6502_step(cpu6502_machine *m) {
+  if (m->cpu.cycles >= m->wake)
+    events_run(m);
+  return cpu_step(m);
+}
+
+CPU6502_API int cpu6502_run(cpu6502_machine *m, uint64_t cycles) {
+  return run_cpu_for(m, cycles);
+}
+
+CPU6502_API void cpu6502_yield(cpu6502_machine *m) { cpu_yield(m); }
+
+CPU6502_API int cpu6502_map_io(cpu6502_machine *m, unsigned page,
+                               unsigned npages, cpu6502_read_fn read,
+                               cpu6502_write_fn write, void *ctx) {
+  if (page >= 256 || !npages)
+    return 0;
+  if (npages > 256 - page)
+    npages = 256 - page;
+  struct lib_io *io = malloc(sizeof(struct lib_io));
+  if (!io)
+    return -1;
+  *io = (struct lib_io){{lib_io_read, lib_io_write}, read, write, ctx, npages};
+  lib_io_release(m, page, npages);
+  bus_map_device(m, page, npages, &io->dev);
+  return 0;
+}
+
+CPU6502_API void cpu6502_map_ram(cpu6502_machine *m, unsigned page,
+                                 unsigned npages) {
+  lib_io_release(m, page, npages);
+  bus_map_ram(m, page, npages);
+}
+
+CPU6502_API void cpu6502_irq(cpu6502_machine *m, uint8_t source, int level) {
+  if (level)
+    irq_raise(m, source);
+  else
+    irq_clear(m, source);
+}
+
+CPU6502_API void cpu6502_nmi(cpu6502_machine *m) { nmi_raise(m); }
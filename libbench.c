@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cpu6502.h"
+#include "workloads.c"
+
+/*
+ * libbench: run bench's workloads through lib6502, the way an embedder
+ * would, and report emulated MHz. make lib also runs it against an
+ * instrumented build of the library, for the profile that the optimised
+ * build is made from. Each workload runs reps times by cpu6502_run and
+ * once instruction by instruction with cpu6502_step.
+ */
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+  if (cpu6502_abi_version() != CPU6502_ABI_VERSION) {
+    fprintf(stderr, "lib6502 ABI %u, expected %u\n", cpu6502_abi_version(),
+            CPU6502_ABI_VERSION);
+    return 1;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+    const struct workload *w = &workloads[i];
+    cpu6502_machine *m = cpu6502_new();
+    if (!m || cpu6502_load(m, 0x8000, w->code, w->len) != 0) {
+      fprintf(stderr, "%s: could not set up a machine\n", w->name);
+      return 1;
+    }
+
+    struct cpu6502_regs start, regs;
+    cpu6502_get_regs(m, &start);
+    start.pc = 0x8000;
+    double t0 = now();
+    for (int r = 0; r < w->reps; r++) {
+      cpu6502_get_regs(m, &regs);
+      start.cycles = regs.cycles;
+      cpu6502_set_regs(m, &start);
+      failed |= (cpu6502_run(m, UINT64_MAX) != CPU6502_BRK);
+    }
+    double t = now() - t0;
+    cpu6502_get_regs(m, &regs);
+    uint64_t cycles = regs.cycles;
+
+    start.cycles = cycles;
+    cpu6502_set_regs(m, &start);
+    while (cpu6502_step(m) != 0x00)
+      ;
+    cpu6502_get_regs(m, &regs);
+    failed |= (regs.cycles - cycles != cycles / w->reps);
+
+    printf("%-8s %10.1f MHz\n", w->name, cycles / t / 1e6);
+    cpu6502_free(m);
+  }
+
+  if (failed)
+    fprintf(stderr, "a workload did not end at BRK the same way each time\n");
+  return failed ? 1 : 0;
+}
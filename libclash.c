@@ -0,0 +1,43 @@
+#include <stdio.h>
+
+#include "cpu6502.h"
+
+/*
+ * libclash: link lib6502.a into a program that has its own functions named
+ * like the core's internals, as an embedder well might. make lib builds and
+ * runs it; if the archive exported anything beyond the cpu6502_ API, the
+ * link would fail with multiple definitions.
+ */
+
+static int loaded, pushed;
+
+int load_bin(const char *path) {
+  (void)path;
+  return ++loaded;
+}
+
+void push_c(int value) { pushed += value; }
+
+int main(void) {
+  static const unsigned char inx[] = {0xE8, 0x00}; // INX, BRK
+  cpu6502_machine *m = cpu6502_new();
+  if (!m || cpu6502_load(m, 0x0400, inx, sizeof(inx)) != 0)
+    return 1;
+
+  struct cpu6502_regs regs;
+  cpu6502_get_regs(m, &regs);
+  regs.pc = 0x0400;
+  regs.x = 41;
+  cpu6502_set_regs(m, &regs);
+  int status = cpu6502_run(m, 1000);
+  cpu6502_get_regs(m, &regs);
+  cpu6502_free(m);
+
+  push_c(load_bin("none"));
+  if (status != CPU6502_BRK || regs.x != 42 || pushed != 1) {
+    fprintf(stderr, "libclash: X=%u after the run, expected 42\n", regs.x);
+    return 1;
+  }
+  printf("libclash: OK\n");
+  return 0;
+}
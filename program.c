@@ -1,160 +1,373 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cpu.c"
 
-#undef STA
-#define STA(addr) STA_os(addr)
-
 #define IO_PUTCHAR 0xFF00
+#define IO_GETCHAR 0xFF01
+#define IO_FLUSH 0xFF02
 #define PROGRAM_START 0x8000
 
-void STA_os(uint16_t addr) {
-  if (addr == IO_PUTCHAR) {
-    putchar(default_cpu.A);
-    fflush(stdout);
-  } else {
-    memory[addr] = default_cpu.A;
+#define CONSOLE_BUF 4096
+
+/*
+ * Record and replay. With -r every read of the console is logged along with
+ * the cycle count it happened at; with -p the log answers the reads instead
+ * of stdin, so a run can be repeated exactly, offline and at full speed.
+ *
+ * A log is "65TR" and a version byte, then one record per read:
+ *
+ *   varint  cycles since the previous record << 2 | kind
+ *   kind 0  value                      same address as the previous read
+ *   kind 1  address (little endian), value
+ *   kind 2  nothing; the run ended at this cycle count
+ *
+ * Varints are LEB128: seven bits a byte, low bits first, top bit set on all
+ * but the last. A read of $FF01 usually takes two bytes.
+ */
+#define IOLOG_MAGIC "65TR\x01"
+
+enum { IOLOG_SAME, IOLOG_ADDR, IOLOG_END };
+
+struct iolog {
+  FILE *f;
+  uint64_t cycles; // of the previous record
+  uint16_t addr;   // of the previous read
+  uint64_t reads;
+  int diverged;
+};
+
+static struct iolog record, replay;
+
+static void put_varint(FILE *f, uint64_t v) {
+  while (v >= 0x80) {
+    putc((int)(v & 0x7F) | 0x80, f);
+    v >>= 7;
   }
+  putc((int)v, f);
 }
 
-int load_bin(const char *path, uint16_t load_addr) {
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    perror("fopen");
-    return -1;
+static int get_varint(FILE *f, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(f);
+    if (c == EOF)
+      return -1;
+    *v |= (uint64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80))
+      return 0;
   }
+  return -1;
+}
 
-  fseek(f, 0, SEEK_END);
-  long size = ftell(f);
-  rewind(f);
+static void iolog_put(struct iolog *t, uint64_t cycles, int kind) {
+  put_varint(t->f, (cycles - t->cycles) << 2 | kind);
+  t->cycles = cycles;
+}
 
-  if (size <= 0 || load_addr + size > 0x10000) {
-    fprintf(stderr, "invalid binary size\n");
-    fclose(f);
-    return -1;
+static void iolog_record(struct iolog *t, uint64_t cycles, uint16_t addr,
+                         uint8_t value) {
+  if (addr == t->addr && t->reads) {
+    iolog_put(t, cycles, IOLOG_SAME);
+  } else {
+    iolog_put(t, cycles, IOLOG_ADDR);
+    putc(addr & 0xFF, t->f);
+    putc(addr >> 8, t->f);
+    t->addr = addr;
   }
+  putc(value, t->f);
+  t->reads++;
+}
 
-  fread(&memory[load_addr], 1, (size_t)size, f);
-  fclose(f);
+// Report the first place the run stops matching the log. The run goes
+// on regardless, being fed what the log says.
+static void iolog_diverged(struct iolog *t, const char *what, uint64_t cycles,
+                           uint16_t addr) {
+  if (!t->diverged)
+    fprintf(stderr,
+            "replay: %s at read %llu: cycle %llu $%04X, log has cycle "
+            "%llu $%04X\n",
+            what, (unsigned long long)t->reads, (unsigned long long)cycles,
+            addr, (unsigned long long)t->cycles, t->addr);
+  t->diverged = 1;
+}
 
-  memory[0xFFFC] = load_addr & 0xFF;
-  memory[0xFFFD] = (load_addr >> 8) & 0xFF;
+// Read the next record; returns its kind, or -1 at a truncated log.
+static int iolog_get(struct iolog *t, uint8_t *value) {
+  uint64_t tag;
+  int kind;
+  if (get_varint(t->f, &tag) != 0)
+    return -1;
+  t->cycles += tag >> 2;
+  kind = (int)(tag & 3);
+  if (kind == IOLOG_ADDR) {
+    int lo = getc(t->f), hi = getc(t->f);
+    t->addr = (uint16_t)(lo | hi << 8);
+  }
+  if (kind == IOLOG_SAME || kind == IOLOG_ADDR) {
+    int c = getc(t->f);
+    if (c == EOF)
+      return -1;
+    *value = (uint8_t)c;
+  }
+  return kind;
+}
 
-  return 0;
+static uint8_t iolog_replay(struct iolog *t, uint64_t cycles, uint16_t addr) {
+  uint8_t value = 0;
+  int kind = iolog_get(t, &value);
+  if (kind == IOLOG_END || kind < 0) {
+    fseek(t->f, 0, SEEK_END); // stay at the end from now on
+    iolog_diverged(t, "log ended", cycles, addr);
+    return 0;
+  }
+  if (t->cycles != cycles || t->addr != addr)
+    iolog_diverged(t, "mismatch", cycles, addr);
+  t->reads++;
+  return value;
 }
 
-void cpu_step(cpu6502 *cpu) {
-  uint8_t opcode = memory[cpu->PC++];
+/*
+ * Page $FF: the console ports, with the vectors and the rest of the page
+ * left as RAM.
+ *
+ *   $FF00  write  append a byte to the output buffer
+ *   $FF01  read   next byte of stdin, 0 at end of input
+ *   $FF02  write  flush the output buffer
+ *
+ * Output is written out when the buffer fills, on a write to $FF02, when
+ * the program stops, and before blocking on input. On a terminal it is also
+ * written out at each newline, like stdio's line buffering.
+ */
+struct console {
+  bus_device dev;
+  int line_buffered;
 
-  switch (opcode) {
-  case 0xA9: { // LDA immediate
-    uint8_t value = memory[cpu->PC++];
-    LDA_c(cpu, value);
-    break;
-  }
+  size_t out_len;
+  uint8_t out[CONSOLE_BUF];
 
-  case 0x8D: { // STA absolute
-    uint8_t lo = memory[cpu->PC++];
-    uint8_t hi = memory[cpu->PC++];
-    uint16_t addr = ((uint16_t)hi << 8) | lo;
-    STA(addr);
-    break;
-  }
-  case 0xA2: { // LDX immediate
-    uint8_t value = memory[cpu->PC++];
-    LDX_c(cpu, value);
-    break;
+  size_t in_pos, in_len;
+  uint8_t in[CONSOLE_BUF];
+};
+
+static void console_flush(struct console *con) {
+  if (con->out_len) {
+    fwrite(con->out, 1, con->out_len, stdout);
+    con->out_len = 0;
   }
+  fflush(stdout);
+}
 
-  case 0xE8: // INX
-    INX_c(cpu);
-    break;
+static uint8_t console_getc(struct console *con) {
+  if (con->in_pos == con->in_len) {
+    // Let the program's prompt out before we wait for a reply, and get the
+    // log so far onto disk in case the wait ends in a kill.
+    console_flush(con);
+    if (record.f)
+      fflush(record.f);
 
-  case 0xE0: { // CPX immediate
-    uint8_t value = memory[cpu->PC++];
-    CPX_c(cpu, value);
-    break;
+    ssize_t n = read(STDIN_FILENO, con->in, sizeof(con->in));
+    if (n <= 0)
+      return 0;
+    con->in_pos = 0;
+    con->in_len = (size_t)n;
   }
+  return con->in[con->in_pos++];
+}
 
-  case 0x90: { // BCC relative
-    int8_t offset = (int8_t)memory[cpu->PC++];
-    BCC_c(cpu, offset);
-    break;
-  }
+static void console_putc(struct console *con, uint8_t c) {
+  con->out[con->out_len++] = c;
+  if (con->out_len == sizeof(con->out) || (c == '\n' && con->line_buffered))
+    console_flush(con);
+}
 
-  case 0x4C: { // JMP absolute
-    uint8_t lo = memory[cpu->PC++];
-    uint8_t hi = memory[cpu->PC++];
-    uint16_t addr = ((uint16_t)hi << 8) | lo;
-    JMP_c(cpu, addr);
-    break;
-  }
-  case 0x8A: { // TXA
-    TXA_c(cpu);
-    break;
-  }
-  case 0x69: { // ADC immediate
-    uint8_t value = memory[cpu->PC++];
-    ADC_c(cpu, value);
-    break;
-  }
-  case 0xCA: { // DEX
-    DEX_c(cpu);
-    break;
-  }
-  case 0xD0: { // BNE relative
-    int8_t offset = (int8_t)memory[cpu->PC++];
-    BNE_c(cpu, offset);
-    break;
-  }
-  case 0x20: { // JSR absolute
-    uint8_t lo = memory[cpu->PC++];
-    uint8_t hi = memory[cpu->PC++];
-    uint16_t addr = ((uint16_t)hi << 8) | lo;
-    JSR_c(cpu, addr);
-    break;
-  }
-  case 0x60: { // RTS
-    RTS_c(cpu);
-    break;
-  }
-  case 0x00: // BRK
-    return;
+static uint8_t console_read(bus_device *dev, machine6502 *m, uint16_t addr) {
+  uint8_t value;
+  if (replay.f)
+    return iolog_replay(&replay, m->cpu.cycles, addr);
+  if (addr == IO_GETCHAR)
+    value = console_getc((struct console *)dev);
+  else
+    value = m->memory[addr];
+  if (record.f)
+    iolog_record(&record, m->cpu.cycles, addr, value);
+  return value;
+}
 
-  default:
-    printf("Unknown opcode: %02X at %04X\n", opcode, cpu->PC - 1);
-    return;
-  }
+static void console_write(bus_device *dev, machine6502 *m, uint16_t addr,
+                          uint8_t value) {
+  if (addr == IO_PUTCHAR)
+    console_putc((struct console *)dev, value);
+  else if (addr == IO_FLUSH)
+    console_flush((struct console *)dev);
+  else
+    m->memory[addr] = value;
 }
 
-void run_cpu(cpu6502 *cpu) {
-  for (;;) {
-    uint8_t opcode = memory[cpu->PC];
-    cpu_step(cpu);
+static struct console console = {{console_read, console_write}};
 
-    if (opcode == 0x00) { /* BRK */
-      break;
-    }
+static FILE *iolog_open(const char *path, const char *mode) {
+  FILE *f = fopen(path, mode);
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  char magic[sizeof(IOLOG_MAGIC) - 1];
+  if (*mode == 'w') {
+    fwrite(IOLOG_MAGIC, 1, sizeof(magic), f);
+  } else if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+             memcmp(magic, IOLOG_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s: not an I/O log\n", path);
+    fclose(f);
+    return NULL;
   }
+  return f;
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "usage: %s program.bin\n", argv[0]);
+  const char *usage =
+      "usage: %s [-r log | -p log] [-t trace | -T trace] [-P profile] "
+      "program.bin|.s\n";
+  const char *insn_trace = NULL, *profile_path = NULL;
+  int opt, insn_lossy = 0;
+
+  while ((opt = getopt(argc, argv, "r:p:t:T:P:")) != -1) {
+    if (opt == 't' || opt == 'T') {
+      insn_trace = optarg;
+      insn_lossy = (opt == 'T');
+      continue;
+    }
+    if (opt == 'P') {
+      profile_path = optarg;
+      continue;
+    }
+    if (opt == 'r' && !replay.f)
+      record.f = iolog_open(optarg, "wb");
+    else if (opt == 'p' && !record.f)
+      replay.f = iolog_open(optarg, "rb");
+    else {
+      fprintf(stderr, usage, argv[0]);
+      return 1;
+    }
+    if (!record.f && !replay.f)
+      return 1;
+  }
+  if (optind >= argc) {
+    fprintf(stderr, usage, argv[0]);
     return 1;
   }
 
-  reset_cpu();
+  static machine6502 machine;
+
+  console.line_buffered = isatty(STDOUT_FILENO);
+
+  reset_cpu_c(&machine);
+  bus_map_device(&machine, IO_PUTCHAR >> 8, 1, &console.dev);
+
+  // Source is assembled in-process; anything else is an image from ld65.
+  const char *path = argv[optind];
+  size_t len = strlen(path);
+  struct rom_image *image = NULL;
+  if (len > 2 && !strcmp(path + len - 2, ".s")) {
+    struct asm_image *code = asm_open(path);
+    if (!code)
+      return 1;
+    asm_load(&machine, code);
+    asm_close(code);
+  } else {
+    image = rom_open(path, PROGRAM_START);
+    if (!image)
+      return 1;
+    bus_map_image(&machine, image);
+  }
+
+  machine.cpu.PC = (uint16_t)bus_read(&machine, 0xFFFC) |
+                   ((uint16_t)bus_read(&machine, 0xFFFD) << 8);
 
-  if (load_bin(argv[1], PROGRAM_START) != 0) {
+  // Every instruction run, for tracedump. With -T the program never waits
+  // on the trace, which drops what it cannot keep up with.
+#if CPU_TRACING
+  FILE *insn_out = insn_trace ? fopen(insn_trace, "wb") : NULL;
+  if (insn_trace &&
+      (!insn_out || (insn_lossy ? trace_start_lossy(&machine, insn_out)
+                                : trace_start(&machine, insn_out)) != 0)) {
+    perror(insn_trace);
     return 1;
   }
+#else
+  (void)insn_lossy;
+  if (insn_trace) {
+    fprintf(stderr, "%s: -t and -T need a build with -DCPU_TRACE\n",
+            argv[0]);
+    return 1;
+  }
+#endif
+
+  // The hot spots go to the profile file, and the call stacks to the same
+  // name with .folded added, for flamegraph.pl.
+  struct profile *profile = NULL;
+  if (profile_path) {
+    profile = profile_new();
+    profile_run(&machine, profile, UINT64_MAX);
+  } else {
+    run_cpu(&machine);
+  }
+  console_flush(&console);
+  rom_close(image);
+  if (machine.undocumented)
+    fprintf(stderr, "%s: ran %llu undocumented opcodes as NOPs, the first at "
+            "$%04X\n", path, (unsigned long long)machine.undocumented,
+            machine.undocumented_pc);
+
+  if (profile) {
+    size_t len = strlen(profile_path);
+    char *folded = malloc(len + sizeof(".folded"));
+    memcpy(folded, profile_path, len);
+    memcpy(folded + len, ".folded", sizeof(".folded"));
+    FILE *report = fopen(profile_path, "w");
+    FILE *stacks = fopen(folded, "w");
+    int failed = !report || !stacks;
+    if (report) {
+      profile_report(profile, report, 50);
+      failed |= (fclose(report) != 0);
+    }
+    if (stacks) {
+      profile_collapsed(profile, stacks);
+      failed |= (fclose(stacks) != 0);
+    }
+    if (failed)
+      fprintf(stderr, "%s: could not write the profile\n", profile_path);
+    free(folded);
+    profile_free(profile);
+  }
 
-  default_cpu.PC = (uint16_t)memory[0xFFFC] | ((uint16_t)memory[0xFFFD] << 8);
+#if CPU_TRACING
+  if (insn_out) {
+    uint64_t dropped = trace_dropped(&machine);
+    if (dropped)
+      fprintf(stderr, "%s: %llu instructions dropped\n", insn_trace,
+              (unsigned long long)dropped);
+    if (trace_stop(&machine) != 0)
+      fprintf(stderr, "%s: write error\n", insn_trace);
+    fclose(insn_out);
+  }
+#endif
 
-  run_cpu(&default_cpu);
+  if (record.f) {
+    iolog_put(&record, machine.cpu.cycles, IOLOG_END);
+    fclose(record.f);
+  }
+  if (replay.f) {
+    uint8_t value;
+    if (iolog_get(&replay, &value) != IOLOG_END ||
+        replay.cycles != machine.cpu.cycles)
+      iolog_diverged(&replay, "run ended", machine.cpu.cycles, 0);
+    fclose(replay.f);
+    return replay.diverged ? 2 : 0;
+  }
 
   return 0;
 }
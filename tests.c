@@ -1,6 +1,112 @@
-#include "cpu.c"
+#include "lib6502.c"
 #include <stdio.h>
 
+static machine6502 m;
+#define MACHINE (&m)
+
+/* Records the last write and answers reads with the low address byte. */
+struct test_device {
+  bus_device dev;
+  int writes;
+  uint16_t last_addr;
+  uint8_t last_value;
+};
+
+static uint8_t test_device_read(bus_device *dev, machine6502 *m,
+                                uint16_t addr) {
+  return addr & 0xFF;
+}
+
+static void test_device_write(bus_device *dev, machine6502 *m, uint16_t addr,
+                              uint8_t value) {
+  struct test_device *td = (struct test_device *)dev;
+  td->writes++;
+  td->last_addr = addr;
+  td->last_value = value;
+}
+
+static void raise_irq(machine6502 *m, void *ctx) { irq_raise(m, 0x01); }
+
+static void raise_both(machine6502 *m, void *ctx) {
+  irq_raise(m, 0x01);
+  nmi_raise(m);
+}
+
+static void tick(machine6502 *m, void *ctx) {
+  int *ticks = ctx;
+  (*ticks)++;
+  event_schedule(m, m->cpu.cycles + 1000, tick, ctx);
+}
+
+/* A cpu6502.h device: reads answer 'A', writes are counted. */
+struct api_io {
+  int writes;
+  uint8_t last;
+};
+
+static uint8_t api_io_read(void *ctx, cpu6502_machine *m, uint16_t addr) {
+  return 'A';
+}
+
+static void api_io_write(void *ctx, cpu6502_machine *m, uint16_t addr,
+                         uint8_t value) {
+  struct api_io *io = ctx;
+  io->writes++;
+  io->last = value;
+}
+
+#if CPU_SCHED
+/* One byte of input at $FF01; reading it while empty parks the machine. */
+struct park_input {
+  bus_device dev;
+  uint8_t byte;
+};
+
+static uint8_t park_input_read(bus_device *dev, machine6502 *m,
+                               uint16_t addr) {
+  struct park_input *in = (struct park_input *)dev;
+  uint8_t c = in->byte;
+  if (!c)
+    sched_park(m);
+  in->byte = 0;
+  return c;
+}
+
+/* The machines that left a scheduler, in order, with the cycles watch had
+   run at the time. */
+struct sched_log {
+  machine6502 *m[4], *watch;
+  int status[4];
+  uint64_t watched[4];
+  int n;
+};
+
+static void sched_left(machine6502 *m, int status, void *ctx) {
+  struct sched_log *log = ctx;
+  if (log->n < 4) {
+    log->m[log->n] = m;
+    log->status[log->n] = status;
+    log->watched[log->n] = log->watch ? log->watch->cpu.cycles : 0;
+  }
+  log->n++;
+}
+#endif
+
+#if CPU_TRACING
+struct trace_log {
+  struct trace_entry e[16];
+  int n;
+};
+
+static int collect_entry(const struct trace_entry *e, void *ctx) {
+  struct trace_log *log = ctx;
+  if (log->n < 16)
+    log->e[log->n] = *e;
+  log->n++;
+  return 0;
+}
+#endif
+
 static int total_tests = 0;
 static int passed_tests = 0;
 
@@ -23,10 +129,10 @@ static int passed_tests = 0;
 
 static int flags_equal(uint8_t C, uint8_t Z, uint8_t I, uint8_t D, uint8_t B,
                        uint8_t U, uint8_t V, uint8_t N) {
-  return (default_cpu.P.C == C && default_cpu.P.Z == Z &&
-          default_cpu.P.I == I && default_cpu.P.D == D &&
-          default_cpu.P.B == B && default_cpu.P.U == U &&
-          default_cpu.P.V == V && default_cpu.P.N == N);
+  return (m.cpu.P.C == C && flag_Z(&m.cpu) == Z &&
+          m.cpu.P.I == I && m.cpu.P.D == D &&
+          m.cpu.P.B == B && m.cpu.P.U == U &&
+          m.cpu.P.V == V && flag_N(&m.cpu) == N);
 }
 
 int main(void) {
@@ -35,20 +141,20 @@ int main(void) {
   BEGIN_TEST("RESET initializes registers and memory");
   reset_cpu();
   int ok_reset =
-      (default_cpu.A == 0 && default_cpu.X == 0 && default_cpu.Y == 0 &&
-       default_cpu.SP == 0xFF && default_cpu.P.U == 1);
+      (m.cpu.A == 0 && m.cpu.X == 0 && m.cpu.Y == 0 &&
+       m.cpu.SP == 0xFF && m.cpu.P.U == 1);
   for (int i = 0; i < 0x10000 && ok_reset; i++)
-    if (memory[i] != 0)
+    if (m.memory[i] != 0)
       ok_reset = 0;
   END_TEST(ok_reset);
 
   BEGIN_TEST("LDA sets A and flags correctly");
   LDA(0x42);
-  int ok_lda = (default_cpu.A == 0x42 && !default_cpu.P.Z && !default_cpu.P.N);
+  int ok_lda = (m.cpu.A == 0x42 && !flag_Z(&m.cpu) && !flag_N(&m.cpu));
   LDA(0x00);
-  ok_lda &= (default_cpu.P.Z == 1);
+  ok_lda &= (flag_Z(&m.cpu) == 1);
   LDA(0xFF);
-  ok_lda &= (default_cpu.P.N == 1);
+  ok_lda &= (flag_N(&m.cpu) == 1);
   END_TEST(ok_lda);
 
   BEGIN_TEST("ADC basic addition and flags");
@@ -57,7 +163,7 @@ int main(void) {
   CLC();
   ADC(0x05);
   int ok_adc =
-      (default_cpu.A == 0x15 && default_cpu.P.C == 0 && default_cpu.P.V == 0);
+      (m.cpu.A == 0x15 && m.cpu.P.C == 0 && m.cpu.P.V == 0);
   END_TEST(ok_adc);
 
   BEGIN_TEST("ADC overflow behavior");
@@ -65,7 +171,7 @@ int main(void) {
   LDA(0x50);
   CLC();
   ADC(0x50);
-  int ok_adc_over = (default_cpu.A == 0xA0 && default_cpu.P.V == 1);
+  int ok_adc_over = (m.cpu.A == 0xA0 && m.cpu.P.V == 1);
   END_TEST(ok_adc_over);
 
   BEGIN_TEST("Transfers (TAX TAY TXA TYA TXS TSX)");
@@ -78,8 +184,8 @@ int main(void) {
   TXS();
   TSX();
   int ok_transfers =
-      (default_cpu.A == default_cpu.X && default_cpu.X == default_cpu.Y &&
-       default_cpu.SP == default_cpu.X && default_cpu.P.Z == 0);
+      (m.cpu.A == m.cpu.X && m.cpu.X == m.cpu.Y &&
+       m.cpu.SP == m.cpu.X && flag_Z(&m.cpu) == 0);
   END_TEST(ok_transfers);
 
   BEGIN_TEST("INX/DEX/INY/DEY modify registers");
@@ -91,15 +197,15 @@ int main(void) {
   INY();
   DEY();
   int ok_incs =
-      (default_cpu.X == 0 && default_cpu.Y == 0xFF && default_cpu.P.Z == 0);
+      (m.cpu.X == 0 && m.cpu.Y == 0xFF && flag_Z(&m.cpu) == 0);
   END_TEST(ok_incs);
 
   BEGIN_TEST("Memory INC/DEC");
   reset_cpu();
-  memory[0x200] = 0x42;
+  m.memory[0x200] = 0x42;
   INC(0x200);
   DEC(0x200);
-  int ok_mem = (memory[0x200] == 0x42);
+  int ok_mem = (m.memory[0x200] == 0x42);
   END_TEST(ok_mem);
 
   BEGIN_TEST("Logic ops AND/ORA/EOR");
@@ -108,14 +214,14 @@ int main(void) {
   AND(0x0F);
   ORA(0xAA);
   EOR(0xFF);
-  int ok_logic = (default_cpu.A == 0x55);
+  int ok_logic = (m.cpu.A == 0x55);
   END_TEST(ok_logic);
 
   BEGIN_TEST("CMP");
   reset_cpu();
   LDA(0x80);
   CMP(0x80);
-  int ok_cmp = (default_cpu.P.Z == 1 && default_cpu.P.C == 1);
+  int ok_cmp = (flag_Z(&m.cpu) == 1 && m.cpu.P.C == 1);
   END_TEST(ok_cmp);
 
   BEGIN_TEST("CPX");
@@ -123,7 +229,7 @@ int main(void) {
   LDX(0x10);
   CPX(0x20);
   int ok_cpx =
-      (default_cpu.P.Z == 0 && default_cpu.P.C == 0 && default_cpu.P.N == 1);
+      (flag_Z(&m.cpu) == 0 && m.cpu.P.C == 0 && flag_N(&m.cpu) == 1);
   END_TEST(ok_cpx);
 
   BEGIN_TEST("CPY");
@@ -131,7 +237,7 @@ int main(void) {
   LDY(0x05);
   CPY(0x04);
   int ok_cpy =
-      (default_cpu.P.Z == 0 && default_cpu.P.C == 1 && default_cpu.P.N == 0);
+      (flag_Z(&m.cpu) == 0 && m.cpu.P.C == 1 && flag_N(&m.cpu) == 0);
   END_TEST(ok_cpy);
 
   BEGIN_TEST("Flag manipulation");
@@ -140,22 +246,22 @@ int main(void) {
   CLD();
   CLI();
   CLV();
-  int ok_flags = (default_cpu.P.C == 1 && default_cpu.P.D == 0 &&
-                  default_cpu.P.I == 0 && default_cpu.P.V == 0);
+  int ok_flags = (m.cpu.P.C == 1 && m.cpu.P.D == 0 &&
+                  m.cpu.P.I == 0 && m.cpu.P.V == 0);
   END_TEST(ok_flags);
 
   BEGIN_TEST("Branching BCC BEQ BPL");
   reset_cpu();
-  default_cpu.PC = 0x1000;
-  default_cpu.P.C = 0;
+  m.cpu.PC = 0x1000;
+  m.cpu.P.C = 0;
   BCC(0x10);
-  int ok_branch = (default_cpu.PC == 0x1010);
-  default_cpu.P.Z = 1;
+  int ok_branch = (m.cpu.PC == 0x1010);
+  set_Z(&m.cpu, 1);
   BEQ(0x20);
-  ok_branch &= (default_cpu.PC == 0x1030);
-  default_cpu.P.N = 0;
+  ok_branch &= (m.cpu.PC == 0x1030);
+  set_N(&m.cpu, 0);
   BPL(0x10);
-  ok_branch &= (default_cpu.PC == 0x1040);
+  ok_branch &= (m.cpu.PC == 0x1040);
   END_TEST(ok_branch);
 
   BEGIN_TEST("Stack PHA/PLA");
@@ -164,9 +270,23 @@ int main(void) {
   PHA();
   LDA(0x00);
   LDA(PLA());
-  int ok_stack = (default_cpu.A == 0xAB && default_cpu.SP == 0xFF);
+  int ok_stack = (m.cpu.A == 0xAB && m.cpu.SP == 0xFF);
   END_TEST(ok_stack);
 
+  BEGIN_TEST("Undocumented opcodes run as NOPs");
+  reset_cpu();
+  m.memory[0x0200] = 0x02; // undocumented
+  m.memory[0x0201] = 0xE8; // INX
+  m.memory[0x0202] = 0xFF; // undocumented
+  mem_changed(&m, 0x02, 1);
+  m.cpu.PC = 0x0200;
+  cpu_step(&m);
+  cpu_step(&m);
+  cpu_step(&m);
+  END_TEST(m.cpu.PC == 0x0203 && m.cpu.X == 1 &&
+           m.cpu.cycles == op_cycles[0x02] + 2u + op_cycles[0xFF] &&
+           m.undocumented == 2 && m.undocumented_pc == 0x0200);
+
   BEGIN_TEST("Store instructions");
   reset_cpu();
   LDA(0x12);
@@ -175,8 +295,8 @@ int main(void) {
   STX(0x0201);
   LDY(0x56);
   STY(0x0202);
-  int ok_store =
-      (memory[0x200] == 0x12 && memory[0x201] == 0x34 && memory[0x202] == 0x56);
+  int ok_store = (m.memory[0x200] == 0x12 && m.memory[0x201] == 0x34 &&
+                  m.memory[0x202] == 0x56);
   END_TEST(ok_store);
 
   BEGIN_TEST("BIT");
@@ -184,7 +304,7 @@ int main(void) {
   LDA(0x40);
   BIT(0xC0);
   int ok_bit =
-      (default_cpu.P.Z == 0 && default_cpu.P.V == 1 && default_cpu.P.N == 1);
+      (flag_Z(&m.cpu) == 0 && m.cpu.P.V == 1 && flag_N(&m.cpu) == 1);
   END_TEST(ok_bit);
 
   BEGIN_TEST("SBC");
@@ -192,7 +312,7 @@ int main(void) {
   LDA(0x10);
   SEC();
   SBC(0x01);
-  int ok_sbc = (default_cpu.A == 0x0F && default_cpu.P.C == 1);
+  int ok_sbc = (m.cpu.A == 0x0F && m.cpu.P.C == 1);
   END_TEST(ok_sbc);
 
   BEGIN_TEST("ASL A");
@@ -200,7 +320,7 @@ int main(void) {
   LDA(0x40);
   ASL_A();
   int ok_asl =
-      (default_cpu.A == 0x80 && default_cpu.P.C == 0 && default_cpu.P.N == 1);
+      (m.cpu.A == 0x80 && m.cpu.P.C == 0 && flag_N(&m.cpu) == 1);
   END_TEST(ok_asl);
 
   BEGIN_TEST("LSR A");
@@ -208,7 +328,7 @@ int main(void) {
   LDA(0x01);
   LSR_A();
   int ok_lsr =
-      (default_cpu.A == 0x00 && default_cpu.P.C == 1 && default_cpu.P.Z == 1);
+      (m.cpu.A == 0x00 && m.cpu.P.C == 1 && flag_Z(&m.cpu) == 1);
   END_TEST(ok_lsr);
 
   BEGIN_TEST("ROL A");
@@ -217,7 +337,7 @@ int main(void) {
   CLC();
   ROL_A();
   int ok_rol =
-      (default_cpu.A == 0x00 && default_cpu.P.C == 1 && default_cpu.P.Z == 1);
+      (m.cpu.A == 0x00 && m.cpu.P.C == 1 && flag_Z(&m.cpu) == 1);
   END_TEST(ok_rol);
 
   BEGIN_TEST("ROR A");
@@ -225,7 +345,7 @@ int main(void) {
   LDA(0x01);
   SEC();
   ROR_A();
-  int ok_ror = (default_cpu.A == 0x00 && default_cpu.P.C == 1);
+  int ok_ror = (m.cpu.A == 0x80 && m.cpu.P.C == 1);
   END_TEST(ok_ror);
 
   BEGIN_TEST("PHP/PLP");
@@ -236,50 +356,50 @@ int main(void) {
   CLC();
   CLI();
   PLP();
-  int ok_php = (default_cpu.P.C == 1 && default_cpu.P.I == 1);
+  int ok_php = (m.cpu.P.C == 1 && m.cpu.P.I == 1);
   END_TEST(ok_php);
 
   BEGIN_TEST("JSR/RTS");
   reset_cpu();
-  default_cpu.PC = 0x3000;
+  m.cpu.PC = 0x3000;
   JSR(0x4000);
   RTS();
-  int ok_jsr = (default_cpu.PC == 0x3000);
+  int ok_jsr = (m.cpu.PC == 0x3000);
   END_TEST(ok_jsr);
 
   BEGIN_TEST("RTI");
   reset_cpu();
-  default_cpu.PC = 0x2000;
+  m.cpu.PC = 0x2000;
   SEC();
-  PHP();
   push(0x12);
   push(0x34);
+  PHP();
   RTI();
-  int ok_rti = (default_cpu.PC == 0x1235 && default_cpu.P.C == 1);
+  int ok_rti = (m.cpu.PC == 0x1234 && m.cpu.P.C == 1);
   END_TEST(ok_rti);
 
   BEGIN_TEST("BVC/BVS");
   reset_cpu();
-  default_cpu.PC = 0x1000;
-  default_cpu.P.V = 0;
+  m.cpu.PC = 0x1000;
+  m.cpu.P.V = 0;
   BVC(0x10);
-  int ok_bv = (default_cpu.PC == 0x1010);
-  default_cpu.P.V = 1;
+  int ok_bv = (m.cpu.PC == 0x1010);
+  m.cpu.P.V = 1;
   BVS(0x10);
-  ok_bv &= (default_cpu.PC == 0x1020);
+  ok_bv &= (m.cpu.PC == 0x1020);
   END_TEST(ok_bv);
 
   BEGIN_TEST("JMP");
   reset_cpu();
   JMP(0xDEAD);
-  int ok_jmp = (default_cpu.PC == 0xDEAD);
+  int ok_jmp = (m.cpu.PC == 0xDEAD);
   END_TEST(ok_jmp);
 
   BEGIN_TEST("NOP");
   reset_cpu();
   LDA(0x42);
   NOP();
-  int ok_nop = (default_cpu.A == 0x42);
+  int ok_nop = (m.cpu.A == 0x42);
   END_TEST(ok_nop);
   /* --------------------------------------------------------- */
   /* Additional edge-case and correctness tests                */
@@ -291,7 +411,7 @@ int main(void) {
   CLC();
   ADC(0x01);
   int ok_adc_carry =
-      (default_cpu.A == 0x00 && default_cpu.P.C == 1 && default_cpu.P.Z == 1);
+      (m.cpu.A == 0x00 && m.cpu.P.C == 1 && flag_Z(&m.cpu) == 1);
   END_TEST(ok_adc_carry);
 
   BEGIN_TEST("ADC negative without overflow");
@@ -300,7 +420,7 @@ int main(void) {
   CLC();
   ADC(0x01);
   int ok_adc_neg =
-      (default_cpu.A == 0x81 && default_cpu.P.N == 1 && default_cpu.P.V == 0);
+      (m.cpu.A == 0x81 && flag_N(&m.cpu) == 1 && m.cpu.P.V == 0);
   END_TEST(ok_adc_neg);
 
   BEGIN_TEST("SBC borrow clears carry");
@@ -309,7 +429,7 @@ int main(void) {
   SEC();
   SBC(0x01);
   int ok_sbc_borrow =
-      (default_cpu.A == 0xFF && default_cpu.P.C == 0 && default_cpu.P.N == 1);
+      (m.cpu.A == 0xFF && m.cpu.P.C == 0 && flag_N(&m.cpu) == 1);
   END_TEST(ok_sbc_borrow);
 
   BEGIN_TEST("CMP negative result");
@@ -317,28 +437,28 @@ int main(void) {
   LDA(0x10);
   CMP(0x20);
   int ok_cmp_neg =
-      (default_cpu.P.C == 0 && default_cpu.P.N == 1 && default_cpu.P.Z == 0);
+      (m.cpu.P.C == 0 && flag_N(&m.cpu) == 1 && flag_Z(&m.cpu) == 0);
   END_TEST(ok_cmp_neg);
 
   BEGIN_TEST("Zero flag cleared on non-zero load");
   reset_cpu();
   LDA(0x00);
   LDA(0x01);
-  int ok_z_clear = (default_cpu.P.Z == 0);
+  int ok_z_clear = (flag_Z(&m.cpu) == 0);
   END_TEST(ok_z_clear);
 
   BEGIN_TEST("INX wraparound");
   reset_cpu();
   LDX(0xFF);
   INX();
-  int ok_inx_wrap = (default_cpu.X == 0x00 && default_cpu.P.Z == 1);
+  int ok_inx_wrap = (m.cpu.X == 0x00 && flag_Z(&m.cpu) == 1);
   END_TEST(ok_inx_wrap);
 
   BEGIN_TEST("DEX wraparound");
   reset_cpu();
   LDX(0x00);
   DEX();
-  int ok_dex_wrap = (default_cpu.X == 0xFF && default_cpu.P.N == 1);
+  int ok_dex_wrap = (m.cpu.X == 0xFF && flag_N(&m.cpu) == 1);
   END_TEST(ok_dex_wrap);
 
   BEGIN_TEST("Stack push/pull order");
@@ -347,22 +467,22 @@ int main(void) {
   push(0xBB);
   uint8_t v1 = pull();
   uint8_t v2 = pull();
-  int ok_stack_order = (v1 == 0xBB && v2 == 0xAA && default_cpu.SP == 0xFF);
+  int ok_stack_order = (v1 == 0xBB && v2 == 0xAA && m.cpu.SP == 0xFF);
   END_TEST(ok_stack_order);
 
   BEGIN_TEST("PHP sets B flag on stack only");
   reset_cpu();
   PHP();
   uint8_t p = pull();
-  int ok_php_b = ((p & 0x10) != 0 && default_cpu.P.B == 0);
+  int ok_php_b = ((p & 0x10) != 0 && m.cpu.P.B == 0);
   END_TEST(ok_php_b);
 
   BEGIN_TEST("PLP restores flags correctly");
   reset_cpu();
   push(0xC3); /* N V Z C set */
   PLP();
-  int ok_plp = (default_cpu.P.N == 1 && default_cpu.P.V == 1 &&
-                default_cpu.P.Z == 1 && default_cpu.P.C == 1);
+  int ok_plp = (flag_N(&m.cpu) == 1 && m.cpu.P.V == 1 &&
+                flag_Z(&m.cpu) == 1 && m.cpu.P.C == 1);
   END_TEST(ok_plp);
 
   BEGIN_TEST("ROL uses carry-in");
@@ -370,7 +490,7 @@ int main(void) {
   LDA(0x7F);
   SEC();
   ROL_A();
-  int ok_rol_carry = (default_cpu.A == 0xFE && default_cpu.P.C == 0);
+  int ok_rol_carry = (m.cpu.A == 0xFF && m.cpu.P.C == 0);
   END_TEST(ok_rol_carry);
 
   BEGIN_TEST("ROR uses carry-in");
@@ -378,33 +498,70 @@ int main(void) {
   LDA(0x00);
   SEC();
   ROR_A();
-  int ok_ror_carry = (default_cpu.A == 0x00 && default_cpu.P.C == 0);
+  int ok_ror_carry =
+      (m.cpu.A == 0x80 && m.cpu.P.C == 0 && flag_N(&m.cpu) == 1);
   END_TEST(ok_ror_carry);
 
+  BEGIN_TEST("SBC signed overflow");
+  reset_cpu();
+  LDA(0x80);
+  SEC();
+  SBC(0x01);
+  int ok_sbc_v = (m.cpu.A == 0x7F && m.cpu.P.V == 1 && m.cpu.P.C == 1);
+  END_TEST(ok_sbc_v);
+
+  BEGIN_TEST("Decimal mode ADC and SBC");
+  reset_cpu();
+  SED();
+  CLC();
+  LDA(0x58);
+  ADC(0x46); /* 58 + 46 = 104 */
+  int ok_dec_adc = (m.cpu.A == 0x04 && m.cpu.P.C == 1);
+  ADC(0x12); /* 04 + 12 + 1 = 17 */
+  ok_dec_adc = ok_dec_adc && m.cpu.A == 0x17 && m.cpu.P.C == 0;
+  SEC();
+  LDA(0x21);
+  SBC(0x34); /* 21 - 34 = -13, borrow */
+  int ok_dec_sbc = (m.cpu.A == 0x87 && m.cpu.P.C == 0);
+  SBC(0x06); /* 87 - 06 - 1 = 80 */
+  ok_dec_sbc = ok_dec_sbc && m.cpu.A == 0x80 && m.cpu.P.C == 1;
+  CLD();
+  END_TEST(ok_dec_adc && ok_dec_sbc);
+
+  BEGIN_TEST("Memory shifts and rotates");
+  reset_cpu();
+  m.memory[0x0010] = 0x81;
+  SEC();
+  ROR_M(0x0010); /* $C0, C set */
+  ROL_M(0x0010); /* $81, C set */
+  ASL_M(0x0010); /* $02, C set */
+  int ok_rmw = (m.memory[0x0010] == 0x02 && m.cpu.P.C == 1);
+  END_TEST(ok_rmw);
+
   BEGIN_TEST("Branch backward (negative offset)");
   reset_cpu();
-  default_cpu.PC = 0x2000;
-  default_cpu.P.Z = 1;
+  m.cpu.PC = 0x2000;
+  set_Z(&m.cpu, 1);
   BEQ(0xF0); /* -16 */
-  int ok_branch_back = (default_cpu.PC == 0x1FF0);
+  int ok_branch_back = (m.cpu.PC == 0x1FF0);
   END_TEST(ok_branch_back);
 
   BEGIN_TEST("JSR pushes correct return address");
   reset_cpu();
-  default_cpu.PC = 0x1234;
+  m.cpu.PC = 0x1234;
   JSR(0x4000);
-  uint8_t lo = memory[0x01FF];
-  uint8_t hi = memory[0x01FE];
+  uint8_t hi = m.memory[0x01FF];
+  uint8_t lo = m.memory[0x01FE];
   int ok_jsr_stack = (((hi << 8) | lo) == 0x1233);
   END_TEST(ok_jsr_stack);
 
   BEGIN_TEST("RTI restores PC exactly");
   reset_cpu();
-  push(0x00); /* P */
-  push(0x78);
   push(0x56);
+  push(0x78);
+  push(0x00); /* P */
   RTI();
-  int ok_rti_pc = (default_cpu.PC == 0x5678);
+  int ok_rti_pc = (m.cpu.PC == 0x5678);
   END_TEST(ok_rti_pc);
 
   BEGIN_TEST("NOP does not modify flags");
@@ -412,8 +569,667 @@ int main(void) {
   SEC();
   SEI();
   NOP();
-  int ok_nop_flags = (default_cpu.P.C == 1 && default_cpu.P.I == 1);
+  int ok_nop_flags = (m.cpu.P.C == 1 && m.cpu.P.I == 1);
   END_TEST(ok_nop_flags);
+
+  BEGIN_TEST("Cycle counts and penalties");
+  reset_cpu();
+  m.memory[0x1201] = 0x01;
+  m.memory[0x0200] = 0xA2; /* LDX #$01      2 */
+  m.memory[0x0201] = 0x01;
+  m.memory[0x0202] = 0xBD; /* LDA $12FF,X   4+1 */
+  m.memory[0x0203] = 0xFF;
+  m.memory[0x0204] = 0x12;
+  m.memory[0x0205] = 0xBD; /* LDA $1200,X   4 */
+  m.memory[0x0206] = 0x00;
+  m.memory[0x0207] = 0x12;
+  m.memory[0x0208] = 0xD0; /* BNE +$00      2+1 */
+  m.memory[0x0209] = 0x00;
+  m.memory[0x020A] = 0xF0; /* BEQ +$00      2 */
+  m.memory[0x020B] = 0x00;
+  m.cpu.PC = 0x0200;
+  for (int i = 0; i < 5; i++)
+    cpu_step(&m);
+  int ok_cycles = (m.cpu.cycles == 16);
+  m.cpu.PC = 0x02FD;
+  m.memory[0x02FD] = 0xD0; /* BNE +$10      2+2, crosses to $030F */
+  m.memory[0x02FE] = 0x10;
+  cpu_step(&m);
+  ok_cycles &= (m.cpu.PC == 0x030F && m.cpu.cycles == 20);
+  END_TEST(ok_cycles);
+
+  BEGIN_TEST("Bus routes every access by page");
+  reset_cpu();
+  struct test_device td = {{test_device_read, test_device_write}};
+  static const uint8_t rom[256] = {[0x10] = 0x99};
+  bus_map_device(&m, 0xD0, 1, &td.dev);
+  bus_map_rom(&m, 0xE0, 1, rom);
+  LDA(0x11);
+  STA(0xD001);
+  LDX(0x22);
+  STX(0xD002);
+  LDY(0x33);
+  STY(0xD003);
+  INC(0xD042); /* reads 0x42 back, writes 0x43 */
+  int ok_bus = (td.writes == 4 && td.last_addr == 0xD042 &&
+                td.last_value == 0x43);
+  STA(0xE010);
+  ok_bus &= (bus_read(&m, 0xE010) == 0x99 && m.memory[0xE010] == 0x00);
+  m.memory[0x0200] = 0x77;
+  ok_bus &= (bus_read(&m, 0x0200) == 0x77);
+  /* Instruction fetches follow the page table when it is remapped. */
+  m.memory[0xE000] = 0xE8; /* INX, under the ROM's BRK */
+  m.cpu.PC = 0xE000;
+  ok_bus &= (cpu_step(&m) == 0x00);
+  bus_map_ram(&m, 0xE0, 1);
+  m.cpu.PC = 0xE000;
+  ok_bus &= (cpu_step(&m) == 0xE8);
+  END_TEST(ok_bus);
+
+  BEGIN_TEST("Machines do not share state");
+  machine6502 *a = machine_new();
+  machine6502 *b = machine_new();
+  LDA_c(a, 0x11);
+  STA_c(a, 0x0200);
+  LDA_c(b, 0x22);
+  STA_c(b, 0x0200);
+  int ok_machines = (a->cpu.A == 0x11 && a->memory[0x200] == 0x11 &&
+                     b->cpu.A == 0x22 && b->memory[0x200] == 0x22);
+  machine_free(a);
+  machine_free(b);
+  END_TEST(ok_machines);
+  BEGIN_TEST("Run loop sees self-modifying code");
+  reset_cpu();
+  static const uint8_t smc[] = {
+      0xA2, 0x03,       /* $0200 LDX #$03 */
+      0xA9, 0x00,       /* $0202 LDA #$00 (operand rewritten below) */
+      0x18,             /* $0204 CLC */
+      0x69, 0x01,       /* $0205 ADC #$01 */
+      0x8D, 0x03, 0x02, /* $0207 STA $0203 */
+      0xCA,             /* $020A DEX */
+      0xD0, 0xF5,       /* $020B BNE $0202 */
+      0x00,             /* $020D BRK */
+  };
+  machine6502 *ref = machine_new();
+  for (unsigned i = 0; i < sizeof(smc); i++)
+    m.memory[0x0200 + i] = ref->memory[0x0200 + i] = smc[i];
+  m.cpu.PC = ref->cpu.PC = 0x0200;
+  run_cpu(&m);
+  while (cpu_step(ref) != 0x00)
+    ;
+  int ok_smc = (m.cpu.A == 0x03 && m.memory[0x0203] == 0x03 &&
+                m.cpu.cycles == ref->cpu.cycles);
+  machine_free(ref);
+  END_TEST(ok_smc);
+
+  BEGIN_TEST("Snapshot restore and fork");
+  reset_cpu();
+  static const uint8_t count[] = {
+      0xE6, 0x10, /* $0200 INC $10 */
+      0xE8,       /* $0202 INX */
+      0x00,       /* $0203 BRK */
+  };
+  for (unsigned i = 0; i < sizeof(count); i++)
+    m.memory[0x0200 + i] = count[i];
+  mem_changed(&m, 0x02, 1);
+  m.cpu.PC = 0x0200;
+  struct snapshot *snap = snapshot_take(&m);
+  run_cpu(&m);
+  m.cpu.PC = 0x0200;
+  run_cpu(&m);
+  int ok_snap = (m.memory[0x0010] == 2 && m.cpu.X == 2);
+  snapshot_restore(&m, snap);
+  ok_snap &= (m.memory[0x0010] == 0 && m.cpu.X == 0 && m.cpu.PC == 0x0200 &&
+              m.cpu.cycles == 0);
+  machine6502 *fork = machine_fork(snap);
+  run_cpu(fork);
+  ok_snap &= (fork->memory[0x0010] == 1 && fork->cpu.X == 1 &&
+              m.memory[0x0010] == 0);
+  machine_free(fork);
+  snapshot_free(snap);
+  END_TEST(ok_snap);
+
+  BEGIN_TEST("Segmented ROM image maps read-only");
+  reset_cpu();
+  static const uint8_t image[] = {
+      0xFF, 0xFF, 0x00, 0x80, 0x05, 0x80, /* segment $8000-$8005 */
+      0xA9, 0x42,                         /* $8000 LDA #$42 */
+      0x8D, 0x00, 0x80,                   /* $8002 STA $8000 */
+      0x00,                               /* $8005 BRK */
+      0xFC, 0xFF, 0xFD, 0xFF,             /* segment $FFFC-$FFFD */
+      0x00, 0x80,                         /* reset vector */
+  };
+  FILE *f = fopen("rom_test.bin", "wb");
+  fwrite(image, 1, sizeof(image), f);
+  fclose(f);
+  struct rom_image *img = rom_open("rom_test.bin", 0x0200);
+  remove("rom_test.bin");
+  int ok_rom = (img != NULL);
+  if (img) {
+    bus_map_image(&m, img);
+    m.cpu.PC = bus_read(&m, 0xFFFC) | bus_read(&m, 0xFFFD) << 8;
+    run_cpu(&m);
+    ok_rom = (m.cpu.A == 0x42 && bus_read(&m, 0x8000) == 0xA9 &&
+              bus_read(&m, 0x8006) == 0x00 && m.memory[0x8000] != 0x42 &&
+              m.rd[0x81] == &m.memory[0x8100]);
+    bus_map_ram(&m, 0x80, 1);
+    bus_map_ram(&m, 0xFF, 1);
+    rom_close(img);
+  }
+  END_TEST(ok_rom);
+
+  BEGIN_TEST("Scheduled event raises IRQ on time");
+  reset_cpu();
+  static const uint8_t idle[] = {
+      0x58,             /* $0200 CLI */
+      0x4C, 0x01, 0x02, /* $0201 JMP $0201 */
+      [0x100] = 0xA9,   /* $0300 LDA #$42 */
+      0x42,
+      0x85, 0x10, /* $0302 STA $10 */
+      0x00,       /* $0304 BRK */
+  };
+  for (unsigned i = 0; i < sizeof(idle); i++)
+    m.memory[0x0200 + i] = idle[i];
+  m.memory[0xFFFE] = 0x00;
+  m.memory[0xFFFF] = 0x03;
+  mem_changed(&m, 0x02, 2);
+  mem_changed(&m, 0xFF, 1);
+  m.cpu.PC = 0x0200;
+  event_schedule(&m, 100, raise_irq, NULL);
+  int ok_irq = (run_cpu_until(&m, 10000) == RUN_BRK);
+  /* Taken after the JMP ending at cycle 101: 7 + 2 + 3 + 7 more. */
+  ok_irq &= (m.memory[0x0010] == 0x42 && m.cpu.cycles == 120 &&
+             m.memory[0x01FF] == 0x02 && m.memory[0x01FE] == 0x01 &&
+             (m.memory[0x01FD] & 0x14) == 0);
+  END_TEST(ok_irq);
+
+  BEGIN_TEST("NMI ignores I, IRQ waits for CLI");
+  reset_cpu();
+  static const uint8_t masked[] = {
+      0xE8,             /* $0200 INX */
+      0xE8,             /* $0201 INX */
+      0xE8,             /* $0202 INX */
+      0x58,             /* $0203 CLI */
+      0xEA,             /* $0204 NOP */
+      0x00,             /* $0205 BRK */
+      [0x100] = 0x86,   /* $0300 STX $11 */
+      0x11, 0x00,       /* $0302 BRK */
+      [0x180] = 0x86,   /* $0380 STX $12 */
+      0x12, 0x40,       /* $0382 RTI */
+  };
+  for (unsigned i = 0; i < sizeof(masked); i++)
+    m.memory[0x0200 + i] = masked[i];
+  m.memory[0xFFFA] = 0x80;
+  m.memory[0xFFFB] = 0x03;
+  m.memory[0xFFFE] = 0x00;
+  m.memory[0xFFFF] = 0x03;
+  mem_changed(&m, 0x02, 2);
+  mem_changed(&m, 0xFF, 1);
+  m.cpu.PC = 0x0200;
+  m.cpu.P.I = 1;
+  event_schedule(&m, 1, raise_both, NULL);
+  run_cpu(&m);
+  /* The IRQ returns to the NOP after CLI. */
+  int ok_nmi = (m.memory[0x0012] == 1 && m.memory[0x0011] == 3 &&
+                m.memory[0x01FF] == 0x02 && m.memory[0x01FE] == 0x04);
+  END_TEST(ok_nmi);
+
+  BEGIN_TEST("Periodic event");
+  reset_cpu();
+  m.memory[0x0200] = 0x4C; /* JMP $0200 */
+  m.memory[0x0201] = 0x00;
+  m.memory[0x0202] = 0x02;
+  mem_changed(&m, 0x02, 1);
+  m.cpu.PC = 0x0200;
+  int ticks = 0;
+  event_schedule(&m, 1000, tick, &ticks);
+  run_cpu_until(&m, 10000);
+  event_cancel(&m, tick, &ticks);
+  int ok_tick = (ticks == 9 && m.nevents == 0);
+  run_cpu_for(&m, 5000);
+  ok_tick &= (ticks == 9);
+  END_TEST(ok_tick);
+
+  BEGIN_TEST("Profiler charges cycles to call frames");
+  reset_cpu();
+  static const uint8_t calls[] = {
+      0x20, 0x10, 0x02, /* $0200 JSR $0210 */
+      0x20, 0x10, 0x02, /* $0203 JSR $0210 */
+      0x00,             /* $0206 BRK */
+      [0x10] = 0xE8,    /* $0210 INX */
+      0x60,             /* $0211 RTS */
+  };
+  for (unsigned i = 0; i < sizeof(calls); i++)
+    m.memory[0x0200 + i] = calls[i];
+  mem_changed(&m, 0x02, 1);
+  m.cpu.PC = 0x0200;
+  struct profile *prof = profile_new();
+  int ok_prof = (profile_run(&m, prof, UINT64_MAX) == RUN_BRK);
+  ok_prof &= (m.cpu.X == 2 && prof->pc_insns[0x0210] == 2 &&
+              prof->pc_cycles[0x0211] == 12 && prof->op_insns[0x20] == 2 &&
+              prof->op_spent[0x00] == 7);
+  FILE *folded = tmpfile();
+  char line[2][32] = {"", ""};
+  if (folded) {
+    profile_collapsed(prof, folded);
+    rewind(folded);
+    for (int i = 0; i < 2 && fgets(line[i], sizeof(line[i]), folded); i++)
+      ;
+    fclose(folded);
+  }
+  /* JSR is charged to the caller, RTS to the callee. */
+  ok_prof &= (!strcmp(line[0], "$0200 19\n") &&
+              !strcmp(line[1], "$0200;$0210 16\n"));
+  profile_free(prof);
+  END_TEST(ok_prof);
+
+  BEGIN_TEST("Assembler encodes every addressing mode");
+  static const char modes_src[] =
+      "ptr = $20\n"
+      ".segment \"CODE\"\n"
+      ".org $0300\n"
+      "start: lda #<table  ; imm\n"
+      "  lda ptr,x\n"
+      "  ldx ptr,y\n"
+      "  lda table,x\n"
+      "  lda table,y\n"
+      "  lda (ptr,x)\n"
+      "  lda (ptr),y\n"
+      "  jmp (vec)\n"
+      "  asl\n"
+      "  ROL a\n"
+      "  stx $10,y\n"
+      "  lda fwd            ; defined below, so absolute\n"
+      "@loop: dex\n"
+      "  bne @loop\n"
+      "table: .byte 1, \"hi\", 'x', >table\n"
+      "vec: .word start\n"
+      "fwd = $12\n"
+      "  lda fwd\n";
+  static const uint8_t modes_bin[] = {
+      0xA9, 0x1D, 0xB5, 0x20, 0xB6, 0x20, 0xBD, 0x1D, 0x03, 0xB9,
+      0x1D, 0x03, 0xA1, 0x20, 0xB1, 0x20, 0x6C, 0x22, 0x03, 0x0A,
+      0x2A, 0x96, 0x10, 0xAD, 0x12, 0x00, 0xCA, 0xD0, 0xFD, 0x01,
+      0x68, 0x69, 0x78, 0x03, 0x00, 0x03, 0xA5, 0x12,
+  };
+  struct asm_image *code = asm_assemble(modes_src, strlen(modes_src), NULL);
+  int ok_asm = (code != NULL);
+  for (unsigned i = 0; ok_asm && i < sizeof(modes_bin); i++)
+    ok_asm &= (code->mem[0x0300 + i] == modes_bin[i] &&
+               (code->used[(0x0300 + i) >> 3] >> ((0x0300 + i) & 7) & 1));
+  ok_asm &= (code && asm_symbol(code, "start@loop") == 0x031A &&
+             asm_symbol(code, "fwd") == 0x12 &&
+             asm_symbol(code, "nothing") == -1);
+  asm_close(code);
+  END_TEST(ok_asm);
+
+  BEGIN_TEST("Assembled 6502.s runs");
+  reset_cpu();
+  static const char digits_src[] = ".segment \"CODE\"\n"
+                                   ".org $8000\n"
+                                   "start:\n"
+                                   "    ldx #5\n"
+                                   "loop:\n"
+                                   "    txa\n"
+                                   "    jsr print_digit\n"
+                                   "    dex\n"
+                                   "    bne loop\n"
+                                   "    brk\n"
+                                   "print_digit:\n"
+                                   "    adc #'0'\n"
+                                   "    sta $FF00\n"
+                                   "    lda #$0A\n"
+                                   "    sta $FF00\n"
+                                   "    rts\n";
+  struct test_device console = {{test_device_read, test_device_write}};
+  bus_map_device(&m, 0xFF, 1, &console.dev);
+  code = asm_assemble(digits_src, strlen(digits_src), "6502.s");
+  int ok_run = (code != NULL);
+  if (code) {
+    asm_load(&m, code);
+    asm_close(code);
+  }
+  m.cpu.PC = (uint16_t)(m.memory[0xFFFC] | m.memory[0xFFFD] << 8);
+  ok_run &= (m.cpu.PC == 0x8000 && m.memory[0x8003] == 0x20);
+  run_cpu(&m);
+  ok_run &= (console.writes == 10 && console.last_addr == 0xFF00 &&
+             console.last_value == 0x0A && m.cpu.X == 0);
+  bus_map_ram(&m, 0xFF, 1);
+  END_TEST(ok_run);
+
+  BEGIN_TEST("Disassembly round-trips every opcode");
+  int ok_dis = 1;
+  for (int op = 0; op < 256 && ok_dis; op++) {
+    const uint8_t b[3] = {(uint8_t)op, 0x34, 0x12};
+    char src[64] = ".org $0300\n", *text = src + strlen(src);
+    unsigned len = dis_text(text, 0x0300, b);
+    text[len] = '\n';
+    text[len + 1] = '\0';
+    code = asm_assemble(src, strlen(src), NULL);
+    ok_dis = (code != NULL);
+    for (unsigned i = 0; code && i < dis_len(b[0]); i++)
+      ok_dis &= (code->mem[0x0300 + i] == b[i]);
+    asm_close(code);
+  }
+  END_TEST(ok_dis);
+
+  BEGIN_TEST("dis_range fills a small buffer in chunks");
+  reset_cpu();
+  static const uint8_t listing_bin[] = {0xA9, 0x05, 0xB1, 0x12, 0xD0,
+                                        0xFA, 0x02, 0x6C, 0x34, 0x12};
+  static const char listing[] = "01FE  A9 05     LDA #$05\n"
+                                "0200  B1 12     LDA ($12),Y\n"
+                                "0202  D0 FA     BNE $01FE\n"
+                                "0204  02        .byte $02\n"
+                                "0205  6C 34 12  JMP ($1234)\n";
+  memcpy(&m.memory[0x01FE], listing_bin, sizeof(listing_bin));
+  char listing_out[256], small[2 * DIS_LINE_MAX];
+  size_t listing_len = 0;
+  uint32_t dis_addr = 0x01FE;
+  int chunks = 0;
+  while (dis_addr < 0x0206 && chunks++ < 10) {
+    size_t n = dis_range(&m, &dis_addr, 0x0206, small, sizeof(small));
+    memcpy(listing_out + listing_len, small, n);
+    listing_len += n;
+  }
+  END_TEST(chunks == 3 && dis_addr == 0x0208 &&
+           listing_len == strlen(listing) &&
+           !memcmp(listing_out, listing, listing_len));
+
+  BEGIN_TEST("dis_range leaves a tiny buffer alone");
+  char tiny[DIS_LINE_MAX + 8];
+  memset(tiny, '#', sizeof(tiny));
+  dis_addr = 0x01FE;
+  size_t tiny_len = dis_range(&m, &dis_addr, 0x0206, tiny, 8);
+  int untouched = 1;
+  for (unsigned i = 0; i < sizeof(tiny); i++)
+    untouched &= (tiny[i] == '#');
+  END_TEST(tiny_len == 0 && dis_addr == 0x01FE && untouched);
+
+  BEGIN_TEST("Embedding API runs a program with I/O");
+  static const uint8_t echo[] = {
+      0xAD, 0x01, 0xD0, /* $0400 LDA $D001 */
+      0x8D, 0x00, 0xD0, /* $0403 STA $D000 */
+      0xE8,             /* $0406 INX */
+      0x00,             /* $0407 BRK */
+  };
+  static const uint8_t vector[] = {0x00, 0x04};
+  struct api_io io = {0};
+  struct cpu6502_regs regs;
+  cpu6502_machine *api = cpu6502_new();
+  int ok_api = (api && cpu6502_abi_version() == CPU6502_ABI_VERSION &&
+                cpu6502_load(api, 0x0400, echo, sizeof(echo)) == 0 &&
+                cpu6502_load(api, 0xFFFC, vector, sizeof(vector)) == 0 &&
+                cpu6502_load(api, 0xFFFF, vector, sizeof(vector)) == -1 &&
+                cpu6502_map_io(api, 0xD0, 1, api_io_read, api_io_write,
+                               &io) == 0);
+  cpu6502_reset(api);
+  ok_api &= (cpu6502_step(api) == 0xAD && cpu6502_peek(api, 0x0401) == 0x01);
+  ok_api &= (cpu6502_run(api, 1000) == CPU6502_BRK && io.writes == 1 &&
+             io.last == 'A');
+  cpu6502_get_regs(api, &regs);
+  ok_api &= (regs.a == 'A' && regs.x == 1 && regs.cycles == 4 + 4 + 2 + 7);
+  regs.pc = 0x0406;
+  cpu6502_set_regs(api, &regs);
+  cpu6502_poke(api, 0x0407, 0xE8); /* INX over the BRK */
+  ok_api &= (cpu6502_run(api, 4) == CPU6502_BUDGET);
+  cpu6502_get_regs(api, &regs);
+  ok_api &= (regs.x == 3);
+  cpu6502_map_ram(api, 0xD0, 1);
+  cpu6502_free(api);
+  END_TEST(ok_api);
+
+#if CPU_SCHED
+  BEGIN_TEST("Scheduler shares cycles by priority");
+  static const uint8_t spin[] = {0x4C, 0x00, 0x02}; /* JMP $0200 */
+  static const uint8_t brief_loop[] = {
+      0xA2, 0x00, /* $0200 LDX #$00 */
+      0xCA,       /* $0202 DEX */
+      0xD0, 0xFD, /* $0203 BNE $0202 */
+      0x00,       /* $0205 BRK */
+  };
+  machine6502 *low = machine_new(), *high = machine_new();
+  machine6502 *brief = machine_new();
+  memcpy(&low->memory[0x0200], spin, sizeof(spin));
+  memcpy(&high->memory[0x0200], spin, sizeof(spin));
+  memcpy(&brief->memory[0x0200], brief_loop, sizeof(brief_loop));
+  low->cpu.PC = high->cpu.PC = brief->cpu.PC = 0x0200;
+  struct sched_log left = {.watch = low};
+  struct sched *sched = sched_new(1000, sched_left, &left);
+  int ok_sched = (sched_add(sched, low, 1, 30000) == 0 &&
+                  sched_add(sched, high, 3, 30000) == 0 &&
+                  sched_add(sched, brief, 1, 0) == 0 &&
+                  sched_add(sched, brief, 1, 0) == -1);
+  ok_sched &= (sched_start(sched, 1) == 0 && sched_wait(sched) == 0 &&
+               left.n == 3);
+  ok_sched &= (left.m[0] == brief && left.status[0] == SCHED_BRK &&
+               left.m[1] == high && left.status[1] == SCHED_LIMIT &&
+               left.m[2] == low && left.status[2] == SCHED_LIMIT);
+  ok_sched &= (left.watched[1] >= 8000 && left.watched[1] <= 12000 &&
+               low->cpu.cycles >= 30000 && !low->task);
+  sched_free(sched);
+  END_TEST(ok_sched);
+
+  BEGIN_TEST("Parked machine waits for sched_wake");
+  static const uint8_t wait_key[] = {
+      0xAD, 0x01, 0xFF, /* $0200 LDA $FF01 */
+      0xF0, 0xFB,       /* $0203 BEQ $0200 */
+      0x8D, 0x00, 0x03, /* $0205 STA $0300 */
+      0x00,             /* $0208 BRK */
+  };
+  struct park_input input = {{park_input_read, test_device_write}};
+  reset_cpu_c(low);
+  bus_map_device(low, 0xFF, 1, &input.dev);
+  memcpy(&low->memory[0x0200], wait_key, sizeof(wait_key));
+  low->cpu.PC = 0x0200;
+  left = (struct sched_log){0};
+  sched = sched_new(0, sched_left, &left);
+  int ok_park = (sched_start(sched, 2) == 0 &&
+                 sched_add(sched, low, 1, 0) == 0 &&
+                 sched_wait(sched) == 1 && low->cpu.cycles == 4);
+  input.byte = 'x';
+  sched_wake(sched, low);
+  ok_park &= (sched_wait(sched) == 0 && left.n == 1 &&
+              left.status[0] == SCHED_BRK && low->memory[0x0300] == 'x');
+  sched_free(sched);
+  machine_free(low);
+  machine_free(high);
+  machine_free(brief);
+  END_TEST(ok_park);
+#endif
+
+#if CPU_WIDE
+  BEGIN_TEST("Wide lanes match run_cpu per lane");
+  reset_cpu();
+  static const uint8_t lanes[] = {
+      0xA6, 0x10,       /* $0200 LDX $10 */
+      0xA9, 0x00,       /* $0202 LDA #$00 */
+      0xA0, 0x00,       /* $0204 LDY #$00 (operand poked in odd lanes) */
+      0x18,             /* $0206 CLC */
+      0x75, 0x20,       /* $0207 ADC $20,X */
+      0x95, 0x40,       /* $0209 STA $40,X */
+      0x20, 0x20, 0x02, /* $020B JSR $0220 */
+      0xCA,             /* $020E DEX */
+      0xD0, 0xF5,       /* $020F BNE $0206 */
+      0x85, 0x11,       /* $0211 STA $11 */
+      0x84, 0x12,       /* $0213 STY $12 */
+      0xAD, 0x05, 0xC0, /* $0215 LDA $C005 (device) */
+      0x8D, 0x00, 0xC0, /* $0218 STA $C000 (device) */
+      0xF8,             /* $021B SED */
+      0x69, 0x19,       /* $021C ADC #$19 */
+      0xD8,             /* $021E CLD */
+      0x00,             /* $021F BRK */
+      0x48,             /* $0220 PHA */
+      0xE0, 0x03,       /* $0221 CPX #$03 */
+      0x90, 0x01,       /* $0223 BCC $0226 */
+      0xC8,             /* $0225 INY */
+      0x68,             /* $0226 PLA */
+      0x60,             /* $0227 RTS */
+  };
+  struct test_device lane_dev = {{test_device_read, test_device_write}};
+  for (unsigned i = 0; i < sizeof(lanes); i++)
+    m.memory[0x0200 + i] = lanes[i];
+  mem_changed(&m, 0x02, 1);
+  bus_map_device(&m, 0xC0, 1, &lane_dev.dev);
+  m.cpu.PC = 0x0200;
+  struct wide6502 *wide = wide_new(&m, WIDE_LANES);
+  machine6502 *lane = machine_new(), *solo = machine_new();
+  int ok_wide = (wide != NULL && lane && solo);
+  for (unsigned i = 0; ok_wide && i < WIDE_LANES; i++) {
+    *wide_mem(wide, i, 0x10) = i % 5 + 1;
+    for (unsigned j = 1; j <= 5; j++)
+      *wide_mem(wide, i, 0x20 + j) = i * 7 + j;
+    if (i & 1)
+      *wide_mem(wide, i, 0x0205) = 0x05;
+  }
+  if (ok_wide)
+    wide_run(wide, UINT64_MAX);
+  bus_map_device(lane, 0xC0, 1, &lane_dev.dev);
+  bus_map_device(solo, 0xC0, 1, &lane_dev.dev);
+  for (unsigned i = 0; ok_wide && i < WIDE_LANES; i++) {
+    wide_get(wide, i, lane);
+    reset_cpu_c(solo);
+    bus_map_device(solo, 0xC0, 1, &lane_dev.dev);
+    memcpy(solo->memory, m.memory, sizeof(solo->memory));
+    solo->memory[0x10] = i % 5 + 1;
+    for (unsigned j = 1; j <= 5; j++)
+      solo->memory[0x20 + j] = i * 7 + j;
+    if (i & 1)
+      solo->memory[0x0205] = 0x05;
+    mem_changed(solo, 0x00, 256);
+    solo->cpu.PC = 0x0200;
+    run_cpu(solo);
+    ok_wide &= (wide->status[i] == RUN_BRK && lane->cpu.A == solo->cpu.A &&
+                lane->cpu.X == solo->cpu.X && lane->cpu.Y == solo->cpu.Y &&
+                lane->cpu.SP == solo->cpu.SP && lane->cpu.PC == solo->cpu.PC &&
+                pack_P(&lane->cpu) == pack_P(&solo->cpu) &&
+                lane->cpu.cycles == solo->cpu.cycles &&
+                !memcmp(lane->memory, solo->memory, 0x300));
+  }
+  /* Every lane wrote the device once, and reference runs once each. */
+  ok_wide &= (lane_dev.writes == 2 * WIDE_LANES && lane_dev.last_value == 5);
+  machine_free(lane);
+  machine_free(solo);
+  wide_free(wide);
+  bus_map_ram(&m, 0xC0, 1);
+  END_TEST(ok_wide);
+#endif
+
+#if CPU_JIT_X86
+  BEGIN_TEST("JIT runs hot loops like cpu_step");
+  static const uint8_t doubling[] = {
+      0xA0, 0x00,       /* $0200 LDY #0 */
+      0xA2, 0x00,       /* $0202 LDX #0 */
+      0x8A,             /* $0204 TXA */
+      0x0A,             /* $0205 ASL A */
+      0x9D, 0x00, 0x03, /* $0206 STA $0300,X */
+      0xE8,             /* $0209 INX */
+      0xD0, 0xF8,       /* $020A BNE $0204 */
+      0x88,             /* $020C DEY */
+      0xD0, 0xF3,       /* $020D BNE $0202 */
+      0x00,             /* $020F BRK */
+  };
+  uint64_t jit_cycles[2];
+  uint8_t jit_table[2][256];
+  int native = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    reset_cpu();
+    memcpy(&m.memory[0x0200], doubling, sizeof(doubling));
+    mem_changed(&m, 0x02, 1);
+    m.cpu.PC = 0x0200;
+    if (pass == 0) {
+      run_cpu(&m);
+      for (int i = 0; m.blocks && i < BLOCK_SLOTS; i++)
+        native |= (m.blocks->slot[i].native != NULL);
+    } else {
+      while (cpu_step(&m) != 0x00)
+        ;
+    }
+    jit_cycles[pass] = m.cpu.cycles;
+    memcpy(jit_table[pass], &m.memory[0x0300], 256);
+  }
+  int ok_jit = (jit_cycles[0] == jit_cycles[1] &&
+                !memcmp(jit_table[0], jit_table[1], 256) &&
+                jit_table[0][0x81] == 0x02);
+  // The loop went native, and the arena is never writable and executable
+  // at once.
+  FILE *maps = fopen("/proc/self/maps", "r");
+  char map_line[512], perms[8];
+  while (maps && fgets(map_line, sizeof(map_line), maps))
+    if (sscanf(map_line, "%*s %7s", perms) == 1 && !strcmp(perms, "rwxp"))
+      ok_jit = 0;
+  if (maps)
+    fclose(maps);
+  END_TEST(ok_jit && native && maps);
+#endif
+
+#if CPU_TRACING
+  BEGIN_TEST("Instruction trace round trip");
+  reset_cpu();
+  static const uint8_t countdown[] = {
+      0xA2, 0x03, /* $0200 LDX #3 */
+      0xCA,       /* $0202 DEX */
+      0xD0, 0xFD, /* $0203 BNE $0202 */
+      0x00,       /* $0205 BRK */
+  };
+  for (unsigned i = 0; i < sizeof(countdown); i++)
+    m.memory[0x0200 + i] = countdown[i];
+  mem_changed(&m, 0x02, 1);
+  m.cpu.PC = 0x0200;
+  FILE *tf = tmpfile();
+  int ok_trace = (tf && trace_start(&m, tf) == 0);
+  if (ok_trace) {
+    run_cpu(&m);
+    ok_trace = (trace_stop(&m) == 0);
+    rewind(tf);
+    struct trace_log got = {0};
+    struct trace_entry *seen = got.e;
+    ok_trace &= (trace_read(tf, collect_entry, &got) == 0 && got.n == 8);
+    // LDX, then DEX/BNE three times, the last BNE not taken, then BRK.
+    ok_trace &= (seen[0].pc == 0x0200 && seen[0].op == 0xA2 &&
+                 seen[0].cycles == 0 && seen[1].x == 3 &&
+                 seen[6].pc == 0x0203 && seen[6].x == 0 &&
+                 seen[7].pc == 0x0205 && seen[7].op == 0x00 &&
+                 seen[7].cycles == m.cpu.cycles - 7);
+  }
+  if (tf)
+    fclose(tf);
+  END_TEST(ok_trace);
+
+  BEGIN_TEST("Lossy trace counts what it drops");
+  reset_cpu();
+  static const uint8_t nested[] = {
+      0xA0, 0x00, /* $0200 LDY #0 */
+      0xA2, 0x00, /* $0202 LDX #0 */
+      0xCA,       /* $0204 DEX */
+      0xD0, 0xFD, /* $0205 BNE $0204 */
+      0x88,       /* $0207 DEY */
+      0xD0, 0xF8, /* $0208 BNE $0202 */
+      0x00,       /* $020A BRK */
+  };
+  for (unsigned i = 0; i < sizeof(nested); i++)
+    m.memory[0x0200 + i] = nested[i];
+  mem_changed(&m, 0x02, 1);
+  m.cpu.PC = 0x0200;
+  FILE *lf = tmpfile();
+  int ok_lossy = (lf && trace_start_lossy(&m, lf) == 0);
+  if (ok_lossy) {
+    run_cpu(&m);
+    uint64_t dropped = trace_dropped(&m);
+    ok_lossy = (trace_stop(&m) == 0);
+    rewind(lf);
+    struct trace_log got = {0};
+    ok_lossy &= (trace_read(lf, collect_entry, &got) == 0);
+    // Whatever the thread kept up with, LDY, 256 rounds of LDX, 256
+    // DEX/BNE pairs, DEY and BNE, then BRK are all accounted for.
+    ok_lossy &= (got.n > 0 && got.n + dropped == 2 + 256 * (3 + 2 * 256));
+    ok_lossy &= (got.e[0].pc == 0x0200 && got.e[0].cycles == 0);
+  }
+  if (lf)
+    fclose(lf);
+  END_TEST(ok_lossy);
+#endif
+
   printf("\n6502 TEST SUMMARY: %d / %d tests passed.\n", passed_tests,
          total_tests);
 
@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.c"
+
+#define PROGRAM_START 0x8000
+
+/*
+ * tracedump: print an instruction trace written by trace_start (program.c
+ * -t, or -T for one with gaps), one instruction per line:
+ *
+ *   <cycles> <pc> <opcode> A=.. X=.. Y=.. P=.. SP=..  [<instruction>]
+ *
+ * with the registers as they were before the instruction ran. Given the
+ * program the trace came from, each line ends with the instruction as
+ * disassembled from it; the trace itself only records the opcode.
+ *
+ * Lines are built by hand into a large buffer rather than through printf,
+ * so that dumping keeps up with traces of hundreds of millions of entries.
+ */
+
+static machine6502 code; // the program, for operand bytes
+static int have_code;
+
+static char out[1 << 16];
+static size_t used;
+
+static int print_entry(const struct trace_entry *e, void *ctx) {
+  if (used > sizeof(out) - 128) {
+    fwrite(out, 1, used, stdout);
+    used = 0;
+  }
+  char digits[20], *p = out + used;
+  unsigned n = 0;
+  uint64_t c = e->cycles;
+  do
+    digits[n++] = (char)('0' + c % 10);
+  while ((c /= 10) != 0);
+  while (n)
+    *p++ = digits[--n];
+
+  memcpy(p, " 0000 00 A=00 X=00 Y=00 P=00 SP=00", 34);
+  DIS_HEX2(p + 1, e->pc >> 8);
+  DIS_HEX2(p + 3, e->pc & 0xFF);
+  DIS_HEX2(p + 6, e->op);
+  DIS_HEX2(p + 11, e->a);
+  DIS_HEX2(p + 16, e->x);
+  DIS_HEX2(p + 21, e->y);
+  DIS_HEX2(p + 26, e->p);
+  DIS_HEX2(p + 32, e->sp);
+  p += 34;
+  if (have_code) {
+    uint8_t b[3] = {e->op, dis_peek(&code, (uint16_t)(e->pc + 1)),
+                    dis_peek(&code, (uint16_t)(e->pc + 2))};
+    memcpy(p, "  ", 2);
+    p += 2;
+    p += dis_text(p, e->pc, b);
+  }
+  *p++ = '\n';
+  used = (size_t)(p - out);
+  return 0;
+}
+
+// Load the program the way program.c does: source is assembled, anything
+// else is an image from ld65.
+static int load_code(const char *path) {
+  size_t len = strlen(path);
+  reset_cpu_c(&code);
+  if (len > 2 && !strcmp(path + len - 2, ".s")) {
+    struct asm_image *img = asm_open(path);
+    if (!img)
+      return -1;
+    asm_load(&code, img);
+    asm_close(img);
+  } else {
+    // Left mapped until exit: code reads through it.
+    struct rom_image *img = rom_open(path, PROGRAM_START);
+    if (!img)
+      return -1;
+    bus_map_image(&code, img);
+  }
+  have_code = 1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace [program.bin|.s]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2 && load_code(argv[2]) != 0)
+    return 1;
+
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+  int status = trace_read(f, print_entry, NULL);
+  fclose(f);
+  fwrite(out, 1, used, stdout);
+
+  if (status != 0) {
+    fprintf(stderr, "%s: damaged trace\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,168 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The programs bench times, shared with libbench, which runs them through
+ * lib6502 to train its profile-guided build.
+ */
+
+/* The 6502.s loop with the putchar port replaced by RAM. Only uses
+   opcodes the switch decoder understands. */
+static const uint8_t loop_prog[] = {
+    0xA2, 0x00,       // $8000 start: ldx #0
+    0x8A,             // $8002 loop:  txa
+    0x20, 0x10, 0x80, // $8003        jsr $8010
+    0xE8,             // $8006        inx
+    0xE0, 0xFF,       // $8007        cpx #$FF
+    0x90, 0xF7,       // $8009        bcc loop
+    0x00,             // $800B        brk
+    0, 0, 0, 0,       // padding
+    0x69, 0x30,       // $8010        adc #'0'
+    0x8D, 0x00, 0x02, // $8012        sta $0200
+    0xA9, 0x0A,       // $8015        lda #$0A
+    0x8D, 0x00, 0x02, // $8017        sta $0200
+    0x60,             // $801A        rts
+};
+
+// A 16-bit running sum of X, 4096 times round.
+static const uint8_t arith_prog[] = {
+    0xA0, 0x10,       // $8000        ldy #16
+    0xA2, 0x00,       // $8002        ldx #0
+    0x8A,             // $8004 loop:  txa
+    0x18,             // $8005        clc
+    0x65, 0x10,       // $8006        adc $10
+    0x85, 0x10,       // $8008        sta $10
+    0xA5, 0x11,       // $800A        lda $11
+    0x69, 0x00,       // $800C        adc #0
+    0x85, 0x11,       // $800E        sta $11
+    0xE8,             // $8010        inx
+    0xD0, 0xF1,       // $8011        bne loop
+    0x88,             // $8013        dey
+    0xD0, 0xEE,       // $8014        bne loop
+    0x00,             // $8016        brk
+};
+
+// Copy $1000-$17FF to $2000-$27FF through two zero page pointers.
+static const uint8_t memcpy_prog[] = {
+    0xA9, 0x00,       // $8000        lda #$00
+    0x85, 0x00,       // $8002        sta $00
+    0x85, 0x02,       // $8004        sta $02
+    0xA9, 0x10,       // $8006        lda #$10
+    0x85, 0x01,       // $8008        sta $01
+    0xA9, 0x20,       // $800A        lda #$20
+    0x85, 0x03,       // $800C        sta $03
+    0xA2, 0x08,       // $800E        ldx #8
+    0xA0, 0x00,       // $8010        ldy #0
+    0xB1, 0x00,       // $8012 loop:  lda ($00),y
+    0x91, 0x02,       // $8014        sta ($02),y
+    0xC8,             // $8016        iny
+    0xD0, 0xF9,       // $8017        bne loop
+    0xE6, 0x01,       // $8019        inc $01
+    0xE6, 0x03,       // $801B        inc $03
+    0xCA,             // $801D        dex
+    0xD0, 0xF2,       // $801E        bne loop
+    0x00,             // $8020        brk
+};
+
+// Sieve of Eratosthenes over 2048 flags at $1000, nonzero for composites.
+// $04/$05 points at the flag for i, $06/$07 at the one for j, and $08/$09
+// holds the step i.
+static const uint8_t sieve_prog[] = {
+    0xA9, 0x00,       // $8000        lda #0
+    0xA8,             // $8002        tay
+    0xA2, 0x10,       // $8003        ldx #$10
+    0x86, 0x01,       // $8005        stx $01
+    0x85, 0x00,       // $8007        sta $00
+    0x91, 0x00,       // $8009 clear: sta ($00),y
+    0xC8,             // $800B        iny
+    0xD0, 0xFB,       // $800C        bne clear
+    0xE6, 0x01,       // $800E        inc $01
+    0xA6, 0x01,       // $8010        ldx $01
+    0xE0, 0x18,       // $8012        cpx #$18
+    0xD0, 0xF3,       // $8014        bne clear
+    0xA9, 0x02,       // $8016        lda #2
+    0x85, 0x04,       // $8018        sta $04
+    0xA9, 0x10,       // $801A        lda #$10
+    0x85, 0x05,       // $801C        sta $05
+    0xA0, 0x00,       // $801E outer: ldy #0
+    0xB1, 0x04,       // $8020        lda ($04),y
+    0xD0, 0x30,       // $8022        bne next
+    0xA5, 0x04,       // $8024        lda $04
+    0x85, 0x08,       // $8026        sta $08
+    0xA5, 0x05,       // $8028        lda $05
+    0x38,             // $802A        sec
+    0xE9, 0x10,       // $802B        sbc #$10
+    0x85, 0x09,       // $802D        sta $09
+    0x18,             // $802F        clc
+    0xA5, 0x04,       // $8030        lda $04
+    0x65, 0x08,       // $8032        adc $08
+    0x85, 0x06,       // $8034        sta $06
+    0xA5, 0x05,       // $8036        lda $05
+    0x65, 0x09,       // $8038        adc $09
+    0x85, 0x07,       // $803A        sta $07
+    0xC9, 0x18,       // $803C inner: cmp #$18
+    0xB0, 0x14,       // $803E        bcs next
+    0xA9, 0x01,       // $8040        lda #1
+    0x91, 0x06,       // $8042        sta ($06),y
+    0x18,             // $8044        clc
+    0xA5, 0x06,       // $8045        lda $06
+    0x65, 0x08,       // $8047        adc $08
+    0x85, 0x06,       // $8049        sta $06
+    0xA5, 0x07,       // $804B        lda $07
+    0x65, 0x09,       // $804D        adc $09
+    0x85, 0x07,       // $804F        sta $07
+    0x4C, 0x3C, 0x80, // $8051        jmp inner
+    0xE6, 0x04,       // $8054 next:  inc $04
+    0xD0, 0x02,       // $8056        bne same
+    0xE6, 0x05,       // $8058        inc $05
+    0xA5, 0x05,       // $805A same:  lda $05
+    0xC9, 0x18,       // $805C        cmp #$18
+    0xD0, 0xBE,       // $805E        bne outer
+    0x00,             // $8060        brk
+};
+
+// Count to 8192 in a three byte decimal counter.
+static const uint8_t bcd_prog[] = {
+    0xF8,             // $8000        sed
+    0xA9, 0x00,       // $8001        lda #0
+    0x85, 0x10,       // $8003        sta $10
+    0x85, 0x11,       // $8005        sta $11
+    0x85, 0x12,       // $8007        sta $12
+    0xA2, 0x00,       // $8009        ldx #0
+    0xA0, 0x20,       // $800B        ldy #32
+    0x18,             // $800D loop:  clc
+    0xA5, 0x10,       // $800E        lda $10
+    0x69, 0x01,       // $8010        adc #1
+    0x85, 0x10,       // $8012        sta $10
+    0xA5, 0x11,       // $8014        lda $11
+    0x69, 0x00,       // $8016        adc #0
+    0x85, 0x11,       // $8018        sta $11
+    0xA5, 0x12,       // $801A        lda $12
+    0x69, 0x00,       // $801C        adc #0
+    0x85, 0x12,       // $801E        sta $12
+    0xCA,             // $8020        dex
+    0xD0, 0xEA,       // $8021        bne loop
+    0x88,             // $8023        dey
+    0xD0, 0xE7,       // $8024        bne loop
+    0xD8,             // $8026        cld
+    0x00,             // $8027        brk
+};
+
+struct workload {
+  const char *name;
+  const uint8_t *code;
+  size_t len;
+  int reps;
+};
+
+#define WORKLOAD(name, prog, reps) {name, prog, sizeof(prog), reps}
+
+// All load at $8000 and end in BRK. reps brings each to some tens of
+// millions of instructions a try.
+static const struct workload workloads[] = {
+    WORKLOAD("loop", loop_prog, 20000),
+    WORKLOAD("arith", arith_prog, 1000),
+    WORKLOAD("memcpy", memcpy_prog, 2000),
+    WORKLOAD("sieve", sieve_prog, 500),
+    WORKLOAD("bcd", bcd_prog, 500),
+};